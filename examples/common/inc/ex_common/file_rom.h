@@ -5,18 +5,28 @@
  * A read-only memory device that is filled with bytes read from a file upon its
  * initial creation. Subsequent snapshots and restorings do not change the
  * bytes.
+ *
+ * The bytes come from the @ref rom_cache.h "ROM image cache", so the devices
+ * of every VM booting the same file share them, and snapshots only store the
+ * hash of the bytes.
  */
 
 #pragma once
 
+#include <ex_common/rom_cache.h>
 #include <fcvm/vm_types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define FILE_ROM_DEV_CLASS 0x02
 
 /// File ROM device context.
 typedef struct {
     size_t size;
-    uint8_t *buf;
+    const uint8_t *buf; //!< Contents of @a image.
+    rom_image_t *image; //!< Shared image the bytes come from.
 
     dev_desc_t desc;
 } file_rom_ctx_t;
@@ -34,7 +44,28 @@ void file_rom_free(file_rom_ctx_t *ctx);
 
 size_t file_rom_snapshot_size(const void *v_ctx);
 size_t file_rom_snapshot(const void *v_ctx, void *v_buf, size_t max_size);
-file_rom_ctx_t *file_rom_restore(const void *v_buf, size_t max_size);
+/**
+ * Restores a ROM device from a snapshot, which uses
+ * #file_rom_snapshot_size() bytes of @a v_buf.
+ *
+ * The image must still be in the cache: open in another VM, or opened again
+ * with #rom_cache_open().
+ *
+ * @param busdev_ctx Bus device context to point at the restored device, or
+ *                   NULL.
+ * @param v_buf      Snapshot buffer.
+ * @param max_size   Size of @a v_buf.
+ *
+ * @returns
+ * A pointer to the restored context structure on success; `NULL` if the image
+ * is not in the cache.
+ */
+file_rom_ctx_t *file_rom_restore(busctl_dev_ctx_t *busdev_ctx,
+                                 const void *v_buf, size_t max_size);
 
 vm_err_t file_rom_read_u8(void *v_ctx, vm_addr_t addr, uint8_t *out);
 vm_err_t file_rom_read_u32(void *v_ctx, vm_addr_t addr, uint32_t *out);
+
+#ifdef __cplusplus
+}
+#endif
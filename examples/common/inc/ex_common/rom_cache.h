@@ -0,0 +1,71 @@
+/**
+ * @file rom_cache.h
+ * Example cache of ROM images shared by every VM of the process.
+ *
+ * Each file is copied once into read-only memory, and every VM that boots
+ * from it gets the same pages, so that a VM only costs its own mutable state.
+ * The image keeps the contents the file had when it was opened, even if the
+ * file is rebuilt in place afterwards. An image is found again by its path, as
+ * long as the file has not changed since it was copied, or by the hash of its
+ * contents, which is what ROM device snapshots store instead of the contents.
+ *
+ * The functions may be called from any thread.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// ROM image copied by the cache.
+typedef struct rom_image {
+    const uint8_t *data; //!< Read-only contents of the file.
+    size_t size;         //!< Size of @a data in bytes.
+    uint64_t hash;       //!< Hash of @a data, see #rom_cache_hash().
+
+    /**
+     * @{
+     * @name Private fields
+     * Used by the cache to find the image again.
+     */
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    size_t num_refs;
+    struct rom_image *next;
+    /// @}
+} rom_image_t;
+
+/**
+ * Copies the file at @a path, or takes a reference to the image that the cache
+ * already has for it: the same unchanged file, or another file with the same
+ * contents.
+ * @returns The image, to be released with #rom_cache_release(), or NULL if the
+ * file cannot be read or is empty.
+ */
+rom_image_t *rom_cache_open(const char *path);
+
+/**
+ * Takes a reference to the image of the cache whose contents have the hash
+ * @a hash.
+ * @returns The image, to be released with #rom_cache_release(), or NULL if no
+ * open image has these contents.
+ */
+rom_image_t *rom_cache_find(uint64_t hash);
+
+/// Releases a reference to @a image, which is unmapped with the last one.
+void rom_cache_release(rom_image_t *image);
+
+/// Hashes @a size bytes at @a data like the images are (64-bit FNV-1a).
+uint64_t rom_cache_hash(const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
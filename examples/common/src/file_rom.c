@@ -1,72 +1,82 @@
 #include <assert.h>
-#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 
 #include <ex_common/file_rom.h>
+#include <fcvm/busctl.h>
 
-static off_t prv_get_file_size(const char *path);
-static bool prv_read_file(const char *path, uint8_t *buf, size_t buf_size);
+static file_rom_ctx_t *prv_file_rom_new(rom_image_t *image);
 
 file_rom_ctx_t *file_rom_new(const char *path) {
-    file_rom_ctx_t *ctx = malloc(sizeof(*ctx));
-    if (!ctx) { return NULL; }
-    memset(ctx, 0, sizeof(*ctx));
-
-    off_t file_size = prv_get_file_size(path);
-    if (file_size == -1) {
-        free(ctx);
-        return NULL;
-    }
+    rom_image_t *image = rom_cache_open(path);
+    if (!image) { return NULL; }
 
-    uint8_t *buf = malloc(file_size);
-    if (!buf) { return NULL; }
-    if (!prv_read_file(path, buf, file_size)) { return NULL; }
-
-    ctx->buf = buf;
-    ctx->size = file_size;
-
-    ctx->desc.dev_class = FILE_ROM_DEV_CLASS;
-    ctx->desc.region_size = file_size;
-    ctx->desc.mem_if.read_u8 = file_rom_read_u8;
-    ctx->desc.mem_if.read_u32 = file_rom_read_u32;
-    ctx->desc.mem_if.write_u8 = NULL; // writes are not supported
-    ctx->desc.mem_if.write_u32 = NULL;
-    ctx->desc.f_snapshot_size = file_rom_snapshot_size;
-    ctx->desc.f_snapshot = file_rom_snapshot;
+    file_rom_ctx_t *ctx = prv_file_rom_new(image);
+    if (!ctx) { return NULL; }
 
-    fprintf(stderr, "file_rom: loaded %s (%ld bytes)\n", path, file_size);
+    fprintf(stderr, "file_rom: loaded %s (%zu bytes)\n", path, ctx->size);
     return ctx;
 }
 
 void file_rom_free(file_rom_ctx_t *ctx) {
     assert(ctx);
-    assert(ctx->buf);
-    free(ctx->buf);
+    assert(ctx->image);
+    rom_cache_release(ctx->image);
     free(ctx);
 }
 
 size_t file_rom_snapshot_size(const void *v_ctx) {
     (void)v_ctx;
-    fprintf(stderr, "TODO: %s\n", __func__);
-    abort();
+    // Only the size and the hash of the image.
+    return 2 * sizeof(uint64_t);
 }
 
 size_t file_rom_snapshot(const void *v_ctx, void *v_buf, size_t max_size) {
-    (void)v_ctx;
-    (void)v_buf;
-    (void)max_size;
-    fprintf(stderr, "TODO: %s\n", __func__);
-    abort();
+    assert(v_ctx);
+    assert(v_buf);
+    const file_rom_ctx_t *ctx = v_ctx;
+    uint8_t *buf = v_buf;
+
+    const uint64_t fields[2] = {ctx->size, ctx->image->hash};
+    assert(sizeof(fields) <= max_size);
+    memcpy(buf, fields, sizeof(fields));
+    return sizeof(fields);
 }
 
-file_rom_ctx_t *file_rom_restore(const void *v_buf, size_t max_size) {
-    (void)v_buf;
-    (void)max_size;
-    fprintf(stderr, "TODO: %s\n", __func__);
-    abort();
+file_rom_ctx_t *file_rom_restore(busctl_dev_ctx_t *busdev_ctx,
+                                 const void *v_buf, size_t max_size) {
+    assert(v_buf);
+    uint64_t fields[2];
+    assert(sizeof(fields) <= max_size);
+    memcpy(fields, v_buf, sizeof(fields));
+
+    rom_image_t *image = rom_cache_find(fields[1]);
+    if (!image) {
+        fprintf(stderr, "file_rom: no image with hash %016llx\n",
+                (unsigned long long)fields[1]);
+        return NULL;
+    }
+    if (image->size != fields[0]) {
+        fprintf(stderr, "file_rom: image size %zu instead of %llu\n",
+                image->size, (unsigned long long)fields[0]);
+        rom_cache_release(image);
+        return NULL;
+    }
+    file_rom_ctx_t *ctx = prv_file_rom_new(image);
+    if (!ctx) { return NULL; }
+
+    // Fill in the busctl dev ctx.
+    if (busdev_ctx) {
+        busdev_ctx->mmio.ctx = ctx;
+        busdev_ctx->mmio.mem_if = ctx->desc.mem_if;
+        busdev_ctx->mmio.direct_ptr = ctx->desc.direct_ptr;
+        busdev_ctx->snapshot_ctx = ctx;
+        busdev_ctx->f_snapshot_size = file_rom_snapshot_size;
+        busdev_ctx->f_snapshot = file_rom_snapshot;
+    }
+
+    return ctx;
 }
 
 vm_err_t file_rom_read_u8(void *v_ctx, vm_addr_t addr, uint8_t *out) {
@@ -92,56 +102,36 @@ vm_err_t file_rom_read_u32(void *v_ctx, vm_addr_t addr, uint32_t *out) {
 }
 
 /**
- * Returns the size of the file at @a path.
- * @param path Path to the file.
- * @returns Size of the file on success or `-1` on error.
- */
-static off_t prv_get_file_size(const char *path) {
-    struct stat st;
-    int ec = stat(path, &st);
-    if (ec != 0) {
-        fprintf(stderr, "file_rom: stat returned %d: %s\n", ec,
-                strerror(errno));
-        return -1;
-    }
-    if (st.st_size < 0) {
-        fprintf(stderr, "file_rom: st_size is negative: %ld\n", st.st_size);
-        return -1;
-    }
-    return st.st_size;
-}
-
-/**
- * Reads @a buf_size bytes from file at @a path into @a buf.
+ * Creates a ROM device that reads from @a image.
  *
- * @param path     Path to the file.
- * @param buf      Buffer to read file bytes into.
- * @param buf_size Size of @a buf.
+ * @param image Image to take over the reference of, released on error.
  *
  * @returns
- * `true` if exactly @a buf_size were read into @a buf from the file, otherwise
- * `false`.
+ * A pointer to the newly created context structure on success; `NULL` on error.
  */
-static bool prv_read_file(const char *path, uint8_t *buf, size_t buf_size) {
-    FILE *h_file = fopen(path, "r");
-    if (!h_file) {
-        printf("fopen returned NULL: %s\n", strerror(errno));
-        return false;
-    }
-
-    size_t num_read = fread(buf, 1, buf_size, h_file);
-    if (num_read != buf_size) {
-        printf("fread read %zu bytes instead of %zu: %s\n", num_read, buf_size,
-               strerror(errno));
-        fclose(h_file);
-        return false;
+static file_rom_ctx_t *prv_file_rom_new(rom_image_t *image) {
+    file_rom_ctx_t *ctx = malloc(sizeof(*ctx));
+    if (!ctx) {
+        rom_cache_release(image);
+        return NULL;
     }
+    memset(ctx, 0, sizeof(*ctx));
 
-    int ec = fclose(h_file);
-    if (ec != 0) {
-        printf("fclose returned %d: %s\n", ec, strerror(errno));
-        return false;
-    }
+    ctx->image = image;
+    ctx->buf = image->data;
+    ctx->size = image->size;
 
-    return true;
+    ctx->desc.dev_class = FILE_ROM_DEV_CLASS;
+    ctx->desc.region_size = image->size;
+    ctx->desc.mem_if.read_u8 = file_rom_read_u8;
+    ctx->desc.mem_if.read_u32 = file_rom_read_u32;
+    ctx->desc.mem_if.write_u8 = NULL; // writes are not supported
+    ctx->desc.mem_if.write_u32 = NULL;
+    ctx->desc.mem_if.get_span = NULL;
+    // The pages are mapped read-only, and the device only allows reads.
+    ctx->desc.direct_ptr = (uint8_t *)image->data;
+    ctx->desc.direct_perms = MEM_DIRECT_READ; // reads skip the callbacks
+    ctx->desc.f_snapshot_size = file_rom_snapshot_size;
+    ctx->desc.f_snapshot = file_rom_snapshot;
+    return ctx;
 }
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ex_common/rom_cache.h>
+
+/// Protects #prv_images and the reference counts.
+static pthread_mutex_t prv_lock = PTHREAD_MUTEX_INITIALIZER;
+/// Open images.
+static rom_image_t *prv_images = NULL;
+
+static bool prv_is_same_file(const rom_image_t *image, const char *path,
+                             const struct stat *st);
+static rom_image_t *prv_find_contents(const rom_image_t *mapped);
+static rom_image_t *prv_map_file(const char *path);
+static void prv_unmap(rom_image_t *image);
+
+rom_image_t *rom_cache_open(const char *path) {
+    assert(path);
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "rom_cache: cannot stat %s: %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&prv_lock);
+    for (rom_image_t *image = prv_images; image; image = image->next) {
+        if (prv_is_same_file(image, path, &st)) {
+            image->num_refs++;
+            pthread_mutex_unlock(&prv_lock);
+            return image;
+        }
+    }
+    pthread_mutex_unlock(&prv_lock);
+
+    // Mapped and hashed without the lock, so another thread may be mapping
+    // the same file, or a file with the same contents: the first one wins.
+    rom_image_t *mapped = prv_map_file(path);
+    if (!mapped) { return NULL; }
+
+    pthread_mutex_lock(&prv_lock);
+    rom_image_t *image = prv_find_contents(mapped);
+    if (image) {
+        image->num_refs++;
+    } else {
+        mapped->next = prv_images;
+        prv_images = mapped;
+        image = mapped;
+        mapped = NULL;
+    }
+    pthread_mutex_unlock(&prv_lock);
+
+    if (mapped) { prv_unmap(mapped); }
+    return image;
+}
+
+rom_image_t *rom_cache_find(uint64_t hash) {
+    pthread_mutex_lock(&prv_lock);
+    rom_image_t *image = prv_images;
+    while (image && image->hash != hash) {
+        image = image->next;
+    }
+    if (image) { image->num_refs++; }
+    pthread_mutex_unlock(&prv_lock);
+    return image;
+}
+
+void rom_cache_release(rom_image_t *image) {
+    assert(image);
+    pthread_mutex_lock(&prv_lock);
+    assert(image->num_refs > 0);
+    if (--image->num_refs > 0) {
+        pthread_mutex_unlock(&prv_lock);
+        return;
+    }
+    rom_image_t **link = &prv_images;
+    while (*link != image) {
+        link = &(*link)->next;
+    }
+    *link = image->next;
+    pthread_mutex_unlock(&prv_lock);
+
+    prv_unmap(image);
+}
+
+uint64_t rom_cache_hash(const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t idx = 0; idx < size; idx++) {
+        hash ^= bytes[idx];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Checks that @a image has been copied from @a path, and that the file has not
+ * been replaced or modified since then.
+ * @param image Open image.
+ * @param path  Path to the file.
+ * @param st    Current status of the file.
+ */
+static bool prv_is_same_file(const rom_image_t *image, const char *path,
+                             const struct stat *st) {
+    return strcmp(image->path, path) == 0 && image->dev == st->st_dev &&
+           image->ino == st->st_ino && image->size == (size_t)st->st_size &&
+           image->mtime.tv_sec == st->st_mtim.tv_sec &&
+           image->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/// Finds an open image with the same contents as @a mapped, or NULL.
+static rom_image_t *prv_find_contents(const rom_image_t *mapped) {
+    for (rom_image_t *image = prv_images; image; image = image->next) {
+        if (image->hash == mapped->hash && image->size == mapped->size &&
+            memcmp(image->data, mapped->data, image->size) == 0) {
+            return image;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Copies the file at @a path into a read-only anonymous mapping and hashes it.
+ * The file itself is not mapped, so that rebuilding it in place changes
+ * neither the bytes of the image nor their size.
+ * @returns A new image with one reference, or NULL on error.
+ */
+static rom_image_t *prv_map_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "rom_cache: cannot open %s: %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        fprintf(stderr, "rom_cache: %s is empty or cannot be read\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "rom_cache: cannot map %s: %s\n", path,
+                strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    size_t num_read = 0;
+    while (num_read < (size_t)st.st_size) {
+        const ssize_t ret =
+            pread(fd, &data[num_read], st.st_size - num_read, num_read);
+        if (ret < 0 && errno == EINTR) { continue; }
+        if (ret <= 0) { break; }
+        num_read += ret;
+    }
+    close(fd);
+    // The file may have been truncated since fstat().
+    if (num_read != (size_t)st.st_size ||
+        mprotect(data, st.st_size, PROT_READ) != 0) {
+        fprintf(stderr, "rom_cache: cannot read %s\n", path);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    rom_image_t *image = malloc(sizeof(*image));
+    char *path_copy = strdup(path);
+    if (!image || !path_copy) {
+        free(image);
+        free(path_copy);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    memset(image, 0, sizeof(*image));
+    image->data = data;
+    image->size = st.st_size;
+    image->hash = rom_cache_hash(data, st.st_size);
+    image->path = path_copy;
+    image->dev = st.st_dev;
+    image->ino = st.st_ino;
+    image->mtime = st.st_mtim;
+    image->num_refs = 1;
+    return image;
+}
+
+/// Unmaps @a image, which is not in #prv_images, and frees it.
+static void prv_unmap(rom_image_t *image) {
+    munmap((void *)image->data, image->size);
+    free(image->path);
+    free(image);
+}
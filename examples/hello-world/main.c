@@ -12,12 +12,18 @@
 #    error "path to the guest program (EX_HELLO_WORLD_GUEST) is not provided"
 #endif
 
+/// Number of instructions executed between checks for a signal.
+#define EX_HELLO_WORLD_RUN_BUDGET 10000
+/// Number of last executed instructions dumped on a CPU exception.
+#define EX_HELLO_WORLD_TRACE_SIZE 64
+
 static atomic_bool g_running = true;
 static atomic_int g_caught_signum = 0;
 
 static vm_ctx_t *g_vm = NULL;
 static file_rom_ctx_t *g_file_rom = NULL;
 static print_dev_ctx_t *g_print_dev = NULL;
+static cpu_trace_t *g_trace = NULL;
 
 static int install_sigint_handler(void);
 static void sigint_handler(int signum);
@@ -64,6 +70,8 @@ static int install_sigint_handler(void) {
 static void sigint_handler(int signum) {
     g_running = false;
     g_caught_signum = signum;
+    // Also wake the loop if the signal comes just before it starts waiting.
+    if (g_vm) { vm_wake(g_vm); }
 }
 
 static int init(void) {
@@ -79,7 +87,9 @@ static int init(void) {
         return 1;
     }
 
+    g_trace = cpu_trace_new(EX_HELLO_WORLD_TRACE_SIZE);
     g_vm = vm_new();
+    vm_set_trace(g_vm, g_trace);
     vm_err_t err = vm_connect_dev(g_vm, &g_file_rom->desc, g_file_rom);
     if (err != VM_ERR_NONE) {
         fprintf(stderr, "%s: could not connect file_rom, error %u\n", __func__,
@@ -98,13 +108,20 @@ static int init(void) {
 
 static int vm_loop(void) {
     while (g_running) {
-        vm_step(g_vm);
+        cpu_stop_t stop = vm_run(g_vm, EX_HELLO_WORLD_RUN_BUDGET, NULL);
 
-        if (g_vm->cpu->num_nested_exc != 0) {
+        if (stop == CPU_STOP_EXCEPTION || stop == CPU_STOP_TRIPLE_FAULT) {
             fprintf(stderr, "%s: unexpected CPU exception, shutting down\n",
                     __func__);
+            fprintf(stderr, "%s: last executed instructions:\n", __func__);
+            cpu_trace_dump(g_trace, stderr);
             return 1;
         }
+        if (stop == CPU_STOP_HALTED || stop == CPU_STOP_IDLE) {
+            // Sleep until a device raises an IRQ or changes, or a signal is
+            // caught.
+            vm_wait_irq(g_vm, -1);
+        }
     }
     return 0;
 }
@@ -112,6 +129,7 @@ static int vm_loop(void) {
 static void cleanup(void) {
     fprintf(stderr, "%s: freeing resources\n", __func__);
     if (g_vm) { vm_free(g_vm); }
+    if (g_trace) { cpu_trace_free(g_trace); }
     if (g_file_rom) { file_rom_free(g_file_rom); }
     if (g_print_dev) { print_dev_free(g_print_dev); }
 }
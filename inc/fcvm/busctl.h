@@ -18,7 +18,7 @@ extern "C" {
 /// Version of the `busctl_ctx_t` structure and its member structures.
 /// Increment this every time anything in the `busctl_ctx_t` structure or its
 /// member structures is changed: field order, size, type, etc.
-#define SN_BUSCTL_CTX_VER ((uint32_t)1)
+#define SN_BUSCTL_CTX_VER ((uint32_t)4)
 
 /**
  * Maximum number of devices that can be registered with the bus.
@@ -88,6 +88,8 @@ struct busctl_dev_ctx {
     void *snapshot_ctx;
     cb_snapshot_size_dev_t f_snapshot_size;
     cb_snapshot_dev_t f_snapshot;
+    /// Change notification hook, see @ref dev_desc_t.f_set_notify.
+    cb_set_notify_dev_t f_set_notify;
 };
 
 typedef struct {
@@ -190,6 +192,8 @@ size_t busctl_snapshot(const busctl_ctx_t *busctl, void *v_buf,
  * The function specified by @a f_restore_dev is called for every device that
  * was connected to the bus prior to the snapshot. This function must restore
  * the device context and callback pointers; see #cb_restore_dev_t.
+ * Devices whose #busctl_dev_ctx_t.f_set_notify has been restored are then
+ * given the change notification function again.
  *
  * @warning
  * If the @a f_restore_dev function does not restore all pointers correctly,
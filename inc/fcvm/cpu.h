@@ -9,6 +9,7 @@
 
 #include <fcvm/cpu_instr.h>
 #include <fcvm/cpu_instr_descs.h>
+#include <fcvm/cpu_trace.h>
 #include <fcvm/intctl.h>
 
 #ifdef __cplusplus
@@ -18,7 +19,7 @@ extern "C" {
 /// Version of the `cpu_ctx_t` structure and its member structures.
 /// Increment this every time anything in the `cpu_ctx_t` structure or its
 /// member structures is changed: field order, size, type, etc.
-#define SN_CPU_CTX_VER ((uint32_t)1)
+#define SN_CPU_CTX_VER ((uint32_t)15)
 
 #define CPU_NUM_GP_REGS 8
 static_assert(CPU_NUM_GP_REGS == CPU_NUM_GP_REG_CODES,
@@ -67,6 +68,135 @@ static_assert(CPU_NUM_EXCEPTIONS < CPU_IVT_FIRST_IRQ_ENTRY,
               "IVT has no space for this many exceptions, increase "
               "CPU_IVT_FIRST_IRQ_ENTRY");
 
+/// Reason for #cpu_run() and #cpu_run_cycles() to return control to the caller.
+typedef enum {
+    /// The instruction or cycle budget has been exhausted.
+    CPU_STOP_BUDGET,
+    /**
+     * The CPU is halted and there are no pending IRQs. Running it again does
+     * nothing until an IRQ is raised, the host can block in #intctl_wait()
+     * meanwhile.
+     */
+    CPU_STOP_HALTED,
+    /**
+     * The CPU is parked in an idle loop: a loop that only reads the memory of
+     * a device with @ref dev_desc_t.f_set_notify, and would do the exact same
+     * thing until that device changes. Running it again does nothing until
+     * an IRQ is raised or a device change is notified, the host can block in
+     * #intctl_wait() meanwhile. The rest of the budget is not spent.
+     * Only the block engines detect idle loops.
+     */
+    CPU_STOP_IDLE,
+    /// An instruction or interrupt entry has raised an exception.
+    /// The CPU enters the exception handler on the next run.
+    CPU_STOP_EXCEPTION,
+    /// Nested exceptions have led to a triple fault.
+    /// The CPU resets on the next run.
+    CPU_STOP_TRIPLE_FAULT,
+} cpu_stop_t;
+
+/// Kinds of CPU memory accesses, each one has its own TLB entry.
+typedef enum {
+    CPU_TLB_FETCH, //!< Instruction fetch.
+    CPU_TLB_LOAD,  //!< Data and stack reads.
+    CPU_TLB_STORE, //!< Data and stack writes.
+    CPU_TLB_IVT,   //!< Interrupt vector reads, kept apart from the data.
+    CPU_TLB_NUM_KINDS,
+} cpu_tlb_kind_t;
+
+/// Memory region resolved by the last access of one kind.
+typedef struct {
+    /// Resolved range, @a span.ptr is NULL if the access kind is not direct.
+    mem_span_t span;
+    uint32_t gen; //!< Value of @a *span.p_gen when the range was resolved.
+} cpu_tlb_entry_t;
+
+/**
+ * Operands and result of the last ALU instruction, from which the flags are
+ * computed when they are read. Only used inside #cpu_run() and #cpu_step(),
+ * @ref cpu_ctx_t.flags is always current when they return.
+ */
+typedef struct {
+    uint8_t opcode; //!< ALU opcode, or 0 if @ref cpu_ctx_t.flags is current.
+    uint32_t op1;   //!< Destination register before the instruction.
+    uint32_t op2;   //!< Source register or immediate value.
+    uint32_t res;   //!< 32-bit result.
+} cpu_lazy_flags_t;
+
+/// Predecoded instruction cache used by #cpu_run().
+typedef struct cpu_icache cpu_icache_t;
+/// Basic-block cache used by the #CPU_ENGINE_BLOCKS engine.
+typedef struct cpu_blocks cpu_blocks_t;
+/// Native code compiler used by the #CPU_ENGINE_JIT engine.
+typedef struct cpu_jit cpu_jit_t;
+/// Ahead-of-time translated code, see @ref cpu_aot.h.
+typedef struct cpu_aot cpu_aot_t;
+/// Hotness counters of the #CPU_ENGINE_TIERED engine.
+typedef struct cpu_tiers cpu_tiers_t;
+
+/// Execution engines of #cpu_run() and #cpu_run_cycles().
+typedef enum {
+    /// Runs one instruction at a time.
+    CPU_ENGINE_INTERP,
+    /**
+     * Runs whole predecoded basic blocks chained to each other. Pending IRQs
+     * are only checked between blocks and after memory accesses, the
+     * architectural results are the same as with #CPU_ENGINE_INTERP.
+     */
+    CPU_ENGINE_BLOCKS,
+    /**
+     * Same as #CPU_ENGINE_BLOCKS, but hot blocks are compiled to host code.
+     * Only supported on x86-64 Linux hosts, behaves like #CPU_ENGINE_BLOCKS
+     * elsewhere. The code is not used while tracing is on.
+     */
+    CPU_ENGINE_JIT,
+    /**
+     * Promotes code through the other engines as it gets hot: cold code is
+     * interpreted, warm blocks are run by the block engine and hot blocks are
+     * compiled like with #CPU_ENGINE_JIT, see #cpu_tier_cfg_t. The block cache
+     * and the compiler are only allocated once some code needs them, which
+     * keeps mostly idle CPUs cheap.
+     */
+    CPU_ENGINE_TIERED,
+} cpu_engine_t;
+
+/// Default of @ref cpu_tier_cfg_t.warm_runs.
+#define CPU_TIER_DEFAULT_WARM_RUNS 4
+/// Default of @ref cpu_tier_cfg_t.hot_runs.
+#define CPU_TIER_DEFAULT_HOT_RUNS 64
+/// Default of @ref cpu_tier_cfg_t.hot_loop_runs.
+#define CPU_TIER_DEFAULT_HOT_LOOP_RUNS 16
+
+/// Promotion thresholds of #CPU_ENGINE_TIERED, see #cpu_set_tiers().
+typedef struct {
+    /// Number of interpreted runs of the code at a block address after which
+    /// the block is built.
+    uint32_t warm_runs;
+    /// Number of runs of a block after which it is compiled.
+    uint32_t hot_runs;
+    /// Number of times a block is entered through a loop back-edge (a jump
+    /// from a block that does not start after it) after which it is compiled.
+    uint32_t hot_loop_runs;
+} cpu_tier_cfg_t;
+
+/// Counters of the work done in each tier by the block engines.
+typedef struct {
+    uint64_t cold_instrs; //!< Instructions run one at a time.
+    uint64_t warm_instrs; //!< Instructions run from predecoded blocks.
+    uint64_t hot_instrs;  //!< Instructions run by native code.
+    uint64_t num_warmed;  //!< Number of blocks built.
+    uint64_t num_heated;  //!< Number of blocks compiled.
+} cpu_tier_stats_t;
+
+/**
+ * Number of times each opcode has been retired right after another one in a
+ * basic block: `counts[first][second]`. Shows which pairs are worth fusing
+ * into superinstructions, see #cpu_set_pair_hist().
+ */
+typedef struct {
+    uint64_t counts[256][256];
+} cpu_pair_hist_t;
+
 typedef struct cpu_ctx {
     cpu_state_t state;
     cpu_instr_t instr;
@@ -75,9 +205,49 @@ typedef struct cpu_ctx {
     uint32_t reg_pc;
     uint32_t reg_sp;
     uint8_t flags;
+    /// Pending flags update, see #cpu_lazy_flags_t. Saved as @a flags.
+    cpu_lazy_flags_t lazy_flags;
+    /**
+     * Number of cycles spent by the CPU, see @ref cpu_instr_desc_t.num_cycles
+     * and #CPU_CYCLES_INT_ENTRY.
+     */
     uint64_t cycles;
 
     mem_if_t *mem;
+    /// Software TLB, see @ref cpu_mem.h. Not saved in snapshots.
+    cpu_tlb_entry_t tlb[CPU_TLB_NUM_KINDS];
+    /// Predecoded instructions, see @ref cpu_icache.h. Not saved in snapshots.
+    cpu_icache_t *icache;
+    /// Engine used by #cpu_run(), see #cpu_set_engine(). Not restored.
+    cpu_engine_t engine;
+    /// Basic blocks, see @ref cpu_block.h. NULL until a block engine is set,
+    /// or until some code is warm with #CPU_ENGINE_TIERED.
+    cpu_blocks_t *blocks;
+    /// Native code compiler, NULL unless the JIT engine has been selected or
+    /// some code is hot with #CPU_ENGINE_TIERED.
+    cpu_jit_t *jit;
+    /// Translated ROM code, see #cpu_load_aot(). Not saved in snapshots.
+    cpu_aot_t *aot;
+    /// Cold code counters, NULL unless the tiered engine has been selected.
+    cpu_tiers_t *tiers;
+    /// Promotion thresholds, see #cpu_set_tiers(). Not restored.
+    cpu_tier_cfg_t tier_cfg;
+    /// Work done in each tier since the CPU was created. Not restored.
+    cpu_tier_stats_t tier_stats;
+
+    /**
+     * The CPU is parked in the idle loop at @a idle_pc, until the device
+     * change generation of @a intctl differs from @a idle_gen (see
+     * #CPU_STOP_IDLE). Not saved in snapshots.
+     */
+    bool idle;
+    vm_addr_t idle_pc;
+    uint32_t idle_gen;
+
+    /// Compare-and-branch pairs are fused, see #cpu_set_fusion(). Not restored.
+    bool fusion;
+    /// Opcode pair histogram, or NULL (see #cpu_set_pair_hist()).
+    cpu_pair_hist_t *pair_hist;
 
     /**
      * An interrupt controller responsible for CPU interrupts.
@@ -90,6 +260,10 @@ typedef struct cpu_ctx {
     uint8_t curr_int_line;
     vm_addr_t curr_isr_addr;
     uint32_t pc_after_isr;
+
+    /// Instruction trace buffer, or NULL if tracing is off (see
+    /// #cpu_set_trace).
+    cpu_trace_t *trace;
 } cpu_ctx_t;
 
 cpu_ctx_t *cpu_new(mem_if_t *mem);
@@ -125,8 +299,133 @@ cpu_ctx_t *cpu_restore(mem_if_t *mem, const void *v_buf, size_t max_size,
 
 void cpu_step(cpu_ctx_t *cpu);
 
-vm_err_t cpu_decode_reg(cpu_ctx_t *cpu, uint8_t reg_ref,
-                        cpu_reg_ref_t *out_reg_ref);
+/**
+ * Executes whole instructions until @a max_instrs instructions are retired or
+ * the CPU has to stop for another reason.
+ *
+ * Contrary to #cpu_step(), each instruction is fetched, decoded and executed in
+ * one go. Pending IRQs are checked only at instruction boundaries. Interrupt
+ * entry and reset are not counted as instructions.
+ *
+ * @param      cpu            CPU core.
+ * @param      max_instrs     Maximum number of instructions to retire.
+ * @param[out] out_num_instrs Number of retired instructions (may be NULL).
+ * @returns Reason for stopping, see #cpu_stop_t.
+ */
+cpu_stop_t cpu_run(cpu_ctx_t *cpu, size_t max_instrs, size_t *out_num_instrs);
+
+/**
+ * Executes whole instructions like #cpu_run() until @a budget cycles are spent
+ * or the CPU has to stop for another reason.
+ *
+ * An instruction or interrupt entry is never split, so the last one may spend
+ * more cycles than there are left in the budget. The caller can subtract this
+ * overshoot from the next budget to keep the time slices fair.
+ *
+ * @param      cpu             CPU core.
+ * @param      budget          Number of cycles to spend.
+ * @param[out] out_used_cycles Number of spent cycles (may be NULL).
+ * @param[out] out_overshoot   Number of cycles spent over @a budget (may be
+ *                             NULL).
+ * @returns Reason for stopping, see #cpu_stop_t.
+ */
+cpu_stop_t cpu_run_cycles(cpu_ctx_t *cpu, uint64_t budget,
+                          uint64_t *out_used_cycles, uint64_t *out_overshoot);
+
+/**
+ * Attaches an instruction trace buffer to @a cpu.
+ * @param cpu   CPU core.
+ * @param trace Trace buffer owned by the caller, or NULL to turn tracing off.
+ */
+void cpu_set_trace(cpu_ctx_t *cpu, cpu_trace_t *trace);
+
+/**
+ * Selects the engine used by #cpu_run() and #cpu_run_cycles().
+ * #cpu_step() always steps through the state machine. Switching back to
+ * another engine disables the compiled code at runtime.
+ * @param cpu    CPU core.
+ * @param engine Execution engine, #CPU_ENGINE_INTERP by default.
+ */
+void cpu_set_engine(cpu_ctx_t *cpu, cpu_engine_t engine);
+
+/**
+ * Sets the promotion thresholds of #CPU_ENGINE_TIERED, the defaults are the
+ * `CPU_TIER_DEFAULT_*` values. Blocks already promoted stay so.
+ * @param cpu CPU core.
+ * @param cfg Thresholds, each one at least 1.
+ */
+void cpu_set_tiers(cpu_ctx_t *cpu, const cpu_tier_cfg_t *cfg);
+
+/**
+ * Turns on or off the fusion of a compare followed by a conditional jump into
+ * one superinstruction by the block engines. The results are the same either
+ * way, turning it off is meant to measure it or to isolate a bug.
+ * @param cpu     CPU core.
+ * @param enabled Fuse the pairs, the default.
+ */
+void cpu_set_fusion(cpu_ctx_t *cpu, bool enabled);
+
+/**
+ * Makes the block engines count the opcode pairs they retire into @a hist.
+ * Pairs split across two blocks, and instructions run one at a time, are not
+ * counted.
+ * @param cpu  CPU core.
+ * @param hist Histogram owned by the caller, or NULL to stop counting.
+ */
+void cpu_set_pair_hist(cpu_ctx_t *cpu, cpu_pair_hist_t *hist);
+
+/// Checks if #CPU_ENGINE_JIT generates native code on this host.
+bool cpu_jit_is_supported(void);
+
+/**
+ * Forgets every memory region resolved by @a cpu, and every predecoded
+ * instruction. Spans handed out by #memctl_get_span() are invalidated
+ * automatically, this is only needed if a custom #mem_if_t changes its mapping.
+ */
+void cpu_tlb_flush(cpu_ctx_t *cpu);
+
+/**
+ * Forgets every instruction and basic block predecoded by #cpu_run().
+ * Stores done by the CPU invalidate the overwritten instructions
+ * automatically, and so do the writes reported by #cpu_note_code_write().
+ * This must be called after the host or a device modifies guest code that
+ * the CPU may have already executed in any other way.
+ */
+void cpu_flush_icache(cpu_ctx_t *cpu);
+
+/**
+ * Forgets the instructions and basic blocks predecoded from the lines of
+ * guest memory overlapped by the @a size bytes at @a addr, which have been
+ * written by someone else than @a cpu. The memory controller calls this on
+ * its own once set up with #memctl_set_code_watch(), as #vm_new() does.
+ * A store of @a cpu reported back by its memory interface while it is being
+ * done is ignored, since the CPU has noted it already.
+ * Must be called from the thread that runs @a cpu.
+ */
+void cpu_note_code_write(cpu_ctx_t *cpu, vm_addr_t addr, uint32_t size);
+
+/**
+ * Number of writes that have invalidated predecoded code of @a cpu: its own
+ * stores to code pages and the writes reported by #cpu_note_code_write().
+ * Not saved in snapshots.
+ */
+uint64_t cpu_num_code_writes(const cpu_ctx_t *cpu);
+
+/**
+ * Decodes the register reference byte @a reg_ref.
+ * @returns #VM_ERR_BAD_REG_REF if it does not reference a register.
+ */
+vm_err_t cpu_decode_reg(uint8_t reg_ref, cpu_reg_ref_t *out_reg_ref);
+
+/// Pointer to the register referenced by @a reg_ref in @a cpu.
+static inline uint32_t *cpu_reg_ptr(cpu_ctx_t *cpu, cpu_reg_ref_t reg_ref) {
+    return (uint32_t *)((uint8_t *)cpu + reg_ref.ctx_offset);
+}
+
+/// Pointer to the lower 8 bits of the register referenced by @a reg_ref.
+static inline uint8_t *cpu_reg_ptr_u8(cpu_ctx_t *cpu, cpu_reg_ref_t reg_ref) {
+    return (uint8_t *)cpu + reg_ref.ctx_offset;
+}
 cpu_exc_type_t cpu_exc_type_of_err(cpu_ctx_t *cpu, vm_err_t err);
 
 vm_err_t cpu_raise_irq(cpu_ctx_t *cpu, uint8_t irq_line);
@@ -0,0 +1,148 @@
+/**
+ * @file cpu_aot.h
+ * Ahead-of-time translated code, used by the block engines.
+ *
+ * The `fcvm-aot` tool translates the basic blocks of a ROM image to C
+ * functions, which the host compiles into a shared object (see
+ * `fcvm_add_aot_module()` in CMake). #cpu_load_aot() loads that object if it
+ * has been translated from the same ROM, and from then on a block built at the
+ * address of a translated one runs the translated function instead of being
+ * interpreted, as long as the guest code there still has the translated bytes.
+ * Self-modifying code and code outside the ROM are interpreted as usual.
+ *
+ * A translated function follows the contract of the JIT code
+ * (see @ref cpu_jit.h): it runs a prefix of its block on the CPU context, only
+ * accesses memory through the direct pointers of the current TLB entries and
+ * never stores to a code page. It returns the index of the first instruction
+ * it has not executed, which the block interpreter runs next, so that memory
+ * callbacks, exceptions, stack instructions and interrupts are handled by the
+ * interpreter.
+ *
+ * This header is also included by the generated code, which only uses the
+ * inline helpers below and does not link with the library.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <fcvm/cpu.h>
+#include <fcvm/page_bitmap.h>
+#include <fcvm/vm_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Version of the structures below, checked by #cpu_load_aot().
+#define CPU_AOT_ABI_VER ((uint32_t)2)
+/// Name of the #cpu_aot_module_t exported by a translated shared object.
+#define CPU_AOT_MODULE_SYM "fcvm_aot_module"
+
+/**
+ * @{
+ * @name Block limits
+ * A translated block must end where the block engines end theirs: after
+ * #CPU_AOT_BLOCK_MAX_OPS instructions, or before the first instruction that
+ * is not in the 2^#CPU_AOT_LINE_SHIFT-byte line the block starts in.
+ * Instructions never cross a line.
+ */
+#define CPU_AOT_BLOCK_MAX_OPS 16
+#define CPU_AOT_LINE_SHIFT    8
+/// @}
+
+/**
+ * Translated code of a block.
+ * @param cpu        CPU context, with the PC at the start of the block.
+ * @param code_pages Bitmap of the guest pages that hold predecoded code.
+ * @returns Number of instructions executed from the start of the block.
+ */
+typedef uint32_t (*cpu_aot_fn_t)(cpu_ctx_t *cpu,
+                                 const mem_page_bitmap_t *code_pages);
+
+/// Translated block.
+typedef struct {
+    vm_addr_t start_pc; //!< Address of the first instruction.
+    uint32_t num_ops;   //!< Number of instructions.
+    uint32_t size;      //!< Size of their code in bytes.
+    const uint8_t *code; //!< Their code, compared with the guest memory.
+    cpu_aot_fn_t fn;
+} cpu_aot_block_t;
+
+/// Contents of a translated shared object, see #CPU_AOT_MODULE_SYM.
+typedef struct {
+    uint32_t abi_ver;        //!< #CPU_AOT_ABI_VER.
+    uint32_t ctx_ver;        //!< #SN_CPU_CTX_VER, the register offsets depend
+                             //!< on the #cpu_ctx_t layout.
+    uint32_t code_page_shift; //!< Size of the pages of @a code_pages.
+    uint64_t rom_hash;       //!< #cpu_aot_hash() of the ROM image.
+    uint32_t rom_size;       //!< Size of the ROM image.
+    uint32_t num_blocks;
+    const cpu_aot_block_t *blocks; //!< Sorted by start address.
+} cpu_aot_module_t;
+
+/// Hash of a ROM image identifying the shared object translated from it.
+uint64_t cpu_aot_hash(const void *buf, size_t size);
+
+/**
+ * Loads the shared object at @a path, translated by `fcvm-aot` from the ROM
+ * image @a rom, replacing the one previously loaded into @a cpu.
+ * The code is used by the block engines only.
+ * @returns #VM_ERR_AOT_LOAD if the object cannot be loaded, or
+ * #VM_ERR_AOT_MISMATCH if it has been translated from another ROM image or
+ * for another version of the library. Nothing is replaced on errors.
+ */
+vm_err_t cpu_load_aot(cpu_ctx_t *cpu, const char *path, const void *rom,
+                      size_t rom_size);
+
+/// Unloads the shared object loaded into @a cpu, if any.
+void cpu_unload_aot(cpu_ctx_t *cpu);
+
+/**
+ * @{
+ * @name Helpers of the generated code
+ */
+
+/// 32-bit register at offset @a off of the CPU context, see #cpu_reg_ptr().
+#define CPU_AOT_REG(cpu, off) (*(uint32_t *)((uint8_t *)(cpu) + (off)))
+/// Lower 8 bits of the register at offset @a off, see #cpu_reg_ptr_u8().
+#define CPU_AOT_REG_U8(cpu, off) (*((uint8_t *)(cpu) + (off)))
+
+/**
+ * Host address of the @a size bytes at @a addr in the current span of the TLB
+ * entry @a kind.
+ * @returns NULL if they are not there or cannot be accessed directly.
+ */
+static inline uint8_t *cpu_aot_direct_ptr(cpu_ctx_t *cpu, cpu_tlb_kind_t kind,
+                                          vm_addr_t addr, uint32_t size) {
+    const cpu_tlb_entry_t *entry = &cpu->tlb[kind];
+    const mem_span_t *span = &entry->span;
+    if (!span->ptr || *span->p_gen != entry->gen ||
+        (addr - span->start) >= (span->end - span->start) ||
+        span->end - addr < size) {
+        return NULL;
+    }
+    return &span->ptr[addr - span->start];
+}
+
+/**
+ * Like #cpu_aot_direct_ptr() for a store, which also has to stay out of the
+ * pages of @a code_pages.
+ */
+static inline uint8_t *cpu_aot_store_ptr(cpu_ctx_t *cpu,
+                                         const mem_page_bitmap_t *code_pages,
+                                         vm_addr_t addr, uint32_t size) {
+    const uint32_t first = addr >> MEM_PAGE_BITMAP_PAGE_SHIFT;
+    const uint32_t last = (addr + size - 1) >> MEM_PAGE_BITMAP_PAGE_SHIFT;
+    if (mem_page_bitmap_test(code_pages, first) ||
+        mem_page_bitmap_test(code_pages, last)) {
+        return NULL;
+    }
+    return cpu_aot_direct_ptr(cpu, CPU_TLB_STORE, addr, size);
+}
+/// @}
+
+#ifdef __cplusplus
+}
+#endif
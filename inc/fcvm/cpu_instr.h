@@ -25,12 +25,12 @@ typedef struct {
     cpu_reg_size_t access_size;
     /// Register code.
     uint8_t reg_code;
-    union {
-        /// Pointer to the register value in the CPU context. See #cpu_ctx_t.
-        uint32_t *p_reg;
-        /// Pointer to the lower 8 bits of the register in the CPU context.
-        uint8_t *p_reg_u8;
-    };
+    /**
+     * Offset of the register value in #cpu_ctx_t, see #cpu_reg_ptr().
+     * Decoded instructions hold no pointers, so they stay valid in a copy of
+     * the CPU context.
+     */
+    uint16_t ctx_offset;
 } cpu_reg_ref_t;
 
 typedef union {
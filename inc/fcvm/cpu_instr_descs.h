@@ -16,6 +16,20 @@ extern "C" {
 
 #define CPU_OP_KIND_MASK 0xE0
 
+/**
+ * @{
+ * @name Instruction cycle costs
+ * Deterministic costs charged to @ref cpu_ctx_t.cycles, not related to the
+ * wall time.
+ */
+/// Cost of fetching, decoding and executing any instruction.
+#define CPU_CYCLES_BASE 1
+/// Extra cost of each data memory access (load, store, push or pop).
+#define CPU_CYCLES_MEM_ACCESS 2
+/// Cost of entering an interrupt handler: an IVT read and a PC push.
+#define CPU_CYCLES_INT_ENTRY (CPU_CYCLES_BASE + 2 * CPU_CYCLES_MEM_ACCESS)
+/// @}
+
 /**
  * @{
  * @name Data movement opcodes (0b001x_xxxx)
@@ -170,6 +184,8 @@ typedef struct {
     uint8_t opcode;
     size_t num_operands;
     cpu_operand_type_t operands[CPU_MAX_OPERANDS];
+    uint32_t num_cycles; //!< Cost of the instruction in CPU cycles.
+    uint8_t size;        //!< Encoded size in bytes, opcode included.
 } cpu_instr_desc_t;
 
 const cpu_instr_desc_t *cpu_lookup_instr_desc(uint8_t opcode);
@@ -0,0 +1,95 @@
+/**
+ * @file cpu_trace.h
+ * CPU instruction trace API.
+ *
+ * Tracing is off by default. When a trace buffer is attached to a CPU with
+ * #cpu_set_trace(), every executed instruction is recorded into it as a
+ * fixed-size binary record (see #cpu_trace_rec_t). The buffer is a lock-free
+ * single-producer single-consumer ring: the thread running the CPU writes the
+ * records, and another host thread may drain them concurrently with
+ * #cpu_trace_drain(), or dump them after a fault with #cpu_trace_dump().
+ *
+ * When the ring is full, the oldest records are overwritten, so the buffer
+ * always holds the latest instructions executed before a fault.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <fcvm/cpu_instr.h>
+#include <fcvm/vm_types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Trace record of one executed instruction.
+typedef struct {
+    uint64_t cycle; //!< Value of @ref cpu_ctx_t.cycles before the instruction.
+    vm_addr_t pc;   //!< Address of the opcode.
+    /**
+     * Raw operand values: the encoded register reference, or the immediate
+     * value. Unused operands are zero.
+     */
+    uint32_t operands[CPU_MAX_OPERANDS];
+    uint8_t opcode; //!< Opcode of the instruction.
+    uint8_t flags;  //!< Value of @ref cpu_ctx_t.flags before the instruction.
+} cpu_trace_rec_t;
+
+/// Trace ring buffer.
+typedef struct cpu_trace cpu_trace_t;
+
+/**
+ * Allocates a trace ring buffer.
+ * @param num_recs Capacity of the buffer in records, must be a power of two.
+ */
+cpu_trace_t *cpu_trace_new(size_t num_recs);
+void cpu_trace_free(cpu_trace_t *trace);
+
+/**
+ * Appends a record of an instruction to @a trace.
+ * Called by the CPU, must only be called from one thread at a time.
+ * @param trace Trace ring buffer.
+ * @param instr Decoded instruction about to be executed.
+ * @param flags Current CPU flags.
+ * @param cycle Current CPU cycle count.
+ */
+void cpu_trace_record(cpu_trace_t *trace, const cpu_instr_t *instr,
+                      uint8_t flags, uint64_t cycle);
+
+/**
+ * Moves the oldest unread records from @a trace into @a out_recs.
+ * May be called concurrently with #cpu_trace_record() from one other thread.
+ * @param      trace          Trace ring buffer.
+ * @param[out] out_recs       Array to copy the records into.
+ * @param      max_recs       Size of @a out_recs.
+ * @param[out] out_num_lost   Number of records that have been overwritten
+ *                            before they could be read (may be NULL).
+ * @returns Number of records written into @a out_recs.
+ */
+size_t cpu_trace_drain(cpu_trace_t *trace, cpu_trace_rec_t *out_recs,
+                       size_t max_recs, size_t *out_num_lost);
+
+/**
+ * Formats a record as text, in the same format as the CPU debug output.
+ * @param      rec     Trace record.
+ * @param[out] out_buf Text buffer, always NUL-terminated.
+ * @param      size    Size of @a out_buf.
+ * @returns Length of the full text, like `snprintf()`.
+ */
+int cpu_trace_format_rec(const cpu_trace_rec_t *rec, char *out_buf,
+                         size_t size);
+
+/**
+ * Drains every unread record from @a trace and writes it into @a stream as
+ * text, one line per instruction.
+ * @returns Number of records written.
+ */
+size_t cpu_trace_dump(cpu_trace_t *trace, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,6 +9,7 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -17,12 +18,30 @@ extern "C" {
 /// Version of the `intctl_ctx_t` structure and its member structures.
 /// Increment this every time anything in the `intctl_ctx_t` structure or its
 /// member structures is changed: field order, size, type, etc.
-#define SN_INTCTL_CTX_VER ((uint32_t)1)
+#define SN_INTCTL_CTX_VER ((uint32_t)3)
 
 #define INTCTL_MAX_IRQ_NUM 31
 
+/**
+ * Interrupt controller context.
+ *
+ * IRQ lines can be raised from any thread, for example by a device thread
+ * while the VM thread is blocked in #intctl_wait().
+ */
 typedef struct {
+    /// Pending IRQ lines, one bit per line. Only accessed atomically.
     uint32_t raised_irqs;
+    /**
+     * Read and write ends of the wait object, signalled when an IRQ line is
+     * raised while none was pending. Both are the same eventfd on Linux, and
+     * the ends of a pipe elsewhere. Not saved in snapshots.
+     */
+    int wait_fds[2];
+    /**
+     * Number of device state changes, see #intctl_notify_dev_change(). Only
+     * accessed atomically, not saved in snapshots.
+     */
+    uint32_t dev_change_gen;
 } intctl_ctx_t;
 
 intctl_ctx_t *intctl_new(void);
@@ -80,6 +99,55 @@ vm_err_t intctl_raise_irq_line(intctl_ctx_t *intctl, uint8_t irq_line);
  */
 bool intctl_get_pending_irq(intctl_ctx_t *intctl, uint8_t *out_irq);
 
+/**
+ * @{
+ * @name Waiting for IRQs
+ * A halted CPU (see #CPU_STOP_HALTED) does nothing until an IRQ is raised, and
+ * an idle one (see #CPU_STOP_IDLE) until an IRQ is raised or a device changes,
+ * so the host can block instead of running it.
+ */
+/**
+ * Blocks until an IRQ is pending, the timeout expires, a device change is
+ * notified, #intctl_wake() is called or the thread is interrupted by a signal.
+ * It may also return early after an IRQ that has already been taken, so the
+ * caller must check its own conditions and wait again.
+ * @param intctl     Interrupt controller.
+ * @param timeout_ms Maximum time to wait in milliseconds, -1 to wait forever.
+ * @returns `true` if an IRQ is pending.
+ */
+bool intctl_wait(intctl_ctx_t *intctl, int timeout_ms);
+
+/**
+ * Wakes the thread blocked in #intctl_wait() without raising an IRQ, e.g. to
+ * shut down the VM. Can be called from any thread.
+ */
+void intctl_wake(intctl_ctx_t *intctl);
+
+/**
+ * Records that the values read from a device have changed, and wakes the
+ * thread blocked in #intctl_wait(). Can be called from any thread, this is the
+ * function given to the devices by @ref dev_desc_t.f_set_notify.
+ */
+void intctl_notify_dev_change(intctl_ctx_t *intctl);
+
+/// Number of #intctl_notify_dev_change() calls so far.
+uint32_t intctl_dev_change_gen(intctl_ctx_t *intctl);
+
+/**
+ * File descriptor that becomes readable when an IRQ line is raised while none
+ * was pending, on a device change or on #intctl_wake(). A host scheduler can
+ * poll the descriptors of many halted VMs at once and only run the ones that
+ * have been signalled. It stays readable until the next #intctl_wait() call,
+ * do not read from it.
+ *
+ * The descriptor belongs to @a intctl and is not saved in snapshots:
+ * #intctl_restore() (and so #cpu_restore() and #vm_restore()) opens a new
+ * one, already readable if an IRQ is pending. The poller must watch it
+ * instead of the descriptor of the snapshotted controller.
+ */
+int intctl_wait_fd(const intctl_ctx_t *intctl);
+/// @}
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <fcvm/page_bitmap.h>
 #include <fcvm/vm_err.h>
 #include <fcvm/vm_types.h>
 
@@ -15,9 +16,39 @@ extern "C" {
 /// Version of the `memctl_ctx_t` structure and its member structures.
 /// Increment this every time anything in the `memctl_ctx_t` structure or its
 /// member structures is changed: field order, size, type, etc.
-#define SN_MEMCTL_CTX_VER ((uint32_t)1)
+#define SN_MEMCTL_CTX_VER ((uint32_t)9)
 
-#define MEMCTL_MAX_REGIONS 33
+/// Maximum number of mapped regions, limited by the page table entries.
+#define MEMCTL_MAX_REGIONS 0xFFFE
+
+/**
+ * @{
+ * @name Page table geometry
+ * The address-to-region lookup table has two levels: the top
+ * #MEMCTL_PT_L1_BITS bits of an address select a second-level table, and the
+ * next bits select a page of #MEMCTL_PAGE_SIZE bytes in it.
+ */
+#define MEMCTL_PAGE_SHIFT 12
+#define MEMCTL_PAGE_SIZE  (1u << MEMCTL_PAGE_SHIFT)
+#define MEMCTL_PT_L1_BITS 10
+#define MEMCTL_PT_L1_SIZE (1u << MEMCTL_PT_L1_BITS)
+#define MEMCTL_PT_L2_BITS (32 - MEMCTL_PT_L1_BITS - MEMCTL_PAGE_SHIFT)
+#define MEMCTL_PT_L2_SIZE (1u << MEMCTL_PT_L2_BITS)
+/// @}
+static_assert(MEMCTL_MAX_REGIONS < 0xFFFF,
+              "region indices do not fit into page table entries");
+
+/// Address-to-region lookup table, see @ref memctl.c.
+typedef struct memctl_page_table memctl_page_table_t;
+
+/**
+ * Function called when a page that holds predecoded code is written, see
+ * #memctl_set_code_watch().
+ * @param ctx  Context passed to #memctl_set_code_watch().
+ * @param addr Address of the first written byte.
+ * @param size Number of written bytes.
+ */
+typedef void (*memctl_code_write_cb)(void *ctx, vm_addr_t addr, uint32_t size);
 
 typedef struct {
     vm_addr_t start;
@@ -25,6 +56,13 @@ typedef struct {
 
     void *ctx;
     mem_if_t mem_if;
+
+    /// Host buffer backing the whole region, see @ref dev_desc_t.direct_ptr.
+    uint8_t *direct_ptr;
+    /// Allowed direct accesses to @a direct_ptr (`MEM_DIRECT_*` bits).
+    uint8_t direct_perms;
+    /// The device reports its changes, see @ref dev_desc_t.f_set_notify.
+    bool notifies_changes;
 } mmio_region_t;
 
 typedef struct {
@@ -33,9 +71,45 @@ typedef struct {
     /// `mem_if_t` and vice versa.
     mem_if_t intf;
 
-    bool used_regions[MEMCTL_MAX_REGIONS];
-    mmio_region_t mapped_regions[MEMCTL_MAX_REGIONS];
+    /**
+     * The @a num_mapped_regions mapped regions, in no particular order.
+     * Grows as regions are mapped, so pointers to the regions are only valid
+     * until the next call to #memctl_map_region() or #memctl_unmap_region().
+     */
+    mmio_region_t *mapped_regions;
+    /// Indices into @a mapped_regions sorted by region start address.
+    uint16_t *sorted_regions;
     size_t num_mapped_regions;
+    /// Number of regions @a mapped_regions and @a sorted_regions have room for.
+    size_t regions_cap;
+
+    /// Lookup table built from @a mapped_regions, not saved in snapshots.
+    memctl_page_table_t *page_table;
+    /**
+     * Incremented whenever the mapping changes, which invalidates the spans
+     * returned by #memctl_get_span(). Not saved in snapshots.
+     */
+    uint32_t map_gen;
+
+    /**
+     * Pages that hold predecoded code, see @ref mem_span_t.code_pages.
+     * Cleared when the mapping changes. Not saved in snapshots.
+     */
+    mem_page_bitmap_t *code_pages;
+    /// Value of @a map_gen when @a code_pages was last cleared.
+    uint32_t code_pages_gen;
+    /// Called on writes to @a code_pages, or NULL. Not saved in snapshots.
+    memctl_code_write_cb f_code_write;
+    void *code_write_ctx; //!< Context passed to @a f_code_write.
+
+    /**
+     * Host address of guest address 0 in the reserved guest address space,
+     * or NULL (see #memctl_reserve_space()). Not saved in snapshots.
+     */
+    uint8_t *space;
+    /// Pages of @a space mapped with #memctl_map_ram(), or NULL. Not saved in
+    /// snapshots.
+    mem_page_bitmap_t *ram_pages;
 } memctl_ctx_t;
 
 memctl_ctx_t *memctl_new(void);
@@ -45,7 +119,7 @@ void memctl_free(memctl_ctx_t *memctl);
 /// @{
 
 /// Calculates the size of a buffer required to store a #memctl_ctx_t snapshot.
-size_t memctl_snapshot_size(void);
+size_t memctl_snapshot_size(const memctl_ctx_t *memctl);
 /**
  * Writes a snapshot of @a memctl into the buffer @a v_buf.
  * @param memctl   Memory controller context to save a snapshot of.
@@ -69,10 +143,65 @@ memctl_ctx_t *memctl_restore(const void *v_buf, size_t max_size,
                              size_t *out_used_size);
 /// @}
 
+/**
+ * Maps a copy of @a mmio. Checking for overlapping regions takes logarithmic
+ * time in the number of mapped regions.
+ * @returns #VM_ERR_MEM_USED if @a mmio overlaps a mapped region,
+ * #VM_ERR_MEM_MAX_REGIONS if #MEMCTL_MAX_REGIONS regions are mapped.
+ */
 vm_err_t memctl_map_region(memctl_ctx_t *memctl, const mmio_region_t *mmio);
 
+/**
+ * Unmaps the region that starts at @a start. RAM mapped with
+ * #memctl_map_ram() is given back to the host. Whoever mapped the region,
+ * such as the bus controller, is not told.
+ * @returns #VM_ERR_BAD_MEM if no region starts at @a start.
+ */
+vm_err_t memctl_unmap_region(memctl_ctx_t *memctl, vm_addr_t start);
+
+/**
+ * Reserves the whole guest address space in the host address space, without
+ * committing any memory, so that RAM can be mapped with #memctl_map_ram().
+ *
+ * The reads and writes of that RAM through #memctl_read_u8(),
+ * #memctl_read_u32(), #memctl_write_u8() and #memctl_write_u32() skip the
+ * region lookup and bounds checks: an access that leaves the RAM faults, and
+ * a `SIGSEGV` handler installed for the whole process turns the fault into a
+ * regular lookup, which fails with the usual error if nothing is mapped
+ * there. Faults outside the accessors are passed on to the previous handler.
+ * Unlike with other regions, a 32-bit access may straddle two adjacent RAM
+ * regions.
+ *
+ * Only supported on x86-64 Linux hosts. The RAM is not saved in snapshots,
+ * so a memory controller with a reserved space cannot be snapshotted.
+ * @returns #VM_ERR_MEM_NO_SPACE if the host is not supported or the space
+ * cannot be reserved.
+ */
+vm_err_t memctl_reserve_space(memctl_ctx_t *memctl);
+
+/**
+ * Maps RAM at [@a start, @a end) in the space reserved by
+ * #memctl_reserve_space(). The region has no callbacks, and is accessed
+ * directly with the @a perms access rights (`MEM_DIRECT_*` bits), which the
+ * host memory protection enforces for the host as well.
+ * @param      memctl  Memory controller with a reserved space.
+ * @param      start   First address, aligned to #MEMCTL_PAGE_SIZE.
+ * @param      end     End address (exclusive), aligned to #MEMCTL_PAGE_SIZE.
+ * @param      perms   Allowed accesses, #MEM_DIRECT_READ at least.
+ * @param      data    Initial contents of the start of the RAM, the rest is
+ *                     zeroed (may be NULL if @a size is 0).
+ * @param      size    Size of @a data.
+ * @param[out] out_ptr Host address of @a start (may be NULL).
+ * @returns #VM_ERR_MEM_NO_SPACE if no space is reserved or the host cannot
+ * commit the memory, or the errors of #memctl_map_region().
+ */
+vm_err_t memctl_map_ram(memctl_ctx_t *memctl, vm_addr_t start, vm_addr_t end,
+                        uint8_t perms, const void *data, size_t size,
+                        uint8_t **out_ptr);
+
 /**
  * Finds a mapped region that contains address @a addr.
+ * The lookup time does not depend on the number of mapped regions.
  * @param[in]  memctl  Memory controller.
  * @param[in]  addr    Contained memory address to search by.
  * @param[out] out_reg Output pointer to the found memory region (may be NULL).
@@ -87,6 +216,51 @@ vm_err_t memctl_read_u8(void *memctl_ctx, vm_addr_t addr, uint8_t *out);
 vm_err_t memctl_read_u32(void *memctl_ctx, vm_addr_t addr, uint32_t *out);
 vm_err_t memctl_write_u8(void *memctl_ctx, vm_addr_t addr, uint8_t val);
 vm_err_t memctl_write_u32(void *memctl_ctx, vm_addr_t addr, uint32_t val);
+bool memctl_get_span(void *memctl_ctx, vm_addr_t addr, mem_span_t *out);
+
+/**
+ * @{
+ * @name Block transfers
+ * Read or write the @a size bytes at @a addr, which may span several regions.
+ * The part in each region is copied with `memcpy()` if the region allows
+ * direct accesses, with the region's block callback if it has one, or byte by
+ * byte otherwise. Writes are reported like with #memctl_write_u8().
+ * @returns #VM_ERR_BAD_MEM if a byte of the block is not mapped,
+ * #VM_ERR_MEM_BAD_OP if a region does not support the transfer, or the error
+ * of a region's callback. The regions before the failing one have been
+ * transferred.
+ */
+vm_err_t memctl_read_block(void *memctl_ctx, vm_addr_t addr, void *out,
+                           size_t size);
+vm_err_t memctl_write_block(void *memctl_ctx, vm_addr_t addr, const void *data,
+                            size_t size);
+/// @}
+
+/**
+ * Invalidates the spans returned by #memctl_get_span().
+ * Must be called after a mapped region is modified in place.
+ */
+void memctl_flush_spans(memctl_ctx_t *memctl);
+
+/**
+ * Sets the function called when memory that a CPU has predecoded code from is
+ * written by someone else than that CPU: through #memctl_write_u8(),
+ * #memctl_write_u32() or #memctl_note_write(). The function is called with
+ * the written range, before the write returns.
+ * @param memctl       Memory controller.
+ * @param f_code_write Function to call, or NULL.
+ * @param ctx          Context passed to @a f_code_write.
+ */
+void memctl_set_code_watch(memctl_ctx_t *memctl,
+                           memctl_code_write_cb f_code_write, void *ctx);
+
+/**
+ * Reports that the host has written the @a size bytes at @a addr through a
+ * direct pointer (see @ref mmio_region_t.direct_ptr), which bypasses the
+ * write functions. Calls the #memctl_set_code_watch() function if the bytes
+ * overlap predecoded code.
+ */
+void memctl_note_write(memctl_ctx_t *memctl, vm_addr_t addr, uint32_t size);
 
 #ifdef __cplusplus
 }
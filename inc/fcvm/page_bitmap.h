@@ -0,0 +1,52 @@
+/**
+ * @file page_bitmap.h
+ * Sparse bitmap of the pages of the guest address space.
+ *
+ * A flat bitmap of the 2^20 pages of 4 KiB would take 128 KiB, most of it
+ * zero. #mem_page_bitmap_t is split into leaves of #MEM_PAGE_BITMAP_LEAF_BITS
+ * bits (16 MiB of address space each) that are only allocated when one of
+ * their bits is set, so a bitmap costs 2 KiB plus 512 bytes per leaf in use.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Page size of the bitmaps.
+#define MEM_PAGE_BITMAP_PAGE_SHIFT 12
+/// Number of bits of a leaf.
+#define MEM_PAGE_BITMAP_LEAF_SHIFT 12
+#define MEM_PAGE_BITMAP_LEAF_BITS  (1u << MEM_PAGE_BITMAP_LEAF_SHIFT)
+/// Number of leaves covering the 32-bit address space.
+#define MEM_PAGE_BITMAP_NUM_LEAVES                                             \
+    ((1ULL << (32 - MEM_PAGE_BITMAP_PAGE_SHIFT)) / MEM_PAGE_BITMAP_LEAF_BITS)
+
+/// Zero-initialize, then update with #mem_page_bitmap_set() and the others.
+typedef struct mem_page_bitmap {
+    /// Leaves of #MEM_PAGE_BITMAP_LEAF_BITS bits, NULL if all clear.
+    uint64_t *leaves[MEM_PAGE_BITMAP_NUM_LEAVES];
+} mem_page_bitmap_t;
+
+/// Tests the bit of @a page (a guest address shifted right by
+/// #MEM_PAGE_BITMAP_PAGE_SHIFT).
+static inline bool mem_page_bitmap_test(const mem_page_bitmap_t *bitmap,
+                                        uint32_t page) {
+    const uint64_t *leaf = bitmap->leaves[page / MEM_PAGE_BITMAP_LEAF_BITS];
+    const uint32_t bit = page % MEM_PAGE_BITMAP_LEAF_BITS;
+    return leaf && ((leaf[bit / 64] >> (bit % 64)) & 1);
+}
+
+void mem_page_bitmap_set(mem_page_bitmap_t *bitmap, uint32_t page);
+void mem_page_bitmap_clear(mem_page_bitmap_t *bitmap, uint32_t page);
+
+/// Clears every bit and frees the leaves.
+void mem_page_bitmap_reset(mem_page_bitmap_t *bitmap);
+
+#ifdef __cplusplus
+}
+#endif
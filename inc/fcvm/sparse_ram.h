@@ -0,0 +1,113 @@
+/**
+ * @file sparse_ram.h
+ * Sparse RAM device API.
+ *
+ * A RAM device whose memory is only allocated where the guest writes to it, a
+ * page of #SPARSE_RAM_PAGE_SIZE bytes at a time. Untouched pages read as the
+ * fill value of the device, so a guest given a large address range only costs
+ * the pages it has written, and so do its snapshots.
+ *
+ * The allocated pages are accessed directly: the device is connected with
+ * #MEM_DIRECT_SPANS, and #sparse_ram_get_span() gives the host address of each
+ * allocated page. Untouched pages go through the callbacks until written.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fcvm/vm_types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Version of the `sparse_ram_ctx_t` structure and of its snapshot format.
+/// Increment this every time anything in the `sparse_ram_ctx_t` structure or
+/// in the snapshot format is changed: field order, size, type, etc.
+#define SN_SPARSE_RAM_CTX_VER ((uint32_t)1)
+
+#define SPARSE_RAM_DEV_CLASS 0x03
+
+/// Size of the pages allocated on first write.
+#define SPARSE_RAM_PAGE_SHIFT 12
+#define SPARSE_RAM_PAGE_SIZE  (1u << SPARSE_RAM_PAGE_SHIFT)
+/// Number of page pointers per table, allocated on first write as well.
+#define SPARSE_RAM_TABLE_SHIFT 10
+#define SPARSE_RAM_TABLE_SIZE  (1u << SPARSE_RAM_TABLE_SHIFT)
+
+/// Sparse RAM device context.
+typedef struct {
+    /// Descriptor to connect the device with, see #vm_connect_dev().
+    dev_desc_t desc;
+
+    vm_addr_t size; //!< Size of the device memory in bytes.
+    uint8_t fill;   //!< Value of the bytes of untouched pages.
+
+    /// Page tables, indexed by the page index divided by
+    /// #SPARSE_RAM_TABLE_SIZE. Missing tables and pages are NULL.
+    uint8_t ***tables;
+    size_t num_tables;
+    size_t num_pages; //!< Number of allocated pages.
+} sparse_ram_ctx_t;
+
+/**
+ * Creates a sparse RAM device without any allocated page.
+ * @param size Size of the device memory in bytes (must not be 0).
+ * @param fill Value of the bytes that have never been written.
+ * @returns A newly allocated #sparse_ram_ctx_t structure, never `NULL`.
+ */
+sparse_ram_ctx_t *sparse_ram_new(vm_addr_t size, uint8_t fill);
+void sparse_ram_free(sparse_ram_ctx_t *ctx);
+
+/// @addtogroup snapshots
+/// @{
+
+/// Calculates the snapshot size, which grows with the number of allocated
+/// pages.
+size_t sparse_ram_snapshot_size(const void *v_ctx);
+/// Writes the size, the fill value and the allocated pages into @a v_buf.
+size_t sparse_ram_snapshot(const void *v_ctx, void *v_buf, size_t max_size);
+/**
+ * Restores a sparse RAM device from a snapshot.
+ *
+ * @param      busdev_ctx    Bus device context to point at the restored
+ *                           device, or NULL.
+ * @param      v_buf         Snapshot buffer.
+ * @param      max_size      Size of @a v_buf.
+ * @param[out] out_used_size Number of bytes used from the buffer @a v_buf.
+ *
+ * @returns A newly allocated #sparse_ram_ctx_t structure, never `NULL`.
+ */
+sparse_ram_ctx_t *sparse_ram_restore(busctl_dev_ctx_t *busdev_ctx,
+                                     const void *v_buf, size_t max_size,
+                                     size_t *out_used_size);
+/// @}
+
+/**
+ * @{
+ * @name Memory interface
+ * Addresses are relative to the start of the device memory. Accesses that
+ * leave it fail with #VM_ERR_BAD_MEM. Writes allocate the pages they change.
+ */
+vm_err_t sparse_ram_read_u8(void *v_ctx, vm_addr_t addr, uint8_t *out);
+vm_err_t sparse_ram_read_u32(void *v_ctx, vm_addr_t addr, uint32_t *out);
+vm_err_t sparse_ram_write_u8(void *v_ctx, vm_addr_t addr, uint8_t val);
+vm_err_t sparse_ram_write_u32(void *v_ctx, vm_addr_t addr, uint32_t val);
+vm_err_t sparse_ram_read_block(void *v_ctx, vm_addr_t addr, void *out,
+                               size_t size);
+vm_err_t sparse_ram_write_block(void *v_ctx, vm_addr_t addr, const void *data,
+                                size_t size);
+/**
+ * Gives the page that contains @a addr: readable and writable directly if it
+ * is allocated, through the callbacks otherwise. The span of an untouched
+ * page stays valid after the page is allocated, it is only slower.
+ */
+bool sparse_ram_get_span(void *v_ctx, vm_addr_t addr, mem_span_t *out);
+/// @}
+
+#ifdef __cplusplus
+}
+#endif
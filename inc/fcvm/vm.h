@@ -7,6 +7,7 @@
 
 #include <fcvm/busctl.h>
 #include <fcvm/cpu.h>
+#include <fcvm/cpu_aot.h>
 #include <fcvm/memctl.h>
 
 #ifdef __cplusplus
@@ -96,6 +97,76 @@ vm_err_t vm_connect_dev(vm_ctx_t *vm, const dev_desc_t *dev_desc, void *ctx);
  */
 void vm_step(vm_ctx_t *vm);
 
+/**
+ * Runs the VM for at most @a max_instrs instructions.
+ * See #cpu_run().
+ */
+cpu_stop_t vm_run(vm_ctx_t *vm, size_t max_instrs, size_t *out_num_instrs);
+
+/**
+ * Runs the VM until it spends @a budget CPU cycles.
+ * See #cpu_run_cycles().
+ */
+cpu_stop_t vm_run_cycles(vm_ctx_t *vm, uint64_t budget,
+                         uint64_t *out_used_cycles, uint64_t *out_overshoot);
+
+/**
+ * Blocks until an IRQ is raised or a device changes, for a VM whose run has
+ * returned #CPU_STOP_HALTED or #CPU_STOP_IDLE. See #intctl_wait().
+ * @returns `true` if an IRQ is pending and the VM must be run again.
+ */
+bool vm_wait_irq(vm_ctx_t *vm, int timeout_ms);
+
+/**
+ * Wakes the thread blocked in #vm_wait_irq(). See #intctl_wake().
+ */
+void vm_wake(vm_ctx_t *vm);
+
+/**
+ * File descriptor signalled when the halted VM has to be run again.
+ * A VM returned by #vm_restore() has a descriptor of its own.
+ * See #intctl_wait_fd().
+ */
+int vm_wait_fd(const vm_ctx_t *vm);
+
+/**
+ * Attaches an instruction trace buffer to the VM CPU.
+ * See #cpu_set_trace().
+ */
+void vm_set_trace(vm_ctx_t *vm, cpu_trace_t *trace);
+
+/**
+ * Selects the execution engine of the VM CPU.
+ * See #cpu_set_engine().
+ */
+void vm_set_engine(vm_ctx_t *vm, cpu_engine_t engine);
+
+/**
+ * Sets the promotion thresholds of the VM CPU.
+ * See #cpu_set_tiers().
+ */
+void vm_set_tiers(vm_ctx_t *vm, const cpu_tier_cfg_t *cfg);
+
+/**
+ * Work done in each tier by the VM CPU.
+ * See @ref cpu_ctx_t.tier_stats.
+ */
+const cpu_tier_stats_t *vm_tier_stats(const vm_ctx_t *vm);
+
+/**
+ * Number of writes that have invalidated code predecoded by the VM CPU.
+ * See #cpu_num_code_writes().
+ */
+uint64_t vm_num_code_writes(const vm_ctx_t *vm);
+
+/**
+ * Loads the code translated ahead of time from the ROM image @a rom, and
+ * selects #CPU_ENGINE_BLOCKS if the VM CPU uses the interpreter, so that the
+ * next runs use it. See #cpu_load_aot().
+ */
+vm_err_t vm_load_aot(vm_ctx_t *vm, const char *path, const void *rom,
+                     size_t rom_size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -45,6 +45,15 @@ typedef enum {
     VM_ERR_MEM_USED,
     /// Memory controller cannot resolve a memory access.
     VM_ERR_MEM_BAD_OP,
+    /// Memory controller cannot back guest RAM with host memory: the guest
+    /// address space is not reserved, or the host refuses.
+    VM_ERR_MEM_NO_SPACE,
+
+    /// An ahead-of-time translated shared object cannot be loaded.
+    VM_ERR_AOT_LOAD,
+    /// An ahead-of-time translated shared object has been translated from
+    /// another ROM image or for another version of the library.
+    VM_ERR_AOT_MISMATCH,
 } vm_err_t;
 
 #ifdef __cplusplus
@@ -19,13 +19,93 @@ typedef vm_err_t (*mem_read_u8_cb)(void *ctx, vm_addr_t addr, uint8_t *out);
 typedef vm_err_t (*mem_read_u32_cb)(void *ctx, vm_addr_t addr, uint32_t *out);
 typedef vm_err_t (*mem_write_u8_cb)(void *ctx, vm_addr_t addr, uint8_t val);
 typedef vm_err_t (*mem_write_u32_cb)(void *ctx, vm_addr_t addr, uint32_t val);
+/**
+ * @{
+ * @name Block transfers
+ * Read or write the @a size bytes at [@a addr, @a addr + @a size) at once.
+ * On failure, part of the block may have been transferred.
+ */
+typedef vm_err_t (*mem_read_block_cb)(void *ctx, vm_addr_t addr, void *out,
+                                      size_t size);
+typedef vm_err_t (*mem_write_block_cb)(void *ctx, vm_addr_t addr,
+                                       const void *data, size_t size);
+/// @}
 
-/// Memory interface used by the CPU.
+/**
+ * @{
+ * @name Direct memory access permissions
+ * Accesses that may bypass the memory interface callbacks and read or write the
+ * host buffer directly, see #mem_span_t.
+ */
+#define MEM_DIRECT_READ  (1 << 0)
+#define MEM_DIRECT_WRITE (1 << 1)
+/**
+ * Instead of a buffer backing the whole device, the @ref mem_if_t.get_span
+ * callback of the device tells which parts of its memory may be accessed
+ * directly, with device addresses. Only valid in @ref dev_desc_t.direct_perms
+ * and @ref mmio_region_t.direct_perms, without the other bits.
+ */
+#define MEM_DIRECT_SPANS (1 << 2)
+/// @}
+
+struct mem_if;
+struct mem_page_bitmap;
+
+/**
+ * Range of guest addresses backed by one device, and how to access it without
+ * looking the device up again.
+ */
 typedef struct {
+    uint8_t *ptr;    //!< Host address of @a start, or NULL.
+    vm_addr_t start; //!< First guest address of the range.
+    vm_addr_t end;   //!< End guest address of the range (exclusive).
+    uint8_t perms;   //!< Allowed direct accesses (`MEM_DIRECT_*` bits).
+
+    /// Device memory interface used for the accesses not allowed by @a perms.
+    const struct mem_if *mem_if;
+    void *ctx;         //!< Context passed to the @a mem_if callbacks.
+    vm_addr_t cb_base; //!< Subtracted from addresses passed to @a mem_if.
+    /// The device reports every change of the values read from the range, see
+    /// @ref dev_desc_t.f_set_notify.
+    bool notifies_changes;
+
+    /**
+     * Mapping generation counter, or NULL if the mapping never changes.
+     * The span is stale once the counter differs from its value at the time
+     * the span has been looked up.
+     */
+    const uint32_t *p_gen;
+
+    /**
+     * Bitmap of the pages of the mapping that hold predecoded code (see
+     * @ref fcvm/page_bitmap.h), or NULL. The CPU sets the bits of the pages it
+     * predecodes, so that writes to them that the CPU does not do itself can
+     * be reported to it (see #memctl_set_code_watch()).
+     */
+    struct mem_page_bitmap *code_pages;
+} mem_span_t;
+
+/**
+ * Finds the range that contains @a addr.
+ * @returns `true` if @a addr is mapped and @a *out has been written. The range
+ * may have no direct access permissions, in which case every access to it must
+ * go through the callbacks in @ref mem_span_t.mem_if.
+ */
+typedef bool (*mem_get_span_cb)(void *ctx, vm_addr_t addr, mem_span_t *out);
+
+/// Memory interface used by the CPU.
+typedef struct mem_if {
     mem_read_u8_cb read_u8;
     mem_read_u32_cb read_u32;
     mem_write_u8_cb write_u8;
     mem_write_u32_cb write_u32;
+    /// Optional range lookup (may be NULL), see #mem_get_span_cb.
+    mem_get_span_cb get_span;
+    /// Optional block read (may be NULL), used instead of repeated
+    /// @a read_u8 calls by #memctl_read_block().
+    mem_read_block_cb read_block;
+    /// Optional block write (may be NULL), see @a read_block.
+    mem_write_block_cb write_block;
 } mem_if_t;
 
 /// @addtogroup snapshots
@@ -63,12 +143,51 @@ typedef size_t (*cb_restore_dev_t)(uint8_t dev_class, busctl_dev_ctx_t *ctx,
                                    void *v_buf, size_t max_size);
 /// @}
 
+/**
+ * Function that a device calls whenever the values read from its memory change
+ * by themselves (not because of a guest write).
+ * @param notify_ctx Context passed along with this function to
+ *                   #cb_set_notify_dev_t.
+ */
+typedef void (*cb_notify_dev_t)(void *notify_ctx);
+/**
+ * Device callback that receives the function to call when the device state
+ * changes, see @ref dev_desc_t.f_set_notify.
+ * @param ctx        Context passed to #vm_connect_dev() or
+ *                   #busctl_connect_dev().
+ * @param f_notify   Function to call on every change, from any thread.
+ * @param notify_ctx Context to pass to @a f_notify.
+ */
+typedef void (*cb_set_notify_dev_t)(void *ctx, cb_notify_dev_t f_notify,
+                                    void *notify_ctx);
+
 /// Device descriptor.
 typedef struct {
     uint8_t dev_class;
     vm_addr_t region_size;
     mem_if_t mem_if;
 
+    /**
+     * Host buffer of @a region_size bytes that backs the device memory, or
+     * NULL. Accesses allowed by @a direct_perms are done with a bounds-checked
+     * `memcpy()` on this buffer instead of the @a mem_if callbacks.
+     */
+    uint8_t *direct_ptr;
+    /// Allowed direct accesses to @a direct_ptr (`MEM_DIRECT_*` bits), or
+    /// #MEM_DIRECT_SPANS with a NULL @a direct_ptr.
+    uint8_t direct_perms;
+
     cb_snapshot_size_dev_t f_snapshot_size;
     cb_snapshot_dev_t f_snapshot;
+
+    /**
+     * Optional hook (may be NULL) through which the device is given the
+     * function to call when the values read from its memory change.
+     *
+     * A device that sets it promises that reading its memory has no side
+     * effects, and that the values read only change by guest writes or with
+     * a notification. The CPU may then stop re-running a guest loop that only
+     * polls the device until it is notified (see #CPU_STOP_IDLE).
+     */
+    cb_set_notify_dev_t f_set_notify;
 } dev_desc_t;
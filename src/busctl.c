@@ -15,6 +15,7 @@ static bool prv_busctl_find_free_slot(busctl_ctx_t *busctl, size_t *out_idx);
 
 static vm_err_t prv_busctl_mmio_read_u32(void *ctx, vm_addr_t addr,
                                          uint32_t *out_val);
+static void prv_busctl_notify_dev(void *v_intctl);
 
 busctl_ctx_t *busctl_new(memctl_ctx_t *memctl, intctl_ctx_t *intctl) {
     return busctl_new_in_reg(memctl, intctl, NULL);
@@ -59,7 +60,7 @@ void busctl_free(busctl_ctx_t *busctl) {
 }
 
 size_t busctl_snapshot_size(const busctl_ctx_t *busctl) {
-    static_assert(SN_BUSCTL_CTX_VER == 1);
+    static_assert(SN_BUSCTL_CTX_VER == 4);
     size_t size = sizeof(busctl_ctx_t);
     for (size_t idx = 0; idx < BUS_MAX_DEVS; idx++) {
         const busctl_dev_ctx_t *dev = &busctl->devs[idx];
@@ -72,7 +73,7 @@ size_t busctl_snapshot_size(const busctl_ctx_t *busctl) {
 
 size_t busctl_snapshot(const busctl_ctx_t *busctl, void *v_buf,
                        size_t max_size) {
-    static_assert(SN_BUSCTL_CTX_VER == 1);
+    static_assert(SN_BUSCTL_CTX_VER == 4);
     D_ASSERT(busctl);
     D_ASSERT(v_buf);
     uint8_t *buf = (uint8_t *)v_buf;
@@ -89,14 +90,22 @@ size_t busctl_snapshot(const busctl_ctx_t *busctl, void *v_buf,
         busctl_copy.devs[idx].mmio.mem_if.read_u32 = NULL;
         busctl_copy.devs[idx].mmio.mem_if.write_u8 = NULL;
         busctl_copy.devs[idx].mmio.mem_if.write_u32 = NULL;
+        busctl_copy.devs[idx].mmio.mem_if.get_span = NULL;
+        busctl_copy.devs[idx].mmio.mem_if.read_block = NULL;
+        busctl_copy.devs[idx].mmio.mem_if.write_block = NULL;
+        busctl_copy.devs[idx].mmio.direct_ptr = NULL;
         busctl_copy.devs[idx].snapshot_ctx = NULL;
         busctl_copy.devs[idx].f_snapshot_size = NULL;
         busctl_copy.devs[idx].f_snapshot = NULL;
+        busctl_copy.devs[idx].f_set_notify = NULL;
     }
     busctl_copy.bus_mmio.mem_if.read_u8 = NULL;
     busctl_copy.bus_mmio.mem_if.read_u32 = NULL;
     busctl_copy.bus_mmio.mem_if.write_u8 = NULL;
     busctl_copy.bus_mmio.mem_if.write_u32 = NULL;
+    busctl_copy.bus_mmio.mem_if.get_span = NULL;
+    busctl_copy.bus_mmio.mem_if.read_block = NULL;
+    busctl_copy.bus_mmio.mem_if.write_block = NULL;
 
     // Write the context.
     D_ASSERT(size + sizeof(busctl_copy) <= max_size);
@@ -118,7 +127,7 @@ size_t busctl_snapshot(const busctl_ctx_t *busctl, void *v_buf,
 busctl_ctx_t *busctl_restore(memctl_ctx_t *memctl, intctl_ctx_t *intctl,
                              cb_restore_dev_t f_restore_dev, const void *v_buf,
                              size_t max_size, size_t *out_used_size) {
-    static_assert(SN_BUSCTL_CTX_VER == 1);
+    static_assert(SN_BUSCTL_CTX_VER == 4);
     D_ASSERT(memctl);
     D_ASSERT(intctl);
     D_ASSERT(f_restore_dev);
@@ -153,9 +162,20 @@ busctl_ctx_t *busctl_restore(memctl_ctx_t *memctl, intctl_ctx_t *intctl,
                 memctl, busctl->devs[idx].mmio.start, &memctl_reg);
             D_ASSERT(err == VM_ERR_NONE);
             D_ASSERT(memctl_reg);
+            D_ASSERTM(busctl->devs[idx].mmio.direct_ptr ||
+                          !(busctl->devs[idx].mmio.direct_perms &
+                            (MEM_DIRECT_READ | MEM_DIRECT_WRITE)),
+                      "restored device has direct permissions but no pointer");
             memcpy(memctl_reg, &busctl->devs[idx].mmio, sizeof(*memctl_reg));
+
+            const busctl_dev_ctx_t *dev = &busctl->devs[idx];
+            if (dev->f_set_notify) {
+                dev->f_set_notify(dev->mmio.ctx, prv_busctl_notify_dev,
+                                  intctl);
+            }
         }
     }
+    memctl_flush_spans(memctl);
 
     *out_used_size = offset;
     return busctl;
@@ -192,6 +212,9 @@ vm_err_t busctl_connect_dev(busctl_ctx_t *busctl, const dev_desc_t *desc,
         .end = map_end,
         .ctx = ctx,
         .mem_if = desc->mem_if,
+        .direct_ptr = desc->direct_ptr,
+        .direct_perms = desc->direct_perms,
+        .notifies_changes = desc->f_set_notify != NULL,
     };
     err = memctl_map_region(busctl->memctl, &mmio);
     if (err != VM_ERR_NONE) { return err; }
@@ -207,6 +230,10 @@ vm_err_t busctl_connect_dev(busctl_ctx_t *busctl, const dev_desc_t *desc,
     dev_ctx->snapshot_ctx = ctx;
     dev_ctx->f_snapshot_size = desc->f_snapshot_size;
     dev_ctx->f_snapshot = desc->f_snapshot;
+    dev_ctx->f_set_notify = desc->f_set_notify;
+    if (desc->f_set_notify) {
+        desc->f_set_notify(ctx, prv_busctl_notify_dev, busctl->intctl);
+    }
     if (out_dev_ctx) { *out_dev_ctx = dev_ctx; }
 
     D_ASSERT(err == VM_ERR_NONE);
@@ -274,3 +301,9 @@ static vm_err_t prv_busctl_mmio_read_u32(void *v_ctx, vm_addr_t offset,
     }
     return err;
 }
+
+/// Change notification function given to the devices, see #cb_notify_dev_t.
+static void prv_busctl_notify_dev(void *v_intctl) {
+    D_ASSERT(v_intctl);
+    intctl_notify_dev_change((intctl_ctx_t *)v_intctl);
+}
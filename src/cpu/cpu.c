@@ -10,15 +10,44 @@
 
 #include <fcvm/cpu.h>
 
+#include "cpu_aot.h"
+#include "cpu_block.h"
 #include "cpu_exec.h"
+#include "cpu_icache.h"
+#include "cpu_isa.h"
+#include "cpu_jit.h"
+#include "cpu_mem.h"
 #include "cpu_stack.h"
+#include "cpu_tier.h"
 #include "debugm.h"
 #include "portability.h"
 
+const uint32_t cpu_tlb_fixed_gen = 0;
+
+static vm_err_t prv_cpu_step(cpu_ctx_t *cpu);
+static cpu_stop_t prv_cpu_run(cpu_ctx_t *cpu, size_t max_instrs,
+                              uint64_t max_cycles, size_t *out_num_instrs);
+static void prv_cpu_take_pending_irq(cpu_ctx_t *cpu);
+static vm_err_t prv_cpu_fetch_isr_addr(cpu_ctx_t *cpu);
+static vm_err_t prv_cpu_enter_isr(cpu_ctx_t *cpu);
+static vm_err_t prv_cpu_run_instr(cpu_ctx_t *cpu);
+static vm_err_t prv_cpu_run_block(cpu_ctx_t *cpu, cpu_block_t **p_block,
+                                  size_t max_instrs, uint64_t max_cycles,
+                                  size_t *out_num_instrs);
+static vm_err_t prv_cpu_run_cold(cpu_ctx_t *cpu, size_t max_instrs,
+                                 uint64_t max_cycles, size_t *out_num_instrs);
+static bool prv_cpu_heat_block(cpu_ctx_t *cpu, cpu_block_t *block);
+static cpu_block_t *prv_cpu_build_block(cpu_ctx_t *cpu);
+static void prv_cpu_find_aot(cpu_ctx_t *cpu, cpu_block_t *block);
+static void prv_cpu_park_if_idle(cpu_ctx_t *cpu, const cpu_block_t *block,
+                                 uint32_t dev_change_gen);
+static bool prv_cpu_stays_idle(cpu_ctx_t *cpu);
+static vm_err_t prv_cpu_decode_instr(cpu_ctx_t *cpu);
+
 static vm_err_t prv_cpu_fetch_decode_operand(cpu_ctx_t *cpu,
                                              cpu_operand_type_t opd_type,
                                              cpu_opd_val_t *out_val);
-static void prv_cpu_print_instr(const cpu_instr_t *instr);
+static void prv_cpu_trace_instr(cpu_ctx_t *cpu);
 
 static bool prv_cpu_check_err(cpu_ctx_t *cpu, vm_err_t err);
 static void prv_cpu_raise_exception(cpu_ctx_t *cpu, vm_err_t err);
@@ -34,6 +63,13 @@ cpu_ctx_t *cpu_new(mem_if_t *mem) {
     cpu->state = CPU_RESET;
     cpu->mem = mem;
     cpu->intctl = intctl_new();
+    cpu->icache = cpu_icache_new();
+    cpu->fusion = true;
+    cpu->tier_cfg = (cpu_tier_cfg_t){
+        .warm_runs = CPU_TIER_DEFAULT_WARM_RUNS,
+        .hot_runs = CPU_TIER_DEFAULT_HOT_RUNS,
+        .hot_loop_runs = CPU_TIER_DEFAULT_HOT_LOOP_RUNS,
+    };
     cpu->num_nested_exc = 0;
 
     return cpu;
@@ -41,17 +77,22 @@ cpu_ctx_t *cpu_new(mem_if_t *mem) {
 
 void cpu_free(cpu_ctx_t *cpu) {
     D_ASSERT(cpu);
+    cpu_unload_aot(cpu);
     intctl_free(cpu->intctl);
+    cpu_icache_free(cpu->icache);
+    if (cpu->blocks) { cpu_blocks_free(cpu->blocks); }
+    if (cpu->jit) { cpu_jit_free(cpu->jit); }
+    if (cpu->tiers) { cpu_tiers_free(cpu->tiers); }
     free(cpu);
 }
 
 size_t cpu_snapshot_size(void) {
-    static_assert(SN_CPU_CTX_VER == 1);
+    static_assert(SN_CPU_CTX_VER == 15);
     return sizeof(cpu_ctx_t) + intctl_snapshot_size();
 }
 
 size_t cpu_snapshot(const cpu_ctx_t *cpu, void *v_buf, size_t max_size) {
-    static_assert(SN_CPU_CTX_VER == 1);
+    static_assert(SN_CPU_CTX_VER == 15);
     D_ASSERT(cpu);
     D_ASSERT(v_buf);
     uint8_t *buf = (uint8_t *)v_buf;
@@ -62,6 +103,17 @@ size_t cpu_snapshot(const cpu_ctx_t *cpu, void *v_buf, size_t max_size) {
     memcpy(&cpu_copy, cpu, sizeof(cpu_copy));
     cpu_copy.mem = NULL;
     cpu_copy.intctl = NULL;
+    cpu_copy.trace = NULL;
+    memset(cpu_copy.tlb, 0, sizeof(cpu_copy.tlb));
+    cpu_copy.icache = NULL;
+    cpu_copy.blocks = NULL;
+    cpu_copy.jit = NULL;
+    cpu_copy.aot = NULL;
+    cpu_copy.tiers = NULL;
+    cpu_copy.idle = false;
+    cpu_copy.pair_hist = NULL;
+    // Save the canonical flags.
+    cpu_exec_sync_flags(&cpu_copy);
 
     // Write the CPU context.
     D_ASSERT(size + sizeof(cpu_copy) <= max_size);
@@ -76,7 +128,7 @@ size_t cpu_snapshot(const cpu_ctx_t *cpu, void *v_buf, size_t max_size) {
 
 cpu_ctx_t *cpu_restore(mem_if_t *mem, const void *v_buf, size_t max_size,
                        size_t *out_used_size) {
-    static_assert(SN_CPU_CTX_VER == 1);
+    static_assert(SN_CPU_CTX_VER == 15);
     D_ASSERT(mem);
     D_ASSERT(v_buf);
     D_ASSERT(out_used_size);
@@ -103,18 +155,11 @@ cpu_ctx_t *cpu_restore(mem_if_t *mem, const void *v_buf, size_t max_size,
     cpu->curr_isr_addr = rest_cpu.curr_isr_addr;
     cpu->pc_after_isr = rest_cpu.pc_after_isr;
 
-    // Restore the register pointers in the instruction execution context.
+    // Decoded operands reference registers by offset, only the descriptor
+    // pointer has to be restored.
     if (cpu->state == CPU_FETCH_DECODE_OPERANDS || cpu->state == CPU_EXECUTE) {
         cpu->instr.desc = cpu_lookup_instr_desc(cpu->instr.opcode);
         D_ASSERT(cpu->instr.desc);
-        for (size_t opd = 0; opd < cpu->instr.next_operand; opd++) {
-            if (cpu->instr.desc->operands[opd] == CPU_OPD_REG) {
-                cpu_decode_reg(cpu,
-                               cpu->instr.operands[opd].reg_ref.encoded_ref,
-                               &cpu->instr.operands[opd].reg_ref);
-                D_ASSERT(cpu->instr.operands[opd].reg_ref.p_reg);
-            }
-        }
     }
 
     // Delete the intctl allocated in cpu_new() and restore it from the buf.
@@ -128,18 +173,109 @@ cpu_ctx_t *cpu_restore(mem_if_t *mem, const void *v_buf, size_t max_size,
 }
 
 void cpu_step(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    cpu->idle = false;
+    prv_cpu_step(cpu);
+    cpu_exec_sync_flags(cpu);
+}
+
+cpu_stop_t cpu_run(cpu_ctx_t *cpu, size_t max_instrs, size_t *out_num_instrs) {
+    D_ASSERT(cpu);
+    return prv_cpu_run(cpu, max_instrs, UINT64_MAX, out_num_instrs);
+}
+
+cpu_stop_t cpu_run_cycles(cpu_ctx_t *cpu, uint64_t budget,
+                          uint64_t *out_used_cycles, uint64_t *out_overshoot) {
+    D_ASSERT(cpu);
+    const uint64_t start_cycles = cpu->cycles;
+    cpu_stop_t stop = prv_cpu_run(cpu, SIZE_MAX, budget, NULL);
+
+    const uint64_t used_cycles = cpu->cycles - start_cycles;
+    if (out_used_cycles) { *out_used_cycles = used_cycles; }
+    if (out_overshoot) {
+        *out_overshoot = used_cycles > budget ? used_cycles - budget : 0;
+    }
+    return stop;
+}
+
+void cpu_set_trace(cpu_ctx_t *cpu, cpu_trace_t *trace) {
+    D_ASSERT(cpu);
+    cpu->trace = trace;
+}
+
+void cpu_set_engine(cpu_ctx_t *cpu, cpu_engine_t engine) {
+    D_ASSERT(cpu);
+    // The tiered engine allocates the blocks and the compiler once needed.
+    if (engine == CPU_ENGINE_TIERED) {
+        if (!cpu->tiers) { cpu->tiers = cpu_tiers_new(); }
+    } else if (engine != CPU_ENGINE_INTERP && !cpu->blocks) {
+        cpu->blocks = cpu_blocks_new();
+    }
+    if (engine == CPU_ENGINE_JIT && !cpu->jit) { cpu->jit = cpu_jit_new(); }
+    cpu->engine = engine;
+    cpu->idle = false;
+}
+
+void cpu_set_tiers(cpu_ctx_t *cpu, const cpu_tier_cfg_t *cfg) {
+    D_ASSERT(cpu);
+    D_ASSERT(cfg);
+    D_ASSERT(cfg->warm_runs > 0 && cfg->hot_runs > 0 && cfg->hot_loop_runs > 0);
+    cpu->tier_cfg = *cfg;
+}
+
+void cpu_set_fusion(cpu_ctx_t *cpu, bool enabled) {
+    D_ASSERT(cpu);
+    cpu->fusion = enabled;
+    // Rebuild the blocks with or without the superinstructions.
+    cpu_icache_clear(cpu->icache);
+}
+
+void cpu_set_pair_hist(cpu_ctx_t *cpu, cpu_pair_hist_t *hist) {
+    D_ASSERT(cpu);
+    cpu->pair_hist = hist;
+}
+
+void cpu_tlb_flush(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    memset(cpu->tlb, 0, sizeof(cpu->tlb));
+    cpu_icache_clear(cpu->icache);
+    cpu->idle = false;
+}
+
+void cpu_flush_icache(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    cpu_icache_clear(cpu->icache);
+    cpu->idle = false;
+}
+
+void cpu_note_code_write(cpu_ctx_t *cpu, vm_addr_t addr, uint32_t size) {
+    D_ASSERT(cpu);
+    cpu_icache_t *icache = cpu->icache;
+    if (icache->own_store_size == size && icache->own_store_addr == addr) {
+        // A store of the CPU itself, already noted.
+        return;
+    }
+    cpu_icache_note_write(icache, addr, size);
+    cpu->idle = false;
+}
+
+uint64_t cpu_num_code_writes(const cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    return cpu->icache->num_code_writes;
+}
+
+/**
+ * Advances the CPU state machine by one state.
+ * @returns The error that raised an exception during this step, or
+ * #VM_ERR_NONE if no exception was raised.
+ */
+static vm_err_t prv_cpu_step(cpu_ctx_t *cpu) {
     D_ASSERT(cpu);
     D_ASSERT(cpu->intctl);
+    vm_err_t err = VM_ERR_NONE;
 
     if (cpu->state == CPU_FETCH_DECODE_OPCODE || cpu->state == CPU_HALTED) {
-        if (intctl_has_pending_irqs(cpu->intctl)) {
-            uint8_t pending_irq;
-            if (intctl_get_pending_irq(cpu->intctl, &pending_irq)) {
-                cpu->curr_int_line = CPU_IVT_FIRST_IRQ_ENTRY + pending_irq;
-                cpu->pc_after_isr = cpu->reg_pc;
-                cpu->state = CPU_INT_FETCH_ISR_ADDR;
-            }
-        }
+        prv_cpu_take_pending_irq(cpu);
     }
 
     switch (cpu->state) {
@@ -152,8 +288,8 @@ void cpu_step(cpu_ctx_t *cpu) {
 
     case CPU_FETCH_DECODE_OPCODE: {
         cpu->instr.start_addr = cpu->reg_pc;
-        vm_err_t err =
-            cpu->mem->read_u8(cpu->mem, cpu->reg_pc, &cpu->instr.opcode);
+        err = cpu_mem_read_u8(cpu, CPU_TLB_FETCH, cpu->reg_pc,
+                              &cpu->instr.opcode);
         if (prv_cpu_check_err(cpu, err)) { goto CPU_STEP_END; }
         cpu->instr.desc = cpu_lookup_instr_desc(cpu->instr.opcode);
         if (cpu->instr.desc) {
@@ -167,7 +303,7 @@ void cpu_step(cpu_ctx_t *cpu) {
         } else {
             D_PRINTF("bad opcode 0x%02X at 0x%08X", cpu->instr.opcode,
                      cpu->reg_pc);
-            vm_err_t err = VM_ERR_BAD_OPCODE;
+            err = VM_ERR_BAD_OPCODE;
             prv_cpu_raise_exception(cpu, err);
         }
         break;
@@ -180,7 +316,7 @@ void cpu_step(cpu_ctx_t *cpu) {
         D_ASSERT(opd_idx < cpu->instr.desc->num_operands);
         cpu_operand_type_t opd_type = cpu->instr.desc->operands[opd_idx];
 
-        vm_err_t err = prv_cpu_fetch_decode_operand(
+        err = prv_cpu_fetch_decode_operand(
             cpu, opd_type, &cpu->instr.operands[opd_idx]);
         if (prv_cpu_check_err(cpu, err)) { goto CPU_STEP_END; }
 
@@ -192,8 +328,9 @@ void cpu_step(cpu_ctx_t *cpu) {
     }
 
     case CPU_EXECUTE: {
-        prv_cpu_print_instr(&cpu->instr);
-        vm_err_t err = cpu_execute_instr(cpu);
+        prv_cpu_trace_instr(cpu);
+        cpu->cycles += cpu->instr.desc->num_cycles;
+        err = cpu_execute_instr(cpu);
         if (prv_cpu_check_err(cpu, err)) { goto CPU_STEP_END; }
         if (cpu->state == CPU_EXECUTE) {
             // If the state has not been changed by the instruction (e.g. HALT),
@@ -207,11 +344,7 @@ void cpu_step(cpu_ctx_t *cpu) {
         break;
 
     case CPU_INT_FETCH_ISR_ADDR: {
-        uint8_t entry_idx = cpu->curr_int_line;
-        vm_addr_t entry_addr = CPU_IVT_ENTRY_ADDR(entry_idx);
-
-        vm_err_t err =
-            cpu->mem->read_u32(cpu->mem, entry_addr, &cpu->curr_isr_addr);
+        err = prv_cpu_fetch_isr_addr(cpu);
         if (prv_cpu_check_err(cpu, err)) { goto CPU_STEP_END; }
 
         if (cpu->curr_int_line == 0) {
@@ -223,7 +356,7 @@ void cpu_step(cpu_ctx_t *cpu) {
     }
 
     case CPU_INT_PUSH_PC: {
-        vm_err_t err = cpu_stack_push_u32(cpu, cpu->pc_after_isr);
+        err = cpu_stack_push_u32(cpu, cpu->pc_after_isr);
         if (prv_cpu_check_err(cpu, err)) { goto CPU_STEP_END; }
         cpu->state = CPU_INT_JUMP;
         break;
@@ -231,6 +364,7 @@ void cpu_step(cpu_ctx_t *cpu) {
 
     case CPU_INT_JUMP: {
         cpu->reg_pc = cpu->curr_isr_addr;
+        cpu->cycles += CPU_CYCLES_INT_ENTRY;
         cpu->state = CPU_FETCH_DECODE_OPCODE;
         break;
     }
@@ -245,11 +379,10 @@ void cpu_step(cpu_ctx_t *cpu) {
     }
 
 CPU_STEP_END:
+    return err;
 }
 
-vm_err_t cpu_decode_reg(cpu_ctx_t *cpu, uint8_t reg_ref,
-                        cpu_reg_ref_t *out_reg_ref) {
-    D_ASSERT(cpu);
+vm_err_t cpu_decode_reg(uint8_t reg_ref, cpu_reg_ref_t *out_reg_ref) {
     D_ASSERT(out_reg_ref);
 
     const uint8_t access_size_u8 = reg_ref & CPU_REG_REF_SIZE_MASK;
@@ -268,17 +401,23 @@ vm_err_t cpu_decode_reg(cpu_ctx_t *cpu, uint8_t reg_ref,
         return VM_ERR_BAD_REG_REF;
     }
 
-    uint32_t *const code_ptr_map[0xFF] = {
-        [CPU_CODE_R0] = &cpu->gp_regs[0], [CPU_CODE_R1] = &cpu->gp_regs[1],
-        [CPU_CODE_R2] = &cpu->gp_regs[2], [CPU_CODE_R3] = &cpu->gp_regs[3],
-        [CPU_CODE_R4] = &cpu->gp_regs[4], [CPU_CODE_R5] = &cpu->gp_regs[5],
-        [CPU_CODE_R6] = &cpu->gp_regs[6], [CPU_CODE_R7] = &cpu->gp_regs[7],
-        [CPU_CODE_SP] = &cpu->reg_sp,
+    // No register is at offset 0, which marks the invalid codes.
+    static const uint16_t code_offset_map[CPU_REG_REF_CODE_MASK + 1] = {
+        [CPU_CODE_R0] = offsetof(cpu_ctx_t, gp_regs[0]),
+        [CPU_CODE_R1] = offsetof(cpu_ctx_t, gp_regs[1]),
+        [CPU_CODE_R2] = offsetof(cpu_ctx_t, gp_regs[2]),
+        [CPU_CODE_R3] = offsetof(cpu_ctx_t, gp_regs[3]),
+        [CPU_CODE_R4] = offsetof(cpu_ctx_t, gp_regs[4]),
+        [CPU_CODE_R5] = offsetof(cpu_ctx_t, gp_regs[5]),
+        [CPU_CODE_R6] = offsetof(cpu_ctx_t, gp_regs[6]),
+        [CPU_CODE_R7] = offsetof(cpu_ctx_t, gp_regs[7]),
+        [CPU_CODE_SP] = offsetof(cpu_ctx_t, reg_sp),
     };
     static_assert(CPU_NUM_GP_REG_CODES == 8, "update register decoding");
+    static_assert(offsetof(cpu_ctx_t, gp_regs) > 0);
 
-    uint32_t *const p_reg = code_ptr_map[reg_code];
-    if (!p_reg) {
+    const uint16_t offset = code_offset_map[reg_code];
+    if (offset == 0) {
         D_PRINTF("bad register code: 0x%02X", reg_code);
         return VM_ERR_BAD_REG_REF;
     }
@@ -286,7 +425,7 @@ vm_err_t cpu_decode_reg(cpu_ctx_t *cpu, uint8_t reg_ref,
     out_reg_ref->encoded_ref = reg_ref;
     out_reg_ref->access_size = access_size;
     out_reg_ref->reg_code = reg_code;
-    out_reg_ref->p_reg = p_reg;
+    out_reg_ref->ctx_offset = offset;
 
     return VM_ERR_NONE;
 }
@@ -324,95 +463,705 @@ vm_err_t cpu_raise_irq(cpu_ctx_t *cpu, uint8_t irq_line) {
     return intctl_raise_irq_line(cpu->intctl, irq_line);
 }
 
-static vm_err_t prv_cpu_fetch_decode_operand(cpu_ctx_t *cpu,
-                                             cpu_operand_type_t opd_type,
-                                             cpu_opd_val_t *out_val) {
+/**
+ * Implements #cpu_run() and #cpu_run_cycles(): runs until either budget is
+ * exhausted.
+ * @param max_cycles Maximum number of cycles to spend, the last instruction or
+ *                   interrupt entry may overshoot it.
+ */
+static cpu_stop_t prv_cpu_run(cpu_ctx_t *cpu, size_t max_instrs,
+                              uint64_t max_cycles, size_t *out_num_instrs) {
     D_ASSERT(cpu);
-    D_ASSERT(out_val);
-    vm_err_t err = VM_ERR_NONE;
-    uint32_t opd_size = 0;
-
-    switch (opd_type) {
-    case CPU_OPD_REG: {
-        uint8_t reg_ref;
-        err = cpu->mem->read_u8(cpu->mem, cpu->reg_pc, &reg_ref);
-        if (err) { return err; }
+    D_ASSERT(cpu->intctl);
+    cpu_stop_t stop = CPU_STOP_BUDGET;
+    size_t num_instrs = 0;
+    const uint64_t start_cycles = cpu->cycles;
+    // Last block run, used to chain to the next one.
+    cpu_block_t *block = NULL;
+
+    while (num_instrs < max_instrs && cpu->cycles - start_cycles < max_cycles) {
+        if (cpu->idle && prv_cpu_stays_idle(cpu)) {
+            stop = CPU_STOP_IDLE;
+            break;
+        }
 
-        err = cpu_decode_reg(cpu, reg_ref, &out_val->reg_ref);
-        if (err) { return err; }
+        // Interrupts are only taken at instruction boundaries.
+        if (cpu->state == CPU_FETCH_DECODE_OPCODE ||
+            cpu->state == CPU_HALTED) {
+            prv_cpu_take_pending_irq(cpu);
+        }
 
-        opd_size = 1;
-        break;
-    }
-    case CPU_OPD_IMM5: {
-        uint8_t imm5;
-        err = cpu->mem->read_u8(cpu->mem, cpu->reg_pc, &imm5);
-        if (err) { return err; }
-        if ((imm5 & ~31) != 0) {
-            err = VM_ERR_BAD_IMM5;
-            return err;
+        vm_err_t err;
+        if (cpu->state == CPU_FETCH_DECODE_OPCODE &&
+            cpu->engine != CPU_ENGINE_INTERP) {
+            size_t block_instrs = 0;
+            err = prv_cpu_run_block(cpu, &block, max_instrs - num_instrs,
+                                    max_cycles - (cpu->cycles - start_cycles),
+                                    &block_instrs);
+            num_instrs += block_instrs;
+        } else if (cpu->state == CPU_FETCH_DECODE_OPCODE) {
+            err = prv_cpu_run_instr(cpu);
+            if (err == VM_ERR_NONE) { num_instrs++; }
+        } else if (cpu->state == CPU_HALTED) {
+            stop = CPU_STOP_HALTED;
+            break;
+        } else if (cpu->state == CPU_INT_FETCH_ISR_ADDR) {
+            block = NULL;
+            err = prv_cpu_enter_isr(cpu);
+        } else {
+            // Reset, and interrupt entries or instructions that were left
+            // half-done (e.g. by a snapshot taken between cpu_step() calls)
+            // are driven by the step state machine.
+            bool mid_instr = cpu->state == CPU_FETCH_DECODE_OPERANDS ||
+                             cpu->state == CPU_EXECUTE;
+            block = NULL;
+            err = prv_cpu_step(cpu);
+            if (err == VM_ERR_NONE && mid_instr &&
+                cpu->state != CPU_FETCH_DECODE_OPERANDS &&
+                cpu->state != CPU_EXECUTE) {
+                num_instrs++;
+            }
         }
 
-        out_val->imm5 = imm5;
-        opd_size = 1;
-        break;
+        if (err != VM_ERR_NONE) {
+            if (cpu->state == CPU_TRIPLE_FAULT) {
+                stop = CPU_STOP_TRIPLE_FAULT;
+            } else {
+                stop = CPU_STOP_EXCEPTION;
+            }
+            break;
+        }
+        if (cpu->idle) {
+            stop = CPU_STOP_IDLE;
+            break;
+        }
     }
-    case CPU_OPD_IMM8: {
-        uint8_t imm8;
-        err = cpu->mem->read_u8(cpu->mem, cpu->reg_pc, &imm8);
-        if (err) { return err; }
 
-        out_val->u8 = imm8;
-        opd_size = 1;
-        break;
+    // Flags are only evaluated lazily while running.
+    cpu_exec_sync_flags(cpu);
+    if (out_num_instrs) { *out_num_instrs = num_instrs; }
+    return stop;
+}
+
+/**
+ * Starts interrupt entry if there is a pending IRQ.
+ * Must only be called at an instruction boundary.
+ */
+static void prv_cpu_take_pending_irq(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    if (intctl_has_pending_irqs(cpu->intctl)) {
+        uint8_t pending_irq;
+        if (intctl_get_pending_irq(cpu->intctl, &pending_irq)) {
+            cpu->curr_int_line = CPU_IVT_FIRST_IRQ_ENTRY + pending_irq;
+            cpu->pc_after_isr = cpu->reg_pc;
+            cpu->state = CPU_INT_FETCH_ISR_ADDR;
+        }
     }
-    case CPU_OPD_IMM32: {
-        uint32_t imm32;
-        err = cpu->mem->read_u32(cpu->mem, cpu->reg_pc, &imm32);
-        if (err) { return err; }
+}
 
-        out_val->u32 = imm32;
-        opd_size = 4;
-        break;
+/// Reads the address of the handler of the current interrupt from the IVT.
+static vm_err_t prv_cpu_fetch_isr_addr(cpu_ctx_t *cpu) {
+    const vm_addr_t entry_addr = CPU_IVT_ENTRY_ADDR(cpu->curr_int_line);
+    return cpu_mem_read_u32(cpu, CPU_TLB_IVT, entry_addr, &cpu->curr_isr_addr);
+}
+
+/**
+ * Enters the handler of the current interrupt at once: reads the IVT entry,
+ * pushes the return address and jumps. The CPU must be in the
+ * #CPU_INT_FETCH_ISR_ADDR state. The resulting state, and the exception raised
+ * on error, are the same as after stepping through the interrupt entry states
+ * with #cpu_step().
+ * @returns The error that raised an exception, or #VM_ERR_NONE.
+ */
+static vm_err_t prv_cpu_enter_isr(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    D_ASSERT(cpu->state == CPU_INT_FETCH_ISR_ADDR);
+    vm_err_t err = prv_cpu_fetch_isr_addr(cpu);
+    if (prv_cpu_check_err(cpu, err)) { return err; }
+
+    // Reset (line 0) does not return, so nothing is pushed.
+    if (cpu->curr_int_line != 0) {
+        err = cpu_stack_push_u32(cpu, cpu->pc_after_isr);
+        if (prv_cpu_check_err(cpu, err)) { return err; }
     }
-    default:
-        D_ASSERTMF(false, "invalid opd_type %d", opd_type);
+
+    cpu->reg_pc = cpu->curr_isr_addr;
+    cpu->cycles += CPU_CYCLES_INT_ENTRY;
+    cpu->state = CPU_FETCH_DECODE_OPCODE;
+    return VM_ERR_NONE;
+}
+
+/**
+ * Fetches, decodes and executes a whole instruction at the current PC, or takes
+ * it already decoded from the instruction cache.
+ * The CPU must be in the #CPU_FETCH_DECODE_OPCODE state. The resulting state is
+ * the same as after stepping through the instruction with #cpu_step().
+ * @returns The error that raised an exception, or #VM_ERR_NONE if the
+ * instruction has been retired.
+ */
+static vm_err_t prv_cpu_run_instr(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    D_ASSERT(cpu->state == CPU_FETCH_DECODE_OPCODE);
+    cpu_instr_t *instr = &cpu->instr;
+    vm_err_t err;
+
+    const cpu_icache_entry_t *cached = cpu_icache_lookup(cpu->icache,
+                                                         cpu->reg_pc);
+    if (cached) {
+        *instr = cached->instr;
+        cpu->reg_pc = cached->next_pc;
+    } else {
+        err = prv_cpu_decode_instr(cpu);
+        if (prv_cpu_check_err(cpu, err)) { return err; }
+        cpu_icache_insert(cpu, cpu->reg_pc);
     }
 
-    cpu->reg_pc += opd_size;
+    prv_cpu_trace_instr(cpu);
+    cpu->cycles += instr->desc->num_cycles;
+    err = cpu_execute_instr(cpu);
+    prv_cpu_check_err(cpu, err);
     return err;
 }
 
-static void prv_cpu_print_instr(const cpu_instr_t *instr) {
-    D_ASSERT(instr);
-    D_ASSERT(instr->desc);
+#define PRV_MEM_ACCESS(op, mnem, layout, cost, mem, handler, jit)              \
+    [CPU_OP_##op] = CPU_ISA_MEM_##mem,
+
+/// Memory accesses of each opcode, see the `mem` column of #CPU_ISA_INSTRS.
+static const bool prv_cpu_mem_accesses[256] = {
+    CPU_ISA_INSTRS(PRV_MEM_ACCESS)
+};
+
+/**
+ * Checks if an instruction with @a opcode accesses data memory or raises an
+ * IRQ, after which an IRQ may be pending or code may have been overwritten.
+ */
+static inline bool prv_cpu_accesses_mem(uint8_t opcode) {
+    return prv_cpu_mem_accesses[opcode];
+}
 
-    fprintf(stderr, "%08X | %02X %4s", instr->start_addr, instr->opcode,
-            instr->desc->mnemonic);
-    for (size_t opd = 0; opd < instr->desc->num_operands; opd++) {
-        if (opd == 0) { fprintf(stderr, " ["); }
-        switch (instr->desc->operands[opd]) {
-        case CPU_OPD_REG:
-            fprintf(stderr, "regref %02X",
-                    instr->operands[opd].reg_ref.encoded_ref);
+/// Checks if an instruction with @a opcode ends a basic block.
+static inline bool prv_cpu_ends_block(uint8_t opcode) {
+    return (opcode & CPU_OP_KIND_MASK) == CPU_OP_KIND_FLOW ||
+           opcode == CPU_OP_HALT || opcode == CPU_OP_INT_V8 ||
+           opcode == CPU_OP_IRET;
+}
+
+/**
+ * Runs the basic block at the current PC if it fits into the budgets, or a
+ * single instruction otherwise.
+ *
+ * The block is executed with the same results as if its instructions were run
+ * one by one by #prv_cpu_run_instr(). Since only memory accesses can raise an
+ * IRQ or overwrite code, the block is left early after an instruction that has
+ * accessed memory if an IRQ is pending or if the block has been invalidated.
+ *
+ * With #CPU_ENGINE_JIT and #CPU_ENGINE_TIERED, hot blocks are compiled and
+ * their native code runs first, the remaining instructions are then interpreted
+ * (see @ref cpu_jit.h). With #CPU_ENGINE_TIERED, the code of blocks that are
+ * not warm yet is run by #prv_cpu_run_cold() instead (see @ref cpu_tier.h).
+ *
+ * @param[in,out] p_block        Block run before, to follow its links. Set to
+ *                               the block run, or NULL if none.
+ * @param         max_instrs     Number of instructions left in the budget.
+ * @param         max_cycles     Number of cycles left in the budget.
+ * @param[out]    out_num_instrs Number of retired instructions.
+ * @returns The error that raised an exception, or #VM_ERR_NONE.
+ */
+static vm_err_t prv_cpu_run_block(cpu_ctx_t *cpu, cpu_block_t **p_block,
+                                  size_t max_instrs, uint64_t max_cycles,
+                                  size_t *out_num_instrs) {
+    D_ASSERT(cpu);
+    D_ASSERT(cpu->blocks || cpu->engine == CPU_ENGINE_TIERED);
+    D_ASSERT(p_block);
+    D_ASSERT(out_num_instrs);
+    D_ASSERT(cpu->state == CPU_FETCH_DECODE_OPCODE);
+    vm_err_t err;
+    *out_num_instrs = 0;
+
+    cpu_block_t *block =
+        cpu->blocks ? cpu_blocks_find_next(cpu->blocks, cpu->icache, *p_block,
+                                           cpu->reg_pc)
+                    : NULL;
+    // Translated code does not need to warm up.
+    if (!block && cpu->engine == CPU_ENGINE_TIERED && !cpu->aot &&
+        !cpu_tiers_count_cold(cpu->tiers, cpu->reg_pc,
+                              cpu->tier_cfg.warm_runs)) {
+        *p_block = NULL;
+        return prv_cpu_run_cold(cpu, max_instrs, max_cycles, out_num_instrs);
+    }
+    if (!block) {
+        if (!cpu->blocks) { cpu->blocks = cpu_blocks_new(); }
+        block = prv_cpu_build_block(cpu);
+        if (block) { cpu->tier_stats.num_warmed++; }
+        if (block && *p_block) { cpu_block_link(*p_block, block); }
+    }
+    // Entries through loop back-edges make the block hot sooner.
+    if (block && *p_block && block->start_pc <= (*p_block)->start_pc &&
+        block->num_loops < UINT32_MAX) {
+        block->num_loops++;
+    }
+    *p_block = block;
+
+    // Instructions are never split, a block that would stop the interpreter
+    // in its middle is not entered.
+    if (!block || block->num_ops > max_instrs ||
+        block->num_cycles > max_cycles) {
+        *p_block = NULL;
+        err = prv_cpu_run_instr(cpu);
+        if (err == VM_ERR_NONE) {
+            *out_num_instrs = 1;
+            cpu->tier_stats.cold_instrs++;
+        }
+        return err;
+    }
+
+    // Device changes notified during the run rule out an idle loop.
+    const uint32_t dev_change_gen =
+        block->idle_loop ? intctl_dev_change_gen(cpu->intctl) : 0;
+
+    size_t op_idx = 0;
+    if (!cpu->trace && block->aot_fn) {
+        // The translated code records the flags like the interpreter.
+        op_idx = block->aot_fn(cpu, &cpu->icache->code_pages);
+    } else if (prv_cpu_heat_block(cpu, block)) {
+        cpu_exec_sync_flags(cpu);
+        op_idx = block->jit_fn(cpu);
+    }
+    if (op_idx > 0) {
+        for (size_t done = 0; done < op_idx; done++) {
+            cpu->cycles += block->ops[done].instr.desc->num_cycles;
+        }
+        cpu->instr = block->ops[op_idx - 1].instr;
+        *out_num_instrs = op_idx;
+        cpu->tier_stats.hot_instrs += op_idx;
+    }
+    const size_t num_native = op_idx;
+
+    for (; op_idx < block->num_ops; op_idx++) {
+        const cpu_block_op_t *op = &block->ops[op_idx];
+        if (op->fused && !cpu->trace) {
+            // The pair ends the block and neither part accesses memory.
+            const cpu_block_op_t *next = op + 1;
+            cpu->instr = next->instr;
+            cpu->reg_pc = next->next_pc;
+            cpu->cycles += op->instr.desc->num_cycles;
+            cpu->cycles += next->instr.desc->num_cycles;
+            op->fused(cpu, &op->instr, &next->instr);
+            *out_num_instrs += 2;
+            op_idx++;
+            continue;
+        }
+        cpu->instr = op->instr;
+        cpu->reg_pc = op->next_pc;
+
+        prv_cpu_trace_instr(cpu);
+        cpu->cycles += cpu->instr.desc->num_cycles;
+        err = cpu_execute_instr(cpu);
+        if (prv_cpu_check_err(cpu, err)) {
+            *p_block = NULL;
+            cpu->tier_stats.warm_instrs += *out_num_instrs - num_native;
+            return err;
+        }
+        (*out_num_instrs)++;
+
+        if (op->mem_access &&
+            (intctl_has_pending_irqs(cpu->intctl) ||
+             !cpu_block_is_current(cpu->icache, block))) {
+            *p_block = NULL;
             break;
-        case CPU_OPD_IMM5:
-            fprintf(stderr, "imm5 %02X", instr->operands[opd].imm5);
+        }
+    }
+
+    cpu->tier_stats.warm_instrs += *out_num_instrs - num_native;
+    if (op_idx == block->num_ops && block->idle_loop) {
+        prv_cpu_park_if_idle(cpu, block, dev_change_gen);
+    }
+    if (cpu->pair_hist) {
+        uint64_t(*counts)[256] = cpu->pair_hist->counts;
+        for (size_t done = 1; done < *out_num_instrs; done++) {
+            counts[block->ops[done - 1].instr.opcode]
+                  [block->ops[done].instr.opcode]++;
+        }
+    }
+    return VM_ERR_NONE;
+}
+
+/**
+ * Runs the cold code at the current PC one instruction at a time, up to where
+ * its block would end. Stops early like #prv_cpu_run_block() does, and when
+ * the budgets are spent or the CPU leaves #CPU_FETCH_DECODE_OPCODE.
+ * @param         max_instrs     Number of instructions left in the budget.
+ * @param         max_cycles     Number of cycles left in the budget.
+ * @param[out]    out_num_instrs Number of retired instructions.
+ * @returns The error that raised an exception, or #VM_ERR_NONE.
+ */
+static vm_err_t prv_cpu_run_cold(cpu_ctx_t *cpu, size_t max_instrs,
+                                 uint64_t max_cycles, size_t *out_num_instrs) {
+    D_ASSERT(cpu);
+    D_ASSERT(out_num_instrs);
+    const vm_addr_t start_pc = cpu->reg_pc;
+    const uint64_t start_cycles = cpu->cycles;
+    *out_num_instrs = 0;
+
+    do {
+        const vm_err_t err = prv_cpu_run_instr(cpu);
+        if (err != VM_ERR_NONE) { return err; }
+        (*out_num_instrs)++;
+        cpu->tier_stats.cold_instrs++;
+
+        const uint8_t opcode = cpu->instr.opcode;
+        if (prv_cpu_ends_block(opcode) ||
+            (prv_cpu_accesses_mem(opcode) &&
+             intctl_has_pending_irqs(cpu->intctl))) {
             break;
-        case CPU_OPD_IMM8:
-            fprintf(stderr, "imm8 %02X", instr->operands[opd].u8);
+        }
+    } while (*out_num_instrs < max_instrs &&
+             *out_num_instrs < CPU_BLOCK_MAX_OPS &&
+             cpu->cycles - start_cycles < max_cycles &&
+             cpu->state == CPU_FETCH_DECODE_OPCODE &&
+             (cpu->reg_pc >> CPU_ICACHE_LINE_SHIFT) ==
+                 (start_pc >> CPU_ICACHE_LINE_SHIFT));
+    return VM_ERR_NONE;
+}
+
+/**
+ * Counts a run of @a block and compiles it once it is hot, with the engines
+ * that compile blocks.
+ * @returns `true` if the native code of @a block can be run.
+ */
+static bool prv_cpu_heat_block(cpu_ctx_t *cpu, cpu_block_t *block) {
+    D_ASSERT(cpu);
+    D_ASSERT(block);
+    if (cpu->trace) { return false; }
+    if (block->jit_fn) { return true; }
+
+    uint32_t hot_runs;
+    uint32_t hot_loop_runs;
+    if (cpu->engine == CPU_ENGINE_JIT) {
+        hot_runs = CPU_JIT_HOT_THRESHOLD;
+        hot_loop_runs = UINT32_MAX;
+    } else if (cpu->engine == CPU_ENGINE_TIERED) {
+        hot_runs = cpu->tier_cfg.hot_runs;
+        hot_loop_runs = cpu->tier_cfg.hot_loop_runs;
+    } else {
+        return false;
+    }
+    // A block is compiled only once, even if it fails.
+    if (block->num_runs == UINT32_MAX) { return false; }
+    block->num_runs++;
+    if (block->num_runs < hot_runs && block->num_loops < hot_loop_runs) {
+        return false;
+    }
+    block->num_runs = UINT32_MAX;
+
+    if (!cpu->jit) { cpu->jit = cpu_jit_new(); }
+    if (!cpu->jit || !cpu_jit_compile(cpu->jit, cpu->blocks, block)) {
+        return false;
+    }
+    cpu->tier_stats.num_heated++;
+    return true;
+}
+
+/**
+ * Parks the CPU (see #CPU_STOP_IDLE) if the run of @a block that has just
+ * ended is a run of an idle loop: it has jumped back to the start of the block,
+ * it has loads and they have all read the memory of one device that notifies
+ * its changes, and neither an IRQ nor a device change has come since
+ * @a dev_change_gen.
+ */
+static void prv_cpu_park_if_idle(cpu_ctx_t *cpu, const cpu_block_t *block,
+                                 uint32_t dev_change_gen) {
+    D_ASSERT(cpu);
+    D_ASSERT(block);
+    if (cpu->reg_pc != block->start_pc ||
+        intctl_has_pending_irqs(cpu->intctl) ||
+        intctl_dev_change_gen(cpu->intctl) != dev_change_gen) {
+        return;
+    }
+
+    // The load addresses have not changed during the run, and the last load
+    // has left the span of its device in the TLB.
+    const cpu_tlb_entry_t *tlb = &cpu->tlb[CPU_TLB_LOAD];
+    const mem_span_t *span = &tlb->span;
+    size_t num_loads = 0;
+    for (size_t op_idx = 0; op_idx < block->num_ops; op_idx++) {
+        vm_addr_t addr;
+        uint32_t size;
+        if (!cpu_exec_load_range(cpu, &block->ops[op_idx].instr, &addr,
+                                 &size)) {
+            continue;
+        }
+        if ((addr - span->start) >= (span->end - span->start) ||
+            span->end - addr < size || *span->p_gen != tlb->gen ||
+            !span->notifies_changes) {
+            return;
+        }
+        num_loads++;
+    }
+    // A loop that polls nothing is left to the budget.
+    if (num_loads == 0) { return; }
+
+    cpu->idle = true;
+    cpu->idle_pc = block->start_pc;
+    cpu->idle_gen = dev_change_gen;
+}
+
+/**
+ * Checks that the CPU parked in an idle loop has to stay there, or unparks it.
+ */
+static bool prv_cpu_stays_idle(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    D_ASSERT(cpu->idle);
+    if (cpu->state == CPU_FETCH_DECODE_OPCODE && cpu->reg_pc == cpu->idle_pc &&
+        !intctl_has_pending_irqs(cpu->intctl) &&
+        intctl_dev_change_gen(cpu->intctl) == cpu->idle_gen) {
+        return true;
+    }
+    cpu->idle = false;
+    return false;
+}
+
+/**
+ * Decodes the basic block at the current PC into its table slot.
+ * The PC and the current instruction are left unchanged.
+ * @returns The new block, or NULL if the first instruction cannot be cached.
+ */
+static cpu_block_t *prv_cpu_build_block(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    const vm_addr_t start_pc = cpu->reg_pc;
+    const cpu_instr_t saved_instr = cpu->instr;
+    cpu_block_t *block = cpu_blocks_slot(cpu->blocks, start_pc);
+    block->valid = false;
+    block->start_pc = start_pc;
+    block->num_ops = 0;
+    block->num_cycles = 0;
+    block->idle_loop = false;
+    block->num_runs = 0;
+    block->num_loops = 0;
+    block->jit_fn = NULL;
+    block->aot_fn = NULL;
+    for (size_t idx = 0; idx < CPU_BLOCK_NUM_LINKS; idx++) {
+        block->links[idx] = NULL;
+    }
+
+    while (block->num_ops < CPU_BLOCK_MAX_OPS) {
+        const vm_addr_t pc = cpu->reg_pc;
+        // Only the line of the start is checked by cpu_block_is_current().
+        if ((pc >> CPU_ICACHE_LINE_SHIFT) !=
+            (start_pc >> CPU_ICACHE_LINE_SHIFT)) {
             break;
-        case CPU_OPD_IMM32:
-            fprintf(stderr, "imm32 %08X", instr->operands[opd].u32);
+        }
+
+        // Only decode what can be read directly, reading device memory through
+        // the callbacks ahead of execution may have side effects.
+        const cpu_tlb_entry_t *tlb = cpu_tlb_lookup(cpu, CPU_TLB_FETCH, pc);
+        if (!tlb || !tlb->span.ptr) { break; }
+        const cpu_instr_desc_t *desc =
+            cpu_lookup_instr_desc(tlb->span.ptr[pc - tlb->span.start]);
+        if (!desc) { break; }
+        if (tlb->span.end - pc < desc->size) { break; }
+
+        if (prv_cpu_decode_instr(cpu) != VM_ERR_NONE ||
+            !cpu_icache_track_code(cpu, pc, cpu->reg_pc)) {
             break;
         }
-        if (opd == instr->desc->num_operands - 1) {
-            fprintf(stderr, "]");
-        } else {
-            fprintf(stderr, ", ");
+
+        cpu_block_op_t *op = &block->ops[block->num_ops++];
+        op->instr = cpu->instr;
+        op->next_pc = cpu->reg_pc;
+        op->mem_access = prv_cpu_accesses_mem(desc->opcode);
+        op->fused = NULL;
+        block->num_cycles += desc->num_cycles;
+        if (cpu->fusion && block->num_ops >= 2) {
+            cpu_block_op_t *prev = op - 1;
+            prev->fused =
+                cpu_exec_fused_handler(prev->instr.opcode, op->instr.opcode);
         }
+
+        if (prv_cpu_ends_block(desc->opcode)) { break; }
+    }
+
+    block->end_pc = cpu->reg_pc;
+    cpu->reg_pc = start_pc;
+    cpu->instr = saved_instr;
+    if (block->num_ops == 0) { return NULL; }
+
+    block->valid = true;
+    block->idle_loop = cpu_block_is_idle_loop(block);
+    block->epoch = cpu->icache->epoch;
+    block->line_gen = *cpu_icache_line_gen(cpu->icache, start_pc);
+    if (cpu->aot) { prv_cpu_find_aot(cpu, block); }
+    return block;
+}
+
+/**
+ * Attaches the translated code of @a block, if the code that it has been
+ * translated from is still there.
+ */
+static void prv_cpu_find_aot(cpu_ctx_t *cpu, cpu_block_t *block) {
+    D_ASSERT(cpu);
+    D_ASSERT(block);
+    // The whole block has been fetched directly from the same span.
+    const cpu_tlb_entry_t *tlb = &cpu->tlb[CPU_TLB_FETCH];
+    const mem_span_t *span = &tlb->span;
+    const vm_addr_t start = block->start_pc;
+    const vm_addr_t size = block->end_pc - start;
+    if (!span->ptr || (start - span->start) >= (span->end - span->start) ||
+        span->end - start < size) {
+        return;
+    }
+    block->aot_fn = cpu_aot_find(cpu->aot, start, block->num_ops,
+                                 &span->ptr[start - span->start], size);
+}
+
+/**
+ * @{
+ * @name Operand decoders
+ * Each one fetches and decodes an operand of its type at the PC into @a out_val
+ * and moves the PC past it.
+ */
+static vm_err_t prv_cpu_decode_opd_reg(cpu_ctx_t *cpu, cpu_opd_val_t *out_val) {
+    uint8_t reg_ref;
+    vm_err_t err = cpu_mem_read_u8(cpu, CPU_TLB_FETCH, cpu->reg_pc, &reg_ref);
+    if (err) { return err; }
+
+    err = cpu_decode_reg(reg_ref, &out_val->reg_ref);
+    if (err) { return err; }
+
+    cpu->reg_pc += CPU_ISA_OPD_SIZE_REG;
+    return VM_ERR_NONE;
+}
+
+static vm_err_t prv_cpu_decode_opd_imm5(cpu_ctx_t *cpu,
+                                        cpu_opd_val_t *out_val) {
+    uint8_t imm5;
+    vm_err_t err = cpu_mem_read_u8(cpu, CPU_TLB_FETCH, cpu->reg_pc, &imm5);
+    if (err) { return err; }
+    if ((imm5 & ~31) != 0) { return VM_ERR_BAD_IMM5; }
+
+    out_val->imm5 = imm5;
+    cpu->reg_pc += CPU_ISA_OPD_SIZE_IMM5;
+    return VM_ERR_NONE;
+}
+
+static vm_err_t prv_cpu_decode_opd_imm8(cpu_ctx_t *cpu,
+                                        cpu_opd_val_t *out_val) {
+    uint8_t imm8;
+    vm_err_t err = cpu_mem_read_u8(cpu, CPU_TLB_FETCH, cpu->reg_pc, &imm8);
+    if (err) { return err; }
+
+    out_val->u8 = imm8;
+    cpu->reg_pc += CPU_ISA_OPD_SIZE_IMM8;
+    return VM_ERR_NONE;
+}
+
+static vm_err_t prv_cpu_decode_opd_imm32(cpu_ctx_t *cpu,
+                                         cpu_opd_val_t *out_val) {
+    uint32_t imm32;
+    vm_err_t err = cpu_mem_read_u32(cpu, CPU_TLB_FETCH, cpu->reg_pc, &imm32);
+    if (err) { return err; }
+
+    out_val->u32 = imm32;
+    cpu->reg_pc += CPU_ISA_OPD_SIZE_IMM32;
+    return VM_ERR_NONE;
+}
+
+/// Decoder of each operand type of the ISA layouts, never called for `NONE`.
+#define PRV_OPD_DECODER_REG   prv_cpu_decode_opd_reg
+#define PRV_OPD_DECODER_IMM5  prv_cpu_decode_opd_imm5
+#define PRV_OPD_DECODER_IMM8  prv_cpu_decode_opd_imm8
+#define PRV_OPD_DECODER_IMM32 prv_cpu_decode_opd_imm32
+#define PRV_OPD_DECODER_NONE  prv_cpu_decode_opd_reg
+/// @}
+
+/**
+ * @{
+ * @name Layout decoders
+ * Each operand layout of @ref cpu_isa.h has its own decoder that fetches and
+ * decodes all its operands, without looking at their types at run time.
+ */
+
+/// Decodes operand @a idx of type @a opd if the layout has @a num operands.
+#define PRV_DECODE_OPERAND(idx, num, opd)                                      \
+    if ((idx) < (num)) {                                                       \
+        cpu->instr.next_operand = (idx);                                       \
+        err = PRV_OPD_DECODER_##opd(cpu, &cpu->instr.operands[idx]);           \
+        if (err) { return err; }                                               \
+    }
+
+/// Defines the decoder of a layout, for #CPU_ISA_LAYOUTS().
+#define PRV_DEF_LAYOUT_DECODER(layout, num, opd0, opd1, opd2)                  \
+    static vm_err_t prv_cpu_decode_##layout(cpu_ctx_t *cpu) {                  \
+        vm_err_t err = VM_ERR_NONE;                                            \
+        PRV_DECODE_OPERAND(0, num, opd0)                                       \
+        PRV_DECODE_OPERAND(1, num, opd1)                                       \
+        PRV_DECODE_OPERAND(2, num, opd2)                                       \
+        cpu->instr.next_operand = (num);                                       \
+        return err;                                                            \
+    }
+
+CPU_ISA_LAYOUTS(PRV_DEF_LAYOUT_DECODER)
+
+/// Decoder of an instruction, for #CPU_ISA_INSTRS().
+#define PRV_LAYOUT_DECODER(op, mnem, layout, cost, mem, handler, jit)          \
+    [CPU_OP_##op] = prv_cpu_decode_##layout,
+
+/// Operand decoder of each opcode, NULL for the opcodes without a descriptor.
+static vm_err_t (*const prv_cpu_layout_decoders[256])(cpu_ctx_t *cpu) = {
+    CPU_ISA_INSTRS(PRV_LAYOUT_DECODER)
+};
+/// @}
+
+/**
+ * Fetches and decodes a whole instruction at the current PC into
+ * @ref cpu_ctx_t.instr, and moves the PC past it. Does not raise exceptions.
+ */
+static vm_err_t prv_cpu_decode_instr(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    cpu_instr_t *instr = &cpu->instr;
+
+    instr->start_addr = cpu->reg_pc;
+    vm_err_t err =
+        cpu_mem_read_u8(cpu, CPU_TLB_FETCH, cpu->reg_pc, &instr->opcode);
+    if (err) { return err; }
+    instr->desc = cpu_lookup_instr_desc(instr->opcode);
+    if (!instr->desc) {
+        D_PRINTF("bad opcode 0x%02X at 0x%08X", instr->opcode, cpu->reg_pc);
+        return VM_ERR_BAD_OPCODE;
+    }
+    cpu->reg_pc += 1;
+    return prv_cpu_layout_decoders[instr->opcode](cpu);
+}
+
+/**
+ * Fetches and decodes a single operand of type @a opd_type, for the step
+ * state machine which decodes one operand per step.
+ */
+static vm_err_t prv_cpu_fetch_decode_operand(cpu_ctx_t *cpu,
+                                             cpu_operand_type_t opd_type,
+                                             cpu_opd_val_t *out_val) {
+    D_ASSERT(cpu);
+    D_ASSERT(out_val);
+    switch (opd_type) {
+    case CPU_OPD_REG:
+        return prv_cpu_decode_opd_reg(cpu, out_val);
+    case CPU_OPD_IMM5:
+        return prv_cpu_decode_opd_imm5(cpu, out_val);
+    case CPU_OPD_IMM8:
+        return prv_cpu_decode_opd_imm8(cpu, out_val);
+    case CPU_OPD_IMM32:
+        return prv_cpu_decode_opd_imm32(cpu, out_val);
+    default:
+        D_ASSERTMF(false, "invalid opd_type %d", opd_type);
+    }
+}
+
+/// Records the instruction about to be executed if tracing is on.
+static void prv_cpu_trace_instr(cpu_ctx_t *cpu) {
+    if (cpu->trace) {
+        cpu_exec_sync_flags(cpu);
+        cpu_trace_record(cpu->trace, &cpu->instr, cpu->flags, cpu->cycles);
     }
-    fprintf(stderr, "\n");
 }
 
 static bool prv_cpu_check_err(cpu_ctx_t *cpu, vm_err_t err) {
@@ -0,0 +1,108 @@
+/**
+ * @file cpu_aot.c
+ * Loading of the ahead-of-time translated shared objects.
+ */
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_aot.h"
+#include "cpu_block.h"
+#include "cpu_icache.h"
+#include "debugm.h"
+
+static_assert(CPU_AOT_BLOCK_MAX_OPS == CPU_BLOCK_MAX_OPS,
+              "translated blocks end like the built ones");
+static_assert(CPU_AOT_LINE_SHIFT == CPU_ICACHE_LINE_SHIFT,
+              "translated blocks end like the built ones");
+
+struct cpu_aot {
+    void *handle; //!< Handle returned by `dlopen()`.
+    const cpu_aot_module_t *module;
+};
+
+uint64_t cpu_aot_hash(const void *buf, size_t size) {
+    // 64-bit FNV-1a.
+    const uint8_t *bytes = buf;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t idx = 0; idx < size; idx++) {
+        hash ^= bytes[idx];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+vm_err_t cpu_load_aot(cpu_ctx_t *cpu, const char *path, const void *rom,
+                      size_t rom_size) {
+    D_ASSERT(cpu);
+    D_ASSERT(path);
+    D_ASSERT(rom);
+
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        D_PRINTF("cannot load %s: %s", path, dlerror());
+        return VM_ERR_AOT_LOAD;
+    }
+    const cpu_aot_module_t *module = dlsym(handle, CPU_AOT_MODULE_SYM);
+    if (!module) {
+        D_PRINTF("%s has no %s", path, CPU_AOT_MODULE_SYM);
+        dlclose(handle);
+        return VM_ERR_AOT_LOAD;
+    }
+    if (module->abi_ver != CPU_AOT_ABI_VER ||
+        module->ctx_ver != SN_CPU_CTX_VER ||
+        module->code_page_shift != MEM_PAGE_BITMAP_PAGE_SHIFT ||
+        module->rom_size != rom_size ||
+        module->rom_hash != cpu_aot_hash(rom, rom_size)) {
+        D_PRINTF("%s is not translated from this ROM by this version", path);
+        dlclose(handle);
+        return VM_ERR_AOT_MISMATCH;
+    }
+
+    cpu_unload_aot(cpu);
+    cpu->aot = malloc(sizeof(*cpu->aot));
+    D_ASSERT(cpu->aot);
+    cpu->aot->handle = handle;
+    cpu->aot->module = module;
+    // Blocks built before do not have the translated code.
+    cpu_icache_clear(cpu->icache);
+    return VM_ERR_NONE;
+}
+
+void cpu_unload_aot(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    if (!cpu->aot) { return; }
+    // The blocks must not keep pointers into the unloaded code.
+    cpu_icache_clear(cpu->icache);
+    dlclose(cpu->aot->handle);
+    free(cpu->aot);
+    cpu->aot = NULL;
+}
+
+cpu_aot_fn_t cpu_aot_find(const cpu_aot_t *aot, vm_addr_t start_pc,
+                          size_t num_ops, const uint8_t *code, size_t size) {
+    D_ASSERT(aot);
+    D_ASSERT(code);
+    const cpu_aot_module_t *module = aot->module;
+
+    // Binary search of the block starting at start_pc.
+    size_t lo = 0;
+    size_t hi = module->num_blocks;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (module->blocks[mid].start_pc < start_pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == module->num_blocks) { return NULL; }
+
+    const cpu_aot_block_t *block = &module->blocks[lo];
+    if (block->start_pc != start_pc || block->num_ops > num_ops ||
+        block->size > size || memcmp(block->code, code, block->size) != 0) {
+        return NULL;
+    }
+    return block->fn;
+}
@@ -0,0 +1,17 @@
+/**
+ * @file cpu_aot.h
+ * Lookup of the ahead-of-time translated blocks, see @ref fcvm/cpu_aot.h.
+ */
+
+#pragma once
+
+#include <fcvm/cpu_aot.h>
+
+/**
+ * Finds the translated code of a block of @a num_ops instructions starting at
+ * @a start_pc, whose code is @a code (@a size bytes).
+ * @returns The translated function of a prefix of the block, or NULL if there
+ * is none or the translated bytes differ from @a code.
+ */
+cpu_aot_fn_t cpu_aot_find(const cpu_aot_t *aot, vm_addr_t start_pc,
+                          size_t num_ops, const uint8_t *code, size_t size);
@@ -0,0 +1,160 @@
+/**
+ * @file cpu_block.c
+ * Basic-block translation cache implementation.
+ *
+ * Blocks are built and run by @ref cpu.c.
+ */
+
+#include <stdlib.h>
+
+#include "cpu_block.h"
+#include "debugm.h"
+
+/// Bit of the flags in the register masks of #prv_cpu_block_op_uses().
+#define PRV_FLAGS_BIT (1U << (CPU_CODE_SP + 1))
+
+static bool prv_cpu_block_op_uses(const cpu_instr_t *instr,
+                                  uint32_t *out_reads, uint32_t *out_writes,
+                                  uint32_t *out_addr_reads);
+
+cpu_blocks_t *cpu_blocks_new(void) {
+    cpu_blocks_t *blocks = calloc(1, sizeof(*blocks));
+    D_ASSERT(blocks);
+    return blocks;
+}
+
+void cpu_blocks_free(cpu_blocks_t *blocks) {
+    D_ASSERT(blocks);
+    free(blocks);
+}
+
+cpu_block_t *cpu_blocks_find_next(cpu_blocks_t *blocks, cpu_icache_t *icache,
+                                  cpu_block_t *block, vm_addr_t pc) {
+    D_ASSERT(blocks);
+    D_ASSERT(icache);
+    if (!block) { return cpu_blocks_lookup(blocks, icache, pc); }
+
+    for (size_t idx = 0; idx < CPU_BLOCK_NUM_LINKS; idx++) {
+        cpu_block_t *next = block->links[idx];
+        if (next && next->start_pc == pc &&
+            cpu_block_is_current(icache, next)) {
+            return next;
+        }
+    }
+
+    cpu_block_t *next = cpu_blocks_lookup(blocks, icache, pc);
+    if (next) { cpu_block_link(block, next); }
+    return next;
+}
+
+bool cpu_block_is_idle_loop(const cpu_block_t *block) {
+    D_ASSERT(block);
+    if (block->num_ops == 0) { return false; }
+    const cpu_instr_t *last = &block->ops[block->num_ops - 1].instr;
+    if ((last->opcode & CPU_OP_KIND_MASK) != CPU_OP_KIND_FLOW) { return false; }
+
+    uint32_t reads[CPU_BLOCK_MAX_OPS];
+    uint32_t writes[CPU_BLOCK_MAX_OPS];
+    uint32_t all_writes = 0;
+    uint32_t addr_reads = 0;
+    for (size_t idx = 0; idx < block->num_ops; idx++) {
+        uint32_t op_addr_reads;
+        if (!prv_cpu_block_op_uses(&block->ops[idx].instr, &reads[idx],
+                                   &writes[idx], &op_addr_reads)) {
+            return false;
+        }
+        all_writes |= writes[idx];
+        addr_reads |= op_addr_reads;
+    }
+    if (addr_reads & all_writes) { return false; }
+
+    // Values carried over from the previous run must not be read.
+    uint32_t set = 0;
+    for (size_t idx = 0; idx < block->num_ops; idx++) {
+        if (reads[idx] & all_writes & ~set) { return false; }
+        set |= writes[idx];
+    }
+    return true;
+}
+
+/**
+ * Finds the registers and flags read and written by @a instr, as masks of
+ * register code bits and #PRV_FLAGS_BIT.
+ * @param[out] out_addr_reads Registers read to compute a load address.
+ * @returns `false` if @a instr has side effects other than setting registers,
+ * flags or the PC, and loading from memory.
+ */
+static bool prv_cpu_block_op_uses(const cpu_instr_t *instr,
+                                  uint32_t *out_reads, uint32_t *out_writes,
+                                  uint32_t *out_addr_reads) {
+    const cpu_opd_val_t *opds = instr->operands;
+#define PRV_REG(idx) (1U << opds[idx].reg_ref.reg_code)
+    uint32_t reads = 0;
+    uint32_t writes = 0;
+    uint32_t addr_reads = 0;
+
+    switch (instr->opcode) {
+    case CPU_OP_MOV_VR:
+    case CPU_OP_LDR_RV0:
+        writes = PRV_REG(0);
+        break;
+    case CPU_OP_MOV_RR:
+        reads = PRV_REG(1);
+        writes = PRV_REG(0);
+        break;
+    case CPU_OP_LDR_RI0:
+    case CPU_OP_LDR_RI8:
+    case CPU_OP_LDR_RI32:
+        addr_reads = PRV_REG(1);
+        writes = PRV_REG(0);
+        break;
+    case CPU_OP_LDR_RIR:
+        addr_reads = PRV_REG(1) | PRV_REG(2);
+        writes = PRV_REG(0);
+        break;
+    case CPU_OP_CMP_RR:
+    case CPU_OP_TST_RR:
+        reads = PRV_REG(0) | PRV_REG(1);
+        writes = PRV_FLAGS_BIT;
+        break;
+    case CPU_OP_TST_RV:
+        reads = PRV_REG(0);
+        writes = PRV_FLAGS_BIT;
+        break;
+    case CPU_OP_NOP:
+        break;
+
+    default:
+        switch (instr->opcode & CPU_OP_KIND_MASK) {
+        case CPU_OP_KIND_ALU:
+            // Even opcodes take a source register, see cpu_instr_descs.h.
+            reads = PRV_REG(0) | ((instr->opcode & 1) ? 0 : PRV_REG(1));
+            writes = PRV_REG(0) | PRV_FLAGS_BIT;
+            break;
+        case CPU_OP_KIND_FLOW:
+            // The lower 2 bits are the operand type, calls and returns share
+            // the last group.
+            if ((instr->opcode & ~3) == (CPU_OP_CALLA_V32 & ~3)) {
+                return false;
+            }
+            if ((instr->opcode & ~3) != CPU_OP_JMPR_V8) {
+                reads = PRV_FLAGS_BIT;
+            }
+            if ((instr->opcode & 3) == 2) { reads |= PRV_REG(0); }
+            break;
+        default:
+            return false;
+        }
+    }
+#undef PRV_REG
+
+    // Setting the lower 8 bits keeps the others.
+    if ((writes & ~PRV_FLAGS_BIT) &&
+        opds[0].reg_ref.access_size == CPU_REG_SIZE_8) {
+        reads |= writes & ~PRV_FLAGS_BIT;
+    }
+    *out_reads = reads | addr_reads;
+    *out_writes = writes;
+    *out_addr_reads = addr_reads;
+    return true;
+}
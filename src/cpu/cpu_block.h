@@ -0,0 +1,138 @@
+/**
+ * @file cpu_block.h
+ * Basic-block translation cache used by the block engines: #CPU_ENGINE_BLOCKS,
+ * #CPU_ENGINE_JIT and #CPU_ENGINE_TIERED.
+ *
+ * A block is a run of predecoded instructions (micro-ops) that ends with a
+ * control flow instruction (jumps, calls, returns, #CPU_OP_HALT,
+ * #CPU_OP_INT_V8 and #CPU_OP_IRET), at the end of an instruction cache line or
+ * after #CPU_BLOCK_MAX_OPS instructions. Blocks are kept in a direct-mapped
+ * table keyed by their start address, and each block remembers the blocks that
+ * have followed it so that the dispatcher does not have to look them up again.
+ *
+ * A block that jumps back to its own start is an idle loop if running it again
+ * would do exactly the same thing as long as the device memory it reads does
+ * not change, see #cpu_block_is_idle_loop().
+ *
+ * Blocks are validated like the predecoded instructions of @ref cpu_icache.h:
+ * a block never crosses a line, and is dropped when the generation of its line
+ * changes, when the instruction cache is cleared or when the memory mapping
+ * changes.
+ */
+
+#pragma once
+
+#include <fcvm/cpu.h>
+#include <fcvm/cpu_aot.h>
+
+#include "cpu_exec.h"
+#include "cpu_icache.h"
+
+/// Number of cached blocks, must be a power of two.
+#define CPU_BLOCK_NUM_ENTRIES 256
+/// Maximum number of instructions in a block.
+#define CPU_BLOCK_MAX_OPS 16
+/// Number of successors remembered by a block.
+#define CPU_BLOCK_NUM_LINKS 2
+
+/// Predecoded instruction of a block.
+typedef struct {
+    cpu_instr_t instr; //!< Ready-to-execute instruction.
+    vm_addr_t next_pc; //!< Address right after the last operand.
+    bool mem_access;   //!< The instruction accesses memory or raises an IRQ.
+    /// Superinstruction of this instruction and the next one, or NULL.
+    cpu_exec_fused_fn_t fused;
+} cpu_block_op_t;
+
+typedef struct cpu_block cpu_block_t;
+
+/**
+ * Native code of a block, see @ref cpu_jit.h.
+ * @returns Number of instructions executed from the start of the block.
+ */
+typedef uint32_t (*cpu_jit_fn_t)(cpu_ctx_t *cpu);
+
+struct cpu_block {
+    bool valid;
+    vm_addr_t start_pc; //!< Address of the first instruction.
+    vm_addr_t end_pc;   //!< Address right after the last instruction.
+    uint32_t line_gen;  //!< Generation of the line of @a start_pc when built.
+    uint32_t epoch;     //!< Instruction cache epoch when built.
+    uint64_t num_cycles; //!< Sum of the cycles of the instructions.
+
+    /// The block may be an idle loop, see #cpu_block_is_idle_loop().
+    bool idle_loop;
+
+    /// Number of runs, counted until compiled, or UINT32_MAX once compiled.
+    uint32_t num_runs;
+    /// Number of entries through a loop back-edge, counted until compiled.
+    uint32_t num_loops;
+    /// Native code, NULL until compiled or if it cannot be compiled.
+    cpu_jit_fn_t jit_fn;
+    /// Translated code (see @ref fcvm/cpu_aot.h), run instead of @a jit_fn.
+    cpu_aot_fn_t aot_fn;
+
+    /// Blocks that have followed this one, checked with their @a start_pc.
+    cpu_block_t *links[CPU_BLOCK_NUM_LINKS];
+
+    size_t num_ops;
+    cpu_block_op_t ops[CPU_BLOCK_MAX_OPS];
+};
+
+struct cpu_blocks {
+    cpu_block_t blocks[CPU_BLOCK_NUM_ENTRIES];
+};
+
+cpu_blocks_t *cpu_blocks_new(void);
+void cpu_blocks_free(cpu_blocks_t *blocks);
+
+/// Returns the table entry that a block starting at @a pc must be built in.
+static inline cpu_block_t *cpu_blocks_slot(cpu_blocks_t *blocks, vm_addr_t pc) {
+    // Instructions are at least one byte long, spread the slots with the low
+    // bits of the address.
+    return &blocks->blocks[pc & (CPU_BLOCK_NUM_ENTRIES - 1)];
+}
+
+/// Checks that the code of @a block has not changed since it was built.
+static inline bool cpu_block_is_current(cpu_icache_t *icache,
+                                        const cpu_block_t *block) {
+    return block->valid && block->epoch == icache->epoch &&
+           block->line_gen == *cpu_icache_line_gen(icache, block->start_pc) &&
+           cpu_icache_mapping_is_current(icache);
+}
+
+/// Finds a valid block starting at @a pc, or returns NULL.
+static inline cpu_block_t *cpu_blocks_lookup(cpu_blocks_t *blocks,
+                                             cpu_icache_t *icache,
+                                             vm_addr_t pc) {
+    cpu_block_t *block = cpu_blocks_slot(blocks, pc);
+    if (block->start_pc == pc && cpu_block_is_current(icache, block)) {
+        return block;
+    }
+    return NULL;
+}
+
+/// Remembers that @a next has followed @a block.
+static inline void cpu_block_link(cpu_block_t *block, cpu_block_t *next) {
+    // The fall-through successor gets its own link, any other target shares
+    // the second one.
+    block->links[next->start_pc == block->end_pc ? 0 : 1] = next;
+}
+
+/**
+ * Finds the block starting at @a pc among the successors of @a block, falling
+ * back to #cpu_blocks_lookup(). A block found in the table is linked to
+ * @a block.
+ */
+cpu_block_t *cpu_blocks_find_next(cpu_blocks_t *blocks, cpu_icache_t *icache,
+                                  cpu_block_t *block, vm_addr_t pc);
+
+/**
+ * Checks if @a block can be an idle loop: it only moves data between registers
+ * and loads from memory, each register or flag it reads is either set earlier
+ * in the block or never set by it, and the load addresses only depend on the
+ * registers that it never sets. A run of such a block that jumps back to its
+ * start leaves the CPU in the state that the next run would leave it in, if
+ * the loaded values stay the same.
+ */
+bool cpu_block_is_idle_loop(const cpu_block_t *block);
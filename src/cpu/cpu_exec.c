@@ -1,18 +1,24 @@
 /**
  * @file cpu_exec.c
  * CPU instruction execution implementation.
+ *
+ * Every opcode, in each of its operand forms, has its own handler in
+ * #cpu_exec_handlers, so executing an instruction is a single indirect call
+ * that does not look at the opcode again. The table is generated from
+ * #CPU_ISA_INSTRS, like the descriptors.
+ *
+ * The block engines also fuse the hottest pairs of the opcode histograms
+ * collected with #cpu_set_pair_hist(), a compare followed by a conditional
+ * jump, into superinstructions with their own handlers (see
+ * #cpu_exec_fused_fn_t).
  */
 
 #include "cpu_exec.h"
+#include "cpu_isa.h"
+#include "cpu_mem.h"
 #include "cpu_stack.h"
 #include "debugm.h"
 
-static vm_err_t prv_cpu_execute_data_instr(cpu_ctx_t *cpu);
-static vm_err_t prv_cpu_execute_alu_instr(cpu_ctx_t *cpu);
-static vm_err_t prv_cpu_execute_flow_instr(cpu_ctx_t *cpu);
-static vm_err_t prv_cpu_execute_stack_instr(cpu_ctx_t *cpu);
-static vm_err_t prv_cpu_execute_other_instr(cpu_ctx_t *cpu);
-
 static vm_err_t prv_cpu_execute_str(cpu_ctx_t *cpu, vm_addr_t dst_addr,
                                     cpu_reg_ref_t src_reg);
 static vm_err_t prv_cpu_execute_ldr(cpu_ctx_t *cpu, vm_addr_t src_addr,
@@ -20,482 +26,566 @@ static vm_err_t prv_cpu_execute_ldr(cpu_ctx_t *cpu, vm_addr_t src_addr,
 static void prv_cpu_set_flags(cpu_ctx_t *cpu, bool zero, bool sign, bool carry,
                               bool overflow);
 
-vm_err_t cpu_execute_instr(cpu_ctx_t *cpu) {
-    D_ASSERT(cpu);
-    vm_err_t err = VM_ERR_NONE;
-
-    uint8_t opcode_kind = cpu->instr.opcode & CPU_OP_KIND_MASK;
-    if (opcode_kind == CPU_OP_KIND_DATA) {
-        err = prv_cpu_execute_data_instr(cpu);
-    } else if (opcode_kind == CPU_OP_KIND_ALU) {
-        err = prv_cpu_execute_alu_instr(cpu);
-    } else if (opcode_kind == CPU_OP_KIND_FLOW) {
-        err = prv_cpu_execute_flow_instr(cpu);
-    } else if (opcode_kind == CPU_OP_KIND_STACK) {
-        err = prv_cpu_execute_stack_instr(cpu);
-    } else if (opcode_kind == CPU_OP_KIND_OTHER) {
-        err = prv_cpu_execute_other_instr(cpu);
-    } else {
-        D_ASSERTMF(false, "instruction is not implemented: 0x%02X",
-                   cpu->instr.opcode);
-    }
+/// Pointer to the register of operand @a idx of the current instruction.
+#define PRV_OPD_REG(idx) cpu_reg_ptr(cpu, cpu->instr.operands[idx].reg_ref)
+/// Value of the register of operand @a idx of @a instr.
+#define PRV_INSTR_REG(instr, idx)                                              \
+    (*cpu_reg_ptr(cpu, (instr)->operands[idx].reg_ref))
 
-    return err;
+/**
+ * @{
+ * @name Data movement handlers
+ */
+static vm_err_t prv_cpu_exec_mov_vr(cpu_ctx_t *cpu) {
+    *PRV_OPD_REG(0) = cpu->instr.operands[1].u32;
+    return VM_ERR_NONE;
 }
 
-static vm_err_t prv_cpu_execute_data_instr(cpu_ctx_t *cpu) {
-    D_ASSERT(cpu);
-    vm_err_t err = VM_ERR_NONE;
+static vm_err_t prv_cpu_exec_mov_rr(cpu_ctx_t *cpu) {
+    *PRV_OPD_REG(0) = *PRV_OPD_REG(1);
+    return VM_ERR_NONE;
+}
 
-    // Source and destination register references.
-    cpu_reg_ref_t reg_src;
-    cpu_reg_ref_t reg_dst;
+static vm_err_t prv_cpu_exec_str_rv0(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    return prv_cpu_execute_str(cpu, opds[0].u32, opds[1].reg_ref);
+}
 
-    // Memory address.
-    uint32_t *p_reg_mem;
-    uint32_t mem_addr;
+static vm_err_t prv_cpu_exec_str_ri0(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    return prv_cpu_execute_str(cpu, *PRV_OPD_REG(0), opds[1].reg_ref);
+}
 
-    // Memory offset.
-    int32_t *p_reg_off;
-    int8_t mem_off8;
-    int32_t mem_off32;
+static vm_err_t prv_cpu_exec_str_ri8(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    const vm_addr_t addr = *PRV_OPD_REG(0) + (int8_t)opds[1].u8;
+    return prv_cpu_execute_str(cpu, addr, opds[2].reg_ref);
+}
 
-    switch (cpu->instr.opcode) {
-    case CPU_OP_MOV_VR:
-        reg_dst = cpu->instr.operands[0].reg_ref;
-        *reg_dst.p_reg = cpu->instr.operands[1].u32;
-        break;
-    case CPU_OP_MOV_RR:
-        reg_dst = cpu->instr.operands[0].reg_ref;
-        reg_src = cpu->instr.operands[1].reg_ref;
-        *reg_dst.p_reg = *reg_src.p_reg;
-        break;
+static vm_err_t prv_cpu_exec_str_ri32(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    const vm_addr_t addr = *PRV_OPD_REG(0) + (int32_t)opds[1].u32;
+    return prv_cpu_execute_str(cpu, addr, opds[2].reg_ref);
+}
 
-    case CPU_OP_STR_RV0:
-        mem_addr = cpu->instr.operands[0].u32;
-        reg_src = cpu->instr.operands[1].reg_ref;
-        err = prv_cpu_execute_str(cpu, mem_addr, reg_src);
-        break;
-    case CPU_OP_STR_RI0:
-        p_reg_mem = cpu->instr.operands[0].reg_ref.p_reg;
-        reg_src = cpu->instr.operands[1].reg_ref;
-        err = prv_cpu_execute_str(cpu, *p_reg_mem, reg_src);
-        break;
-    case CPU_OP_STR_RI8:
-        p_reg_mem = cpu->instr.operands[0].reg_ref.p_reg;
-        mem_off8 = (int8_t)cpu->instr.operands[1].u8;
-        reg_src = cpu->instr.operands[2].reg_ref;
-        err = prv_cpu_execute_str(cpu, *p_reg_mem + mem_off8, reg_src);
-        break;
-    case CPU_OP_STR_RI32:
-        p_reg_mem = cpu->instr.operands[0].reg_ref.p_reg;
-        mem_off32 = (int32_t)cpu->instr.operands[1].u32;
-        reg_src = cpu->instr.operands[2].reg_ref;
-        err = prv_cpu_execute_str(cpu, *p_reg_mem + mem_off32, reg_src);
-        break;
-    case CPU_OP_STR_RIR:
-        p_reg_mem = cpu->instr.operands[0].reg_ref.p_reg;
-        p_reg_off = (int32_t *)cpu->instr.operands[1].reg_ref.p_reg;
-        reg_src = cpu->instr.operands[2].reg_ref;
-        err = prv_cpu_execute_str(cpu, *p_reg_mem + *p_reg_off, reg_src);
-        break;
+static vm_err_t prv_cpu_exec_str_rir(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    const vm_addr_t addr = *PRV_OPD_REG(0) + *(int32_t *)PRV_OPD_REG(1);
+    return prv_cpu_execute_str(cpu, addr, opds[2].reg_ref);
+}
 
-    case CPU_OP_LDR_RV0:
-        reg_dst = cpu->instr.operands[0].reg_ref;
-        mem_addr = cpu->instr.operands[1].u32;
-        err = prv_cpu_execute_ldr(cpu, mem_addr, reg_dst);
-        break;
-    case CPU_OP_LDR_RI0:
-        reg_dst = cpu->instr.operands[0].reg_ref;
-        p_reg_mem = cpu->instr.operands[1].reg_ref.p_reg;
-        err = prv_cpu_execute_ldr(cpu, *p_reg_mem, reg_dst);
-        break;
-    case CPU_OP_LDR_RI8:
-        reg_dst = cpu->instr.operands[0].reg_ref;
-        p_reg_mem = cpu->instr.operands[1].reg_ref.p_reg;
-        mem_off8 = (int8_t)cpu->instr.operands[2].u8;
-        err = prv_cpu_execute_ldr(cpu, *p_reg_mem + mem_off8, reg_dst);
-        break;
-    case CPU_OP_LDR_RI32:
-        reg_dst = cpu->instr.operands[0].reg_ref;
-        p_reg_mem = cpu->instr.operands[1].reg_ref.p_reg;
-        mem_off32 = (int32_t)cpu->instr.operands[2].u32;
-        err = prv_cpu_execute_ldr(cpu, *p_reg_mem + mem_off32, reg_dst);
-        break;
-    case CPU_OP_LDR_RIR: {
-        reg_dst = cpu->instr.operands[0].reg_ref;
-        p_reg_mem = cpu->instr.operands[1].reg_ref.p_reg;
-        p_reg_off = (int32_t *)cpu->instr.operands[2].reg_ref.p_reg;
-        err = prv_cpu_execute_ldr(cpu, *p_reg_mem + *p_reg_off, reg_dst);
-        break;
-    }
+static vm_err_t prv_cpu_exec_ldr_rv0(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    return prv_cpu_execute_ldr(cpu, opds[1].u32, opds[0].reg_ref);
+}
 
-    default:
-        D_ASSERTMF(false, "instruction is not implemented: 0x%02X",
-                   cpu->instr.opcode);
-    }
+static vm_err_t prv_cpu_exec_ldr_ri0(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    return prv_cpu_execute_ldr(cpu, *PRV_OPD_REG(1), opds[0].reg_ref);
+}
 
-    return err;
+static vm_err_t prv_cpu_exec_ldr_ri8(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    const vm_addr_t addr = *PRV_OPD_REG(1) + (int8_t)opds[2].u8;
+    return prv_cpu_execute_ldr(cpu, addr, opds[0].reg_ref);
 }
 
-static vm_err_t prv_cpu_execute_alu_instr(cpu_ctx_t *cpu) {
-    uint32_t *p_reg_dst;
-    uint32_t src_val;
-    if ((cpu->instr.opcode & 1) == 0) {
-        // Even opcodes require two register operands.
-        p_reg_dst = cpu->instr.operands[0].reg_ref.p_reg;
-        src_val = *cpu->instr.operands[1].reg_ref.p_reg;
-    } else if (cpu->instr.opcode == CPU_OP_NOT_R) {
-        // Only one register operand.
-        p_reg_dst = cpu->instr.operands[0].reg_ref.p_reg;
-    } else {
-        // Odd opcodes require a register operand and an imm32 value, except for
-        // some opcodes.
-        p_reg_dst = cpu->instr.operands[0].reg_ref.p_reg;
-
-        if (cpu->instr.opcode == CPU_OP_SHL_RV ||
-            cpu->instr.opcode == CPU_OP_SHR_RV ||
-            cpu->instr.opcode == CPU_OP_ROL_RV ||
-            cpu->instr.opcode == CPU_OP_ROR_RV) {
-            // Second operand is an imm5.
-            src_val = cpu->instr.operands[1].imm5;
-        } else {
-            // Second operand is an imm32.
-            src_val = cpu->instr.operands[1].u32;
-        }
-    }
+static vm_err_t prv_cpu_exec_ldr_ri32(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    const vm_addr_t addr = *PRV_OPD_REG(1) + (int32_t)opds[2].u32;
+    return prv_cpu_execute_ldr(cpu, addr, opds[0].reg_ref);
+}
 
-    bool flag_zero = false;
-    bool flag_sign = false;
-    bool flag_carry = false;
-    bool flag_ovf = false;
+static vm_err_t prv_cpu_exec_ldr_rir(cpu_ctx_t *cpu) {
+    const cpu_opd_val_t *opds = cpu->instr.operands;
+    const vm_addr_t addr = *PRV_OPD_REG(1) + *(int32_t *)PRV_OPD_REG(2);
+    return prv_cpu_execute_ldr(cpu, addr, opds[0].reg_ref);
+}
+/// @}
 
-    switch (cpu->instr.opcode) {
-    case CPU_OP_ADD_RR:
-    case CPU_OP_ADD_RV: {
-        uint64_t res = (uint64_t)*p_reg_dst + src_val;
-        bool sign_op1 = (*p_reg_dst & (1 << 31)) != 0;
-        bool sign_op2 = (src_val & (1 << 31)) != 0;
-        bool sign_res = (res & (1L << 31)) != 0;
-        flag_zero = res == 0;
-        flag_sign = sign_res;
-        flag_carry = (res & ~0xFFFFFFFFL) != 0;
-        flag_ovf = (sign_op1 == sign_op2) && (sign_res != sign_op1);
-        *p_reg_dst = (uint32_t)res;
-        break;
-    }
+/**
+ * @{
+ * @name Arithmetic and logic handlers
+ * Handlers only compute the result, the flags are evaluated from the operands
+ * when they are read (see #cpu_exec_sync_flags()).
+ */
 
-    case CPU_OP_SUB_RR:
-    case CPU_OP_SUB_RV: {
-        uint32_t res = *p_reg_dst - src_val;
-        bool sign_op1 = (*p_reg_dst & (1 << 31)) != 0;
-        bool sign_op2 = (src_val & (1 << 31)) != 0;
-        bool sign_res = (res & (1L << 31)) != 0;
-        flag_zero = res == 0;
-        flag_sign = sign_res;
-        flag_carry = *p_reg_dst >= src_val;
-        flag_ovf = (sign_op1 != sign_op2) && (sign_res != sign_op1);
-        *p_reg_dst = (uint32_t)res;
-        break;
-    }
+/// Source operand of the `_RR` forms.
+#define PRV_SRC_R (*PRV_OPD_REG(1))
+/// Source operand of the `_RV` forms taking an imm32.
+#define PRV_SRC_V (cpu->instr.operands[1].u32)
+/// Source operand of the `_RV` forms taking an imm5.
+#define PRV_SRC_IMM5 ((uint32_t)cpu->instr.operands[1].imm5)
+/// Source operand of #CPU_OP_NOT_R, which has none.
+#define PRV_SRC_NONE 0U
 
-    case CPU_OP_MUL_RR:
-    case CPU_OP_MUL_RV: {
-        uint64_t res = (uint64_t)*p_reg_dst * src_val;
-        flag_zero = res == 0;
-        flag_sign = (res & (1L << 31)) != 0;
-        flag_carry = (res & ~0xFFFFFFFFL) != 0;
-        *p_reg_dst = (uint32_t)res;
-        break;
+/**
+ * Defines the handler @a name of an ALU instruction that computes @a expr from
+ * `dst` and `src`, and stores it into the destination register if @a store.
+ */
+#define PRV_DEF_ALU_HANDLER(name, src_val, expr, store)                        \
+    static vm_err_t name(cpu_ctx_t *cpu) {                                     \
+        uint32_t *p_reg_dst = PRV_OPD_REG(0);                                  \
+        const uint32_t dst = *p_reg_dst;                                       \
+        const uint32_t src = (src_val);                                        \
+        const uint32_t res = (expr);                                           \
+        if (store) { *p_reg_dst = res; }                                       \
+        prv_cpu_record_flags(cpu, dst, src, res);                              \
+        return VM_ERR_NONE;                                                    \
     }
 
-    case CPU_OP_DIV_RR:
-    case CPU_OP_DIV_RV:
-    case CPU_OP_IDIV_RR:
-    case CPU_OP_IDIV_RV: {
-        if (src_val == 0) { return VM_ERR_DIV_BY_ZERO; }
-        uint32_t res;
-        if (cpu->instr.opcode == CPU_OP_DIV_RR ||
-            cpu->instr.opcode == CPU_OP_DIV_RV) {
-            res = *p_reg_dst / src_val;
-        } else {
-            res = (int32_t)*p_reg_dst / (int32_t)src_val;
-        }
-        flag_zero = res == 0;
-        flag_sign = (res & (1L << 31)) != 0;
-        *p_reg_dst = (uint32_t)res;
-        break;
-    }
+/// Remembers the inputs of the flags of the current ALU instruction.
+static inline void prv_cpu_record_flags(cpu_ctx_t *cpu, uint32_t op1,
+                                        uint32_t op2, uint32_t res) {
+    cpu->lazy_flags = (cpu_lazy_flags_t){
+        .opcode = cpu->instr.opcode,
+        .op1 = op1,
+        .op2 = op2,
+        .res = res,
+    };
+}
 
-    case CPU_OP_AND_RR:
-    case CPU_OP_AND_RV: {
-        uint32_t res = *p_reg_dst & src_val;
-        flag_zero = res == 0;
-        flag_sign = (res & (1 << 31)) != 0;
-        *p_reg_dst = (uint32_t)res;
-        break;
-    }
+static inline uint32_t prv_cpu_rol(uint32_t val, uint32_t num_bits) {
+    num_bits &= 31;
+    return (val << num_bits) | (val >> ((32 - num_bits) & 31));
+}
 
-    case CPU_OP_OR_RR:
-    case CPU_OP_OR_RV: {
-        uint32_t res = *p_reg_dst | src_val;
-        flag_zero = res == 0;
-        flag_sign = (res & (1 << 31)) != 0;
-        *p_reg_dst = (uint32_t)res;
-        break;
-    }
+static inline uint32_t prv_cpu_ror(uint32_t val, uint32_t num_bits) {
+    num_bits &= 31;
+    return (val >> num_bits) | (val << ((32 - num_bits) & 31));
+}
 
-    case CPU_OP_XOR_RR:
-    case CPU_OP_XOR_RV: {
-        uint32_t res = *p_reg_dst ^ src_val;
-        flag_zero = res == 0;
-        flag_sign = (res & (1 << 31)) != 0;
-        *p_reg_dst = (uint32_t)res;
-        break;
-    }
+// clang-format off
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_add_rr, PRV_SRC_R, dst + src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_add_rv, PRV_SRC_V, dst + src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_sub_rr, PRV_SRC_R, dst - src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_sub_rv, PRV_SRC_V, dst - src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_mul_rr, PRV_SRC_R, dst * src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_mul_rv, PRV_SRC_V, dst * src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_and_rr, PRV_SRC_R, dst & src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_and_rv, PRV_SRC_V, dst & src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_or_rr,  PRV_SRC_R, dst | src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_or_rv,  PRV_SRC_V, dst | src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_xor_rr, PRV_SRC_R, dst ^ src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_xor_rv, PRV_SRC_V, dst ^ src, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_not_r,  PRV_SRC_NONE, ~dst, true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_shl_rr, PRV_SRC_R, dst << (src & 31), true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_shl_rv, PRV_SRC_IMM5, dst << (src & 31), true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_shr_rr, PRV_SRC_R, dst >> (src & 31), true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_shr_rv, PRV_SRC_IMM5, dst >> (src & 31), true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_rol_rr, PRV_SRC_R, prv_cpu_rol(dst, src), true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_rol_rv, PRV_SRC_IMM5, prv_cpu_rol(dst, src),
+                    true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_ror_rr, PRV_SRC_R, prv_cpu_ror(dst, src), true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_ror_rv, PRV_SRC_IMM5, prv_cpu_ror(dst, src),
+                    true)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_cmp_rr, PRV_SRC_R, dst - src, false)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_tst_rr, PRV_SRC_R, dst & src, false)
+PRV_DEF_ALU_HANDLER(prv_cpu_exec_tst_rv, PRV_SRC_V, dst & src, false)
+// clang-format on
+
+/// Divides the destination register by @a src, like #PRV_DEF_ALU_HANDLER.
+static inline vm_err_t prv_cpu_exec_div(cpu_ctx_t *cpu, uint32_t src,
+                                        bool is_signed) {
+    if (src == 0) { return VM_ERR_DIV_BY_ZERO; }
+    uint32_t *p_reg_dst = PRV_OPD_REG(0);
+    const uint32_t dst = *p_reg_dst;
+    const uint32_t res =
+        is_signed ? (uint32_t)((int32_t)dst / (int32_t)src) : dst / src;
+    *p_reg_dst = res;
+    prv_cpu_record_flags(cpu, dst, src, res);
+    return VM_ERR_NONE;
+}
 
-    case CPU_OP_NOT_R: {
-        uint32_t res = ~*p_reg_dst;
-        flag_zero = res == 0;
-        flag_sign = (res & (1 << 31)) != 0;
-        *p_reg_dst = (uint32_t)res;
-        break;
-    }
+static vm_err_t prv_cpu_exec_div_rr(cpu_ctx_t *cpu) {
+    return prv_cpu_exec_div(cpu, PRV_SRC_R, false);
+}
 
-    case CPU_OP_SHL_RR:
-    case CPU_OP_SHL_RV: {
-        uint32_t numbits = src_val & 31;
-        uint32_t res = *p_reg_dst << numbits;
-        flag_zero = res == 0;
-        flag_sign = (res & (1 << 31)) != 0;
-        if (numbits > 0) {
-            flag_carry = (*p_reg_dst & (1 << (32 - numbits))) != 0;
-        }
-        *p_reg_dst = res;
-        break;
-    }
+static vm_err_t prv_cpu_exec_div_rv(cpu_ctx_t *cpu) {
+    return prv_cpu_exec_div(cpu, PRV_SRC_V, false);
+}
 
-    case CPU_OP_SHR_RR:
-    case CPU_OP_SHR_RV: {
-        uint32_t numbits = src_val & 31;
-        uint32_t res = *p_reg_dst >> numbits;
-        flag_zero = res == 0;
-        flag_sign = (res & (1 << 31)) != 0;
-        if (numbits > 0) {
-            flag_carry = (*p_reg_dst & (1 << (-1 + numbits))) != 0;
-        }
-        *p_reg_dst = res;
-        break;
-    }
+static vm_err_t prv_cpu_exec_idiv_rr(cpu_ctx_t *cpu) {
+    return prv_cpu_exec_div(cpu, PRV_SRC_R, true);
+}
 
-    case CPU_OP_CMP_RR: {
-        // Same as SUB_RR, except that the dest reg is not written to.
-        uint32_t res = *p_reg_dst - src_val;
-        bool sign_op1 = (*p_reg_dst & (1 << 31)) != 0;
-        bool sign_op2 = (src_val & (1 << 31)) != 0;
-        bool sign_res = (res & (1L << 31)) != 0;
-        flag_zero = res == 0;
-        flag_sign = sign_res;
-        flag_carry = *p_reg_dst >= src_val;
-        flag_ovf = (sign_op1 != sign_op2) && (sign_res != sign_op1);
-        break;
-    }
+static vm_err_t prv_cpu_exec_idiv_rv(cpu_ctx_t *cpu) {
+    return prv_cpu_exec_div(cpu, PRV_SRC_V, true);
+}
+/// @}
 
-    case CPU_OP_TST_RR:
-    case CPU_OP_TST_RV: {
-        // Same as AND_*, except that the dest reg is not written to.
-        uint32_t res = *p_reg_dst & src_val;
-        flag_zero = res == 0;
-        flag_sign = (res & (1 << 31)) != 0;
-        break;
-    }
+/**
+ * @{
+ * @name Control flow handlers
+ */
 
-    case CPU_OP_ROL_RR:
-    case CPU_OP_ROL_RV:
-    case CPU_OP_ROR_RR:
-    case CPU_OP_ROR_RV:
-    default:
-        D_ASSERTMF(false, "instruction is not implemented: 0x%02X",
-                   cpu->instr.opcode);
+/// Target of the `R_V8` forms, relative to the jump instruction.
+#define PRV_TARGET_V8                                                          \
+    (cpu->instr.start_addr + (int8_t)cpu->instr.operands[0].u8)
+/// Target of the `A_V32` forms.
+#define PRV_TARGET_V32 (cpu->instr.operands[0].u32)
+/// Target of the `A_R` forms.
+#define PRV_TARGET_R (*PRV_OPD_REG(0))
+
+/// Defines the handler @a name of a jump to @a target taken if @a cond.
+#define PRV_DEF_JUMP_HANDLER(name, cond, target)                               \
+    static vm_err_t name(cpu_ctx_t *cpu) {                                     \
+        if (cond) { cpu->reg_pc = (target); }                                  \
+        return VM_ERR_NONE;                                                    \
     }
 
-    prv_cpu_set_flags(cpu, flag_zero, flag_sign, flag_carry, flag_ovf);
+static inline bool prv_cpu_flag(cpu_ctx_t *cpu, uint8_t flag) {
+    cpu_exec_sync_flags(cpu);
+    return (cpu->flags & flag) != 0;
+}
+
+/// Checks the "less than" condition: sign differs from overflow.
+static inline bool prv_cpu_cond_lt(cpu_ctx_t *cpu) {
+    return prv_cpu_flag(cpu, CPU_FLAG_SIGN) !=
+           prv_cpu_flag(cpu, CPU_FLAG_OVERFLOW);
+}
+
+/// Zero flag, evaluated if needed.
+#define PRV_FLAG_ZERO prv_cpu_flag(cpu, CPU_FLAG_ZERO)
+
+#define PRV_COND_JMP true
+#define PRV_COND_JEQ PRV_FLAG_ZERO
+#define PRV_COND_JNE !PRV_FLAG_ZERO
+#define PRV_COND_JGT (!PRV_FLAG_ZERO && !prv_cpu_cond_lt(cpu))
+#define PRV_COND_JGE !prv_cpu_cond_lt(cpu)
+#define PRV_COND_JLT prv_cpu_cond_lt(cpu)
+#define PRV_COND_JLE (PRV_FLAG_ZERO || prv_cpu_cond_lt(cpu))
+
+// clang-format off
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jmpr_v8,  PRV_COND_JMP, PRV_TARGET_V8)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jmpa_v32, PRV_COND_JMP, PRV_TARGET_V32)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jmpa_r,   PRV_COND_JMP, PRV_TARGET_R)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jeqr_v8,  PRV_COND_JEQ, PRV_TARGET_V8)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jeqa_v32, PRV_COND_JEQ, PRV_TARGET_V32)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jeqa_r,   PRV_COND_JEQ, PRV_TARGET_R)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jner_v8,  PRV_COND_JNE, PRV_TARGET_V8)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jnea_v32, PRV_COND_JNE, PRV_TARGET_V32)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jnea_r,   PRV_COND_JNE, PRV_TARGET_R)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jgtr_v8,  PRV_COND_JGT, PRV_TARGET_V8)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jgta_v32, PRV_COND_JGT, PRV_TARGET_V32)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jgta_r,   PRV_COND_JGT, PRV_TARGET_R)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jger_v8,  PRV_COND_JGE, PRV_TARGET_V8)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jgea_v32, PRV_COND_JGE, PRV_TARGET_V32)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jgea_r,   PRV_COND_JGE, PRV_TARGET_R)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jltr_v8,  PRV_COND_JLT, PRV_TARGET_V8)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jlta_v32, PRV_COND_JLT, PRV_TARGET_V32)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jlta_r,   PRV_COND_JLT, PRV_TARGET_R)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jler_v8,  PRV_COND_JLE, PRV_TARGET_V8)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jlea_v32, PRV_COND_JLE, PRV_TARGET_V32)
+PRV_DEF_JUMP_HANDLER(prv_cpu_exec_jlea_r,   PRV_COND_JLE, PRV_TARGET_R)
+// clang-format on
+
+static vm_err_t prv_cpu_exec_calla_v32(cpu_ctx_t *cpu) {
+    cpu_stack_push_u32(cpu, cpu->reg_pc);
+    cpu->reg_pc = PRV_TARGET_V32;
     return VM_ERR_NONE;
 }
 
-static vm_err_t prv_cpu_execute_flow_instr(cpu_ctx_t *cpu) {
-    vm_err_t err = VM_ERR_NONE;
+static vm_err_t prv_cpu_exec_calla_r(cpu_ctx_t *cpu) {
+    const uint32_t jump_pc = PRV_TARGET_R;
+    cpu_stack_push_u32(cpu, cpu->reg_pc);
+    cpu->reg_pc = jump_pc;
+    return VM_ERR_NONE;
+}
 
-    bool do_jump;
-    bool flag_zero = (cpu->flags & CPU_FLAG_ZERO) != 0;
-    bool flag_sign = (cpu->flags & CPU_FLAG_SIGN) != 0;
-    bool flag_overflow = (cpu->flags & CPU_FLAG_OVERFLOW) != 0;
-    bool flag_S_xor_V = flag_sign ^ flag_overflow;
-    switch (cpu->instr.opcode) {
-    case CPU_OP_JEQR_V8:
-    case CPU_OP_JEQA_V32:
-    case CPU_OP_JEQA_R:
-        do_jump = flag_zero;
-        break;
+static vm_err_t prv_cpu_exec_ret(cpu_ctx_t *cpu) {
+    uint32_t jump_pc = 0;
+    cpu_stack_pop_u32(cpu, &jump_pc);
+    cpu->reg_pc = jump_pc;
+    return VM_ERR_NONE;
+}
+/// @}
 
-    case CPU_OP_JNER_V8:
-    case CPU_OP_JNEA_V32:
-    case CPU_OP_JNEA_R:
-        do_jump = !flag_zero;
-        break;
+/**
+ * @{
+ * @name Stack handlers
+ */
+static vm_err_t prv_cpu_exec_push_v32(cpu_ctx_t *cpu) {
+    return cpu_stack_push_u32(cpu, cpu->instr.operands[0].u32);
+}
 
-    case CPU_OP_JGTR_V8:
-    case CPU_OP_JGTA_V32:
-    case CPU_OP_JGTA_R:
-        do_jump = !flag_zero && !flag_S_xor_V;
-        break;
+static vm_err_t prv_cpu_exec_push_r(cpu_ctx_t *cpu) {
+    return cpu_stack_push_u32(cpu, *PRV_OPD_REG(0));
+}
 
-    case CPU_OP_JGER_V8:
-    case CPU_OP_JGEA_V32:
-    case CPU_OP_JGEA_R:
-        do_jump = !flag_S_xor_V;
-        break;
+static vm_err_t prv_cpu_exec_pop_r(cpu_ctx_t *cpu) {
+    return cpu_stack_pop_u32(cpu, PRV_OPD_REG(0));
+}
+/// @}
 
-    case CPU_OP_JLTR_V8:
-    case CPU_OP_JLTA_V32:
-    case CPU_OP_JLTA_R:
-        do_jump = flag_S_xor_V;
-        break;
+/**
+ * @{
+ * @name Other handlers
+ */
+static vm_err_t prv_cpu_exec_nop(cpu_ctx_t *cpu) {
+    (void)cpu;
+    return VM_ERR_NONE;
+}
 
-    case CPU_OP_JLER_V8:
-    case CPU_OP_JLEA_V32:
-    case CPU_OP_JLEA_R:
-        do_jump = flag_zero || flag_S_xor_V;
-        break;
+static vm_err_t prv_cpu_exec_halt(cpu_ctx_t *cpu) {
+    cpu->state = CPU_HALTED;
+    return VM_ERR_NONE;
+}
 
+static vm_err_t prv_cpu_exec_int_v8(cpu_ctx_t *cpu) {
+    return cpu_raise_irq(cpu, cpu->instr.operands[0].u8);
+}
+
+static vm_err_t prv_cpu_exec_iret(cpu_ctx_t *cpu) {
+    return cpu_stack_pop_u32(cpu, &cpu->reg_pc);
+}
+/// @}
+
+/**
+ * @{
+ * @name Superinstruction handlers
+ * The flags of a compare encode the order of two signed values: the operands
+ * for #CPU_OP_CMP_RR, and the result and zero for the tests (whose overflow
+ * flag is always clear). `PRV_FUSED_<x>_<compare>` are the source operand, the
+ * result, and these two values.
+ */
+#define PRV_FUSED_SRC_cmp_rr PRV_INSTR_REG(first, 1)
+#define PRV_FUSED_RES_cmp_rr (dst - src)
+#define PRV_FUSED_LHS_cmp_rr dst
+#define PRV_FUSED_RHS_cmp_rr src
+#define PRV_FUSED_SRC_tst_rr PRV_INSTR_REG(first, 1)
+#define PRV_FUSED_RES_tst_rr (dst & src)
+#define PRV_FUSED_LHS_tst_rr res
+#define PRV_FUSED_RHS_tst_rr 0
+#define PRV_FUSED_SRC_tst_rv (first->operands[1].u32)
+#define PRV_FUSED_RES_tst_rv (dst & src)
+#define PRV_FUSED_LHS_tst_rv res
+#define PRV_FUSED_RHS_tst_rv 0
+
+/// Target of the jump @a instr, the lower opcode bits tell the operand type.
+static inline vm_addr_t prv_cpu_fused_target(cpu_ctx_t *cpu,
+                                             const cpu_instr_t *instr) {
+    switch (instr->opcode & 3) {
+    case 0:
+        return instr->start_addr + (int8_t)instr->operands[0].u8;
+    case 1:
+        return instr->operands[0].u32;
     default:
-        do_jump = true;
+        return PRV_INSTR_REG(instr, 0);
     }
+}
 
-    uint32_t jump_pc;
-    switch (cpu->instr.opcode) {
-    case CPU_OP_JMPR_V8:
-    case CPU_OP_JEQR_V8:
-    case CPU_OP_JNER_V8:
-    case CPU_OP_JGTR_V8:
-    case CPU_OP_JGER_V8:
-    case CPU_OP_JLTR_V8:
-    case CPU_OP_JLER_V8:
-        jump_pc = cpu->instr.start_addr + (int8_t)cpu->instr.operands[0].u8;
-        break;
-    case CPU_OP_JMPA_V32:
-    case CPU_OP_JEQA_V32:
-    case CPU_OP_JNEA_V32:
-    case CPU_OP_JGTA_V32:
-    case CPU_OP_JGEA_V32:
-    case CPU_OP_JLTA_V32:
-    case CPU_OP_JLEA_V32:
-        jump_pc = cpu->instr.operands[0].u32;
-        break;
-    case CPU_OP_JMPA_R:
-    case CPU_OP_JEQA_R:
-    case CPU_OP_JNEA_R:
-    case CPU_OP_JGTA_R:
-    case CPU_OP_JGEA_R:
-    case CPU_OP_JLTA_R:
-    case CPU_OP_JLEA_R:
-        jump_pc = *cpu->instr.operands[0].reg_ref.p_reg;
-        break;
+/**
+ * Defines the handler of @a cmp followed by the jump @a jcc, taken if the
+ * signed values ordered by the flags compare with @a op.
+ */
+#define PRV_DEF_FUSED_HANDLER(cmp, jcc, op, jcc_opcode)                        \
+    static void prv_cpu_exec_##cmp##_##jcc(                                    \
+        cpu_ctx_t *cpu, const cpu_instr_t *first, const cpu_instr_t *second) { \
+        const uint32_t dst = PRV_INSTR_REG(first, 0);                          \
+        const uint32_t src = PRV_FUSED_SRC_##cmp;                              \
+        const uint32_t res = PRV_FUSED_RES_##cmp;                              \
+        cpu->lazy_flags = (cpu_lazy_flags_t){                                  \
+            .opcode = first->opcode,                                           \
+            .op1 = dst,                                                        \
+            .op2 = src,                                                        \
+            .res = res,                                                        \
+        };                                                                     \
+        const int32_t lhs = (int32_t)(PRV_FUSED_LHS_##cmp);                    \
+        const int32_t rhs = (int32_t)(PRV_FUSED_RHS_##cmp);                    \
+        if (lhs op rhs) { cpu->reg_pc = prv_cpu_fused_target(cpu, second); }  \
+    }
 
-    case CPU_OP_CALLA_V32:
-    case CPU_OP_CALLA_R: {
-        if (cpu->instr.opcode == CPU_OP_CALLA_V32) {
-            jump_pc = cpu->instr.operands[0].u32;
-        } else {
-            jump_pc = *cpu->instr.operands[0].reg_ref.p_reg;
-        }
-        uint32_t next_instr_at = cpu->reg_pc;
-        cpu_stack_push_u32(cpu, next_instr_at);
-        break;
+/// Applies `M(cmp, jcc, op, jcc_opcode)` to every conditional jump.
+#define PRV_FUSED_JUMPS(M, cmp)                                                \
+    M(cmp, jeq, ==, CPU_OP_JEQR_V8)                                            \
+    M(cmp, jne, !=, CPU_OP_JNER_V8)                                            \
+    M(cmp, jgt, >, CPU_OP_JGTR_V8)                                             \
+    M(cmp, jge, >=, CPU_OP_JGER_V8)                                            \
+    M(cmp, jlt, <, CPU_OP_JLTR_V8)                                             \
+    M(cmp, jle, <=, CPU_OP_JLER_V8)
+
+PRV_FUSED_JUMPS(PRV_DEF_FUSED_HANDLER, cmp_rr)
+PRV_FUSED_JUMPS(PRV_DEF_FUSED_HANDLER, tst_rr)
+PRV_FUSED_JUMPS(PRV_DEF_FUSED_HANDLER, tst_rv)
+
+/// Index of the group of four jump opcodes that @a opcode belongs to.
+#define PRV_JUMP_GROUP(opcode) (((opcode) - CPU_OP_KIND_FLOW) >> 2)
+
+/// Superinstruction of a jump, for #PRV_FUSED_JUMPS().
+#define PRV_FUSED_HANDLER(cmp, jcc, op, jcc_opcode)                            \
+    [PRV_JUMP_GROUP(jcc_opcode)] = prv_cpu_exec_##cmp##_##jcc,
+
+cpu_exec_fused_fn_t cpu_exec_fused_handler(uint8_t first, uint8_t second) {
+    static const cpu_exec_fused_fn_t cmp_rr_fns[8] = {
+        PRV_FUSED_JUMPS(PRV_FUSED_HANDLER, cmp_rr)
+    };
+    static const cpu_exec_fused_fn_t tst_rr_fns[8] = {
+        PRV_FUSED_JUMPS(PRV_FUSED_HANDLER, tst_rr)
+    };
+    static const cpu_exec_fused_fn_t tst_rv_fns[8] = {
+        PRV_FUSED_JUMPS(PRV_FUSED_HANDLER, tst_rv)
+    };
+
+    // The fourth opcode of each group is not a jump (#CPU_OP_RET).
+    if ((second & CPU_OP_KIND_MASK) != CPU_OP_KIND_FLOW || (second & 3) == 3) {
+        return NULL;
     }
+    switch (first) {
+    case CPU_OP_CMP_RR:
+        return cmp_rr_fns[PRV_JUMP_GROUP(second)];
+    case CPU_OP_TST_RR:
+        return tst_rr_fns[PRV_JUMP_GROUP(second)];
+    case CPU_OP_TST_RV:
+        return tst_rv_fns[PRV_JUMP_GROUP(second)];
+    default:
+        return NULL;
+    }
+}
+/// @}
 
-    case CPU_OP_RET:
-        cpu_stack_pop_u32(cpu, &jump_pc);
-        break;
+/// Handler of an instruction, for #CPU_ISA_INSTRS().
+#define PRV_HANDLER(op, mnem, layout, cost, mem, handler, jit)                 \
+    [CPU_OP_##op] = prv_cpu_exec_##handler,
+
+const cpu_exec_fn_t cpu_exec_handlers[256] = {
+    CPU_ISA_INSTRS(PRV_HANDLER)
+};
 
+static vm_err_t prv_cpu_execute_str(cpu_ctx_t *cpu, vm_addr_t dst_addr,
+                                    cpu_reg_ref_t src_reg) {
+    switch (src_reg.access_size) {
+    case CPU_REG_SIZE_8:
+        return cpu_mem_write_u8(cpu, dst_addr, *cpu_reg_ptr_u8(cpu, src_reg));
+    case CPU_REG_SIZE_32:
+        return cpu_mem_write_u32(cpu, dst_addr, *cpu_reg_ptr(cpu, src_reg));
     default:
-        D_ASSERTMF(false, "instruction is not implemented: 0x%02X",
-                   cpu->instr.opcode);
+        D_TODO();
     }
+}
 
-    if (err == VM_ERR_NONE && do_jump) { cpu->reg_pc = jump_pc; }
-    return err;
+static vm_err_t prv_cpu_execute_ldr(cpu_ctx_t *cpu, vm_addr_t src_addr,
+                                    cpu_reg_ref_t dst_reg) {
+    switch (dst_reg.access_size) {
+    case CPU_REG_SIZE_8:
+        return cpu_mem_read_u8(cpu, CPU_TLB_LOAD, src_addr,
+                               cpu_reg_ptr_u8(cpu, dst_reg));
+    case CPU_REG_SIZE_32:
+        return cpu_mem_read_u32(cpu, CPU_TLB_LOAD, src_addr,
+                                cpu_reg_ptr(cpu, dst_reg));
+    default:
+        D_TODO();
+    }
 }
 
-static vm_err_t prv_cpu_execute_stack_instr(cpu_ctx_t *cpu) {
+bool cpu_exec_load_range(cpu_ctx_t *cpu, const cpu_instr_t *instr,
+                         vm_addr_t *out_addr, uint32_t *out_size) {
     D_ASSERT(cpu);
-    vm_err_t err = VM_ERR_NONE;
+    D_ASSERT(instr);
+    D_ASSERT(out_addr);
+    D_ASSERT(out_size);
+    const cpu_opd_val_t *opds = instr->operands;
 
-    switch (cpu->instr.opcode) {
-    case CPU_OP_PUSH_V32:
-        err = cpu_stack_push_u32(cpu, cpu->instr.operands[0].u32);
+    // Same addresses as the LDR handlers.
+    switch (instr->opcode) {
+    case CPU_OP_LDR_RV0:
+        *out_addr = opds[1].u32;
         break;
-
-    case CPU_OP_PUSH_R:
-        err = cpu_stack_push_u32(cpu, *cpu->instr.operands[0].reg_ref.p_reg);
+    case CPU_OP_LDR_RI0:
+        *out_addr = PRV_INSTR_REG(instr, 1);
         break;
-
-    case CPU_OP_POP_R:
-        err = cpu_stack_pop_u32(cpu, cpu->instr.operands[0].reg_ref.p_reg);
+    case CPU_OP_LDR_RI8:
+        *out_addr = PRV_INSTR_REG(instr, 1) + (int8_t)opds[2].u8;
+        break;
+    case CPU_OP_LDR_RI32:
+        *out_addr = PRV_INSTR_REG(instr, 1) + (int32_t)opds[2].u32;
+        break;
+    case CPU_OP_LDR_RIR:
+        *out_addr =
+            PRV_INSTR_REG(instr, 1) + (int32_t)PRV_INSTR_REG(instr, 2);
         break;
-
     default:
-        D_ASSERTMF(false, "instruction is not implemented: 0x%02X",
-                   cpu->instr.opcode);
+        return false;
     }
 
-    return err;
+    *out_size = opds[0].reg_ref.access_size == CPU_REG_SIZE_8 ? 1 : 4;
+    return true;
 }
 
-static vm_err_t prv_cpu_execute_other_instr(cpu_ctx_t *cpu) {
-    vm_err_t err = VM_ERR_NONE;
-    switch (cpu->instr.opcode) {
-    case CPU_OP_INT_V8:
-        err = cpu_raise_irq(cpu, cpu->instr.operands[0].u8);
+void cpu_exec_eval_flags(cpu_ctx_t *cpu) {
+    D_ASSERT(cpu);
+    const cpu_lazy_flags_t *lazy = &cpu->lazy_flags;
+    const bool sign_op1 = (lazy->op1 & (1U << 31)) != 0;
+    const bool sign_op2 = (lazy->op2 & (1U << 31)) != 0;
+    const bool sign_res = (lazy->res & (1U << 31)) != 0;
+
+    bool flag_zero = lazy->res == 0;
+    bool flag_carry = false;
+    bool flag_ovf = false;
+    switch (lazy->opcode) {
+    case CPU_OP_ADD_RR:
+    case CPU_OP_ADD_RV: {
+        // Zero is set from the 33-bit sum.
+        const bool carry = lazy->res < lazy->op1;
+        flag_zero = lazy->res == 0 && !carry;
+        flag_carry = carry;
+        flag_ovf = (sign_op1 == sign_op2) && (sign_res != sign_op1);
         break;
+    }
 
-    case CPU_OP_HALT:
-        cpu->state = CPU_HALTED;
+    case CPU_OP_SUB_RR:
+    case CPU_OP_SUB_RV:
+    case CPU_OP_CMP_RR:
+        flag_carry = lazy->op1 >= lazy->op2;
+        flag_ovf = (sign_op1 != sign_op2) && (sign_res != sign_op1);
         break;
 
-    case CPU_OP_IRET:
-        err = cpu_stack_pop_u32(cpu, &cpu->reg_pc);
+    case CPU_OP_MUL_RR:
+    case CPU_OP_MUL_RV: {
+        // Zero is set from the 64-bit product.
+        const uint64_t res = (uint64_t)lazy->op1 * lazy->op2;
+        flag_zero = res == 0;
+        flag_carry = (res >> 32) != 0;
         break;
+    }
 
-    default:
-        D_ASSERTMF(false, "instruction is not implemented: 0x%02X",
-                   cpu->instr.opcode);
+    case CPU_OP_SHL_RR:
+    case CPU_OP_SHL_RV: {
+        const uint32_t numbits = lazy->op2 & 31;
+        if (numbits > 0) {
+            flag_carry = (lazy->op1 & (1U << (32 - numbits))) != 0;
+        }
+        break;
     }
-    return err;
-}
 
-static vm_err_t prv_cpu_execute_str(cpu_ctx_t *cpu, vm_addr_t dst_addr,
-                                    cpu_reg_ref_t src_reg) {
-    switch (src_reg.access_size) {
-    case CPU_REG_SIZE_8:
-        return cpu->mem->write_u8(cpu->mem, dst_addr, *src_reg.p_reg_u8);
-    case CPU_REG_SIZE_32:
-        return cpu->mem->write_u32(cpu->mem, dst_addr, *src_reg.p_reg);
-    default:
-        D_TODO();
+    case CPU_OP_SHR_RR:
+    case CPU_OP_SHR_RV: {
+        const uint32_t numbits = lazy->op2 & 31;
+        if (numbits > 0) {
+            flag_carry = (lazy->op1 & (1U << (numbits - 1))) != 0;
+        }
+        break;
     }
-}
 
-static vm_err_t prv_cpu_execute_ldr(cpu_ctx_t *cpu, vm_addr_t src_addr,
-                                    cpu_reg_ref_t dst_reg) {
-    switch (dst_reg.access_size) {
-    case CPU_REG_SIZE_8:
-        return cpu->mem->read_u8(cpu->mem, src_addr, dst_reg.p_reg_u8);
-    case CPU_REG_SIZE_32:
-        return cpu->mem->read_u32(cpu->mem, src_addr, dst_reg.p_reg);
+    case CPU_OP_ROL_RR:
+    case CPU_OP_ROL_RV:
+        // Carry is the last bit rotated, now the lowest one.
+        if ((lazy->op2 & 31) != 0) { flag_carry = (lazy->res & 1) != 0; }
+        break;
+
+    case CPU_OP_ROR_RR:
+    case CPU_OP_ROR_RV:
+        // Carry is the last bit rotated, now the highest one.
+        if ((lazy->op2 & 31) != 0) { flag_carry = sign_res; }
+        break;
+
     default:
-        D_TODO();
+        // Divisions and logic instructions only set zero and sign.
+        break;
     }
+
+    prv_cpu_set_flags(cpu, flag_zero, sign_res, flag_carry, flag_ovf);
+    cpu->lazy_flags.opcode = 0;
 }
 
 static void prv_cpu_set_flags(cpu_ctx_t *cpu, bool zero, bool sign, bool carry,
@@ -7,4 +7,53 @@
 
 #include <fcvm/cpu.h>
 
-vm_err_t cpu_execute_instr(cpu_ctx_t *cpu);
+/**
+ * Executes @ref cpu_ctx_t.instr, whose operands have been decoded.
+ * @returns The error that must raise an exception, or #VM_ERR_NONE.
+ */
+typedef vm_err_t (*cpu_exec_fn_t)(cpu_ctx_t *cpu);
+
+/// Handler of each opcode, NULL for the opcodes without a descriptor.
+extern const cpu_exec_fn_t cpu_exec_handlers[256];
+
+/// Executes the decoded instruction with its handler.
+static inline vm_err_t cpu_execute_instr(cpu_ctx_t *cpu) {
+    return cpu_exec_handlers[cpu->instr.opcode](cpu);
+}
+
+/**
+ * Executes a superinstruction: @a first, a compare (#CPU_OP_CMP_RR,
+ * #CPU_OP_TST_RR or #CPU_OP_TST_RV), then @a second, the conditional jump right
+ * after it. The results are the same as with their own handlers, but the jump
+ * condition is computed from the operands instead of the flags, which are only
+ * recorded for whatever reads them next. Never fails and never accesses
+ * memory. @ref cpu_ctx_t.reg_pc must already point past @a second.
+ */
+typedef void (*cpu_exec_fused_fn_t)(cpu_ctx_t *cpu, const cpu_instr_t *first,
+                                    const cpu_instr_t *second);
+
+/**
+ * Finds the handler of the superinstruction made of the opcodes @a first and
+ * @a second, see #cpu_exec_fused_fn_t.
+ * @returns NULL if the pair is not fused.
+ */
+cpu_exec_fused_fn_t cpu_exec_fused_handler(uint8_t first, uint8_t second);
+
+/**
+ * Computes the range of memory that the load instruction @a instr reads with
+ * the current register values.
+ * @returns `false` if @a instr is not a load.
+ */
+bool cpu_exec_load_range(cpu_ctx_t *cpu, const cpu_instr_t *instr,
+                         vm_addr_t *out_addr, uint32_t *out_size);
+
+/// Computes @ref cpu_ctx_t.flags from @ref cpu_ctx_t.lazy_flags.
+void cpu_exec_eval_flags(cpu_ctx_t *cpu);
+
+/**
+ * Makes @ref cpu_ctx_t.flags current. ALU instructions only record their
+ * operands, this must be called before the flags are read.
+ */
+static inline void cpu_exec_sync_flags(cpu_ctx_t *cpu) {
+    if (cpu->lazy_flags.opcode != 0) { cpu_exec_eval_flags(cpu); }
+}
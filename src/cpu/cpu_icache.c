@@ -0,0 +1,112 @@
+/**
+ * @file cpu_icache.c
+ * Predecoded instruction cache implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_icache.h"
+#include "debugm.h"
+
+cpu_icache_t *cpu_icache_new(void) {
+    cpu_icache_t *icache = calloc(1, sizeof(*icache));
+    D_ASSERT(icache);
+    return icache;
+}
+
+void cpu_icache_free(cpu_icache_t *icache) {
+    D_ASSERT(icache);
+    mem_page_bitmap_reset(&icache->code_pages);
+    free(icache);
+}
+
+void cpu_icache_clear(cpu_icache_t *icache) {
+    D_ASSERT(icache);
+    for (size_t idx = 0; idx < CPU_ICACHE_NUM_ENTRIES; idx++) {
+        icache->entries[idx].valid = false;
+    }
+    mem_page_bitmap_reset(&icache->code_pages);
+    icache->p_map_gen = NULL;
+    icache->map_gen = 0;
+    icache->epoch++;
+}
+
+bool cpu_icache_track_code(cpu_ctx_t *cpu, vm_addr_t pc, vm_addr_t next_pc) {
+    D_ASSERT(cpu);
+    cpu_icache_t *icache = cpu->icache;
+    const vm_addr_t last = next_pc - 1;
+
+    // The whole code must have been read directly from one line.
+    const cpu_tlb_entry_t *tlb = &cpu->tlb[CPU_TLB_FETCH];
+    const vm_addr_t span_size = tlb->span.end - tlb->span.start;
+    if (!tlb->span.ptr || (pc - tlb->span.start) >= span_size ||
+        (last - tlb->span.start) >= span_size ||
+        *tlb->span.p_gen != tlb->gen) {
+        return false;
+    }
+    if ((pc >> CPU_ICACHE_LINE_SHIFT) != (last >> CPU_ICACHE_LINE_SHIFT)) {
+        return false;
+    }
+
+    // Code decoded under another mapping must not be used anymore.
+    if (icache->p_map_gen != tlb->span.p_gen ||
+        icache->map_gen != *tlb->span.p_gen) {
+        cpu_icache_clear(icache);
+        icache->p_map_gen = tlb->span.p_gen;
+        icache->map_gen = *tlb->span.p_gen;
+    }
+
+    const uint32_t page = pc >> CPU_ICACHE_PAGE_SHIFT;
+    if (!mem_page_bitmap_test(&icache->code_pages, page)) {
+        mem_page_bitmap_set(&icache->code_pages, page);
+    }
+    // Lets the memory controller report the writes of others.
+    if (tlb->span.code_pages &&
+        !mem_page_bitmap_test(tlb->span.code_pages, page)) {
+        mem_page_bitmap_set(tlb->span.code_pages, page);
+    }
+    return true;
+}
+
+void cpu_icache_note_write(cpu_icache_t *icache, vm_addr_t addr,
+                           uint32_t size) {
+    D_ASSERT(icache);
+    if (size == 0) { return; }
+
+    // 64-bit addresses do not overflow past the last line.
+    const uint64_t first = addr >> CPU_ICACHE_LINE_SHIFT;
+    const uint64_t last = ((uint64_t)addr + size - 1) >> CPU_ICACHE_LINE_SHIFT;
+    if (last - first >= CPU_ICACHE_NUM_LINE_GENS) {
+        // Every line generation would be incremented anyway.
+        cpu_icache_clear(icache);
+        icache->num_code_writes++;
+        return;
+    }
+
+    bool is_code = false;
+    for (uint64_t line = first; line <= last; line++) {
+        const vm_addr_t line_addr = (vm_addr_t)(line << CPU_ICACHE_LINE_SHIFT);
+        if (cpu_icache_is_code_page(icache, line_addr)) {
+            (*cpu_icache_line_gen(icache, line_addr))++;
+            is_code = true;
+        }
+    }
+    if (is_code) { icache->num_code_writes++; }
+}
+
+void cpu_icache_insert(cpu_ctx_t *cpu, vm_addr_t next_pc) {
+    D_ASSERT(cpu);
+    D_ASSERT(cpu->instr.desc);
+    cpu_icache_t *icache = cpu->icache;
+    const vm_addr_t pc = cpu->instr.start_addr;
+    if (!cpu_icache_track_code(cpu, pc, next_pc)) { return; }
+
+    cpu_icache_entry_t *entry =
+        &icache->entries[pc & (CPU_ICACHE_NUM_ENTRIES - 1)];
+    entry->valid = true;
+    entry->pc = pc;
+    entry->next_pc = next_pc;
+    entry->line_gen = *cpu_icache_line_gen(icache, pc);
+    entry->instr = cpu->instr;
+}
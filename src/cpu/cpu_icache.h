@@ -0,0 +1,140 @@
+/**
+ * @file cpu_icache.h
+ * Predecoded instruction cache.
+ *
+ * #cpu_run() keeps the instructions it has decoded in a direct-mapped table
+ * keyed by the guest PC, so that instructions executed again (typically in a
+ * loop) are not fetched and decoded again. Only instructions that have been
+ * fetched from directly readable memory (see #MEM_DIRECT_READ) are cached,
+ * since reading device memory through the callbacks may have side effects.
+ *
+ * Code pages are tracked in a sparse bitmap (see @ref fcvm/page_bitmap.h).
+ * When the CPU stores to a code page, the generation of the store address line
+ * is incremented, which invalidates every cached instruction in that line. The
+ * cache is also flushed when the memory mapping changes. The code pages are
+ * also marked in the bitmap of the memory mapping, if it has one (see
+ * @ref mem_span_t.code_pages), through which the writes done behind the CPU's
+ * back are reported to #cpu_note_code_write(). Other writes are not tracked,
+ * see #cpu_flush_icache().
+ */
+
+#pragma once
+
+#include <fcvm/cpu.h>
+#include <fcvm/page_bitmap.h>
+
+/// Number of cached instructions, must be a power of two.
+#define CPU_ICACHE_NUM_ENTRIES 1024
+
+/// Cached instructions cannot cross a line, and are invalidated per line.
+#define CPU_ICACHE_LINE_SHIFT 8
+/// Number of line generation counters, must be a power of two.
+#define CPU_ICACHE_NUM_LINE_GENS 4096
+
+/// Granularity of the code page bitmap.
+#define CPU_ICACHE_PAGE_SHIFT MEM_PAGE_BITMAP_PAGE_SHIFT
+
+/// Predecoded instruction.
+typedef struct {
+    bool valid;
+    vm_addr_t pc;      //!< Address of the opcode.
+    vm_addr_t next_pc; //!< Address right after the last operand.
+    uint32_t line_gen; //!< Generation of the line of @a pc when decoded.
+    cpu_instr_t instr; //!< Ready-to-execute instruction.
+} cpu_icache_entry_t;
+
+struct cpu_icache {
+    /// Mapping generation counter of the code the entries were decoded from.
+    const uint32_t *p_map_gen;
+    uint32_t map_gen; //!< Value of @a *p_map_gen when the entries were added.
+    /// Incremented every time the cache is cleared.
+    uint32_t epoch;
+    /// Number of writes to code pages, see #cpu_num_code_writes().
+    uint64_t num_code_writes;
+    /// Store of the CPU being passed to its memory interface, already noted
+    /// by #cpu_icache_note_store(). @a own_store_size is 0 if there is none.
+    vm_addr_t own_store_addr;
+    uint32_t own_store_size;
+
+    uint32_t line_gens[CPU_ICACHE_NUM_LINE_GENS];
+    mem_page_bitmap_t code_pages;
+    cpu_icache_entry_t entries[CPU_ICACHE_NUM_ENTRIES];
+};
+
+cpu_icache_t *cpu_icache_new(void);
+void cpu_icache_free(cpu_icache_t *icache);
+void cpu_icache_clear(cpu_icache_t *icache);
+
+/**
+ * Invalidates the cached instructions in the lines overlapped by the @a size
+ * bytes at @a addr, for writes of any size. Clears the whole cache if there
+ * are too many lines.
+ */
+void cpu_icache_note_write(cpu_icache_t *icache, vm_addr_t addr,
+                           uint32_t size);
+
+/**
+ * Starts tracking stores to the code in [@a pc, @a next_pc), if it can be
+ * cached: the code must lie in one line and must have been fetched directly
+ * with the current fetch TLB entry.
+ * Clears the cache if the memory mapping has changed since the cached code has
+ * been decoded.
+ * @returns `true` if the code can be cached and validated with the generation
+ * of the line of @a pc (see #cpu_icache_line_gen()).
+ */
+bool cpu_icache_track_code(cpu_ctx_t *cpu, vm_addr_t pc, vm_addr_t next_pc);
+
+/**
+ * Adds the instruction that the CPU has just decoded into @a cpu->instr, if
+ * it can be cached.
+ * @param cpu     CPU context.
+ * @param next_pc Address right after the instruction.
+ */
+void cpu_icache_insert(cpu_ctx_t *cpu, vm_addr_t next_pc);
+
+static inline uint32_t *cpu_icache_line_gen(cpu_icache_t *icache,
+                                            vm_addr_t addr) {
+    const uint32_t line = addr >> CPU_ICACHE_LINE_SHIFT;
+    return &icache->line_gens[line & (CPU_ICACHE_NUM_LINE_GENS - 1)];
+}
+
+/// Checks if code decoded under the current mapping is still valid.
+static inline bool cpu_icache_mapping_is_current(const cpu_icache_t *icache) {
+    return icache->p_map_gen && *icache->p_map_gen == icache->map_gen;
+}
+
+/// Finds a valid cached instruction at @a pc, or returns NULL.
+static inline const cpu_icache_entry_t *cpu_icache_lookup(cpu_icache_t *icache,
+                                                          vm_addr_t pc) {
+    const cpu_icache_entry_t *entry =
+        &icache->entries[pc & (CPU_ICACHE_NUM_ENTRIES - 1)];
+    if (entry->valid && entry->pc == pc &&
+        entry->line_gen == *cpu_icache_line_gen(icache, pc) &&
+        cpu_icache_mapping_is_current(icache)) {
+        return entry;
+    }
+    return NULL;
+}
+
+static inline bool cpu_icache_is_code_page(const cpu_icache_t *icache,
+                                           vm_addr_t addr) {
+    return mem_page_bitmap_test(&icache->code_pages,
+                                addr >> CPU_ICACHE_PAGE_SHIFT);
+}
+
+/// Invalidates the cached instructions overwritten by a CPU store.
+static inline void cpu_icache_note_store(cpu_icache_t *icache, vm_addr_t addr,
+                                         uint32_t size) {
+    const vm_addr_t last = addr + size - 1;
+    bool is_code = false;
+    if (cpu_icache_is_code_page(icache, addr)) {
+        (*cpu_icache_line_gen(icache, addr))++;
+        is_code = true;
+    }
+    if ((last >> CPU_ICACHE_LINE_SHIFT) != (addr >> CPU_ICACHE_LINE_SHIFT) &&
+        cpu_icache_is_code_page(icache, last)) {
+        (*cpu_icache_line_gen(icache, last))++;
+        is_code = true;
+    }
+    if (is_code) { icache->num_code_writes++; }
+}
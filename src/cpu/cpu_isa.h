@@ -0,0 +1,184 @@
+/**
+ * @file cpu_isa.h
+ * Instruction set definition.
+ *
+ * This is the only list of the instructions: the descriptors in
+ * @ref cpu_instr_descs.c, the decoders in @ref cpu.c, the handler table in
+ * @ref cpu_exec.c and the compiler selection in @ref cpu_jit.c are all
+ * generated from #CPU_ISA_INSTRS, so they cannot get out of sync. The opcode
+ * values themselves are part of the public API, in @ref cpu_instr_descs.h.
+ */
+
+#pragma once
+
+#include <fcvm/cpu_instr_descs.h>
+
+/**
+ * @{
+ * @name Operand types
+ * `CPU_ISA_OPD_<type>` is the #cpu_operand_type_t of an operand type used in
+ * the layouts below, `CPU_ISA_OPD_SIZE_<type>` its encoded size in bytes.
+ * `NONE` fills the unused operands of a layout, it is never decoded.
+ */
+#define CPU_ISA_OPD_REG   CPU_OPD_REG
+#define CPU_ISA_OPD_IMM5  CPU_OPD_IMM5
+#define CPU_ISA_OPD_IMM8  CPU_OPD_IMM8
+#define CPU_ISA_OPD_IMM32 CPU_OPD_IMM32
+#define CPU_ISA_OPD_NONE  CPU_OPD_REG
+
+#define CPU_ISA_OPD_SIZE_REG   1
+#define CPU_ISA_OPD_SIZE_IMM5  1
+#define CPU_ISA_OPD_SIZE_IMM8  1
+#define CPU_ISA_OPD_SIZE_IMM32 4
+#define CPU_ISA_OPD_SIZE_NONE  0
+/// @}
+
+/**
+ * @{
+ * @name Operand layouts
+ * `CPU_ISA_LAYOUT_<layout>(M)` expands to
+ * `M(layout, num_operands, opd0, opd1, opd2)`, with the operand types in
+ * encoding order. `R` is a register, `V<n>` an n-bit immediate value.
+ */
+#define CPU_ISA_LAYOUT_NONE(M)    M(NONE, 0, NONE, NONE, NONE)
+#define CPU_ISA_LAYOUT_R(M)       M(R, 1, REG, NONE, NONE)
+#define CPU_ISA_LAYOUT_V8(M)      M(V8, 1, IMM8, NONE, NONE)
+#define CPU_ISA_LAYOUT_V32(M)     M(V32, 1, IMM32, NONE, NONE)
+#define CPU_ISA_LAYOUT_R_R(M)     M(R_R, 2, REG, REG, NONE)
+#define CPU_ISA_LAYOUT_R_V5(M)    M(R_V5, 2, REG, IMM5, NONE)
+#define CPU_ISA_LAYOUT_R_V32(M)   M(R_V32, 2, REG, IMM32, NONE)
+#define CPU_ISA_LAYOUT_V32_R(M)   M(V32_R, 2, IMM32, REG, NONE)
+#define CPU_ISA_LAYOUT_R_R_R(M)   M(R_R_R, 3, REG, REG, REG)
+#define CPU_ISA_LAYOUT_R_V8_R(M)  M(R_V8_R, 3, REG, IMM8, REG)
+#define CPU_ISA_LAYOUT_R_V32_R(M) M(R_V32_R, 3, REG, IMM32, REG)
+#define CPU_ISA_LAYOUT_R_R_V8(M)  M(R_R_V8, 3, REG, REG, IMM8)
+#define CPU_ISA_LAYOUT_R_R_V32(M) M(R_R_V32, 3, REG, REG, IMM32)
+
+/// Applies @a M to every layout, like the `CPU_ISA_LAYOUT_*` macros.
+#define CPU_ISA_LAYOUTS(M)                                                     \
+    CPU_ISA_LAYOUT_NONE(M)                                                     \
+    CPU_ISA_LAYOUT_R(M)                                                        \
+    CPU_ISA_LAYOUT_V8(M)                                                       \
+    CPU_ISA_LAYOUT_V32(M)                                                      \
+    CPU_ISA_LAYOUT_R_R(M)                                                      \
+    CPU_ISA_LAYOUT_R_V5(M)                                                     \
+    CPU_ISA_LAYOUT_R_V32(M)                                                    \
+    CPU_ISA_LAYOUT_V32_R(M)                                                    \
+    CPU_ISA_LAYOUT_R_R_R(M)                                                    \
+    CPU_ISA_LAYOUT_R_V8_R(M)                                                   \
+    CPU_ISA_LAYOUT_R_V32_R(M)                                                  \
+    CPU_ISA_LAYOUT_R_R_V8(M)                                                   \
+    CPU_ISA_LAYOUT_R_R_V32(M)
+/// @}
+
+/**
+ * @{
+ * @name Cycle costs
+ * `CPU_ISA_CYCLES_<cost>` is the cost of an instruction that only accesses
+ * registers (`REG`) or makes one data memory access (`MEM`).
+ */
+#define CPU_ISA_CYCLES_REG CPU_CYCLES_BASE
+#define CPU_ISA_CYCLES_MEM (CPU_CYCLES_BASE + CPU_CYCLES_MEM_ACCESS)
+/// @}
+
+/**
+ * @{
+ * @name Memory accesses
+ * `CPU_ISA_MEM_<mem>` tells if an instruction accesses data memory, including
+ * the stack, or raises an IRQ (`YES`), so that an IRQ may be pending or code
+ * may have been overwritten once it has run, or only accesses registers (`NO`).
+ */
+#define CPU_ISA_MEM_YES true
+#define CPU_ISA_MEM_NO  false
+/// @}
+
+/**
+ * Applies `X(op, mnemonic, layout, cost, mem, handler, jit)` to every
+ * instruction:
+ * - `op` is the opcode name without the `CPU_OP_` prefix,
+ * - `layout` is one of the `CPU_ISA_LAYOUT_*` suffixes,
+ * - `cost` is one of the `CPU_ISA_CYCLES_*` suffixes,
+ * - `mem` is one of the `CPU_ISA_MEM_*` suffixes, which unlike `cost` is not
+ *   about cycles (`INT` is `YES` but costs `REG`),
+ * - `handler` is the name of the handler without the `prv_cpu_exec_` prefix,
+ * - `jit` is how @ref cpu_jit.c compiles it: `MOV`, `MEM`, `ALU`, `JUMP` (only
+ *   at the end of a block) or `NONE` (left to the interpreter).
+ */
+// clang-format off
+#define CPU_ISA_INSTRS(X)                                                      \
+    X(MOV_VR,    "MOV",   R_V32,   REG, NO,  mov_vr,    MOV)                   \
+    X(MOV_RR,    "MOV",   R_R,     REG, NO,  mov_rr,    MOV)                   \
+    X(STR_RV0,   "STR",   V32_R,   MEM, YES, str_rv0,   MEM)                   \
+    X(STR_RI0,   "STR",   R_R,     MEM, YES, str_ri0,   MEM)                   \
+    X(STR_RI8,   "STR",   R_V8_R,  MEM, YES, str_ri8,   MEM)                   \
+    X(STR_RI32,  "STR",   R_V32_R, MEM, YES, str_ri32,  MEM)                   \
+    X(STR_RIR,   "STR",   R_R_R,   MEM, YES, str_rir,   MEM)                   \
+    X(LDR_RV0,   "LDR",   R_V32,   MEM, YES, ldr_rv0,   MEM)                   \
+    X(LDR_RI0,   "LDR",   R_R,     MEM, YES, ldr_ri0,   MEM)                   \
+    X(LDR_RI8,   "LDR",   R_R_V8,  MEM, YES, ldr_ri8,   MEM)                   \
+    X(LDR_RI32,  "LDR",   R_R_V32, MEM, YES, ldr_ri32,  MEM)                   \
+    X(LDR_RIR,   "LDR",   R_R_R,   MEM, YES, ldr_rir,   MEM)                   \
+                                                                               \
+    X(ADD_RR,    "ADD",   R_R,     REG, NO,  add_rr,    ALU)                   \
+    X(ADD_RV,    "ADD",   R_V32,   REG, NO,  add_rv,    ALU)                   \
+    X(SUB_RR,    "SUB",   R_R,     REG, NO,  sub_rr,    ALU)                   \
+    X(SUB_RV,    "SUB",   R_V32,   REG, NO,  sub_rv,    ALU)                   \
+    X(MUL_RR,    "MUL",   R_R,     REG, NO,  mul_rr,    ALU)                   \
+    X(MUL_RV,    "MUL",   R_V32,   REG, NO,  mul_rv,    ALU)                   \
+    X(DIV_RR,    "DIV",   R_R,     REG, NO,  div_rr,    ALU)                   \
+    X(DIV_RV,    "DIV",   R_V32,   REG, NO,  div_rv,    ALU)                   \
+    X(IDIV_RR,   "IDIV",  R_R,     REG, NO,  idiv_rr,   ALU)                   \
+    X(IDIV_RV,   "IDIV",  R_V32,   REG, NO,  idiv_rv,   ALU)                   \
+    X(AND_RR,    "AND",   R_R,     REG, NO,  and_rr,    ALU)                   \
+    X(AND_RV,    "AND",   R_V32,   REG, NO,  and_rv,    ALU)                   \
+    X(OR_RR,     "OR",    R_R,     REG, NO,  or_rr,     ALU)                   \
+    X(OR_RV,     "OR",    R_V32,   REG, NO,  or_rv,     ALU)                   \
+    X(XOR_RR,    "XOR",   R_R,     REG, NO,  xor_rr,    ALU)                   \
+    X(XOR_RV,    "XOR",   R_V32,   REG, NO,  xor_rv,    ALU)                   \
+    X(NOT_R,     "NOT",   R,       REG, NO,  not_r,     ALU)                   \
+    X(SHL_RR,    "SHL",   R_R,     REG, NO,  shl_rr,    ALU)                   \
+    X(SHL_RV,    "SHL",   R_V5,    REG, NO,  shl_rv,    ALU)                   \
+    X(SHR_RR,    "SHR",   R_R,     REG, NO,  shr_rr,    ALU)                   \
+    X(SHR_RV,    "SHR",   R_V5,    REG, NO,  shr_rv,    ALU)                   \
+    X(ROL_RR,    "ROL",   R_R,     REG, NO,  rol_rr,    NONE)                  \
+    X(ROL_RV,    "ROL",   R_V5,    REG, NO,  rol_rv,    NONE)                  \
+    X(ROR_RR,    "ROR",   R_R,     REG, NO,  ror_rr,    NONE)                  \
+    X(ROR_RV,    "ROR",   R_V5,    REG, NO,  ror_rv,    NONE)                  \
+    X(CMP_RR,    "CMP",   R_R,     REG, NO,  cmp_rr,    ALU)                   \
+    X(TST_RR,    "TST",   R_R,     REG, NO,  tst_rr,    ALU)                   \
+    X(TST_RV,    "TST",   R_V32,   REG, NO,  tst_rv,    ALU)                   \
+                                                                               \
+    X(JMPR_V8,   "JMPR",  V8,      REG, NO,  jmpr_v8,   JUMP)                  \
+    X(JMPA_V32,  "JMPA",  V32,     REG, NO,  jmpa_v32,  JUMP)                  \
+    X(JMPA_R,    "JMPA",  R,       REG, NO,  jmpa_r,    JUMP)                  \
+    X(JEQR_V8,   "JEQR",  V8,      REG, NO,  jeqr_v8,   JUMP)                  \
+    X(JEQA_V32,  "JEQA",  V32,     REG, NO,  jeqa_v32,  JUMP)                  \
+    X(JEQA_R,    "JEQA",  R,       REG, NO,  jeqa_r,    JUMP)                  \
+    X(JNER_V8,   "JNER",  V8,      REG, NO,  jner_v8,   JUMP)                  \
+    X(JNEA_V32,  "JNEA",  V32,     REG, NO,  jnea_v32,  JUMP)                  \
+    X(JNEA_R,    "JNEA",  R,       REG, NO,  jnea_r,    JUMP)                  \
+    X(JGTR_V8,   "JGTR",  V8,      REG, NO,  jgtr_v8,   JUMP)                  \
+    X(JGTA_V32,  "JGTA",  V32,     REG, NO,  jgta_v32,  JUMP)                  \
+    X(JGTA_R,    "JGTA",  R,       REG, NO,  jgta_r,    JUMP)                  \
+    X(JGER_V8,   "JGER",  V8,      REG, NO,  jger_v8,   JUMP)                  \
+    X(JGEA_V32,  "JGEA",  V32,     REG, NO,  jgea_v32,  JUMP)                  \
+    X(JGEA_R,    "JGEA",  R,       REG, NO,  jgea_r,    JUMP)                  \
+    X(JLTR_V8,   "JLTR",  V8,      REG, NO,  jltr_v8,   JUMP)                  \
+    X(JLTA_V32,  "JLTA",  V32,     REG, NO,  jlta_v32,  JUMP)                  \
+    X(JLTA_R,    "JLTA",  R,       REG, NO,  jlta_r,    JUMP)                  \
+    X(JLER_V8,   "JLER",  V8,      REG, NO,  jler_v8,   JUMP)                  \
+    X(JLEA_V32,  "JLEA",  V32,     REG, NO,  jlea_v32,  JUMP)                  \
+    X(JLEA_R,    "JLEA",  R,       REG, NO,  jlea_r,    JUMP)                  \
+    X(CALLA_V32, "CALLA", V32,     MEM, YES, calla_v32, NONE)                  \
+    X(CALLA_R,   "CALLA", R,       MEM, YES, calla_r,   NONE)                  \
+    X(RET,       "RET",   NONE,    MEM, YES, ret,       NONE)                  \
+                                                                               \
+    X(PUSH_V32,  "PUSH",  V32,     MEM, YES, push_v32,  NONE)                  \
+    X(PUSH_R,    "PUSH",  R,       MEM, YES, push_r,    NONE)                  \
+    X(POP_R,     "POP",   R,       MEM, YES, pop_r,     NONE)                  \
+                                                                               \
+    X(NOP,       "NOP",   NONE,    REG, NO,  nop,       NONE)                  \
+    X(HALT,      "HALT",  NONE,    REG, NO,  halt,      NONE)                  \
+    X(INT_V8,    "INT",   V8,      REG, YES, int_v8,    NONE)                  \
+    X(IRET,      "IRET",  NONE,    MEM, YES, iret,      NONE)
+// clang-format on
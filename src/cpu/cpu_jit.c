@@ -0,0 +1,883 @@
+/**
+ * @file cpu_jit.c
+ * Native code compiler implementation for x86-64 Linux hosts.
+ *
+ * Register allocation of the generated code:
+ * - `rdi`: CPU context (first argument of #cpu_jit_fn_t);
+ * - `r8d`-`r15d`: guest registers `r0`-`r7`;
+ * - `ebx`: guest flags;
+ * - `rax`, `rcx`, `rdx`, `rsi`: scratch.
+ *
+ * The code does not call any function, so the stack is only used to save the
+ * callee-saved registers.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_isa.h"
+#include "cpu_jit.h"
+#include "debugm.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#    define CPU_JIT_SUPPORTED 1
+#    include <sys/mman.h>
+#else
+#    define CPU_JIT_SUPPORTED 0
+#endif
+
+#if CPU_JIT_SUPPORTED
+
+/// Size of the buffer a block is compiled into before being copied.
+#define CPU_JIT_BUF_SIZE 8192
+/// Maximum number of side exits of a block.
+#define CPU_JIT_MAX_EXITS (CPU_BLOCK_MAX_OPS * 8)
+
+/// Host registers.
+enum {
+    X86_RAX = 0,
+    X86_RCX = 1,
+    X86_RDX = 2,
+    X86_RBX = 3,
+    X86_RSI = 6,
+    X86_RDI = 7,
+};
+
+/// Condition codes of `jcc`, `setcc` and `cmovcc`.
+enum {
+    X86_CC_O = 0x0,
+    X86_CC_B = 0x2,
+    X86_CC_AE = 0x3,
+    X86_CC_E = 0x4,
+    X86_CC_NE = 0x5,
+    X86_CC_A = 0x7,
+    X86_CC_S = 0x8,
+    X86_CC_NONE = -1,
+};
+
+/// Host register of the guest register @a reg_code.
+#define X86_GUEST_REG(reg_code) (8 + (reg_code))
+
+#define CPU_OFF(field)  ((uint32_t)offsetof(cpu_ctx_t, field))
+#define TLB_OFF(kind, field)                                                   \
+    (CPU_OFF(tlb) + (uint32_t)((kind) * sizeof(cpu_tlb_entry_t) +             \
+                               offsetof(cpu_tlb_entry_t, field)))
+
+typedef struct {
+    uint8_t buf[CPU_JIT_BUF_SIZE];
+    size_t size;
+    bool overflow;
+
+    /// Offsets of the `rel32` fields of the side exit jumps.
+    size_t exit_fixups[CPU_JIT_MAX_EXITS];
+    /// Index of the instruction each side exit resumes at.
+    uint32_t exit_ops[CPU_JIT_MAX_EXITS];
+    size_t num_exits;
+} cpu_jit_emitter_t;
+
+/// How an instruction is compiled, see the `jit` column of #CPU_ISA_INSTRS().
+typedef enum {
+    CPU_JIT_OP_NONE, //!< Not compiled, ends the compiled part of a block.
+    CPU_JIT_OP_MOV,  //!< Register or immediate move.
+    CPU_JIT_OP_MEM,  //!< Load or store, see prv_jit_compile_mem().
+    CPU_JIT_OP_ALU,  //!< ALU instruction, see prv_jit_compile_alu().
+    CPU_JIT_OP_JUMP, //!< Jump ending a block, see prv_jit_compile_jump().
+} cpu_jit_op_t;
+
+#define PRV_JIT_OP(op, mnem, layout, cost, mem, handler, jit)                  \
+    [CPU_OP_##op] = CPU_JIT_OP_##jit,
+
+/// Compiler of each opcode, #CPU_JIT_OP_NONE for the opcodes without one.
+static const uint8_t prv_jit_ops[256] = {
+    CPU_ISA_INSTRS(PRV_JIT_OP)
+};
+
+struct cpu_jit {
+    uint8_t *code;    //!< Executable memory.
+    size_t code_used; //!< Number of bytes of @a code used.
+    cpu_jit_emitter_t emitter;
+};
+
+static bool prv_jit_supports(const cpu_block_op_t *op, bool is_last);
+static void prv_jit_flags_liveness(const cpu_block_t *block, uint32_t num_ops,
+                                   bool *out_live);
+static void prv_jit_compile_op(cpu_jit_emitter_t *e, const cpu_block_op_t *op,
+                               uint32_t op_idx, bool flags_live);
+static void prv_jit_compile_alu(cpu_jit_emitter_t *e, const cpu_instr_t *instr,
+                                uint32_t op_idx, bool flags_live);
+static void prv_jit_compile_mem(cpu_jit_emitter_t *e, const cpu_instr_t *instr,
+                                uint32_t op_idx);
+static void prv_jit_compile_jump(cpu_jit_emitter_t *e,
+                                 const cpu_block_op_t *op);
+static void prv_jit_mem_check(cpu_jit_emitter_t *e, cpu_tlb_kind_t kind,
+                              uint32_t size, uint32_t op_idx);
+
+static void prv_jit_u8(cpu_jit_emitter_t *e, uint8_t val);
+static void prv_jit_u32(cpu_jit_emitter_t *e, uint32_t val);
+static void prv_jit_rex(cpu_jit_emitter_t *e, bool wide, int reg, int rm,
+                        bool force);
+static void prv_jit_rr(cpu_jit_emitter_t *e, uint8_t opcode, int reg, int rm);
+static void prv_jit_mem(cpu_jit_emitter_t *e, bool wide, uint16_t opcode,
+                        int reg, int base, uint32_t disp);
+static void prv_jit_imm(cpu_jit_emitter_t *e, int digit, int rm, uint32_t imm);
+static void prv_jit_mov_imm(cpu_jit_emitter_t *e, int reg, uint32_t imm);
+static void prv_jit_setcc(cpu_jit_emitter_t *e, int cc, int reg);
+static void prv_jit_flags(cpu_jit_emitter_t *e, int carry_cc, int ovf_cc);
+static void prv_jit_merge_flags(cpu_jit_emitter_t *e, bool carry, bool ovf);
+static void prv_jit_exit_if(cpu_jit_emitter_t *e, int cc, uint32_t op_idx);
+
+cpu_jit_t *cpu_jit_new(void) {
+    void *code = mmap(NULL, CPU_JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        D_PRINT("cannot allocate executable memory");
+        return NULL;
+    }
+
+    cpu_jit_t *jit = calloc(1, sizeof(*jit));
+    D_ASSERT(jit);
+    jit->code = code;
+    return jit;
+}
+
+void cpu_jit_free(cpu_jit_t *jit) {
+    D_ASSERT(jit);
+    munmap(jit->code, CPU_JIT_CODE_SIZE);
+    free(jit);
+}
+
+bool cpu_jit_is_supported(void) {
+    return true;
+}
+
+bool cpu_jit_compile(cpu_jit_t *jit, cpu_blocks_t *blocks, cpu_block_t *block) {
+    D_ASSERT(jit);
+    D_ASSERT(blocks);
+    D_ASSERT(block);
+    block->jit_fn = NULL;
+
+    uint32_t num_ops = 0;
+    while (num_ops < block->num_ops &&
+           prv_jit_supports(&block->ops[num_ops],
+                            num_ops + 1 == block->num_ops)) {
+        num_ops++;
+    }
+    if (num_ops == 0) { return false; }
+
+    cpu_jit_emitter_t *e = &jit->emitter;
+    e->size = 0;
+    e->overflow = false;
+    e->num_exits = 0;
+
+    // Prologue: save the callee-saved registers, load the guest state.
+    prv_jit_u8(e, 0x53); // push rbx
+    for (int reg = 12; reg <= 15; reg++) {
+        prv_jit_rex(e, false, 0, reg, false);
+        prv_jit_u8(e, 0x50 + (reg & 7)); // push r12-r15
+    }
+    for (int reg = 0; reg < CPU_NUM_GP_REGS; reg++) {
+        prv_jit_mem(e, false, 0x8B, X86_GUEST_REG(reg), X86_RDI,
+                    CPU_OFF(gp_regs) + 4 * reg);
+    }
+    prv_jit_mem(e, false, 0x0FB6, X86_RBX, X86_RDI, CPU_OFF(flags));
+
+    bool flags_live[CPU_BLOCK_MAX_OPS];
+    prv_jit_flags_liveness(block, num_ops, flags_live);
+    for (uint32_t op_idx = 0; op_idx < num_ops; op_idx++) {
+        prv_jit_compile_op(e, &block->ops[op_idx], op_idx, flags_live[op_idx]);
+    }
+
+    if (num_ops == block->num_ops) {
+        const cpu_block_op_t *last = &block->ops[num_ops - 1];
+        if (prv_jit_ops[last->instr.opcode] != CPU_JIT_OP_JUMP) {
+            // mov dword [rdi + reg_pc], end_pc
+            prv_jit_mem(e, false, 0xC7, 0, X86_RDI, CPU_OFF(reg_pc));
+            prv_jit_u32(e, block->end_pc);
+        }
+    }
+    prv_jit_mov_imm(e, X86_RAX, num_ops);
+
+    // Epilogue: write the guest state back, restore the saved registers.
+    const size_t epilogue = e->size;
+    for (int reg = 0; reg < CPU_NUM_GP_REGS; reg++) {
+        prv_jit_mem(e, false, 0x89, X86_GUEST_REG(reg), X86_RDI,
+                    CPU_OFF(gp_regs) + 4 * reg);
+    }
+    prv_jit_mem(e, false, 0x88, X86_RBX, X86_RDI, CPU_OFF(flags));
+    for (int reg = 15; reg >= 12; reg--) {
+        prv_jit_rex(e, false, 0, reg, false);
+        prv_jit_u8(e, 0x58 + (reg & 7)); // pop r12-r15
+    }
+    prv_jit_u8(e, 0x5B); // pop rbx
+    prv_jit_u8(e, 0xC3); // ret
+
+    // Side exits: return the index of the instruction to interpret.
+    for (size_t exit_idx = 0; exit_idx < e->num_exits; exit_idx++) {
+        const size_t fixup = e->exit_fixups[exit_idx];
+        const uint32_t rel = (uint32_t)(e->size - (fixup + 4));
+        if (fixup + 4 <= CPU_JIT_BUF_SIZE) { memcpy(&e->buf[fixup], &rel, 4); }
+        prv_jit_mov_imm(e, X86_RAX, e->exit_ops[exit_idx]);
+        prv_jit_u8(e, 0xE9); // jmp epilogue
+        prv_jit_u32(e, (uint32_t)(epilogue - (e->size + 4)));
+    }
+    if (e->overflow) { return false; }
+
+    if (jit->code_used + e->size > CPU_JIT_CODE_SIZE) {
+        // Drop all the code and start over.
+        for (size_t idx = 0; idx < CPU_BLOCK_NUM_ENTRIES; idx++) {
+            blocks->blocks[idx].jit_fn = NULL;
+        }
+        jit->code_used = 0;
+    }
+
+    uint8_t *code = &jit->code[jit->code_used];
+    if (mprotect(jit->code, CPU_JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    memcpy(code, e->buf, e->size);
+    if (mprotect(jit->code, CPU_JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        D_ASSERTM(false, "cannot make the generated code executable");
+    }
+    jit->code_used += (e->size + 15) & ~(size_t)15;
+    block->jit_fn = (cpu_jit_fn_t)(void *)code;
+    return true;
+}
+
+/// Checks if @a op can be compiled.
+static bool prv_jit_supports(const cpu_block_op_t *op, bool is_last) {
+    // Only the general-purpose registers live in host registers.
+    for (size_t idx = 0; idx < op->instr.desc->num_operands; idx++) {
+        if (op->instr.desc->operands[idx] == CPU_OPD_REG &&
+            op->instr.operands[idx].reg_ref.reg_code >= CPU_NUM_GP_REGS) {
+            return false;
+        }
+    }
+    switch (prv_jit_ops[op->instr.opcode]) {
+    case CPU_JIT_OP_MOV:
+    case CPU_JIT_OP_MEM:
+    case CPU_JIT_OP_ALU:
+        return true;
+    case CPU_JIT_OP_JUMP:
+        return is_last;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Finds which of the first @a num_ops instructions of @a block leave flags
+ * that are read before the next ALU instruction overwrites them: by a
+ * conditional jump, by the interpreter after a side exit, or after the compiled
+ * code. The flags of the other ALU instructions are not computed.
+ * @param[out] out_live Whether the flags are live after each instruction.
+ */
+static void prv_jit_flags_liveness(const cpu_block_t *block, uint32_t num_ops,
+                                   bool *out_live) {
+    // The flags are written back at the end.
+    bool live = true;
+    for (uint32_t op_idx = num_ops; op_idx-- > 0;) {
+        const uint8_t opcode = block->ops[op_idx].instr.opcode;
+        out_live[op_idx] = live;
+        switch (prv_jit_ops[opcode]) {
+        case CPU_JIT_OP_ALU:
+            // Divisions may exit before they overwrite the flags.
+            live = opcode == CPU_OP_DIV_RR || opcode == CPU_OP_DIV_RV ||
+                   opcode == CPU_OP_IDIV_RR || opcode == CPU_OP_IDIV_RV;
+            break;
+        case CPU_JIT_OP_MEM:
+            // Loads and stores may exit.
+            live = true;
+            break;
+        case CPU_JIT_OP_JUMP:
+            if ((opcode & ~3) != CPU_OP_JMPR_V8) { live = true; }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void prv_jit_compile_op(cpu_jit_emitter_t *e, const cpu_block_op_t *op,
+                               uint32_t op_idx, bool flags_live) {
+    const cpu_instr_t *instr = &op->instr;
+    switch (prv_jit_ops[instr->opcode]) {
+    case CPU_JIT_OP_MOV:
+        if (instr->opcode == CPU_OP_MOV_VR) {
+            prv_jit_mov_imm(e,
+                            X86_GUEST_REG(instr->operands[0].reg_ref.reg_code),
+                            instr->operands[1].u32);
+        } else {
+            prv_jit_rr(e, 0x89,
+                       X86_GUEST_REG(instr->operands[1].reg_ref.reg_code),
+                       X86_GUEST_REG(instr->operands[0].reg_ref.reg_code));
+        }
+        break;
+    case CPU_JIT_OP_MEM:
+        prv_jit_compile_mem(e, instr, op_idx);
+        break;
+    case CPU_JIT_OP_ALU:
+        prv_jit_compile_alu(e, instr, op_idx, flags_live);
+        break;
+    case CPU_JIT_OP_JUMP:
+        prv_jit_compile_jump(e, op);
+        break;
+    default:
+        D_ASSERTMF(false, "cannot compile 0x%02X", instr->opcode);
+    }
+}
+
+/**
+ * Compiles an ALU instruction, following prv_cpu_execute_alu_instr(). The
+ * flags are only computed if @a flags_live.
+ */
+static void prv_jit_compile_alu(cpu_jit_emitter_t *e, const cpu_instr_t *instr,
+                                uint32_t op_idx, bool flags_live) {
+    const uint8_t opcode = instr->opcode;
+    // Comparisons only set the flags.
+    if (!flags_live && (opcode == CPU_OP_CMP_RR || opcode == CPU_OP_TST_RR ||
+                        opcode == CPU_OP_TST_RV)) {
+        return;
+    }
+    const int dst = X86_GUEST_REG(instr->operands[0].reg_ref.reg_code);
+    const bool src_is_reg = (opcode & 1) == 0;
+    const int src =
+        src_is_reg ? X86_GUEST_REG(instr->operands[1].reg_ref.reg_code) : 0;
+    const uint32_t imm = src_is_reg ? 0 : instr->operands[1].u32;
+
+    // Two-operand instructions of the form `op dst, src` with their x86
+    // opcodes (r/m32, r32) and /digit (r/m32, imm32).
+    uint8_t rr_opcode = 0;
+    int imm_digit = 0;
+    int carry_cc = X86_CC_NONE;
+    int ovf_cc = X86_CC_NONE;
+    switch (opcode) {
+    case CPU_OP_ADD_RR:
+    case CPU_OP_ADD_RV:
+        // The guest zero flag is computed from the 33-bit sum.
+        if (src_is_reg) {
+            prv_jit_rr(e, 0x01, src, dst);
+        } else {
+            prv_jit_imm(e, 0, dst, imm);
+        }
+        if (!flags_live) { return; }
+        prv_jit_setcc(e, X86_CC_E, X86_RAX);
+        prv_jit_setcc(e, X86_CC_S, X86_RCX);
+        prv_jit_setcc(e, X86_CC_B, X86_RDX);
+        prv_jit_setcc(e, X86_CC_O, X86_RSI);
+        prv_jit_u8(e, 0x38); // cmp al, dl: zero if the low half is zero
+        prv_jit_u8(e, 0xD0); // and there is no carry
+        prv_jit_setcc(e, X86_CC_A, X86_RAX);
+        prv_jit_merge_flags(e, true, true);
+        return;
+    case CPU_OP_SUB_RR:
+    case CPU_OP_SUB_RV:
+        // The guest carry flag is set when there is no borrow.
+        rr_opcode = 0x29, imm_digit = 5;
+        carry_cc = X86_CC_AE, ovf_cc = X86_CC_O;
+        break;
+    case CPU_OP_CMP_RR:
+        rr_opcode = 0x39, imm_digit = 7;
+        carry_cc = X86_CC_AE, ovf_cc = X86_CC_O;
+        break;
+    case CPU_OP_AND_RR:
+    case CPU_OP_AND_RV:
+        rr_opcode = 0x21, imm_digit = 4;
+        break;
+    case CPU_OP_OR_RR:
+    case CPU_OP_OR_RV:
+        rr_opcode = 0x09, imm_digit = 1;
+        break;
+    case CPU_OP_XOR_RR:
+    case CPU_OP_XOR_RV:
+        rr_opcode = 0x31, imm_digit = 6;
+        break;
+    case CPU_OP_TST_RR:
+        rr_opcode = 0x85;
+        break;
+
+    case CPU_OP_TST_RV:
+        prv_jit_rex(e, false, 0, dst, false); // test dst, imm
+        prv_jit_u8(e, 0xF7);
+        prv_jit_u8(e, 0xC0 | (dst & 7));
+        prv_jit_u32(e, imm);
+        prv_jit_flags(e, X86_CC_NONE, X86_CC_NONE);
+        return;
+
+    case CPU_OP_NOT_R:
+        prv_jit_rex(e, false, 0, dst, false); // not dst
+        prv_jit_u8(e, 0xF7);
+        prv_jit_u8(e, 0xD0 | (dst & 7));
+        if (!flags_live) { return; }
+        prv_jit_rr(e, 0x85, dst, dst); // test dst, dst
+        prv_jit_flags(e, X86_CC_NONE, X86_CC_NONE);
+        return;
+
+    case CPU_OP_MUL_RR:
+    case CPU_OP_MUL_RV:
+        // The guest zero flag is computed from the 64-bit product.
+        if (src_is_reg) {
+            prv_jit_rr(e, 0x89, src, X86_RCX);
+        } else {
+            prv_jit_mov_imm(e, X86_RCX, imm);
+        }
+        prv_jit_rr(e, 0x89, dst, X86_RAX);
+        prv_jit_u8(e, 0xF7); // mul ecx
+        prv_jit_u8(e, 0xE1);
+        prv_jit_rr(e, 0x89, X86_RAX, dst);
+        if (!flags_live) { return; }
+        prv_jit_rr(e, 0x85, X86_RDX, X86_RDX); // test edx, edx
+        prv_jit_setcc(e, X86_CC_NE, X86_RDX);
+        prv_jit_rr(e, 0x85, X86_RAX, X86_RAX); // test eax, eax
+        prv_jit_setcc(e, X86_CC_S, X86_RCX);
+        prv_jit_setcc(e, X86_CC_E, X86_RAX);
+        prv_jit_u8(e, 0x38); // cmp al, dl: zero if the low half is zero
+        prv_jit_u8(e, 0xD0); // and the high half is not
+        prv_jit_setcc(e, X86_CC_A, X86_RAX);
+        prv_jit_merge_flags(e, true, false);
+        return;
+
+    case CPU_OP_DIV_RR:
+    case CPU_OP_DIV_RV:
+    case CPU_OP_IDIV_RR:
+    case CPU_OP_IDIV_RV: {
+        const bool is_signed =
+            opcode == CPU_OP_IDIV_RR || opcode == CPU_OP_IDIV_RV;
+        if (src_is_reg) {
+            prv_jit_rr(e, 0x89, src, X86_RCX);
+        } else {
+            prv_jit_mov_imm(e, X86_RCX, imm);
+        }
+        // Division by zero raises an exception, and the host would trap on
+        // INT32_MIN / -1: let the interpreter run these.
+        prv_jit_rr(e, 0x85, X86_RCX, X86_RCX);
+        prv_jit_exit_if(e, X86_CC_E, op_idx);
+        if (is_signed) {
+            prv_jit_imm(e, 7, X86_RCX, UINT32_MAX); // cmp ecx, -1
+            prv_jit_exit_if(e, X86_CC_E, op_idx);
+        }
+        prv_jit_rr(e, 0x89, dst, X86_RAX);
+        if (is_signed) {
+            prv_jit_u8(e, 0x99); // cdq
+            prv_jit_u8(e, 0xF7); // idiv ecx
+            prv_jit_u8(e, 0xF9);
+        } else {
+            prv_jit_rr(e, 0x31, X86_RDX, X86_RDX); // xor edx, edx
+            prv_jit_u8(e, 0xF7);                   // div ecx
+            prv_jit_u8(e, 0xF1);
+        }
+        prv_jit_rr(e, 0x89, X86_RAX, dst);
+        if (!flags_live) { return; }
+        prv_jit_rr(e, 0x85, X86_RAX, X86_RAX);
+        prv_jit_flags(e, X86_CC_NONE, X86_CC_NONE);
+        return;
+    }
+
+    case CPU_OP_SHL_RR:
+    case CPU_OP_SHL_RV:
+    case CPU_OP_SHR_RR:
+    case CPU_OP_SHR_RV: {
+        const int digit =
+            opcode == CPU_OP_SHL_RR || opcode == CPU_OP_SHL_RV ? 4 : 5;
+        if (!src_is_reg) {
+            const uint8_t num_bits = instr->operands[1].imm5 & 31;
+            if (num_bits == 0) {
+                if (!flags_live) { return; }
+                // x86 leaves the flags alone, the guest clears the carry.
+                prv_jit_rr(e, 0x85, dst, dst);
+                prv_jit_flags(e, X86_CC_NONE, X86_CC_NONE);
+                return;
+            }
+            prv_jit_rex(e, false, 0, dst, false); // shl/shr dst, num_bits
+            prv_jit_u8(e, 0xC1);
+            prv_jit_u8(e, 0xC0 | (digit << 3) | (dst & 7));
+            prv_jit_u8(e, num_bits);
+            if (flags_live) { prv_jit_flags(e, X86_CC_B, X86_CC_NONE); }
+            return;
+        }
+
+        prv_jit_rr(e, 0x89, src, X86_RCX);
+        if (!flags_live) {
+            // x86 masks the count to 5 bits like the guest.
+            prv_jit_rex(e, false, 0, dst, false); // shl/shr dst, cl
+            prv_jit_u8(e, 0xD3);
+            prv_jit_u8(e, 0xC0 | (digit << 3) | (dst & 7));
+            return;
+        }
+        prv_jit_imm(e, 4, X86_RCX, 31); // and ecx, 31
+        prv_jit_u8(e, 0x74);            // jz no_shift
+        const size_t jz_rel = e->size;
+        prv_jit_u8(e, 0);
+        prv_jit_rex(e, false, 0, dst, false); // shl/shr dst, cl
+        prv_jit_u8(e, 0xD3);
+        prv_jit_u8(e, 0xC0 | (digit << 3) | (dst & 7));
+        prv_jit_setcc(e, X86_CC_B, X86_RDX);
+        prv_jit_u8(e, 0xEB); // jmp done
+        const size_t jmp_rel = e->size;
+        prv_jit_u8(e, 0);
+        // no_shift:
+        e->buf[jz_rel] = (uint8_t)(e->size - (jz_rel + 1));
+        prv_jit_rr(e, 0x31, X86_RDX, X86_RDX); // xor edx, edx
+        // done:
+        e->buf[jmp_rel] = (uint8_t)(e->size - (jmp_rel + 1));
+        prv_jit_rr(e, 0x85, dst, dst);
+        prv_jit_setcc(e, X86_CC_E, X86_RAX);
+        prv_jit_setcc(e, X86_CC_S, X86_RCX);
+        prv_jit_merge_flags(e, true, false);
+        return;
+    }
+
+    default:
+        D_ASSERTMF(false, "cannot compile 0x%02X", opcode);
+        return;
+    }
+
+    if (src_is_reg) {
+        prv_jit_rr(e, rr_opcode, src, dst);
+    } else {
+        prv_jit_imm(e, imm_digit, dst, imm);
+    }
+    if (flags_live) { prv_jit_flags(e, carry_cc, ovf_cc); }
+}
+
+/// Compiles a load or a store, following prv_cpu_execute_data_instr().
+static void prv_jit_compile_mem(cpu_jit_emitter_t *e, const cpu_instr_t *instr,
+                                uint32_t op_idx) {
+    const cpu_opd_val_t *opds = instr->operands;
+    const bool is_store = instr->opcode <= CPU_OP_STR_RIR;
+
+    // Address into eax, and the register operand.
+    cpu_reg_ref_t reg;
+    switch (instr->opcode) {
+    case CPU_OP_STR_RV0:
+        prv_jit_mov_imm(e, X86_RAX, opds[0].u32);
+        reg = opds[1].reg_ref;
+        break;
+    case CPU_OP_LDR_RV0:
+        prv_jit_mov_imm(e, X86_RAX, opds[1].u32);
+        reg = opds[0].reg_ref;
+        break;
+    default: {
+        const size_t mem_opd = is_store ? 0 : 1;
+        const size_t off_opd = is_store ? 1 : 2;
+        prv_jit_rr(e, 0x89, X86_GUEST_REG(opds[mem_opd].reg_ref.reg_code),
+                   X86_RAX);
+        switch (instr->opcode) {
+        case CPU_OP_STR_RI8:
+        case CPU_OP_LDR_RI8:
+            prv_jit_imm(e, 0, X86_RAX,
+                        (uint32_t)(int32_t)(int8_t)opds[off_opd].u8);
+            break;
+        case CPU_OP_STR_RI32:
+        case CPU_OP_LDR_RI32:
+            prv_jit_imm(e, 0, X86_RAX, opds[off_opd].u32);
+            break;
+        case CPU_OP_STR_RIR:
+        case CPU_OP_LDR_RIR:
+            prv_jit_rr(e, 0x01,
+                       X86_GUEST_REG(opds[off_opd].reg_ref.reg_code), X86_RAX);
+            break;
+        default:
+            break;
+        }
+        reg = is_store ? opds[instr->desc->num_operands - 1].reg_ref
+                       : opds[0].reg_ref;
+        break;
+    }
+    }
+
+    const bool is_u8 = reg.access_size == CPU_REG_SIZE_8;
+    const uint32_t size = is_u8 ? 1 : 4;
+    if (is_store) {
+        // Stores to code are left to the interpreter, which invalidates the
+        // overwritten instructions.
+        // Check the pages of the first and the last byte, see
+        // mem_page_bitmap_test().
+        const uint32_t offsets[] = {0, size - 1};
+        for (size_t idx = 0; idx < (size > 1 ? 2 : 1); idx++) {
+            prv_jit_mem(e, true, 0x8B, X86_RDX, X86_RDI, CPU_OFF(icache));
+            prv_jit_rr(e, 0x89, X86_RAX, X86_RCX); // mov ecx, eax
+            if (offsets[idx]) { prv_jit_imm(e, 0, X86_RCX, offsets[idx]); }
+            prv_jit_u8(e, 0xC1); // shr ecx, CPU_ICACHE_PAGE_SHIFT
+            prv_jit_u8(e, 0xE9);
+            prv_jit_u8(e, CPU_ICACHE_PAGE_SHIFT);
+            prv_jit_rr(e, 0x89, X86_RCX, X86_RSI); // mov esi, ecx
+            prv_jit_u8(e, 0xC1); // shr esi, MEM_PAGE_BITMAP_LEAF_SHIFT
+            prv_jit_u8(e, 0xEE);
+            prv_jit_u8(e, MEM_PAGE_BITMAP_LEAF_SHIFT);
+            // mov rdx, [rdx + rsi * 8 + code_pages.leaves]
+            prv_jit_u8(e, 0x48);
+            prv_jit_u8(e, 0x8B);
+            prv_jit_u8(e, 0x94);
+            prv_jit_u8(e, 0xF2);
+            prv_jit_u32(e, offsetof(cpu_icache_t, code_pages.leaves));
+            prv_jit_rex(e, true, X86_RDX, X86_RDX, false); // test rdx, rdx
+            prv_jit_u8(e, 0x85);
+            prv_jit_u8(e, 0xD2);
+            prv_jit_u8(e, 0x74); // jz over the bit test
+            const size_t skip_fixup = e->size;
+            prv_jit_u8(e, 0);
+            // and ecx, MEM_PAGE_BITMAP_LEAF_BITS - 1; bt [rdx], rcx
+            prv_jit_imm(e, 4, X86_RCX, MEM_PAGE_BITMAP_LEAF_BITS - 1);
+            prv_jit_mem(e, true, 0x0FA3, X86_RCX, X86_RDX, 0);
+            prv_jit_exit_if(e, X86_CC_B, op_idx);
+            if (skip_fixup < CPU_JIT_BUF_SIZE) {
+                e->buf[skip_fixup] = (uint8_t)(e->size - (skip_fixup + 1));
+            }
+        }
+    }
+    prv_jit_mem_check(e, is_store ? CPU_TLB_STORE : CPU_TLB_LOAD, size,
+                      op_idx);
+
+    // mov [rsi + rcx], reg / mov reg, [rsi + rcx]
+    const int host_reg = X86_GUEST_REG(reg.reg_code);
+    prv_jit_rex(e, false, host_reg, 0, false);
+    prv_jit_u8(e, (is_store ? 0x88 : 0x8A) | (is_u8 ? 0 : 1));
+    prv_jit_u8(e, 0x04 | ((host_reg & 7) << 3));
+    prv_jit_u8(e, 0x0E);
+}
+
+/**
+ * Checks that the address in eax can be accessed directly through the TLB
+ * entry of kind @a kind, leaves the host pointer in rsi and the offset in rcx.
+ * Follows cpu_mem_read_u8() and the other accessors of @ref cpu_mem.h.
+ */
+static void prv_jit_mem_check(cpu_jit_emitter_t *e, cpu_tlb_kind_t kind,
+                              uint32_t size, uint32_t op_idx) {
+    prv_jit_mem(e, true, 0x8B, X86_RSI, X86_RDI, TLB_OFF(kind, span.ptr));
+    prv_jit_u8(e, 0x48); // test rsi, rsi (REX.W)
+    prv_jit_rr(e, 0x85, X86_RSI, X86_RSI);
+    prv_jit_exit_if(e, X86_CC_E, op_idx);
+
+    // The entry must be current.
+    prv_jit_mem(e, true, 0x8B, X86_RDX, X86_RDI, TLB_OFF(kind, span.p_gen));
+    prv_jit_u8(e, 0x8B); // mov edx, [rdx]
+    prv_jit_u8(e, 0x12);
+    prv_jit_mem(e, false, 0x3B, X86_RDX, X86_RDI, TLB_OFF(kind, gen));
+    prv_jit_exit_if(e, X86_CC_NE, op_idx);
+
+    // The address must be in the span, and so must the last byte.
+    prv_jit_rr(e, 0x89, X86_RAX, X86_RCX);
+    prv_jit_mem(e, false, 0x2B, X86_RCX, X86_RDI, TLB_OFF(kind, span.start));
+    prv_jit_mem(e, false, 0x8B, X86_RDX, X86_RDI, TLB_OFF(kind, span.end));
+    prv_jit_mem(e, false, 0x2B, X86_RDX, X86_RDI, TLB_OFF(kind, span.start));
+    prv_jit_rr(e, 0x39, X86_RDX, X86_RCX); // cmp ecx, edx
+    prv_jit_exit_if(e, X86_CC_AE, op_idx);
+    if (size > 1) {
+        prv_jit_mem(e, false, 0x8B, X86_RDX, X86_RDI, TLB_OFF(kind, span.end));
+        prv_jit_rr(e, 0x29, X86_RAX, X86_RDX); // sub edx, eax
+        prv_jit_imm(e, 7, X86_RDX, size);      // cmp edx, size
+        prv_jit_exit_if(e, X86_CC_B, op_idx);
+    }
+}
+
+/// Compiles the jump ending a block, following prv_cpu_execute_flow_instr().
+static void prv_jit_compile_jump(cpu_jit_emitter_t *e,
+                                 const cpu_block_op_t *op) {
+    const cpu_instr_t *instr = &op->instr;
+    const uint8_t cond = instr->opcode & ~3;
+
+    prv_jit_mov_imm(e, X86_RAX, op->next_pc);
+    switch (instr->opcode & 3) {
+    case 0:
+        prv_jit_mov_imm(e, X86_RDX,
+                        instr->start_addr + (int8_t)instr->operands[0].u8);
+        break;
+    case 1:
+        prv_jit_mov_imm(e, X86_RDX, instr->operands[0].u32);
+        break;
+    default:
+        prv_jit_rr(e, 0x89, X86_GUEST_REG(instr->operands[0].reg_ref.reg_code),
+                   X86_RDX);
+        break;
+    }
+
+    // Leave ZF clear if the jump is taken, from the guest flags in ebx.
+    bool taken_if_nz = true;
+    switch (cond) {
+    case CPU_OP_JEQR_V8:
+    case CPU_OP_JNER_V8:
+        prv_jit_u8(e, 0xF7); // test ebx, CPU_FLAG_ZERO
+        prv_jit_u8(e, 0xC3);
+        prv_jit_u32(e, CPU_FLAG_ZERO);
+        taken_if_nz = cond == CPU_OP_JEQR_V8;
+        break;
+    case CPU_OP_JGER_V8:
+    case CPU_OP_JLTR_V8:
+    case CPU_OP_JGTR_V8:
+    case CPU_OP_JLER_V8:
+        // ecx = (flags ^ (flags >> 2)) & CPU_FLAG_SIGN: sign ^ overflow
+        static_assert(CPU_FLAG_OVERFLOW == CPU_FLAG_SIGN << 2);
+        prv_jit_rr(e, 0x89, X86_RBX, X86_RCX);
+        prv_jit_u8(e, 0xC1); // shr ecx, 2
+        prv_jit_u8(e, 0xE9);
+        prv_jit_u8(e, 2);
+        prv_jit_rr(e, 0x31, X86_RBX, X86_RCX);
+        prv_jit_imm(e, 4, X86_RCX, CPU_FLAG_SIGN);
+        if (cond == CPU_OP_JGTR_V8 || cond == CPU_OP_JLER_V8) {
+            prv_jit_rr(e, 0x89, X86_RBX, X86_RSI);
+            prv_jit_imm(e, 4, X86_RSI, CPU_FLAG_ZERO);
+            prv_jit_rr(e, 0x09, X86_RSI, X86_RCX);
+        }
+        taken_if_nz = cond == CPU_OP_JLTR_V8 || cond == CPU_OP_JLER_V8;
+        break;
+    default:
+        // Unconditional jump.
+        prv_jit_rr(e, 0x89, X86_RDX, X86_RAX);
+        goto JUMP_STORE_PC;
+    }
+    // cmovnz/cmovz eax, edx
+    prv_jit_u8(e, 0x0F);
+    prv_jit_u8(e, 0x40 + (taken_if_nz ? X86_CC_NE : X86_CC_E));
+    prv_jit_u8(e, 0xC0 | (X86_RAX << 3) | X86_RDX);
+
+JUMP_STORE_PC:
+    prv_jit_mem(e, false, 0x89, X86_RAX, X86_RDI, CPU_OFF(reg_pc));
+}
+
+static void prv_jit_u8(cpu_jit_emitter_t *e, uint8_t val) {
+    if (e->size < CPU_JIT_BUF_SIZE) {
+        e->buf[e->size++] = val;
+    } else {
+        e->overflow = true;
+    }
+}
+
+static void prv_jit_u32(cpu_jit_emitter_t *e, uint32_t val) {
+    for (int byte = 0; byte < 4; byte++) {
+        prv_jit_u8(e, (uint8_t)(val >> (8 * byte)));
+    }
+}
+
+/// Emits a REX prefix if needed, @a force is needed to access sil and dil.
+static void prv_jit_rex(cpu_jit_emitter_t *e, bool wide, int reg, int rm,
+                        bool force) {
+    const uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40 || force) { prv_jit_u8(e, rex); }
+}
+
+/// Emits `opcode r/m32, r32` or `opcode r32, r/m32` with two registers.
+static void prv_jit_rr(cpu_jit_emitter_t *e, uint8_t opcode, int reg, int rm) {
+    prv_jit_rex(e, false, reg, rm, false);
+    prv_jit_u8(e, opcode);
+    prv_jit_u8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/**
+ * Emits `opcode` with a `[base + disp32]` memory operand.
+ * @param opcode One-byte opcode, or two-byte opcode starting with `0x0F`.
+ */
+static void prv_jit_mem(cpu_jit_emitter_t *e, bool wide, uint16_t opcode,
+                        int reg, int base, uint32_t disp) {
+    D_ASSERT(base == X86_RDI || base == X86_RDX);
+    prv_jit_rex(e, wide, reg, base, false);
+    if (opcode > 0xFF) { prv_jit_u8(e, 0x0F); }
+    prv_jit_u8(e, (uint8_t)opcode);
+    prv_jit_u8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    prv_jit_u32(e, disp);
+}
+
+/// Emits `op r/m32, imm32` of the 0x81 group.
+static void prv_jit_imm(cpu_jit_emitter_t *e, int digit, int rm, uint32_t imm) {
+    prv_jit_rex(e, false, 0, rm, false);
+    prv_jit_u8(e, 0x81);
+    prv_jit_u8(e, 0xC0 | (digit << 3) | (rm & 7));
+    prv_jit_u32(e, imm);
+}
+
+static void prv_jit_mov_imm(cpu_jit_emitter_t *e, int reg, uint32_t imm) {
+    prv_jit_rex(e, false, 0, reg, false);
+    prv_jit_u8(e, 0xB8 + (reg & 7));
+    prv_jit_u32(e, imm);
+}
+
+/// Emits `setcc` into the low byte of @a reg.
+static void prv_jit_setcc(cpu_jit_emitter_t *e, int cc, int reg) {
+    prv_jit_rex(e, false, 0, reg, reg >= 4);
+    prv_jit_u8(e, 0x0F);
+    prv_jit_u8(e, 0x90 + cc);
+    prv_jit_u8(e, 0xC0 | (reg & 7));
+}
+
+/**
+ * Sets the guest flags from the host flags of the last instruction: zero and
+ * sign, and carry and overflow from the host conditions @a carry_cc and
+ * @a ovf_cc, or cleared if they are #X86_CC_NONE.
+ */
+static void prv_jit_flags(cpu_jit_emitter_t *e, int carry_cc, int ovf_cc) {
+    prv_jit_setcc(e, X86_CC_E, X86_RAX);
+    prv_jit_setcc(e, X86_CC_S, X86_RCX);
+    if (carry_cc != X86_CC_NONE) { prv_jit_setcc(e, carry_cc, X86_RDX); }
+    if (ovf_cc != X86_CC_NONE) { prv_jit_setcc(e, ovf_cc, X86_RSI); }
+    prv_jit_merge_flags(e, carry_cc != X86_CC_NONE, ovf_cc != X86_CC_NONE);
+}
+
+/**
+ * Replaces the guest flags in ebx by al (zero), cl (sign), dl (carry, if
+ * @a carry) and sil (overflow, if @a ovf), each one being 0 or 1.
+ */
+static void prv_jit_merge_flags(cpu_jit_emitter_t *e, bool carry, bool ovf) {
+    static const struct {
+        int reg;
+        int shift;
+    } bits[] = {{X86_RCX, 1}, {X86_RDX, 2}, {X86_RSI, 3}};
+
+    prv_jit_u8(e, 0x0F); // movzx eax, al
+    prv_jit_u8(e, 0xB6);
+    prv_jit_u8(e, 0xC0);
+    for (size_t idx = 0; idx < 3; idx++) {
+        if ((bits[idx].reg == X86_RDX && !carry) ||
+            (bits[idx].reg == X86_RSI && !ovf)) {
+            continue;
+        }
+        // movzx ecx, cl/dl/sil; shl ecx, shift; or eax, ecx
+        prv_jit_rex(e, false, X86_RCX, bits[idx].reg, bits[idx].reg >= 4);
+        prv_jit_u8(e, 0x0F);
+        prv_jit_u8(e, 0xB6);
+        prv_jit_u8(e, 0xC0 | (X86_RCX << 3) | bits[idx].reg);
+        prv_jit_u8(e, 0xC1);
+        prv_jit_u8(e, 0xE1);
+        prv_jit_u8(e, (uint8_t)bits[idx].shift);
+        prv_jit_rr(e, 0x09, X86_RCX, X86_RAX);
+    }
+    prv_jit_imm(e, 4, X86_RBX, ~(uint32_t)0xF); // and ebx, ~0xF
+    prv_jit_rr(e, 0x09, X86_RAX, X86_RBX);      // or ebx, eax
+}
+
+/// Leaves the code before @a op_idx if the host condition @a cc is met.
+static void prv_jit_exit_if(cpu_jit_emitter_t *e, int cc, uint32_t op_idx) {
+    prv_jit_u8(e, 0x0F);
+    prv_jit_u8(e, 0x80 + cc);
+    if (e->num_exits < CPU_JIT_MAX_EXITS) {
+        e->exit_fixups[e->num_exits] = e->size;
+        e->exit_ops[e->num_exits] = op_idx;
+        e->num_exits++;
+    } else {
+        e->overflow = true;
+    }
+    prv_jit_u32(e, 0);
+}
+
+#else // !CPU_JIT_SUPPORTED
+
+cpu_jit_t *cpu_jit_new(void) {
+    return NULL;
+}
+
+void cpu_jit_free(cpu_jit_t *jit) {
+    (void)jit;
+    D_ASSERTM(false, "JIT is not supported");
+}
+
+bool cpu_jit_is_supported(void) {
+    return false;
+}
+
+bool cpu_jit_compile(cpu_jit_t *jit, cpu_blocks_t *blocks, cpu_block_t *block) {
+    (void)jit;
+    (void)blocks;
+    (void)block;
+    return false;
+}
+
+#endif // CPU_JIT_SUPPORTED
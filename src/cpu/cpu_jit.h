@@ -0,0 +1,47 @@
+/**
+ * @file cpu_jit.h
+ * Native code compiler for hot basic blocks, used by the #CPU_ENGINE_JIT
+ * engine.
+ *
+ * A block that has been run #CPU_JIT_HOT_THRESHOLD times is compiled to host
+ * code. Only a prefix of the block made of supported instructions (moves, ALU
+ * instructions except rotations, loads and stores, jumps) is compiled, the
+ * rest of the block is run by the block interpreter.
+ *
+ * The compiled code works on the guest registers and flags kept in host
+ * registers. It accesses memory only through the direct pointers of the
+ * current TLB entries (see @ref cpu_mem.h), and never stores to a code page.
+ * Whenever an instruction cannot be executed that way (MMIO, TLB miss, store to
+ * code, division by zero, ...), the code writes the guest state back and
+ * returns the index of that instruction, so that the block interpreter runs it
+ * and reports errors the same way.
+ *
+ * The compiler is only implemented for x86-64 Linux hosts, elsewhere
+ * #cpu_jit_new() fails and the engine behaves like #CPU_ENGINE_BLOCKS.
+ */
+
+#pragma once
+
+#include <fcvm/cpu.h>
+
+#include "cpu_block.h"
+
+/// Number of runs after which a block is compiled.
+#define CPU_JIT_HOT_THRESHOLD 16
+/// Size of the executable memory, all the code is dropped when it is full.
+#define CPU_JIT_CODE_SIZE (1024 * 1024)
+
+/**
+ * Creates a compiler with its own executable memory.
+ * @returns The new compiler, or NULL if the host is not supported or
+ * executable memory cannot be allocated.
+ */
+cpu_jit_t *cpu_jit_new(void);
+void cpu_jit_free(cpu_jit_t *jit);
+
+/**
+ * Compiles @a block, setting @ref cpu_block_t.jit_fn on success.
+ * Every block of @a blocks loses its code if the executable memory is full.
+ * @returns `true` if some code has been generated.
+ */
+bool cpu_jit_compile(cpu_jit_t *jit, cpu_blocks_t *blocks, cpu_block_t *block);
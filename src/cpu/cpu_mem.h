@@ -0,0 +1,144 @@
+/**
+ * @file cpu_mem.h
+ * CPU memory access helpers.
+ *
+ * The CPU keeps a tiny software TLB in @ref cpu_ctx_t.tlb: one entry per
+ * access kind (instruction fetch, load, store), each holding the span of the
+ * memory region that the last access of that kind has resolved to (see
+ * #mem_span_t). An access that falls into the span skips the memory
+ * controller lookup, and either copies the bytes from the host buffer if the
+ * region allows direct access, or calls the region callbacks directly.
+ *
+ * An entry is refilled through @ref mem_if_t.get_span on a miss, and goes
+ * stale when the mapping generation counter of its span changes. Whenever an
+ * access cannot be served by the TLB, it falls back to the #mem_if_t callbacks
+ * of the CPU, so the errors are reported the same way as without the TLB.
+ *
+ * Every store is also reported to the predecoded instruction cache (see
+ * @ref cpu_icache.h), whether it succeeds or not.
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <fcvm/cpu.h>
+
+#include "cpu_icache.h"
+#include "debugm.h"
+
+/**
+ * Generation counter of the spans whose mapping never changes. It lives
+ * outside of the context so that the TLB stays valid in a copy of it.
+ */
+extern const uint32_t cpu_tlb_fixed_gen;
+
+/**
+ * Finds the TLB entry of kind @a kind that contains @a addr, refilling it if
+ * needed.
+ * @returns The entry, or NULL if the access must go through @ref cpu_ctx_t.mem.
+ */
+static inline cpu_tlb_entry_t *cpu_tlb_lookup(cpu_ctx_t *cpu,
+                                              cpu_tlb_kind_t kind,
+                                              vm_addr_t addr) {
+    cpu_tlb_entry_t *entry = &cpu->tlb[kind];
+    mem_span_t *span = &entry->span;
+    if ((addr - span->start) < (span->end - span->start) &&
+        *span->p_gen == entry->gen) {
+        return entry;
+    }
+
+    // The optional fields of the span must not be left from the last one.
+    memset(span, 0, sizeof(*span));
+    if (!cpu->mem->get_span || !cpu->mem->get_span(cpu->mem, addr, span)) {
+        memset(entry, 0, sizeof(*entry));
+        return NULL;
+    }
+    D_ASSERT(span->mem_if);
+
+    const uint8_t perm =
+        kind == CPU_TLB_STORE ? MEM_DIRECT_WRITE : MEM_DIRECT_READ;
+    if (!(span->perms & perm)) { span->ptr = NULL; }
+    if (!span->p_gen) { span->p_gen = &cpu_tlb_fixed_gen; }
+    entry->gen = *span->p_gen;
+    return entry;
+}
+
+static inline vm_err_t cpu_mem_read_u8(cpu_ctx_t *cpu, cpu_tlb_kind_t kind,
+                                       vm_addr_t addr, uint8_t *out) {
+    const cpu_tlb_entry_t *entry = cpu_tlb_lookup(cpu, kind, addr);
+    if (entry) {
+        const mem_span_t *span = &entry->span;
+        if (span->ptr) {
+            *out = span->ptr[addr - span->start];
+            return VM_ERR_NONE;
+        }
+        if (span->mem_if->read_u8) {
+            return span->mem_if->read_u8(span->ctx, addr - span->cb_base, out);
+        }
+    }
+    return cpu->mem->read_u8(cpu->mem, addr, out);
+}
+
+static inline vm_err_t cpu_mem_read_u32(cpu_ctx_t *cpu, cpu_tlb_kind_t kind,
+                                        vm_addr_t addr, uint32_t *out) {
+    const cpu_tlb_entry_t *entry = cpu_tlb_lookup(cpu, kind, addr);
+    if (entry && entry->span.end - addr >= 4) {
+        const mem_span_t *span = &entry->span;
+        if (span->ptr) {
+            memcpy(out, &span->ptr[addr - span->start], 4);
+            return VM_ERR_NONE;
+        }
+        if (span->mem_if->read_u32) {
+            return span->mem_if->read_u32(span->ctx, addr - span->cb_base, out);
+        }
+    }
+    return cpu->mem->read_u32(cpu->mem, addr, out);
+}
+
+static inline vm_err_t cpu_mem_write_u8(cpu_ctx_t *cpu, vm_addr_t addr,
+                                        uint8_t val) {
+    cpu_icache_note_store(cpu->icache, addr, 1);
+    const cpu_tlb_entry_t *entry = cpu_tlb_lookup(cpu, CPU_TLB_STORE, addr);
+    if (entry) {
+        const mem_span_t *span = &entry->span;
+        if (span->ptr) {
+            span->ptr[addr - span->start] = val;
+            return VM_ERR_NONE;
+        }
+        if (span->mem_if->write_u8) {
+            return span->mem_if->write_u8(span->ctx, addr - span->cb_base, val);
+        }
+    }
+    // The memory interface may report the store back with
+    // #cpu_note_code_write(), which must not count it twice.
+    cpu->icache->own_store_addr = addr;
+    cpu->icache->own_store_size = 1;
+    const vm_err_t err = cpu->mem->write_u8(cpu->mem, addr, val);
+    cpu->icache->own_store_size = 0;
+    return err;
+}
+
+static inline vm_err_t cpu_mem_write_u32(cpu_ctx_t *cpu, vm_addr_t addr,
+                                         uint32_t val) {
+    cpu_icache_note_store(cpu->icache, addr, 4);
+    const cpu_tlb_entry_t *entry = cpu_tlb_lookup(cpu, CPU_TLB_STORE, addr);
+    if (entry && entry->span.end - addr >= 4) {
+        const mem_span_t *span = &entry->span;
+        if (span->ptr) {
+            memcpy(&span->ptr[addr - span->start], &val, 4);
+            return VM_ERR_NONE;
+        }
+        if (span->mem_if->write_u32) {
+            return span->mem_if->write_u32(span->ctx, addr - span->cb_base,
+                                           val);
+        }
+    }
+    // The memory interface may report the store back with
+    // #cpu_note_code_write(), which must not count it twice.
+    cpu->icache->own_store_addr = addr;
+    cpu->icache->own_store_size = 4;
+    const vm_err_t err = cpu->mem->write_u32(cpu->mem, addr, val);
+    cpu->icache->own_store_size = 0;
+    return err;
+}
@@ -3,6 +3,7 @@
  * CPU stack operations implementation.
  */
 
+#include "cpu_mem.h"
 #include "cpu_stack.h"
 #include "debugm.h"
 
@@ -10,7 +11,7 @@ vm_err_t cpu_stack_push_u32(cpu_ctx_t *cpu, uint32_t val) {
     D_ASSERT(cpu != NULL);
     if (cpu->reg_sp >= 4) {
         cpu->reg_sp -= 4;
-        return cpu->mem->write_u32(cpu->mem, cpu->reg_sp, val);
+        return cpu_mem_write_u32(cpu, cpu->reg_sp, val);
     } else {
         vm_err_t err = VM_ERR_STACK_OVERFLOW;
         return err;
@@ -19,7 +20,7 @@ vm_err_t cpu_stack_push_u32(cpu_ctx_t *cpu, uint32_t val) {
 
 vm_err_t cpu_stack_pop_u32(cpu_ctx_t *cpu, uint32_t *out_val) {
     D_ASSERT(cpu != NULL);
-    vm_err_t err = cpu->mem->read_u32(cpu->mem, cpu->reg_sp, out_val);
+    vm_err_t err = cpu_mem_read_u32(cpu, CPU_TLB_LOAD, cpu->reg_sp, out_val);
     if (err == VM_ERR_NONE) {
         if (cpu->reg_sp <= 0xFFFFFFFF - 4) {
             cpu->reg_sp += 4;
@@ -0,0 +1,22 @@
+/**
+ * @file cpu_tier.c
+ * Hotness counters of the tiered engine.
+ *
+ * The promotions themselves are done by @ref cpu.c.
+ */
+
+#include <stdlib.h>
+
+#include "cpu_tier.h"
+#include "debugm.h"
+
+cpu_tiers_t *cpu_tiers_new(void) {
+    cpu_tiers_t *tiers = calloc(1, sizeof(*tiers));
+    D_ASSERT(tiers);
+    return tiers;
+}
+
+void cpu_tiers_free(cpu_tiers_t *tiers) {
+    D_ASSERT(tiers);
+    free(tiers);
+}
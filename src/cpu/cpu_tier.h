@@ -0,0 +1,42 @@
+/**
+ * @file cpu_tier.h
+ * Hotness counters of the #CPU_ENGINE_TIERED engine.
+ *
+ * Code starts cold: it is run by the instruction interpreter one would-be
+ * block at a time, and the runs of each block address are counted in a small
+ * direct-mapped table. The table has no tags, a collision only makes some code
+ * warm earlier. Once the code at an address has run
+ * @ref cpu_tier_cfg_t.warm_runs times, its block is built and run by the block
+ * engine. The runs of blocks, and their entries through loop back-edges, are
+ * counted in the blocks themselves (see @ref cpu_block_t.num_runs) until they
+ * are hot enough to be compiled.
+ */
+
+#pragma once
+
+#include <fcvm/cpu.h>
+
+/// Number of cold code counters, must be a power of two.
+#define CPU_TIER_NUM_COUNTERS 512
+
+struct cpu_tiers {
+    /// Interpreted runs of the code at each block address, saturating.
+    uint16_t cold_runs[CPU_TIER_NUM_COUNTERS];
+};
+
+cpu_tiers_t *cpu_tiers_new(void);
+void cpu_tiers_free(cpu_tiers_t *tiers);
+
+/**
+ * Counts an interpreted run of the code at @a pc.
+ * @returns `true` if the code is warm: it has already run at least
+ * @a warm_runs times.
+ */
+static inline bool cpu_tiers_count_cold(cpu_tiers_t *tiers, vm_addr_t pc,
+                                        uint32_t warm_runs) {
+    uint16_t *runs = &tiers->cold_runs[pc & (CPU_TIER_NUM_COUNTERS - 1)];
+    if (*runs >= warm_runs) { return true; }
+    // Thresholds above UINT16_MAX keep the code cold.
+    if (*runs < UINT16_MAX) { (*runs)++; }
+    return false;
+}
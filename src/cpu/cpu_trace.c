@@ -0,0 +1,187 @@
+/**
+ * @file cpu_trace.c
+ * CPU instruction trace ring buffer.
+ *
+ * The ring is indexed by two monotonic record counters: @c head is only
+ * written by the producer (the CPU) and @c tail is only written by the
+ * consumer. The producer never waits for the consumer and overwrites the
+ * oldest records instead. The consumer copies the records first and checks
+ * afterwards that the producer has not overwritten them in the meantime, like a
+ * sequence lock reader.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcvm/cpu_trace.h>
+
+#include "debugm.h"
+
+struct cpu_trace {
+    uint64_t mask;    //!< Capacity minus one.
+    uint64_t head;    //!< Number of records ever written.
+    uint64_t claimed; //!< Number of records ever started being written.
+    uint64_t tail;    //!< Number of records ever consumed or lost.
+    cpu_trace_rec_t recs[];
+};
+
+cpu_trace_t *cpu_trace_new(size_t num_recs) {
+    D_ASSERTM(num_recs > 0 && (num_recs & (num_recs - 1)) == 0,
+              "trace capacity must be a power of two");
+    cpu_trace_t *trace =
+        malloc(sizeof(*trace) + num_recs * sizeof(*trace->recs));
+    D_ASSERT(trace);
+    memset(trace, 0, sizeof(*trace) + num_recs * sizeof(*trace->recs));
+    trace->mask = num_recs - 1;
+    return trace;
+}
+
+void cpu_trace_free(cpu_trace_t *trace) {
+    D_ASSERT(trace);
+    free(trace);
+}
+
+void cpu_trace_record(cpu_trace_t *trace, const cpu_instr_t *instr,
+                      uint8_t flags, uint64_t cycle) {
+    D_ASSERT(trace);
+    D_ASSERT(instr);
+    D_ASSERT(instr->desc);
+
+    const uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+    // Announce the write before the slot of an unread record starts being
+    // overwritten, so that the consumer can detect it.
+    __atomic_store_n(&trace->claimed, head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    cpu_trace_rec_t *rec = &trace->recs[head & trace->mask];
+    rec->cycle = cycle;
+    rec->pc = instr->start_addr;
+    rec->opcode = instr->opcode;
+    rec->flags = flags;
+    for (size_t opd = 0; opd < CPU_MAX_OPERANDS; opd++) {
+        uint32_t val = 0;
+        if (opd < instr->desc->num_operands) {
+            switch (instr->desc->operands[opd]) {
+            case CPU_OPD_REG:
+                val = instr->operands[opd].reg_ref.encoded_ref;
+                break;
+            case CPU_OPD_IMM5:
+                val = instr->operands[opd].imm5;
+                break;
+            case CPU_OPD_IMM8:
+                val = instr->operands[opd].u8;
+                break;
+            case CPU_OPD_IMM32:
+                val = instr->operands[opd].u32;
+                break;
+            }
+        }
+        rec->operands[opd] = val;
+    }
+
+    __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+size_t cpu_trace_drain(cpu_trace_t *trace, cpu_trace_rec_t *out_recs,
+                       size_t max_recs, size_t *out_num_lost) {
+    D_ASSERT(trace);
+    D_ASSERT(out_recs || max_recs == 0);
+    const uint64_t capacity = trace->mask + 1;
+    uint64_t tail = trace->tail;
+    size_t num_lost = 0;
+
+    // Skip the records that have already been overwritten.
+    const uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    if (head - tail > capacity) {
+        num_lost += head - capacity - tail;
+        tail = head - capacity;
+    }
+
+    size_t num_read = head - tail;
+    if (num_read > max_recs) { num_read = max_recs; }
+    for (size_t idx = 0; idx < num_read; idx++) {
+        out_recs[idx] = trace->recs[(tail + idx) & trace->mask];
+    }
+
+    // The producer might have overwritten some of the copied records. Once it
+    // has claimed N records, the records before N - capacity are gone.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    const uint64_t claimed = __atomic_load_n(&trace->claimed, __ATOMIC_RELAXED);
+    if (claimed > capacity && tail < claimed - capacity) {
+        size_t num_torn = claimed - capacity - tail;
+        if (num_torn > num_read) { num_torn = num_read; }
+        memmove(out_recs, &out_recs[num_torn],
+                (num_read - num_torn) * sizeof(*out_recs));
+        num_lost += num_torn;
+        num_read -= num_torn;
+        tail += num_torn;
+    }
+
+    trace->tail = tail + num_read;
+    if (out_num_lost) { *out_num_lost = num_lost; }
+    return num_read;
+}
+
+int cpu_trace_format_rec(const cpu_trace_rec_t *rec, char *out_buf,
+                         size_t size) {
+    D_ASSERT(rec);
+    D_ASSERT(out_buf || size == 0);
+    const cpu_instr_desc_t *desc = cpu_lookup_instr_desc(rec->opcode);
+    size_t len = 0;
+
+#define PRV_APPEND(...)                                                        \
+    len += snprintf(len < size ? &out_buf[len] : NULL,                         \
+                    len < size ? size - len : 0, __VA_ARGS__)
+
+    PRV_APPEND("%08X | %02X %4s", rec->pc, rec->opcode,
+               desc ? desc->mnemonic : "????");
+    const size_t num_operands = desc ? desc->num_operands : 0;
+    for (size_t opd = 0; opd < num_operands; opd++) {
+        if (opd == 0) { PRV_APPEND(" ["); }
+        switch (desc->operands[opd]) {
+        case CPU_OPD_REG:
+            PRV_APPEND("regref %02X", rec->operands[opd]);
+            break;
+        case CPU_OPD_IMM5:
+            PRV_APPEND("imm5 %02X", rec->operands[opd]);
+            break;
+        case CPU_OPD_IMM8:
+            PRV_APPEND("imm8 %02X", rec->operands[opd]);
+            break;
+        case CPU_OPD_IMM32:
+            PRV_APPEND("imm32 %08X", rec->operands[opd]);
+            break;
+        }
+        if (opd == num_operands - 1) {
+            PRV_APPEND("]");
+        } else {
+            PRV_APPEND(", ");
+        }
+    }
+
+#undef PRV_APPEND
+
+    return (int)len;
+}
+
+size_t cpu_trace_dump(cpu_trace_t *trace, FILE *stream) {
+    D_ASSERT(trace);
+    D_ASSERT(stream);
+    size_t num_dumped = 0;
+
+    cpu_trace_rec_t recs[64];
+    const size_t max_recs = sizeof(recs) / sizeof(recs[0]);
+    size_t num_recs;
+    size_t num_lost;
+    while ((num_recs = cpu_trace_drain(trace, recs, max_recs, &num_lost)) > 0) {
+        if (num_lost > 0) { fprintf(stream, "(%zu records lost)\n", num_lost); }
+        for (size_t idx = 0; idx < num_recs; idx++) {
+            char line[128];
+            cpu_trace_format_rec(&recs[idx], line, sizeof(line));
+            fprintf(stream, "%s\n", line);
+        }
+        num_dumped += num_recs;
+    }
+
+    return num_dumped;
+}
@@ -3,50 +3,75 @@
  * Interrupt controller implementation.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#    include <sys/eventfd.h>
+#endif
 
 #include "debugm.h"
 #include "portability.h"
 #include <fcvm/intctl.h>
 
+static void prv_intctl_open_wait_fds(intctl_ctx_t *intctl);
+static void prv_intctl_signal(intctl_ctx_t *intctl);
+static void prv_intctl_drain(intctl_ctx_t *intctl);
+
 intctl_ctx_t *intctl_new(void) {
     intctl_ctx_t *intctl = malloc(sizeof(*intctl));
     D_ASSERT(intctl);
     memset(intctl, 0, sizeof(*intctl));
+    prv_intctl_open_wait_fds(intctl);
 
     return intctl;
 }
 
 void intctl_free(intctl_ctx_t *intctl) {
     D_ASSERT(intctl);
+    close(intctl->wait_fds[0]);
+    if (intctl->wait_fds[1] != intctl->wait_fds[0]) {
+        close(intctl->wait_fds[1]);
+    }
     free(intctl);
 }
 
 size_t intctl_snapshot_size(void) {
-    static_assert(SN_INTCTL_CTX_VER == 1);
+    static_assert(SN_INTCTL_CTX_VER == 3);
     return sizeof(intctl_ctx_t);
 }
 
 size_t intctl_snapshot(const intctl_ctx_t *intctl, void *v_buf,
                        size_t max_size) {
-    static_assert(SN_INTCTL_CTX_VER == 1);
+    static_assert(SN_INTCTL_CTX_VER == 3);
     D_ASSERT(intctl);
     D_ASSERT(v_buf);
     uint8_t *buf = (uint8_t *)v_buf;
     size_t size = 0;
 
+    // The wait object belongs to this process.
+    intctl_ctx_t intctl_copy;
+    memcpy(&intctl_copy, intctl, sizeof(intctl_copy));
+    intctl_copy.raised_irqs =
+        __atomic_load_n(&intctl->raised_irqs, __ATOMIC_ACQUIRE);
+    intctl_copy.wait_fds[0] = -1;
+    intctl_copy.wait_fds[1] = -1;
+    intctl_copy.dev_change_gen = 0;
+
     // Write the intctl context.
-    D_ASSERT(size + sizeof(*intctl) <= max_size);
-    memcpy(&buf[size], intctl, sizeof(*intctl));
-    size += sizeof(*intctl);
+    D_ASSERT(size + sizeof(intctl_copy) <= max_size);
+    memcpy(&buf[size], &intctl_copy, sizeof(intctl_copy));
+    size += sizeof(intctl_copy);
 
     return size;
 }
 
 intctl_ctx_t *intctl_restore(const void *v_buf, size_t max_size,
                              size_t *out_used_size) {
-    static_assert(SN_INTCTL_CTX_VER == 1);
+    static_assert(SN_INTCTL_CTX_VER == 3);
     D_ASSERT(v_buf);
     D_ASSERT(out_used_size);
     uint8_t *buf = (uint8_t *)v_buf;
@@ -61,6 +86,8 @@ intctl_ctx_t *intctl_restore(const void *v_buf, size_t max_size,
     // Create a new intctl and set the fields manually.
     intctl_ctx_t *intctl = intctl_new();
     intctl->raised_irqs = rest_intctl.raised_irqs;
+    // The wait object is new, it has not seen the pending IRQs being raised.
+    if (intctl->raised_irqs != 0) { prv_intctl_signal(intctl); }
 
     *out_used_size = offset;
     return intctl;
@@ -68,14 +95,17 @@ intctl_ctx_t *intctl_restore(const void *v_buf, size_t max_size,
 
 bool intctl_has_pending_irqs(intctl_ctx_t *intctl) {
     D_ASSERT(intctl);
-    return intctl->raised_irqs != 0;
+    return __atomic_load_n(&intctl->raised_irqs, __ATOMIC_ACQUIRE) != 0;
 }
 
 vm_err_t intctl_raise_irq_line(intctl_ctx_t *intctl, uint8_t irq_line) {
     D_ASSERT(intctl);
     vm_err_t err = VM_ERR_NONE;
     if (irq_line <= INTCTL_MAX_IRQ_NUM) {
-        intctl->raised_irqs |= (1 << irq_line);
+        const uint32_t old_irqs = __atomic_fetch_or(
+            &intctl->raised_irqs, 1U << irq_line, __ATOMIC_SEQ_CST);
+        // A waiter only blocks while no IRQ is pending.
+        if (old_irqs == 0) { prv_intctl_signal(intctl); }
     } else {
         err = VM_ERR_INVALID_IRQ_NUM;
     }
@@ -84,14 +114,89 @@ vm_err_t intctl_raise_irq_line(intctl_ctx_t *intctl, uint8_t irq_line) {
 
 bool intctl_get_pending_irq(intctl_ctx_t *intctl, uint8_t *out_irq) {
     D_ASSERT(intctl);
-    if (intctl->raised_irqs) {
-        int fto = stdc_first_trailing_one(intctl->raised_irqs);
+    uint32_t raised_irqs =
+        __atomic_load_n(&intctl->raised_irqs, __ATOMIC_ACQUIRE);
+    while (raised_irqs) {
+        int fto = stdc_first_trailing_one(raised_irqs);
         D_ASSERT(fto != 0);
         uint8_t irq_num = fto - 1;
-        intctl->raised_irqs &= ~(1 << irq_num);
-        *out_irq = irq_num;
-        return true;
-    } else {
-        return false;
+        // Another thread may raise more lines in the meantime.
+        if (__atomic_compare_exchange_n(
+                &intctl->raised_irqs, &raised_irqs,
+                raised_irqs & ~(1U << irq_num), false, __ATOMIC_ACQ_REL,
+                __ATOMIC_ACQUIRE)) {
+            *out_irq = irq_num;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool intctl_wait(intctl_ctx_t *intctl, int timeout_ms) {
+    D_ASSERT(intctl);
+    if (intctl_has_pending_irqs(intctl)) { return true; }
+
+    // A line raised after the check signals the object, which wakes poll().
+    struct pollfd pfd = {.fd = intctl->wait_fds[0], .events = POLLIN};
+    int num_ready = poll(&pfd, 1, timeout_ms);
+    D_ASSERTMF(num_ready >= 0 || errno == EINTR, "poll() failed: %s",
+               strerror(errno));
+    prv_intctl_drain(intctl);
+    return intctl_has_pending_irqs(intctl);
+}
+
+void intctl_wake(intctl_ctx_t *intctl) {
+    D_ASSERT(intctl);
+    prv_intctl_signal(intctl);
+}
+
+void intctl_notify_dev_change(intctl_ctx_t *intctl) {
+    D_ASSERT(intctl);
+    __atomic_fetch_add(&intctl->dev_change_gen, 1, __ATOMIC_SEQ_CST);
+    prv_intctl_signal(intctl);
+}
+
+uint32_t intctl_dev_change_gen(intctl_ctx_t *intctl) {
+    D_ASSERT(intctl);
+    return __atomic_load_n(&intctl->dev_change_gen, __ATOMIC_ACQUIRE);
+}
+
+int intctl_wait_fd(const intctl_ctx_t *intctl) {
+    D_ASSERT(intctl);
+    return intctl->wait_fds[0];
+}
+
+static void prv_intctl_open_wait_fds(intctl_ctx_t *intctl) {
+#if defined(__linux__)
+    const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    D_ASSERTMF(fd >= 0, "eventfd() failed: %s", strerror(errno));
+    intctl->wait_fds[0] = fd;
+    intctl->wait_fds[1] = fd;
+#else
+    const int res = pipe(intctl->wait_fds);
+    D_ASSERTMF(res == 0, "pipe() failed: %s", strerror(errno));
+    for (size_t idx = 0; idx < 2; idx++) {
+        const int fd = intctl->wait_fds[idx];
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
     }
+#endif
+}
+
+static void prv_intctl_signal(intctl_ctx_t *intctl) {
+    // Failing with EAGAIN means that the object is already signalled.
+#if defined(__linux__)
+    const uint64_t one = 1;
+    ssize_t num_written = write(intctl->wait_fds[1], &one, sizeof(one));
+#else
+    const uint8_t one = 1;
+    ssize_t num_written = write(intctl->wait_fds[1], &one, sizeof(one));
+#endif
+    D_ASSERTMF(num_written >= 0 || errno == EAGAIN, "write() failed: %s",
+               strerror(errno));
+}
+
+static void prv_intctl_drain(intctl_ctx_t *intctl) {
+    uint64_t buf;
+    while (read(intctl->wait_fds[0], &buf, sizeof(buf)) > 0) {}
 }
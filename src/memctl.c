@@ -1,17 +1,60 @@
 /**
  * @file memctl.c
  * Memory controller implementation.
+ *
+ * Regions are looked up by address through a two-level page table. Each page
+ * entry holds the index of the region that covers the whole page plus one, or
+ * zero if the page is not mapped. A page that is only partially covered by
+ * regions (regions do not have to be page-aligned) is marked as split and gets
+ * a map with an entry for every address in it.
+ *
+ * The regions are kept densely in #memctl_ctx_t.mapped_regions, in mapping
+ * order, and #memctl_ctx_t.sorted_regions orders them by start address, so
+ * that overlaps are found with a binary search. Unmapping a region moves the
+ * last region into its place, and the page table entries of the moved region
+ * are rewritten.
  */
 
 #include <stdlib.h>
 #include <string.h>
 
 #include "debugm.h"
+#include "memctl_space.h"
 #include "portability.h"
 
 #include <fcvm/memctl.h>
 
-static bool prv_memctl_find_free_reg(memctl_ctx_t *memctl, size_t *out_idx);
+/// Page table entry of a page that is split between regions.
+#define MEMCTL_PT_SPLIT 0xFFFF
+
+static_assert(MEMCTL_PAGE_SHIFT == MEM_PAGE_BITMAP_PAGE_SHIFT,
+              "ram_pages has a bit per page");
+
+/// Second-level page table.
+typedef struct {
+    uint16_t pages[MEMCTL_PT_L2_SIZE]; //!< Region index + 1 for every page.
+    uint16_t *split_pages[MEMCTL_PT_L2_SIZE]; //!< Maps of split pages.
+} memctl_pt_l2_t;
+
+struct memctl_page_table {
+    memctl_pt_l2_t *l2_tables[MEMCTL_PT_L1_SIZE];
+};
+
+static size_t prv_memctl_lower_bound(const memctl_ctx_t *memctl,
+                                     vm_addr_t addr);
+static bool prv_memctl_is_free(const memctl_ctx_t *memctl, vm_addr_t start,
+                               vm_addr_t end);
+static void prv_memctl_add_reg(memctl_ctx_t *memctl, const mmio_region_t *mmio);
+static inline uint8_t *prv_memctl_ram_ptr(const memctl_ctx_t *memctl,
+                                          vm_addr_t addr);
+static inline void prv_memctl_sync_code_pages(memctl_ctx_t *memctl);
+
+static memctl_page_table_t *prv_memctl_pt_new(void);
+static void prv_memctl_pt_free(memctl_page_table_t *pt);
+static uint16_t prv_memctl_pt_lookup(const memctl_page_table_t *pt,
+                                     vm_addr_t addr);
+static void prv_memctl_pt_set(memctl_page_table_t *pt, vm_addr_t start,
+                              vm_addr_t end, uint16_t entry);
 
 memctl_ctx_t *memctl_new(void) {
     memctl_ctx_t *memctl = malloc(sizeof(*memctl));
@@ -22,25 +65,43 @@ memctl_ctx_t *memctl_new(void) {
     memctl->intf.read_u32 = memctl_read_u32;
     memctl->intf.write_u8 = memctl_write_u8;
     memctl->intf.write_u32 = memctl_write_u32;
+    memctl->intf.get_span = memctl_get_span;
+    memctl->intf.read_block = memctl_read_block;
+    memctl->intf.write_block = memctl_write_block;
+
+    memctl->page_table = prv_memctl_pt_new();
+    memctl->code_pages = calloc(1, sizeof(*memctl->code_pages));
+    D_ASSERT(memctl->code_pages);
 
     return memctl;
 }
 
 void memctl_free(memctl_ctx_t *memctl) {
     D_ASSERT(memctl);
+    prv_memctl_pt_free(memctl->page_table);
+    free(memctl->mapped_regions);
+    free(memctl->sorted_regions);
+    mem_page_bitmap_reset(memctl->code_pages);
+    free(memctl->code_pages);
+    if (memctl->space) { memctl_space_release(memctl->space); }
+    if (memctl->ram_pages) { mem_page_bitmap_reset(memctl->ram_pages); }
+    free(memctl->ram_pages);
     free(memctl);
 }
 
-size_t memctl_snapshot_size(void) {
-    static_assert(SN_MEMCTL_CTX_VER == 1);
-    return sizeof(memctl_ctx_t);
+size_t memctl_snapshot_size(const memctl_ctx_t *memctl) {
+    static_assert(SN_MEMCTL_CTX_VER == 9);
+    D_ASSERT(memctl);
+    return sizeof(memctl_ctx_t) +
+           memctl->num_mapped_regions * sizeof(mmio_region_t);
 }
 
 size_t memctl_snapshot(const memctl_ctx_t *memctl, void *v_buf,
                        size_t max_size) {
-    static_assert(SN_MEMCTL_CTX_VER == 1);
+    static_assert(SN_MEMCTL_CTX_VER == 9);
     D_ASSERT(memctl);
     D_ASSERT(v_buf);
+    D_ASSERTM(!memctl->space, "the reserved space RAM cannot be saved");
     uint8_t *buf = (uint8_t *)v_buf;
     size_t size = 0;
 
@@ -51,26 +112,51 @@ size_t memctl_snapshot(const memctl_ctx_t *memctl, void *v_buf,
     memctl_copy.intf.read_u32 = NULL;
     memctl_copy.intf.write_u8 = NULL;
     memctl_copy.intf.write_u32 = NULL;
-    for (size_t idx = 0; idx < MEMCTL_MAX_REGIONS; idx++) {
-        mmio_region_t *reg = &memctl_copy.mapped_regions[idx];
-        reg->ctx = NULL;
-        reg->mem_if.read_u8 = NULL;
-        reg->mem_if.read_u32 = NULL;
-        reg->mem_if.write_u8 = NULL;
-        reg->mem_if.write_u32 = NULL;
-    }
+    memctl_copy.intf.get_span = NULL;
+    memctl_copy.intf.read_block = NULL;
+    memctl_copy.intf.write_block = NULL;
+    memctl_copy.mapped_regions = NULL;
+    memctl_copy.sorted_regions = NULL;
+    memctl_copy.regions_cap = 0;
+    memctl_copy.page_table = NULL;
+    memctl_copy.map_gen = 0;
+    memctl_copy.code_pages = NULL;
+    memctl_copy.code_pages_gen = 0;
+    memctl_copy.f_code_write = NULL;
+    memctl_copy.code_write_ctx = NULL;
+    memctl_copy.space = NULL;
+    memctl_copy.ram_pages = NULL;
 
     // Write the memctl context.
     D_ASSERT(size + sizeof(memctl_copy) <= max_size);
     memcpy(&buf[size], &memctl_copy, sizeof(memctl_copy));
     size += sizeof(memctl_copy);
 
+    // Write the regions in the order of their indices.
+    for (size_t idx = 0; idx < memctl->num_mapped_regions; idx++) {
+        mmio_region_t reg_copy;
+        memcpy(&reg_copy, &memctl->mapped_regions[idx], sizeof(reg_copy));
+        reg_copy.ctx = NULL;
+        reg_copy.mem_if.read_u8 = NULL;
+        reg_copy.mem_if.read_u32 = NULL;
+        reg_copy.mem_if.write_u8 = NULL;
+        reg_copy.mem_if.write_u32 = NULL;
+        reg_copy.mem_if.get_span = NULL;
+        reg_copy.mem_if.read_block = NULL;
+        reg_copy.mem_if.write_block = NULL;
+        reg_copy.direct_ptr = NULL;
+
+        D_ASSERT(size + sizeof(reg_copy) <= max_size);
+        memcpy(&buf[size], &reg_copy, sizeof(reg_copy));
+        size += sizeof(reg_copy);
+    }
+
     return size;
 }
 
 memctl_ctx_t *memctl_restore(const void *v_buf, size_t max_size,
                              size_t *out_used_size) {
-    static_assert(SN_MEMCTL_CTX_VER == 1);
+    static_assert(SN_MEMCTL_CTX_VER == 9);
     D_ASSERT(v_buf);
     D_ASSERT(out_used_size);
     uint8_t *buf = (uint8_t *)v_buf;
@@ -85,13 +171,20 @@ memctl_ctx_t *memctl_restore(const void *v_buf, size_t max_size,
     // Create a new memctl and set the fields manually.
     // memctl_new() sets the memctl's interface pointers.
     memctl_ctx_t *memctl = memctl_new();
-    memcpy(memctl->used_regions, rest_memctl.used_regions,
-           sizeof(rest_memctl.used_regions));
-    memcpy(memctl->mapped_regions, rest_memctl.mapped_regions,
-           sizeof(rest_memctl.mapped_regions));
-    memctl->num_mapped_regions = rest_memctl.num_mapped_regions;
 
-    // The caller must now restore the context and interface of each region.
+    // Restore the regions, which keep their indices, and rebuild the lookup
+    // tables.
+    D_ASSERT(rest_memctl.num_mapped_regions <= MEMCTL_MAX_REGIONS);
+    for (size_t idx = 0; idx < rest_memctl.num_mapped_regions; idx++) {
+        mmio_region_t rest_reg;
+        D_ASSERT(offset + sizeof(rest_reg) <= max_size);
+        memcpy(&rest_reg, &buf[offset], sizeof(rest_reg));
+        offset += sizeof(rest_reg);
+        prv_memctl_add_reg(memctl, &rest_reg);
+    }
+
+    // The caller must now restore the context and interface of each region,
+    // and call memctl_flush_spans() afterwards.
 
     *out_used_size = offset;
     return memctl;
@@ -101,47 +194,124 @@ vm_err_t memctl_map_region(memctl_ctx_t *memctl, const mmio_region_t *mmio) {
     D_ASSERT(memctl);
     D_ASSERT(mmio);
     D_ASSERT(mmio->start < mmio->end);
+    D_ASSERT(mmio->direct_ptr ||
+             !(mmio->direct_perms & (MEM_DIRECT_READ | MEM_DIRECT_WRITE)));
+    D_ASSERT(!(mmio->direct_perms & MEM_DIRECT_SPANS) ||
+             (mmio->mem_if.get_span && !mmio->direct_ptr));
     vm_err_t err = VM_ERR_NONE;
 
-    // FIXME: there are two iterations over the mapped_regions array, but it
-    // could be one if we checked both the start and end in a single iteration.
-    if (memctl_find_reg_by_addr(memctl, mmio->start, NULL) == VM_ERR_NONE) {
-        err = VM_ERR_MEM_USED;
-        return err;
-    }
-    // The end is exclusive, that's why we check if `end - 1`, the last byte of
-    // this region, not `end`, is contained in another region.
-    if (memctl_find_reg_by_addr(memctl, mmio->end - 1, NULL) == VM_ERR_NONE) {
+    if (!prv_memctl_is_free(memctl, mmio->start, mmio->end)) {
         err = VM_ERR_MEM_USED;
         return err;
     }
 
-    size_t idx;
-    if (!prv_memctl_find_free_reg(memctl, &idx)) {
+    if (memctl->num_mapped_regions == MEMCTL_MAX_REGIONS) {
         err = VM_ERR_MEM_MAX_REGIONS;
         return err;
     }
 
-    memctl->used_regions[idx] = true;
-    memcpy(&memctl->mapped_regions[idx], mmio, sizeof(*mmio));
+    prv_memctl_add_reg(memctl, mmio);
+    memctl_flush_spans(memctl);
 
     return err;
 }
 
+vm_err_t memctl_unmap_region(memctl_ctx_t *memctl, vm_addr_t start) {
+    D_ASSERT(memctl);
+    const size_t pos = prv_memctl_lower_bound(memctl, start);
+    if (pos == memctl->num_mapped_regions ||
+        memctl->mapped_regions[memctl->sorted_regions[pos]].start != start) {
+        return VM_ERR_BAD_MEM;
+    }
+
+    const size_t idx = memctl->sorted_regions[pos];
+    const mmio_region_t *reg = &memctl->mapped_regions[idx];
+    prv_memctl_pt_set(memctl->page_table, reg->start, reg->end, 0);
+    if (prv_memctl_ram_ptr(memctl, reg->start)) {
+        for (vm_addr_t page = reg->start >> MEMCTL_PAGE_SHIFT;
+             page < reg->end >> MEMCTL_PAGE_SHIFT; page++) {
+            mem_page_bitmap_clear(memctl->ram_pages, page);
+        }
+        memctl_space_commit(memctl->space, reg->start, reg->end, 0, NULL, 0);
+    }
+    memmove(&memctl->sorted_regions[pos], &memctl->sorted_regions[pos + 1],
+            (memctl->num_mapped_regions - pos - 1) * sizeof(uint16_t));
+
+    // Keep the regions dense by moving the last one into the hole.
+    const size_t last = --memctl->num_mapped_regions;
+    if (idx != last) {
+        const mmio_region_t *moved = &memctl->mapped_regions[last];
+        memcpy(&memctl->mapped_regions[idx], moved, sizeof(*moved));
+        prv_memctl_pt_set(memctl->page_table, moved->start, moved->end,
+                          idx + 1);
+        memctl->sorted_regions[prv_memctl_lower_bound(memctl, moved->start)] =
+            idx;
+    }
+    memctl_flush_spans(memctl);
+
+    return VM_ERR_NONE;
+}
+
+vm_err_t memctl_reserve_space(memctl_ctx_t *memctl) {
+    D_ASSERT(memctl);
+    if (memctl->space) { return VM_ERR_NONE; }
+
+    // The regions mapped so far are left outside the space.
+    memctl->space = memctl_space_reserve();
+    if (!memctl->space) { return VM_ERR_MEM_NO_SPACE; }
+    memctl->ram_pages = calloc(1, sizeof(*memctl->ram_pages));
+    D_ASSERT(memctl->ram_pages);
+    return VM_ERR_NONE;
+}
+
+vm_err_t memctl_map_ram(memctl_ctx_t *memctl, vm_addr_t start, vm_addr_t end,
+                        uint8_t perms, const void *data, size_t size,
+                        uint8_t **out_ptr) {
+    D_ASSERT(memctl);
+    D_ASSERT(start < end);
+    D_ASSERT(data || size == 0);
+    D_ASSERT(size <= end - start);
+    D_ASSERT(start % MEMCTL_PAGE_SIZE == 0 && end % MEMCTL_PAGE_SIZE == 0);
+    D_ASSERT(perms & MEM_DIRECT_READ);
+    if (!memctl->space) { return VM_ERR_MEM_NO_SPACE; }
+    if (!prv_memctl_is_free(memctl, start, end)) { return VM_ERR_MEM_USED; }
+
+    if (!memctl_space_commit(memctl->space, start, end, perms, data, size)) {
+        // Leave nothing accessible behind.
+        memctl_space_commit(memctl->space, start, end, 0, NULL, 0);
+        return VM_ERR_MEM_NO_SPACE;
+    }
+    const mmio_region_t ram = {
+        .start = start,
+        .end = end,
+        .direct_ptr = &memctl->space[start],
+        .direct_perms = perms,
+    };
+    const vm_err_t err = memctl_map_region(memctl, &ram);
+    if (err != VM_ERR_NONE) {
+        memctl_space_commit(memctl->space, start, end, 0, NULL, 0);
+        return err;
+    }
+
+    for (vm_addr_t page = start >> MEMCTL_PAGE_SHIFT;
+         page < end >> MEMCTL_PAGE_SHIFT; page++) {
+        mem_page_bitmap_set(memctl->ram_pages, page);
+    }
+    if (out_ptr) { *out_ptr = &memctl->space[start]; }
+    return VM_ERR_NONE;
+}
+
 vm_err_t memctl_find_reg_by_addr(memctl_ctx_t *memctl, vm_addr_t addr,
                                  mmio_region_t **out_reg) {
     D_ASSERT(memctl);
     vm_err_t err = VM_ERR_BAD_MEM;
 
-    for (size_t idx = 0; idx < MEMCTL_MAX_REGIONS; idx++) {
-        if (memctl->used_regions[idx]) {
-            mmio_region_t reg = memctl->mapped_regions[idx];
-            if (reg.start <= addr && addr < reg.end) {
-                if (out_reg) { *out_reg = &memctl->mapped_regions[idx]; }
-                err = VM_ERR_NONE;
-                break;
-            }
-        }
+    uint16_t entry = prv_memctl_pt_lookup(memctl->page_table, addr);
+    if (entry != 0) {
+        size_t idx = entry - 1;
+        D_ASSERT(idx < memctl->num_mapped_regions);
+        if (out_reg) { *out_reg = &memctl->mapped_regions[idx]; }
+        err = VM_ERR_NONE;
     }
 
     return err;
@@ -152,10 +322,15 @@ vm_err_t memctl_read_u8(void *v_memctl_ctx, vm_addr_t addr, uint8_t *out) {
     memctl_ctx_t *memctl = (memctl_ctx_t *)v_memctl_ctx;
     vm_err_t err = VM_ERR_NONE;
 
+    uint8_t *ram = prv_memctl_ram_ptr(memctl, addr);
+    if (ram && memctl_space_load_u8(ram, out)) { return VM_ERR_NONE; }
+
     mmio_region_t *reg;
     err = memctl_find_reg_by_addr(memctl, addr, &reg);
     if (err == VM_ERR_NONE) {
-        if (reg->mem_if.read_u8) {
+        if (reg->direct_perms & MEM_DIRECT_READ) {
+            *out = reg->direct_ptr[addr - reg->start];
+        } else if (reg->mem_if.read_u8) {
             vm_addr_t rel_addr = addr - reg->start;
             err = reg->mem_if.read_u8(reg->ctx, rel_addr, out);
         } else {
@@ -171,11 +346,20 @@ vm_err_t memctl_read_u32(void *v_memctl_ctx, vm_addr_t addr, uint32_t *out) {
     memctl_ctx_t *memctl = (memctl_ctx_t *)v_memctl_ctx;
     vm_err_t err = VM_ERR_NONE;
 
+    uint8_t *ram = prv_memctl_ram_ptr(memctl, addr);
+    if (ram && memctl_space_load_u32(ram, out)) { return VM_ERR_NONE; }
+
     mmio_region_t *reg;
     err = memctl_find_reg_by_addr(memctl, addr, &reg);
     if (err == VM_ERR_NONE) {
-        if (reg->mem_if.read_u32) {
-            if (addr + 4 <= reg->end) {
+        if (reg->direct_perms & MEM_DIRECT_READ) {
+            if (reg->end - addr >= 4) {
+                memcpy(out, &reg->direct_ptr[addr - reg->start], 4);
+            } else {
+                err = VM_ERR_BAD_MEM;
+            }
+        } else if (reg->mem_if.read_u32) {
+            if (reg->end - addr >= 4) {
                 vm_addr_t rel_addr = addr - reg->start;
                 err = reg->mem_if.read_u32(reg->ctx, rel_addr, out);
             } else {
@@ -194,16 +378,25 @@ vm_err_t memctl_write_u8(void *v_memctl_ctx, vm_addr_t addr, uint8_t val) {
     memctl_ctx_t *memctl = (memctl_ctx_t *)v_memctl_ctx;
     vm_err_t err = VM_ERR_NONE;
 
+    uint8_t *ram = prv_memctl_ram_ptr(memctl, addr);
+    if (ram && memctl_space_store_u8(ram, val)) {
+        memctl_note_write(memctl, addr, 1);
+        return VM_ERR_NONE;
+    }
+
     mmio_region_t *reg;
     err = memctl_find_reg_by_addr(memctl, addr, &reg);
     if (err == VM_ERR_NONE) {
-        if (reg->mem_if.write_u8) {
+        if (reg->direct_perms & MEM_DIRECT_WRITE) {
+            reg->direct_ptr[addr - reg->start] = val;
+        } else if (reg->mem_if.write_u8) {
             vm_addr_t rel_addr = addr - reg->start;
             err = reg->mem_if.write_u8(reg->ctx, rel_addr, val);
         } else {
             err = VM_ERR_MEM_BAD_OP;
         }
     }
+    if (err == VM_ERR_NONE) { memctl_note_write(memctl, addr, 1); }
 
     return err;
 }
@@ -213,11 +406,23 @@ vm_err_t memctl_write_u32(void *v_memctl_ctx, vm_addr_t addr, uint32_t val) {
     memctl_ctx_t *memctl = (memctl_ctx_t *)v_memctl_ctx;
     vm_err_t err = VM_ERR_NONE;
 
+    uint8_t *ram = prv_memctl_ram_ptr(memctl, addr);
+    if (ram && memctl_space_store_u32(ram, val)) {
+        memctl_note_write(memctl, addr, 4);
+        return VM_ERR_NONE;
+    }
+
     mmio_region_t *reg;
     err = memctl_find_reg_by_addr(memctl, addr, &reg);
     if (err == VM_ERR_NONE) {
-        if (reg->mem_if.write_u32) {
-            if (addr + 4 <= reg->end) {
+        if (reg->direct_perms & MEM_DIRECT_WRITE) {
+            if (reg->end - addr >= 4) {
+                memcpy(&reg->direct_ptr[addr - reg->start], &val, 4);
+            } else {
+                err = VM_ERR_BAD_MEM;
+            }
+        } else if (reg->mem_if.write_u32) {
+            if (reg->end - addr >= 4) {
                 vm_addr_t rel_addr = addr - reg->start;
                 err = reg->mem_if.write_u32(reg->ctx, rel_addr, val);
             } else {
@@ -227,26 +432,359 @@ vm_err_t memctl_write_u32(void *v_memctl_ctx, vm_addr_t addr, uint32_t val) {
             err = VM_ERR_MEM_BAD_OP;
         }
     }
+    if (err == VM_ERR_NONE) { memctl_note_write(memctl, addr, 4); }
 
     return err;
 }
 
+bool memctl_get_span(void *v_memctl_ctx, vm_addr_t addr, mem_span_t *out) {
+    D_ASSERT(v_memctl_ctx);
+    D_ASSERT(out);
+    memctl_ctx_t *memctl = (memctl_ctx_t *)v_memctl_ctx;
+
+    mmio_region_t *reg;
+    if (memctl_find_reg_by_addr(memctl, addr, &reg) != VM_ERR_NONE) {
+        return false;
+    }
+
+    out->ptr = reg->direct_ptr;
+    out->start = reg->start;
+    out->end = reg->end;
+    out->perms = reg->direct_perms;
+    if (reg->direct_perms & MEM_DIRECT_SPANS) {
+        // The device tells which part of its memory around @a addr is direct,
+        // otherwise the whole region goes through the callbacks.
+        mem_span_t dev_span;
+        const vm_addr_t rel_addr = addr - reg->start;
+        out->perms = 0;
+        if (reg->mem_if.get_span(reg->ctx, rel_addr, &dev_span)) {
+            D_ASSERT(dev_span.start <= rel_addr && rel_addr < dev_span.end);
+            D_ASSERT(dev_span.end <= reg->end - reg->start);
+            out->ptr = dev_span.ptr;
+            out->start = reg->start + dev_span.start;
+            out->end = reg->start + dev_span.end;
+            out->perms =
+                dev_span.perms & (MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+        }
+    }
+    out->mem_if = &reg->mem_if;
+    out->ctx = reg->ctx;
+    out->cb_base = reg->start;
+    out->notifies_changes = reg->notifies_changes;
+    out->p_gen = &memctl->map_gen;
+    prv_memctl_sync_code_pages(memctl);
+    out->code_pages = memctl->code_pages;
+    return true;
+}
+
+vm_err_t memctl_read_block(void *v_memctl_ctx, vm_addr_t addr, void *out,
+                           size_t size) {
+    D_ASSERT(v_memctl_ctx);
+    D_ASSERT(out || size == 0);
+    memctl_ctx_t *memctl = (memctl_ctx_t *)v_memctl_ctx;
+    uint8_t *dst = (uint8_t *)out;
+
+    // 64-bit addresses do not overflow past the end of the address space.
+    uint64_t pos = addr;
+    const uint64_t end = pos + size;
+    while (pos < end) {
+        mmio_region_t *reg;
+        if (pos > VM_MAX_ADDR ||
+            memctl_find_reg_by_addr(memctl, pos, &reg) != VM_ERR_NONE) {
+            return VM_ERR_BAD_MEM;
+        }
+        const uint64_t last = end < reg->end ? end : reg->end;
+        const vm_addr_t rel_addr = pos - reg->start;
+        const size_t chunk = last - pos;
+
+        vm_err_t err = VM_ERR_NONE;
+        if (reg->direct_perms & MEM_DIRECT_READ) {
+            memcpy(dst, &reg->direct_ptr[rel_addr], chunk);
+        } else if (reg->mem_if.read_block) {
+            err = reg->mem_if.read_block(reg->ctx, rel_addr, dst, chunk);
+        } else if (reg->mem_if.read_u8) {
+            for (size_t idx = 0; idx < chunk && err == VM_ERR_NONE; idx++) {
+                err = reg->mem_if.read_u8(reg->ctx, rel_addr + idx, &dst[idx]);
+            }
+        } else {
+            err = VM_ERR_MEM_BAD_OP;
+        }
+        if (err != VM_ERR_NONE) { return err; }
+
+        dst += chunk;
+        pos = last;
+    }
+
+    return VM_ERR_NONE;
+}
+
+vm_err_t memctl_write_block(void *v_memctl_ctx, vm_addr_t addr,
+                            const void *data, size_t size) {
+    D_ASSERT(v_memctl_ctx);
+    D_ASSERT(data || size == 0);
+    memctl_ctx_t *memctl = (memctl_ctx_t *)v_memctl_ctx;
+    const uint8_t *src = (const uint8_t *)data;
+
+    // 64-bit addresses do not overflow past the end of the address space.
+    uint64_t pos = addr;
+    const uint64_t end = pos + size;
+    while (pos < end) {
+        mmio_region_t *reg;
+        if (pos > VM_MAX_ADDR ||
+            memctl_find_reg_by_addr(memctl, pos, &reg) != VM_ERR_NONE) {
+            return VM_ERR_BAD_MEM;
+        }
+        const uint64_t last = end < reg->end ? end : reg->end;
+        const vm_addr_t rel_addr = pos - reg->start;
+        const size_t chunk = last - pos;
+
+        vm_err_t err = VM_ERR_NONE;
+        if (reg->direct_perms & MEM_DIRECT_WRITE) {
+            memcpy(&reg->direct_ptr[rel_addr], src, chunk);
+        } else if (reg->mem_if.write_block) {
+            err = reg->mem_if.write_block(reg->ctx, rel_addr, src, chunk);
+        } else if (reg->mem_if.write_u8) {
+            for (size_t idx = 0; idx < chunk && err == VM_ERR_NONE; idx++) {
+                err = reg->mem_if.write_u8(reg->ctx, rel_addr + idx, src[idx]);
+            }
+        } else {
+            err = VM_ERR_MEM_BAD_OP;
+        }
+        // The bytes before a failure may have been written.
+        memctl_note_write(memctl, pos, chunk);
+        if (err != VM_ERR_NONE) { return err; }
+
+        src += chunk;
+        pos = last;
+    }
+
+    return VM_ERR_NONE;
+}
+
+void memctl_flush_spans(memctl_ctx_t *memctl) {
+    D_ASSERT(memctl);
+    // The CPUs drop the code decoded under the old mapping, and
+    // @ref memctl_ctx_t.code_pages is cleared before it is used again.
+    memctl->map_gen++;
+}
+
+void memctl_set_code_watch(memctl_ctx_t *memctl,
+                           memctl_code_write_cb f_code_write, void *ctx) {
+    D_ASSERT(memctl);
+    memctl->f_code_write = f_code_write;
+    memctl->code_write_ctx = ctx;
+}
+
+void memctl_note_write(memctl_ctx_t *memctl, vm_addr_t addr, uint32_t size) {
+    D_ASSERT(memctl);
+    if (!memctl->f_code_write || size == 0) { return; }
+    prv_memctl_sync_code_pages(memctl);
+
+    // 64-bit addresses do not overflow past the last page.
+    const uint64_t first = addr >> MEM_PAGE_BITMAP_PAGE_SHIFT;
+    const uint64_t last =
+        ((uint64_t)addr + size - 1) >> MEM_PAGE_BITMAP_PAGE_SHIFT;
+    for (uint64_t page = first;
+         page <= last && page <= (VM_MAX_ADDR >> MEM_PAGE_BITMAP_PAGE_SHIFT);
+         page++) {
+        if (mem_page_bitmap_test(memctl->code_pages, page)) {
+            memctl->f_code_write(memctl->code_write_ctx, addr, size);
+            return;
+        }
+    }
+}
+
+/**
+ * Finds where a region starting at @a addr goes in
+ * #memctl_ctx_t.sorted_regions.
+ * @returns Position of the first region that starts at or after @a addr.
+ */
+static size_t prv_memctl_lower_bound(const memctl_ctx_t *memctl,
+                                     vm_addr_t addr) {
+    D_ASSERT(memctl);
+    size_t low = 0;
+    size_t high = memctl->num_mapped_regions;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        const size_t idx = memctl->sorted_regions[mid];
+        if (memctl->mapped_regions[idx].start < addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/// Checks that no address in [@a start, @a end) is mapped.
+static bool prv_memctl_is_free(const memctl_ctx_t *memctl, vm_addr_t start,
+                               vm_addr_t end) {
+    D_ASSERT(memctl);
+    D_ASSERT(start < end);
+
+    // The regions do not overlap, so only the regions on both sides of
+    // @a start can overlap [@a start, @a end).
+    const size_t pos = prv_memctl_lower_bound(memctl, start);
+    if (pos < memctl->num_mapped_regions &&
+        memctl->mapped_regions[memctl->sorted_regions[pos]].start < end) {
+        return false;
+    }
+    if (pos > 0 &&
+        memctl->mapped_regions[memctl->sorted_regions[pos - 1]].end > start) {
+        return false;
+    }
+    return true;
+}
+
 /**
- * Finds an unused index in the #memctl_ctx_t.mapped_regions array.
- * @param[in]  memctl  Memory controller.
- * @param[out] out_idx Output pointer to the unused index.
- * @returns `true` if an unused index was found and written at @a *out_idx,
- *          `false` if no unused index was found and @a *out_idx was not
- *          changed.
+ * Appends a copy of @a mmio to #memctl_ctx_t.mapped_regions, growing it if
+ * needed, and adds it to the lookup tables. The caller checks that it does
+ * not overlap the mapped regions.
  */
-static bool prv_memctl_find_free_reg(memctl_ctx_t *memctl, size_t *out_idx) {
+static void prv_memctl_add_reg(memctl_ctx_t *memctl,
+                               const mmio_region_t *mmio) {
     D_ASSERT(memctl);
-    D_ASSERT(out_idx);
-    for (size_t idx = 0; idx < MEMCTL_MAX_REGIONS; idx++) {
-        if (!memctl->used_regions[idx]) {
-            *out_idx = idx;
-            return true;
+    D_ASSERT(mmio);
+    D_ASSERT(memctl->num_mapped_regions < MEMCTL_MAX_REGIONS);
+
+    if (memctl->num_mapped_regions == memctl->regions_cap) {
+        size_t cap = memctl->regions_cap ? memctl->regions_cap * 2 : 8;
+        if (cap > MEMCTL_MAX_REGIONS) { cap = MEMCTL_MAX_REGIONS; }
+        memctl->mapped_regions =
+            realloc(memctl->mapped_regions, cap * sizeof(mmio_region_t));
+        memctl->sorted_regions =
+            realloc(memctl->sorted_regions, cap * sizeof(uint16_t));
+        D_ASSERT(memctl->mapped_regions && memctl->sorted_regions);
+        memctl->regions_cap = cap;
+    }
+
+    const size_t idx = memctl->num_mapped_regions;
+    const size_t pos = prv_memctl_lower_bound(memctl, mmio->start);
+    memcpy(&memctl->mapped_regions[idx], mmio, sizeof(*mmio));
+    memmove(&memctl->sorted_regions[pos + 1], &memctl->sorted_regions[pos],
+            (idx - pos) * sizeof(uint16_t));
+    memctl->sorted_regions[pos] = idx;
+    memctl->num_mapped_regions++;
+    prv_memctl_pt_set(memctl->page_table, mmio->start, mmio->end, idx + 1);
+}
+
+/**
+ * Host address of @a addr in the reserved space, if @a addr is in RAM mapped
+ * with #memctl_map_ram().
+ * @returns NULL if the access has to go through the region lookup.
+ */
+static inline uint8_t *prv_memctl_ram_ptr(const memctl_ctx_t *memctl,
+                                          vm_addr_t addr) {
+    if (!memctl->ram_pages) { return NULL; }
+    const uint32_t page = addr >> MEMCTL_PAGE_SHIFT;
+    if (!mem_page_bitmap_test(memctl->ram_pages, page)) { return NULL; }
+    return &memctl->space[addr];
+}
+
+/**
+ * Clears @ref memctl_ctx_t.code_pages if the mapping has changed since it was
+ * last cleared. Clearing it lazily keeps mapping many regions in a row cheap.
+ */
+static inline void prv_memctl_sync_code_pages(memctl_ctx_t *memctl) {
+    if (memctl->code_pages_gen == memctl->map_gen) { return; }
+    mem_page_bitmap_reset(memctl->code_pages);
+    memctl->code_pages_gen = memctl->map_gen;
+}
+
+static memctl_page_table_t *prv_memctl_pt_new(void) {
+    memctl_page_table_t *pt = malloc(sizeof(*pt));
+    D_ASSERT(pt);
+    memset(pt, 0, sizeof(*pt));
+    return pt;
+}
+
+static void prv_memctl_pt_free(memctl_page_table_t *pt) {
+    D_ASSERT(pt);
+    for (size_t l1_idx = 0; l1_idx < MEMCTL_PT_L1_SIZE; l1_idx++) {
+        memctl_pt_l2_t *l2 = pt->l2_tables[l1_idx];
+        if (!l2) { continue; }
+        for (size_t l2_idx = 0; l2_idx < MEMCTL_PT_L2_SIZE; l2_idx++) {
+            free(l2->split_pages[l2_idx]);
+        }
+        free(l2);
+    }
+    free(pt);
+}
+
+/**
+ * Looks up the region that contains @a addr.
+ * @returns Index of the region plus one, or zero if @a addr is not mapped.
+ */
+static uint16_t prv_memctl_pt_lookup(const memctl_page_table_t *pt,
+                                     vm_addr_t addr) {
+    D_ASSERT(pt);
+    const memctl_pt_l2_t *l2 =
+        pt->l2_tables[addr >> (MEMCTL_PT_L2_BITS + MEMCTL_PAGE_SHIFT)];
+    if (!l2) { return 0; }
+
+    const size_t l2_idx = (addr >> MEMCTL_PAGE_SHIFT) & (MEMCTL_PT_L2_SIZE - 1);
+    const uint16_t entry = l2->pages[l2_idx];
+    if (entry != MEMCTL_PT_SPLIT) { return entry; }
+    return l2->split_pages[l2_idx][addr & (MEMCTL_PAGE_SIZE - 1)];
+}
+
+/**
+ * Sets the page table entry of every address in [@a start, @a end) to
+ * @a entry, the index of a region plus one or zero to unmap them.
+ */
+static void prv_memctl_pt_set(memctl_page_table_t *pt, vm_addr_t start,
+                              vm_addr_t end, uint16_t entry) {
+    D_ASSERT(pt);
+    D_ASSERT(start < end);
+    D_ASSERT(entry <= MEMCTL_MAX_REGIONS);
+
+    // 64-bit addresses do not overflow past the last page.
+    uint64_t addr = start;
+    while (addr < end) {
+        const uint64_t page_start = addr & ~(uint64_t)(MEMCTL_PAGE_SIZE - 1);
+        const uint64_t page_end = page_start + MEMCTL_PAGE_SIZE;
+        const uint64_t last = end < page_end ? end : page_end;
+
+        const size_t l1_idx = addr >> (MEMCTL_PT_L2_BITS + MEMCTL_PAGE_SHIFT);
+        if (!pt->l2_tables[l1_idx]) {
+            pt->l2_tables[l1_idx] = malloc(sizeof(memctl_pt_l2_t));
+            D_ASSERT(pt->l2_tables[l1_idx]);
+            memset(pt->l2_tables[l1_idx], 0, sizeof(memctl_pt_l2_t));
+        }
+        memctl_pt_l2_t *l2 = pt->l2_tables[l1_idx];
+
+        const size_t l2_idx =
+            (addr >> MEMCTL_PAGE_SHIFT) & (MEMCTL_PT_L2_SIZE - 1);
+        if (addr == page_start && last == page_end &&
+            l2->pages[l2_idx] != MEMCTL_PT_SPLIT) {
+            l2->pages[l2_idx] = entry;
+            addr = last;
+            continue;
+        }
+
+        if (l2->pages[l2_idx] != MEMCTL_PT_SPLIT) {
+            uint16_t *split = malloc(MEMCTL_PAGE_SIZE * sizeof(uint16_t));
+            D_ASSERT(split);
+            for (size_t offset = 0; offset < MEMCTL_PAGE_SIZE; offset++) {
+                split[offset] = l2->pages[l2_idx];
+            }
+            l2->split_pages[l2_idx] = split;
+            l2->pages[l2_idx] = MEMCTL_PT_SPLIT;
+        }
+        uint16_t *split = l2->split_pages[l2_idx];
+        for (; addr < last; addr++) {
+            split[addr - page_start] = entry;
+        }
+
+        // Merge the page back once a single entry is left in it.
+        size_t offset = 1;
+        while (offset < MEMCTL_PAGE_SIZE && split[offset] == split[0]) {
+            offset++;
+        }
+        if (offset == MEMCTL_PAGE_SIZE) {
+            l2->pages[l2_idx] = split[0];
+            l2->split_pages[l2_idx] = NULL;
+            free(split);
         }
     }
-    return false;
 }
@@ -0,0 +1,140 @@
+/**
+ * @file memctl_space.c
+ * Host reservation of the guest address space and fault recovery.
+ */
+
+#define _GNU_SOURCE
+
+#include "memctl_space.h"
+#include "debugm.h"
+
+#if MEMCTL_SPACE_SUPPORTED
+
+#    include <signal.h>
+#    include <stdint.h>
+#    include <string.h>
+#    include <sys/mman.h>
+#    include <ucontext.h>
+
+/// Entry of the fixup section, with offsets relative to the fields.
+typedef struct {
+    int32_t insn;  //!< Instruction that may fault.
+    int32_t fixup; //!< Where to resume after a fault.
+} memctl_space_fixup_t;
+
+/// Bounds of the fixup section, provided by the linker.
+extern const memctl_space_fixup_t __start_fcvm_space_fixups[];
+extern const memctl_space_fixup_t __stop_fcvm_space_fixups[];
+
+/// `SIGSEGV` action before #prv_memctl_space_on_segv() has been installed.
+static struct sigaction prv_old_action;
+/// 0 until the handler is being installed, 1 while it is, 2 once it is.
+static int prv_handler_state;
+
+static void prv_memctl_space_install_handler(void);
+static void prv_memctl_space_on_segv(int sig, siginfo_t *info, void *v_uc);
+
+uint8_t *memctl_space_reserve(void) {
+    prv_memctl_space_install_handler();
+    void *space = mmap(NULL, MEMCTL_SPACE_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (space == MAP_FAILED) {
+        D_PRINT("cannot reserve the guest address space");
+        return NULL;
+    }
+    return space;
+}
+
+void memctl_space_release(uint8_t *space) {
+    D_ASSERT(space);
+    munmap(space, MEMCTL_SPACE_SIZE);
+}
+
+bool memctl_space_commit(uint8_t *space, vm_addr_t start, uint64_t end,
+                         uint8_t perms, const void *data, size_t size) {
+    D_ASSERT(space);
+    D_ASSERT(start < end && end <= (1ULL << 32));
+    D_ASSERT(start % MEMCTL_PAGE_SIZE == 0 && end % MEMCTL_PAGE_SIZE == 0);
+    D_ASSERT(size <= end - start);
+
+    // Fresh anonymous pages replace the previous contents.
+    const int init_prot = size > 0 ? PROT_READ | PROT_WRITE : PROT_NONE;
+    void *pages = mmap(&space[start], end - start, init_prot,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                       -1, 0);
+    if (pages == MAP_FAILED) { return false; }
+    if (size > 0) { memcpy(pages, data, size); }
+
+    int prot = PROT_NONE;
+    if (perms & MEM_DIRECT_READ) { prot |= PROT_READ; }
+    if (perms & MEM_DIRECT_WRITE) { prot |= PROT_READ | PROT_WRITE; }
+    return mprotect(pages, end - start, prot) == 0;
+}
+
+/// Installs #prv_memctl_space_on_segv() once for the whole process.
+static void prv_memctl_space_install_handler(void) {
+    int state = 0;
+    if (__atomic_compare_exchange_n(&prv_handler_state, &state, 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        struct sigaction action = {0};
+        action.sa_sigaction = prv_memctl_space_on_segv;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        const int err = sigaction(SIGSEGV, &action, &prv_old_action);
+        D_ASSERT(err == 0);
+        __atomic_store_n(&prv_handler_state, 2, __ATOMIC_RELEASE);
+        return;
+    }
+    // Another thread is installing it.
+    while (__atomic_load_n(&prv_handler_state, __ATOMIC_ACQUIRE) != 2) {}
+}
+
+/**
+ * Resumes a guarded accessor at its fixup code, or passes the fault on.
+ * Only touches the fixup section and @a v_uc, which is async-signal-safe.
+ */
+static void prv_memctl_space_on_segv(int sig, siginfo_t *info, void *v_uc) {
+    ucontext_t *uc = v_uc;
+    const uintptr_t pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    for (const memctl_space_fixup_t *entry = __start_fcvm_space_fixups;
+         entry < __stop_fcvm_space_fixups; entry++) {
+        if ((uintptr_t)&entry->insn + entry->insn == pc) {
+            uc->uc_mcontext.gregs[REG_RIP] =
+                (greg_t)((uintptr_t)&entry->fixup + entry->fixup);
+            return;
+        }
+    }
+
+    if (prv_old_action.sa_flags & SA_SIGINFO) {
+        prv_old_action.sa_sigaction(sig, info, v_uc);
+    } else if (prv_old_action.sa_handler != SIG_DFL &&
+               prv_old_action.sa_handler != SIG_IGN) {
+        prv_old_action.sa_handler(sig);
+    } else {
+        // The faulting instruction runs again with the previous action.
+        sigaction(SIGSEGV, &prv_old_action, NULL);
+    }
+}
+
+#else
+
+uint8_t *memctl_space_reserve(void) {
+    return NULL;
+}
+
+void memctl_space_release(uint8_t *space) {
+    (void)space;
+}
+
+bool memctl_space_commit(uint8_t *space, vm_addr_t start, uint64_t end,
+                         uint8_t perms, const void *data, size_t size) {
+    (void)space;
+    (void)start;
+    (void)end;
+    (void)perms;
+    (void)data;
+    (void)size;
+    return false;
+}
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * @file memctl_space.h
+ * Host reservation of the guest address space, see #memctl_reserve_space().
+ *
+ * The whole 4 GiB guest address space is reserved with no access rights, and
+ * only the RAM mapped with #memctl_map_ram() is made accessible, at the host
+ * address of the space plus the guest address. Accesses to guest RAM are then
+ * done without looking up the region or checking its bounds: an access that
+ * leaves the RAM faults, and the `SIGSEGV` handler resumes the accessor at its
+ * fixup code, which reports the failure so that the access is retried the slow
+ * way.
+ *
+ * Each accessor records the address of its faulting instruction and of its
+ * fixup code in a dedicated section, which the handler searches. Faults
+ * elsewhere are passed on to the handler installed before.
+ *
+ * Only implemented for x86-64 Linux hosts, elsewhere no space can be reserved.
+ */
+
+#pragma once
+
+#include <fcvm/memctl.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#    define MEMCTL_SPACE_SUPPORTED 1
+#else
+#    define MEMCTL_SPACE_SUPPORTED 0
+#endif
+
+/// Size of the reservation. Regions end before 4 GiB, so an access that
+/// starts in RAM cannot leave the reservation.
+#define MEMCTL_SPACE_SIZE (1ULL << 32)
+
+/**
+ * Reserves the guest address space without any access rights.
+ * @returns Host address of guest address 0, or NULL if the host is not
+ * supported or has no room for it.
+ */
+uint8_t *memctl_space_reserve(void);
+void memctl_space_release(uint8_t *space);
+
+/**
+ * Replaces the pages of [@a start, @a end) by zeroed pages, with the @a
+ * size bytes of @a data copied at their start, and gives them the access
+ * rights @a perms (`MEM_DIRECT_*` bits).
+ * @a start and @a end must be aligned to #MEMCTL_PAGE_SIZE.
+ * @returns `false` if the host refuses.
+ */
+bool memctl_space_commit(uint8_t *space, vm_addr_t start, uint64_t end,
+                         uint8_t perms, const void *data, size_t size);
+
+#if MEMCTL_SPACE_SUPPORTED
+
+/// Records that a fault at the label @a insn resumes at the label @a fixup.
+#    define MEMCTL_SPACE_FIXUP(insn, fixup)                                    \
+        ".pushsection fcvm_space_fixups, \"a\"\n"                             \
+        ".balign 4\n"                                                          \
+        ".long " insn " - .\n"                                                 \
+        ".long " fixup " - .\n"                                                \
+        ".popsection\n"
+
+/**
+ * @{
+ * @name Guarded accessors
+ * Access host memory that may not be accessible.
+ * @returns `false` if the access has faulted and has not been done.
+ */
+static inline bool memctl_space_load_u8(const uint8_t *ptr, uint8_t *out) {
+    uint32_t ok = 1;
+    uint8_t val;
+    __asm__ volatile("1: movb (%[ptr]), %[val]\n"
+                     "2:\n"
+                     ".pushsection .text.unlikely, \"ax\"\n"
+                     "3: xorl %[ok], %[ok]\n"
+                     "   jmp 2b\n"
+                     ".popsection\n" MEMCTL_SPACE_FIXUP("1b", "3b")
+                     : [val] "=q"(val), [ok] "+r"(ok)
+                     : [ptr] "r"(ptr)
+                     : "memory");
+    if (ok) { *out = val; }
+    return ok;
+}
+
+static inline bool memctl_space_load_u32(const uint8_t *ptr, uint32_t *out) {
+    uint32_t ok = 1;
+    uint32_t val;
+    __asm__ volatile("1: movl (%[ptr]), %[val]\n"
+                     "2:\n"
+                     ".pushsection .text.unlikely, \"ax\"\n"
+                     "3: xorl %[ok], %[ok]\n"
+                     "   jmp 2b\n"
+                     ".popsection\n" MEMCTL_SPACE_FIXUP("1b", "3b")
+                     : [val] "=r"(val), [ok] "+r"(ok)
+                     : [ptr] "r"(ptr)
+                     : "memory");
+    if (ok) { *out = val; }
+    return ok;
+}
+
+static inline bool memctl_space_store_u8(uint8_t *ptr, uint8_t val) {
+    uint32_t ok = 1;
+    __asm__ volatile("1: movb %[val], (%[ptr])\n"
+                     "2:\n"
+                     ".pushsection .text.unlikely, \"ax\"\n"
+                     "3: xorl %[ok], %[ok]\n"
+                     "   jmp 2b\n"
+                     ".popsection\n" MEMCTL_SPACE_FIXUP("1b", "3b")
+                     : [ok] "+r"(ok)
+                     : [ptr] "r"(ptr), [val] "q"(val)
+                     : "memory");
+    return ok;
+}
+
+static inline bool memctl_space_store_u32(uint8_t *ptr, uint32_t val) {
+    uint32_t ok = 1;
+    __asm__ volatile("1: movl %[val], (%[ptr])\n"
+                     "2:\n"
+                     ".pushsection .text.unlikely, \"ax\"\n"
+                     "3: xorl %[ok], %[ok]\n"
+                     "   jmp 2b\n"
+                     ".popsection\n" MEMCTL_SPACE_FIXUP("1b", "3b")
+                     : [ok] "+r"(ok)
+                     : [ptr] "r"(ptr), [val] "r"(val)
+                     : "memory");
+    return ok;
+}
+/// @}
+
+#else
+
+static inline bool memctl_space_load_u8(const uint8_t *ptr, uint8_t *out) {
+    (void)ptr;
+    (void)out;
+    return false;
+}
+
+static inline bool memctl_space_load_u32(const uint8_t *ptr, uint32_t *out) {
+    (void)ptr;
+    (void)out;
+    return false;
+}
+
+static inline bool memctl_space_store_u8(uint8_t *ptr, uint8_t val) {
+    (void)ptr;
+    (void)val;
+    return false;
+}
+
+static inline bool memctl_space_store_u32(uint8_t *ptr, uint32_t val) {
+    (void)ptr;
+    (void)val;
+    return false;
+}
+
+#endif
@@ -0,0 +1,37 @@
+/**
+ * @file page_bitmap.c
+ * Sparse page bitmap implementation.
+ */
+
+#include <stdlib.h>
+
+#include "debugm.h"
+
+#include <fcvm/page_bitmap.h>
+
+void mem_page_bitmap_set(mem_page_bitmap_t *bitmap, uint32_t page) {
+    D_ASSERT(bitmap);
+    uint64_t **p_leaf = &bitmap->leaves[page / MEM_PAGE_BITMAP_LEAF_BITS];
+    if (!*p_leaf) {
+        *p_leaf = calloc(MEM_PAGE_BITMAP_LEAF_BITS / 64, sizeof(uint64_t));
+        D_ASSERT(*p_leaf);
+    }
+    const uint32_t bit = page % MEM_PAGE_BITMAP_LEAF_BITS;
+    (*p_leaf)[bit / 64] |= 1ULL << (bit % 64);
+}
+
+void mem_page_bitmap_clear(mem_page_bitmap_t *bitmap, uint32_t page) {
+    D_ASSERT(bitmap);
+    uint64_t *leaf = bitmap->leaves[page / MEM_PAGE_BITMAP_LEAF_BITS];
+    if (!leaf) { return; }
+    const uint32_t bit = page % MEM_PAGE_BITMAP_LEAF_BITS;
+    leaf[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+void mem_page_bitmap_reset(mem_page_bitmap_t *bitmap) {
+    D_ASSERT(bitmap);
+    for (size_t idx = 0; idx < MEM_PAGE_BITMAP_NUM_LEAVES; idx++) {
+        free(bitmap->leaves[idx]);
+        bitmap->leaves[idx] = NULL;
+    }
+}
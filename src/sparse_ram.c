@@ -0,0 +1,343 @@
+/**
+ * @file sparse_ram.c
+ * Sparse RAM device implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debugm.h"
+#include <fcvm/busctl.h>
+#include <fcvm/sparse_ram.h>
+
+#define SPARSE_RAM_PAGE_MASK (SPARSE_RAM_PAGE_SIZE - 1)
+
+/// Snapshot header, followed by the allocated pages.
+typedef struct {
+    vm_addr_t size;
+    uint8_t fill;
+    uint32_t num_pages;
+} sparse_ram_sn_hdr_t;
+
+static uint8_t *prv_sparse_ram_find_page(const sparse_ram_ctx_t *ctx,
+                                         size_t page_idx);
+static uint8_t *prv_sparse_ram_alloc_page(sparse_ram_ctx_t *ctx,
+                                          size_t page_idx);
+static bool prv_sparse_ram_in_bounds(const sparse_ram_ctx_t *ctx,
+                                     vm_addr_t addr, size_t size);
+static void prv_sparse_ram_read(const sparse_ram_ctx_t *ctx, vm_addr_t addr,
+                                void *out, size_t size);
+static void prv_sparse_ram_write(sparse_ram_ctx_t *ctx, vm_addr_t addr,
+                                 const void *data, size_t size);
+static bool prv_sparse_ram_is_fill(const sparse_ram_ctx_t *ctx,
+                                   const uint8_t *data, size_t size);
+
+sparse_ram_ctx_t *sparse_ram_new(vm_addr_t size, uint8_t fill) {
+    D_ASSERT(size > 0);
+    sparse_ram_ctx_t *ctx = malloc(sizeof(*ctx));
+    D_ASSERT(ctx);
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->size = size;
+    ctx->fill = fill;
+    const size_t num_pages =
+        ((uint64_t)size + SPARSE_RAM_PAGE_SIZE - 1) >> SPARSE_RAM_PAGE_SHIFT;
+    ctx->num_tables =
+        (num_pages + SPARSE_RAM_TABLE_SIZE - 1) >> SPARSE_RAM_TABLE_SHIFT;
+    ctx->tables = calloc(ctx->num_tables, sizeof(*ctx->tables));
+    D_ASSERT(ctx->tables);
+
+    ctx->desc.dev_class = SPARSE_RAM_DEV_CLASS;
+    ctx->desc.region_size = size;
+    ctx->desc.mem_if.read_u8 = sparse_ram_read_u8;
+    ctx->desc.mem_if.read_u32 = sparse_ram_read_u32;
+    ctx->desc.mem_if.write_u8 = sparse_ram_write_u8;
+    ctx->desc.mem_if.write_u32 = sparse_ram_write_u32;
+    ctx->desc.mem_if.get_span = sparse_ram_get_span;
+    ctx->desc.mem_if.read_block = sparse_ram_read_block;
+    ctx->desc.mem_if.write_block = sparse_ram_write_block;
+    ctx->desc.direct_ptr = NULL;
+    ctx->desc.direct_perms = MEM_DIRECT_SPANS;
+    ctx->desc.f_snapshot_size = sparse_ram_snapshot_size;
+    ctx->desc.f_snapshot = sparse_ram_snapshot;
+
+    return ctx;
+}
+
+void sparse_ram_free(sparse_ram_ctx_t *ctx) {
+    D_ASSERT(ctx);
+    for (size_t tbl = 0; tbl < ctx->num_tables; tbl++) {
+        if (!ctx->tables[tbl]) { continue; }
+        for (size_t idx = 0; idx < SPARSE_RAM_TABLE_SIZE; idx++) {
+            free(ctx->tables[tbl][idx]);
+        }
+        free(ctx->tables[tbl]);
+    }
+    free(ctx->tables);
+    free(ctx);
+}
+
+size_t sparse_ram_snapshot_size(const void *v_ctx) {
+    static_assert(SN_SPARSE_RAM_CTX_VER == 1);
+    D_ASSERT(v_ctx);
+    const sparse_ram_ctx_t *ctx = (const sparse_ram_ctx_t *)v_ctx;
+    return sizeof(sparse_ram_sn_hdr_t) +
+           ctx->num_pages * (sizeof(uint32_t) + SPARSE_RAM_PAGE_SIZE);
+}
+
+size_t sparse_ram_snapshot(const void *v_ctx, void *v_buf, size_t max_size) {
+    static_assert(SN_SPARSE_RAM_CTX_VER == 1);
+    D_ASSERT(v_ctx);
+    D_ASSERT(v_buf);
+    const sparse_ram_ctx_t *ctx = (const sparse_ram_ctx_t *)v_ctx;
+    uint8_t *buf = (uint8_t *)v_buf;
+    size_t size = 0;
+
+    // Write the header.
+    sparse_ram_sn_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.size = ctx->size;
+    hdr.fill = ctx->fill;
+    hdr.num_pages = (uint32_t)ctx->num_pages;
+    D_ASSERT(size + sizeof(hdr) <= max_size);
+    memcpy(&buf[size], &hdr, sizeof(hdr));
+    size += sizeof(hdr);
+
+    // Write the index and the contents of each allocated page, in address
+    // order.
+    const size_t num_pages =
+        ((uint64_t)ctx->size + SPARSE_RAM_PAGE_SIZE - 1) >>
+        SPARSE_RAM_PAGE_SHIFT;
+    for (size_t page_idx = 0; page_idx < num_pages; page_idx++) {
+        if (!ctx->tables[page_idx >> SPARSE_RAM_TABLE_SHIFT]) {
+            page_idx |= SPARSE_RAM_TABLE_SIZE - 1;
+            continue;
+        }
+        const uint8_t *page = prv_sparse_ram_find_page(ctx, page_idx);
+        if (!page) { continue; }
+
+        const uint32_t idx32 = (uint32_t)page_idx;
+        D_ASSERT(size + sizeof(idx32) + SPARSE_RAM_PAGE_SIZE <= max_size);
+        memcpy(&buf[size], &idx32, sizeof(idx32));
+        size += sizeof(idx32);
+        memcpy(&buf[size], page, SPARSE_RAM_PAGE_SIZE);
+        size += SPARSE_RAM_PAGE_SIZE;
+    }
+
+    return size;
+}
+
+sparse_ram_ctx_t *sparse_ram_restore(busctl_dev_ctx_t *busdev_ctx,
+                                     const void *v_buf, size_t max_size,
+                                     size_t *out_used_size) {
+    static_assert(SN_SPARSE_RAM_CTX_VER == 1);
+    D_ASSERT(v_buf);
+    D_ASSERT(out_used_size);
+    const uint8_t *buf = (const uint8_t *)v_buf;
+    size_t offset = 0;
+
+    // Read the header.
+    sparse_ram_sn_hdr_t hdr;
+    D_ASSERT(offset + sizeof(hdr) <= max_size);
+    memcpy(&hdr, &buf[offset], sizeof(hdr));
+    offset += sizeof(hdr);
+
+    // Create the device and allocate the saved pages again.
+    sparse_ram_ctx_t *ctx = sparse_ram_new(hdr.size, hdr.fill);
+    for (uint32_t idx = 0; idx < hdr.num_pages; idx++) {
+        uint32_t page_idx;
+        D_ASSERT(offset + sizeof(page_idx) + SPARSE_RAM_PAGE_SIZE <=
+                 max_size);
+        memcpy(&page_idx, &buf[offset], sizeof(page_idx));
+        offset += sizeof(page_idx);
+        D_ASSERT(((uint64_t)page_idx << SPARSE_RAM_PAGE_SHIFT) < ctx->size);
+
+        uint8_t *page = prv_sparse_ram_alloc_page(ctx, page_idx);
+        memcpy(page, &buf[offset], SPARSE_RAM_PAGE_SIZE);
+        offset += SPARSE_RAM_PAGE_SIZE;
+    }
+
+    // Fill in the busctl dev ctx.
+    if (busdev_ctx) {
+        busdev_ctx->mmio.ctx = ctx;
+        busdev_ctx->mmio.mem_if = ctx->desc.mem_if;
+        busdev_ctx->mmio.direct_ptr = NULL;
+        busdev_ctx->snapshot_ctx = ctx;
+        busdev_ctx->f_snapshot_size = sparse_ram_snapshot_size;
+        busdev_ctx->f_snapshot = sparse_ram_snapshot;
+    }
+
+    *out_used_size = offset;
+    return ctx;
+}
+
+vm_err_t sparse_ram_read_u8(void *v_ctx, vm_addr_t addr, uint8_t *out) {
+    D_ASSERT(v_ctx);
+    D_ASSERT(out);
+    const sparse_ram_ctx_t *ctx = (const sparse_ram_ctx_t *)v_ctx;
+    if (!prv_sparse_ram_in_bounds(ctx, addr, 1)) { return VM_ERR_BAD_MEM; }
+    const uint8_t *page =
+        prv_sparse_ram_find_page(ctx, addr >> SPARSE_RAM_PAGE_SHIFT);
+    *out = page ? page[addr & SPARSE_RAM_PAGE_MASK] : ctx->fill;
+    return VM_ERR_NONE;
+}
+
+vm_err_t sparse_ram_read_u32(void *v_ctx, vm_addr_t addr, uint32_t *out) {
+    D_ASSERT(v_ctx);
+    D_ASSERT(out);
+    const sparse_ram_ctx_t *ctx = (const sparse_ram_ctx_t *)v_ctx;
+    if (!prv_sparse_ram_in_bounds(ctx, addr, 4)) { return VM_ERR_BAD_MEM; }
+    prv_sparse_ram_read(ctx, addr, out, 4);
+    return VM_ERR_NONE;
+}
+
+vm_err_t sparse_ram_write_u8(void *v_ctx, vm_addr_t addr, uint8_t val) {
+    D_ASSERT(v_ctx);
+    sparse_ram_ctx_t *ctx = (sparse_ram_ctx_t *)v_ctx;
+    if (!prv_sparse_ram_in_bounds(ctx, addr, 1)) { return VM_ERR_BAD_MEM; }
+    prv_sparse_ram_write(ctx, addr, &val, 1);
+    return VM_ERR_NONE;
+}
+
+vm_err_t sparse_ram_write_u32(void *v_ctx, vm_addr_t addr, uint32_t val) {
+    D_ASSERT(v_ctx);
+    sparse_ram_ctx_t *ctx = (sparse_ram_ctx_t *)v_ctx;
+    if (!prv_sparse_ram_in_bounds(ctx, addr, 4)) { return VM_ERR_BAD_MEM; }
+    prv_sparse_ram_write(ctx, addr, &val, 4);
+    return VM_ERR_NONE;
+}
+
+vm_err_t sparse_ram_read_block(void *v_ctx, vm_addr_t addr, void *out,
+                               size_t size) {
+    D_ASSERT(v_ctx);
+    D_ASSERT(out || size == 0);
+    const sparse_ram_ctx_t *ctx = (const sparse_ram_ctx_t *)v_ctx;
+    if (!prv_sparse_ram_in_bounds(ctx, addr, size)) { return VM_ERR_BAD_MEM; }
+    prv_sparse_ram_read(ctx, addr, out, size);
+    return VM_ERR_NONE;
+}
+
+vm_err_t sparse_ram_write_block(void *v_ctx, vm_addr_t addr, const void *data,
+                                size_t size) {
+    D_ASSERT(v_ctx);
+    D_ASSERT(data || size == 0);
+    sparse_ram_ctx_t *ctx = (sparse_ram_ctx_t *)v_ctx;
+    if (!prv_sparse_ram_in_bounds(ctx, addr, size)) { return VM_ERR_BAD_MEM; }
+    prv_sparse_ram_write(ctx, addr, data, size);
+    return VM_ERR_NONE;
+}
+
+bool sparse_ram_get_span(void *v_ctx, vm_addr_t addr, mem_span_t *out) {
+    D_ASSERT(v_ctx);
+    D_ASSERT(out);
+    sparse_ram_ctx_t *ctx = (sparse_ram_ctx_t *)v_ctx;
+    if (addr >= ctx->size) { return false; }
+
+    const vm_addr_t start = addr & ~(vm_addr_t)SPARSE_RAM_PAGE_MASK;
+    uint8_t *page =
+        prv_sparse_ram_find_page(ctx, addr >> SPARSE_RAM_PAGE_SHIFT);
+    memset(out, 0, sizeof(*out));
+    out->ptr = page;
+    out->start = start;
+    out->end = ctx->size - start > SPARSE_RAM_PAGE_SIZE
+                   ? start + SPARSE_RAM_PAGE_SIZE
+                   : ctx->size;
+    out->perms = page ? MEM_DIRECT_READ | MEM_DIRECT_WRITE : 0;
+    out->mem_if = &ctx->desc.mem_if;
+    out->ctx = ctx;
+    out->cb_base = 0;
+    // Pages are only freed with the device.
+    out->p_gen = NULL;
+    return true;
+}
+
+/// Finds the allocated page @a page_idx, or NULL if it is untouched.
+static uint8_t *prv_sparse_ram_find_page(const sparse_ram_ctx_t *ctx,
+                                         size_t page_idx) {
+    uint8_t **table = ctx->tables[page_idx >> SPARSE_RAM_TABLE_SHIFT];
+    if (!table) { return NULL; }
+    return table[page_idx & (SPARSE_RAM_TABLE_SIZE - 1)];
+}
+
+/**
+ * Allocates the page @a page_idx, and its table if needed, filled with the
+ * fill value.
+ * @returns The page, which may already have been allocated.
+ */
+static uint8_t *prv_sparse_ram_alloc_page(sparse_ram_ctx_t *ctx,
+                                          size_t page_idx) {
+    uint8_t ***p_table = &ctx->tables[page_idx >> SPARSE_RAM_TABLE_SHIFT];
+    if (!*p_table) {
+        *p_table = calloc(SPARSE_RAM_TABLE_SIZE, sizeof(**p_table));
+        D_ASSERT(*p_table);
+    }
+    uint8_t **p_page = &(*p_table)[page_idx & (SPARSE_RAM_TABLE_SIZE - 1)];
+    if (!*p_page) {
+        *p_page = malloc(SPARSE_RAM_PAGE_SIZE);
+        D_ASSERT(*p_page);
+        memset(*p_page, ctx->fill, SPARSE_RAM_PAGE_SIZE);
+        ctx->num_pages++;
+    }
+    return *p_page;
+}
+
+/// Checks that [@a addr, @a addr + @a size) is in the device memory.
+static bool prv_sparse_ram_in_bounds(const sparse_ram_ctx_t *ctx,
+                                     vm_addr_t addr, size_t size) {
+    return addr <= ctx->size && size <= ctx->size - addr;
+}
+
+/// Reads an in-bounds range, page by page.
+static void prv_sparse_ram_read(const sparse_ram_ctx_t *ctx, vm_addr_t addr,
+                                void *out, size_t size) {
+    uint8_t *dst = (uint8_t *)out;
+    while (size > 0) {
+        const size_t offset = addr & SPARSE_RAM_PAGE_MASK;
+        size_t chunk = SPARSE_RAM_PAGE_SIZE - offset;
+        if (chunk > size) { chunk = size; }
+
+        const uint8_t *page =
+            prv_sparse_ram_find_page(ctx, addr >> SPARSE_RAM_PAGE_SHIFT);
+        if (page) {
+            memcpy(dst, &page[offset], chunk);
+        } else {
+            memset(dst, ctx->fill, chunk);
+        }
+        dst += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+}
+
+/**
+ * Writes an in-bounds range, page by page. Untouched pages are only allocated
+ * if the bytes written to them differ from the fill value.
+ */
+static void prv_sparse_ram_write(sparse_ram_ctx_t *ctx, vm_addr_t addr,
+                                 const void *data, size_t size) {
+    const uint8_t *src = (const uint8_t *)data;
+    while (size > 0) {
+        const size_t offset = addr & SPARSE_RAM_PAGE_MASK;
+        size_t chunk = SPARSE_RAM_PAGE_SIZE - offset;
+        if (chunk > size) { chunk = size; }
+
+        const size_t page_idx = addr >> SPARSE_RAM_PAGE_SHIFT;
+        uint8_t *page = prv_sparse_ram_find_page(ctx, page_idx);
+        if (!page && !prv_sparse_ram_is_fill(ctx, src, chunk)) {
+            page = prv_sparse_ram_alloc_page(ctx, page_idx);
+        }
+        if (page) { memcpy(&page[offset], src, chunk); }
+        src += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+}
+
+/// Checks whether the @a size bytes at @a data all have the fill value.
+static bool prv_sparse_ram_is_fill(const sparse_ram_ctx_t *ctx,
+                                   const uint8_t *data, size_t size) {
+    for (size_t idx = 0; idx < size; idx++) {
+        if (data[idx] != ctx->fill) { return false; }
+    }
+    return true;
+}
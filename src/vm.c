@@ -9,6 +9,8 @@
 #include "debugm.h"
 #include <fcvm/vm.h>
 
+static void prv_vm_code_write(void *ctx, vm_addr_t addr, uint32_t size);
+
 vm_ctx_t *vm_new(void) {
     vm_ctx_t *vm = malloc(sizeof(*vm));
     D_ASSERT(vm);
@@ -16,6 +18,7 @@ vm_ctx_t *vm_new(void) {
 
     vm->memctl = memctl_new();
     vm->cpu = cpu_new(&vm->memctl->intf);
+    memctl_set_code_watch(vm->memctl, prv_vm_code_write, vm->cpu);
     vm->busctl = busctl_new(vm->memctl, vm->cpu->intctl);
 
     return vm;
@@ -31,8 +34,8 @@ void vm_free(vm_ctx_t *vm) {
 
 size_t vm_snapshot_size(const vm_ctx_t *vm) {
     static_assert(SN_VM_CTX_VER == 1);
-    return sizeof(vm_ctx_t) + memctl_snapshot_size() + cpu_snapshot_size() +
-           busctl_snapshot_size(vm->busctl);
+    return sizeof(vm_ctx_t) + memctl_snapshot_size(vm->memctl) +
+           cpu_snapshot_size() + busctl_snapshot_size(vm->busctl);
 }
 
 size_t vm_snapshot(const vm_ctx_t *vm, void *v_buf, size_t max_size) {
@@ -92,6 +95,7 @@ vm_ctx_t *vm_restore(cb_restore_dev_t f_restore_dev, const void *v_buf,
     vm->cpu = cpu_restore(&vm->memctl->intf, &buf[offset], max_size - offset,
                           &cpu_size);
     offset += cpu_size;
+    memctl_set_code_watch(vm->memctl, prv_vm_code_write, vm->cpu);
 
     // Restore the busctl context.
     size_t busctl_size = 0;
@@ -115,3 +119,81 @@ void vm_step(vm_ctx_t *vm) {
     D_ASSERT(vm->cpu);
     cpu_step(vm->cpu);
 }
+
+cpu_stop_t vm_run(vm_ctx_t *vm, size_t max_instrs, size_t *out_num_instrs) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    return cpu_run(vm->cpu, max_instrs, out_num_instrs);
+}
+
+cpu_stop_t vm_run_cycles(vm_ctx_t *vm, uint64_t budget,
+                         uint64_t *out_used_cycles, uint64_t *out_overshoot) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    return cpu_run_cycles(vm->cpu, budget, out_used_cycles, out_overshoot);
+}
+
+bool vm_wait_irq(vm_ctx_t *vm, int timeout_ms) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    return intctl_wait(vm->cpu->intctl, timeout_ms);
+}
+
+void vm_wake(vm_ctx_t *vm) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    intctl_wake(vm->cpu->intctl);
+}
+
+int vm_wait_fd(const vm_ctx_t *vm) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    return intctl_wait_fd(vm->cpu->intctl);
+}
+
+void vm_set_trace(vm_ctx_t *vm, cpu_trace_t *trace) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    cpu_set_trace(vm->cpu, trace);
+}
+
+void vm_set_engine(vm_ctx_t *vm, cpu_engine_t engine) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    cpu_set_engine(vm->cpu, engine);
+}
+
+void vm_set_tiers(vm_ctx_t *vm, const cpu_tier_cfg_t *cfg) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    cpu_set_tiers(vm->cpu, cfg);
+}
+
+const cpu_tier_stats_t *vm_tier_stats(const vm_ctx_t *vm) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    return &vm->cpu->tier_stats;
+}
+
+uint64_t vm_num_code_writes(const vm_ctx_t *vm) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    return cpu_num_code_writes(vm->cpu);
+}
+
+vm_err_t vm_load_aot(vm_ctx_t *vm, const char *path, const void *rom,
+                     size_t rom_size) {
+    D_ASSERT(vm);
+    D_ASSERT(vm->cpu);
+    const vm_err_t err = cpu_load_aot(vm->cpu, path, rom, rom_size);
+    if (err != VM_ERR_NONE) { return err; }
+    if (vm->cpu->engine == CPU_ENGINE_INTERP) {
+        cpu_set_engine(vm->cpu, CPU_ENGINE_BLOCKS);
+    }
+    return VM_ERR_NONE;
+}
+
+/// Invalidates the code of the VM CPU written through the memory controller.
+static void prv_vm_code_write(void *ctx, vm_addr_t addr, uint32_t size) {
+    cpu_note_code_write((cpu_ctx_t *)ctx, addr, size);
+}
@@ -17,9 +17,15 @@ struct TestDevice {
             .mem_if = {.read_u8 = nullptr,
                        .read_u32 = read_u32,
                        .write_u8 = nullptr,
-                       .write_u32 = write_u32},
+                       .write_u32 = write_u32,
+                       .get_span = nullptr,
+                       .read_block = nullptr,
+                       .write_block = nullptr},
+            .direct_ptr = nullptr,
+            .direct_perms = 0,
             .f_snapshot_size = nullptr,
             .f_snapshot = nullptr,
+            .f_set_notify = nullptr,
         };
     }
 
@@ -79,13 +85,20 @@ TEST_F(BusCtlTest, RegisterDevice) {
         .read_u32 = NULL,
         .write_u8 = NULL,
         .write_u32 = NULL,
+        .get_span = NULL,
+        .read_block = NULL,
+        .write_block = NULL,
     };
+    uint8_t dev_bytes[10] = {};
     dev_desc_t req = {
         .dev_class = 0xAA,
         .region_size = 10,
         .mem_if = mem_if,
+        .direct_ptr = dev_bytes,
+        .direct_perms = MEM_DIRECT_READ,
         .f_snapshot_size = nullptr,
         .f_snapshot = nullptr,
+        .f_set_notify = nullptr,
     };
 
     const busctl_dev_ctx_t *dev_ctx = nullptr;
@@ -96,6 +109,34 @@ TEST_F(BusCtlTest, RegisterDevice) {
     EXPECT_EQ(dev_ctx->dev_class, req.dev_class);
     EXPECT_EQ(dev_ctx->mmio.ctx, &mem_ctx);
     EXPECT_EQ(dev_ctx->mmio.end - dev_ctx->mmio.start, req.region_size);
+    EXPECT_EQ(dev_ctx->mmio.direct_ptr, dev_bytes);
+    EXPECT_EQ(dev_ctx->mmio.direct_perms, MEM_DIRECT_READ);
+}
+
+TEST_F(BusCtlTest, ConnectGivesNotifyFunction) {
+    struct NotifyingDevice {
+        TestDevice dev;
+        cb_notify_dev_t f_notify = nullptr;
+        void *notify_ctx = nullptr;
+
+        static void set_notify(void *ctx, cb_notify_dev_t f_notify,
+                               void *notify_ctx) {
+            auto *self = reinterpret_cast<NotifyingDevice *>(ctx);
+            self->f_notify = f_notify;
+            self->notify_ctx = notify_ctx;
+        }
+    } dev;
+    dev_desc_t req = dev.dev.build_req();
+    req.f_set_notify = NotifyingDevice::set_notify;
+
+    const busctl_dev_ctx_t *dev_ctx = nullptr;
+    ASSERT_EQ(busctl_connect_dev(busctl, &req, &dev, &dev_ctx), VM_ERR_NONE);
+    EXPECT_TRUE(dev_ctx->mmio.notifies_changes);
+    ASSERT_NE(dev.f_notify, nullptr);
+
+    const uint32_t gen = intctl_dev_change_gen(intctl);
+    dev.f_notify(dev.notify_ctx);
+    EXPECT_EQ(intctl_dev_change_gen(intctl), gen + 1);
 }
 
 TEST_F(BusCtlTest, RegisterMaxDevices) {
@@ -112,13 +153,19 @@ TEST_F(BusCtlTest, RegisterMaxDevices) {
         mem_if = {.read_u8 = NULL,
                   .read_u32 = NULL,
                   .write_u8 = NULL,
-                  .write_u32 = NULL};
+                  .write_u32 = NULL,
+                  .get_span = NULL,
+                  .read_block = NULL,
+                  .write_block = NULL};
         req = {
             .dev_class = (uint8_t)idx_dev,
             .region_size = 10 + (vm_addr_t)idx_dev,
             .mem_if = mem_if,
+            .direct_ptr = nullptr,
+            .direct_perms = 0,
             .f_snapshot_size = nullptr,
             .f_snapshot = nullptr,
+            .f_set_notify = nullptr,
         };
 
         vm_err_t err = busctl_connect_dev(busctl, &req, &mem_ctx, &dev_ctx);
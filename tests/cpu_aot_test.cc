@@ -0,0 +1,125 @@
+#include <fstream>
+#include <string>
+
+#include <dlfcn.h>
+
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include <fcvm/cpu_aot.h>
+#include "testcommon/cpu_engine_test.h"
+
+#define TEST_MEM_BASE CPU_IVT_ADDR
+#define TEST_MEM_SIZE 8192
+
+#define TEST_PROG_START (CPU_IVT_ADDR + CPU_IVT_SIZE)
+
+/// Runs the same ROM with the interpreter and with its translated code.
+class CPUAOTTest : public CPUEngineTest {
+  protected:
+    CPUAOTTest() : CPUEngineTest(CPU_ENGINE_BLOCKS, TEST_MEM_SIZE) {}
+
+    /**
+     * Makes a ROM image mapped at 0 with @a prog at #TEST_PROG_START, which is
+     * also the reset entry point.
+     */
+    static std::vector<uint8_t> build_rom(const std::vector<uint8_t> &prog) {
+        std::vector<uint8_t> rom(TEST_PROG_START - TEST_MEM_BASE);
+        const vm_addr_t entry = TEST_PROG_START;
+        memcpy(&rom[CPU_IVT_ENTRY_ADDR(0) - TEST_MEM_BASE], &entry,
+               sizeof(entry));
+        rom.insert(rom.end(), prog.begin(), prog.end());
+        return rom;
+    }
+
+    /**
+     * Translates @a rom and compiles it, like `fcvm_add_aot_module()` does.
+     * @returns Path of the shared object.
+     */
+    std::string translate(const std::vector<uint8_t> &rom) {
+        const std::string base =
+            testing::TempDir() +
+            testing::UnitTest::GetInstance()->current_test_info()->name();
+        std::ofstream(base + ".bin", std::ios::binary)
+            .write((const char *)rom.data(), rom.size());
+
+        const std::string tool = std::string(TEST_AOT_TOOL) + " " + base +
+                                 ".bin --output " + base + ".c";
+        EXPECT_EQ(std::system(tool.c_str()), 0) << tool;
+        const std::string cc =
+            std::string(TEST_AOT_CC) + " " + base + ".c -o " + base + ".so";
+        EXPECT_EQ(std::system(cc.c_str()), 0) << cc;
+
+        // Something has been translated.
+        const std::string path = base + ".so";
+        void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        EXPECT_NE(handle, nullptr) << dlerror();
+        if (handle) {
+            const auto *module = (const cpu_aot_module_t *)dlsym(
+                handle, CPU_AOT_MODULE_SYM);
+            EXPECT_NE(module, nullptr);
+            if (module) { EXPECT_GT(module->num_blocks, 0u); }
+            dlclose(handle);
+        }
+        return path;
+    }
+
+    /// Translates and loads @a rom into the second CPU.
+    void load(const std::vector<uint8_t> &rom) {
+        write(TEST_MEM_BASE, rom);
+        const std::string path = translate(rom);
+        ASSERT_EQ(cpu_load_aot(cpus[1], path.c_str(), rom.data(), rom.size()),
+                  VM_ERR_NONE);
+    }
+};
+
+TEST_F(CPUAOTTest, TranslatedROMRunsLikeInterpreter) {
+    load(build_rom(build_sum_prog(41)));
+    run_until_halt();
+}
+
+TEST_F(CPUAOTTest, RejectsOtherROM) {
+    std::vector<uint8_t> rom = build_rom(build_sum_prog(41));
+    const std::string path = translate(rom);
+
+    EXPECT_EQ(cpu_load_aot(cpus[1], "does-not-exist.so", rom.data(),
+                           rom.size()),
+              VM_ERR_AOT_LOAD);
+    rom.back() ^= 1;
+    EXPECT_EQ(cpu_load_aot(cpus[1], path.c_str(), rom.data(), rom.size()),
+              VM_ERR_AOT_MISMATCH);
+    EXPECT_EQ(cpu_load_aot(cpus[1], path.c_str(), rom.data(), rom.size() - 1),
+              VM_ERR_AOT_MISMATCH);
+    EXPECT_EQ(cpus[1]->aot, nullptr);
+}
+
+TEST_F(CPUAOTTest, SelfModifiedCodeFallsBack) {
+    // The translated loop patches the immediate of the translated code it
+    // jumps to, which must be interpreted from then on.
+    constexpr vm_addr_t loop_start = TEST_PROG_START + 6;
+    constexpr vm_addr_t patched_code = TEST_PROG_START + 256;
+    ProgBuilder prog = build_prog();
+    prog.instr(build_instr(CPU_OP_MOV_VR)
+                   .reg_code(CPU_CODE_R1)
+                   .imm32(patched_code + 2))
+        // loop:
+        .instr(build_instr(CPU_OP_ADD_RV).reg_code(CPU_CODE_R0).imm32(1))
+        .instr(build_instr(CPU_OP_STR_RI0)
+                   .reg_code(CPU_CODE_R1)
+                   .reg_code(CPU_CODE_R0))
+        .instr(build_instr(CPU_OP_JMPA_V32).imm32(patched_code));
+    prog.bytes.resize(patched_code - TEST_PROG_START);
+    prog.instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R2).imm32(0))
+        .instr(build_instr(CPU_OP_CMP_RR)
+                   .reg_code(CPU_CODE_R2)
+                   .reg_code(CPU_CODE_R4))
+        .instr(build_instr(CPU_OP_JNEA_V32).imm32(loop_start))
+        .instr(build_instr(CPU_OP_HALT));
+    load(build_rom(prog.bytes));
+    for (cpu_ctx_t *cpu : cpus) {
+        cpu->gp_regs[4] = 20;
+    }
+
+    run_until_halt();
+    EXPECT_EQ(cpus[1]->gp_regs[0], 20u);
+}
@@ -0,0 +1,499 @@
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include "testcommon/cpu_engine_test.h"
+
+#define TEST_MEM_BASE  CPU_IVT_ADDR
+#define TEST_MEM_SIZE  2048
+#define TEST_STACK_TOP (TEST_MEM_BASE + TEST_MEM_SIZE)
+
+#define TEST_PROG_START (CPU_IVT_ADDR + CPU_IVT_SIZE)
+#define TEST_ISR_START  (TEST_PROG_START + 256)
+#define TEST_IRQ_ADDR   (TEST_STACK_TOP - 256)
+#define TEST_IRQ_LINE   3
+
+/**
+ * Memory that can be read directly but is written through the callbacks, and
+ * raises an IRQ when a byte is stored at #TEST_IRQ_ADDR.
+ */
+struct IrqMem {
+    mem_if_t mem_if; // must be the first member
+    FakeMem *backing = nullptr;
+    cpu_ctx_t *cpu = nullptr;
+
+    void wrap(FakeMem *abacking) {
+        backing = abacking;
+        mem_if = backing->mem_if;
+        mem_if.write_u8 = write_u8;
+        mem_if.write_u32 = write_u32;
+        mem_if.get_span = get_span;
+    }
+
+    static IrqMem *from_ctx(void *ctx) {
+        return reinterpret_cast<IrqMem *>(ctx);
+    }
+
+    static vm_err_t write_u8(void *ctx, vm_addr_t addr, uint8_t val) {
+        IrqMem *mem = from_ctx(ctx);
+        if (addr == TEST_IRQ_ADDR) { cpu_raise_irq(mem->cpu, TEST_IRQ_LINE); }
+        return mem->backing->write(addr, &val, 1);
+    }
+    static vm_err_t write_u32(void *ctx, vm_addr_t addr, uint32_t val) {
+        return from_ctx(ctx)->backing->write(addr, &val, 4);
+    }
+    static bool get_span(void *ctx, vm_addr_t addr, mem_span_t *out) {
+        IrqMem *mem = from_ctx(ctx);
+        if (addr < mem->backing->base || addr >= mem->backing->end) {
+            return false;
+        }
+        out->ptr = mem->backing->bytes;
+        out->start = mem->backing->base;
+        out->end = mem->backing->end;
+        out->perms = MEM_DIRECT_READ;
+        out->mem_if = &mem->mem_if;
+        out->ctx = mem;
+        out->cb_base = 0;
+        out->p_gen = nullptr;
+        return true;
+    }
+};
+
+/// Runs the same program with both engines, which must agree on everything.
+class CPUBlockTest : public CPUEngineTest {
+  protected:
+    CPUBlockTest() : CPUEngineTest(CPU_ENGINE_BLOCKS, TEST_MEM_SIZE) {
+        mem_if_t *mem_ifs[2];
+        for (size_t idx = 0; idx < 2; idx++) {
+            irq_mems[idx].wrap(mems[idx]);
+            mem_ifs[idx] = &irq_mems[idx].mem_if;
+        }
+        use_mem_ifs(mem_ifs);
+        for (size_t idx = 0; idx < 2; idx++) {
+            irq_mems[idx].cpu = cpus[idx];
+        }
+    }
+
+    /// Sums the numbers from 10 down to 1 into r0, then halts.
+    static std::vector<uint8_t> build_sum_loop() {
+        return build_prog()
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(0))
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R1).imm32(10))
+            // loop:
+            .instr(build_instr(CPU_OP_ADD_RR)
+                       .reg_code(CPU_CODE_R0)
+                       .reg_code(CPU_CODE_R1))
+            .instr(build_instr(CPU_OP_SUB_RV).reg_code(CPU_CODE_R1).imm32(1))
+            .instr(build_instr(CPU_OP_JNER_V8).imm8((uint8_t)-9))
+            .instr(build_instr(CPU_OP_HALT))
+            .bytes;
+    }
+
+    /**
+     * Compares @a lhs in r0 with @a rhs, then jumps with @a jump to code that
+     * sets r3 to 2 instead of 1, then halts.
+     */
+    static std::vector<uint8_t> build_compare_and_branch(uint8_t compare,
+                                                         uint8_t jump,
+                                                         uint32_t lhs,
+                                                         uint32_t rhs) {
+        const vm_addr_t jump_addr =
+            TEST_PROG_START + 3 * 6 + (compare == CPU_OP_TST_RV ? 6 : 3);
+        const vm_addr_t target = jump_addr + ((jump & 3) == 1 ? 5 : 2) + 7;
+
+        InstrBuilder compare_instr = build_instr(compare);
+        compare_instr.reg_code(CPU_CODE_R0);
+        if (compare == CPU_OP_TST_RV) {
+            compare_instr.imm32(rhs);
+        } else {
+            compare_instr.reg_code(CPU_CODE_R1);
+        }
+        InstrBuilder jump_instr = build_instr(jump);
+        if ((jump & 3) == 0) {
+            jump_instr.imm8((uint8_t)(target - jump_addr));
+        } else if ((jump & 3) == 1) {
+            jump_instr.imm32(target);
+        } else {
+            jump_instr.reg_code(CPU_CODE_R2);
+        }
+        return build_prog()
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(lhs))
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R1).imm32(rhs))
+            .instr(
+                build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R2).imm32(target))
+            .instr(compare_instr)
+            .instr(jump_instr)
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R3).imm32(1))
+            .instr(build_instr(CPU_OP_HALT))
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R3).imm32(2))
+            .instr(build_instr(CPU_OP_HALT))
+            .bytes;
+    }
+
+    /// Writes @a prog and restarts both CPUs at its start.
+    void restart(const std::vector<uint8_t> &prog) {
+        write(TEST_PROG_START, prog);
+        for (cpu_ctx_t *cpu : cpus) {
+            cpu_flush_icache(cpu);
+            cpu->state = CPU_FETCH_DECODE_OPCODE;
+            cpu->reg_pc = TEST_PROG_START;
+        }
+    }
+
+    /// Wrap #mems and raise IRQs on the CPU of the same index.
+    IrqMem irq_mems[2];
+};
+
+TEST_F(CPUBlockTest, RunsLikeInterpreter) {
+    write(TEST_PROG_START, build_sum_loop());
+    ASSERT_EQ(run_both(1000), CPU_STOP_HALTED);
+    EXPECT_EQ(cpus[1]->gp_regs[0], 55);
+}
+
+TEST_F(CPUBlockTest, InstructionBudgetSplitsBlocks) {
+    write(TEST_PROG_START, build_sum_loop());
+    for (size_t max_instrs = 1; max_instrs < 5; max_instrs++) {
+        for (size_t slice = 0; slice < 4; slice++) {
+            run_both(max_instrs);
+        }
+    }
+    ASSERT_EQ(run_both(1000), CPU_STOP_HALTED);
+    EXPECT_EQ(cpus[1]->gp_regs[0], 55);
+}
+
+TEST_F(CPUBlockTest, CycleBudgetSplitsBlocks) {
+    write(TEST_PROG_START, build_sum_loop());
+    for (uint64_t budget = 1; budget < 5; budget++) {
+        for (size_t slice = 0; slice < 4; slice++) {
+            run_both_cycles(budget);
+        }
+    }
+    ASSERT_EQ(run_both_cycles(1000), CPU_STOP_HALTED);
+    EXPECT_EQ(cpus[1]->gp_regs[0], 55);
+}
+
+TEST_F(CPUBlockTest, StoreToOwnBlockIsSeen) {
+    // The store overwrites the immediate of the next instruction in the same
+    // block, the new value must be used right away.
+    constexpr vm_addr_t patched_imm = TEST_PROG_START + 6 + 3 + 2;
+    write(TEST_PROG_START,
+          build_prog()
+              .instr(build_instr(CPU_OP_MOV_VR)
+                         .reg_code(CPU_CODE_R1)
+                         .imm32(patched_imm))
+              .instr(build_instr(CPU_OP_STR_RI0)
+                         .reg_code(CPU_CODE_R1)
+                         .reg_code(CPU_CODE_R1))
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(1))
+              .instr(build_instr(CPU_OP_HALT))
+              .bytes);
+    ASSERT_EQ(run_both(100), CPU_STOP_HALTED);
+    EXPECT_EQ(cpus[1]->gp_regs[0], patched_imm);
+}
+
+TEST_F(CPUBlockTest, StoreToNextLineIsSeen) {
+    // Blocks are validated with the line of their start only. The loop starts
+    // right before an instruction cache line (256 bytes) boundary, and stores
+    // its counter into the immediate of the instruction right after it.
+    constexpr vm_addr_t line_end = TEST_PROG_START + 256;
+    constexpr vm_addr_t loop = line_end - 6;
+    constexpr vm_addr_t patched_imm = line_end + 2;
+    write(loop - 12,
+          build_prog()
+              .instr(build_instr(CPU_OP_MOV_VR)
+                         .reg_code(CPU_CODE_R1)
+                         .imm32(patched_imm))
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R3).imm32(3))
+              // loop:
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R2).imm32(5))
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(1))
+              .instr(build_instr(CPU_OP_STR_RI0)
+                         .reg_code(CPU_CODE_R1)
+                         .reg_code(CPU_CODE_R3))
+              .instr(build_instr(CPU_OP_SUB_RV).reg_code(CPU_CODE_R3).imm32(1))
+              .instr(build_instr(CPU_OP_JNER_V8).imm8((uint8_t)-21))
+              .instr(build_instr(CPU_OP_HALT))
+              .bytes);
+    for (cpu_ctx_t *cpu : cpus) {
+        cpu->reg_pc = loop - 12;
+    }
+    ASSERT_EQ(run_both(100), CPU_STOP_HALTED);
+    EXPECT_EQ(cpus[1]->gp_regs[0], 2);
+}
+
+TEST_F(CPUBlockTest, IRQRaisedByStoreIsTakenAfterIt) {
+    write_ivt_entry(CPU_IVT_FIRST_IRQ_ENTRY + TEST_IRQ_LINE, TEST_ISR_START);
+    write(TEST_ISR_START,
+          build_prog()
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R2).imm32(7))
+              .instr(build_instr(CPU_OP_HALT))
+              .bytes);
+    write(TEST_PROG_START,
+          build_prog()
+              .instr(build_instr(CPU_OP_MOV_VR)
+                         .reg_code(CPU_CODE_R1)
+                         .imm32(TEST_IRQ_ADDR))
+              .instr(build_instr(CPU_OP_STR_RI0)
+                         .reg_code(CPU_CODE_R1)
+                         .reg_code(CPU_CODE_R1 | CPU_REG_REF_SIZE_8))
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(1))
+              .instr(build_instr(CPU_OP_HALT))
+              .bytes);
+    for (size_t slice = 0; slice < 4; slice++) {
+        run_both(2);
+    }
+    EXPECT_EQ(cpus[1]->gp_regs[2], 7);
+    EXPECT_EQ(cpus[1]->gp_regs[0], 0);
+}
+
+TEST_F(CPUBlockTest, ExceptionStopsBlock) {
+    write_ivt_entry(CPU_EXC_DIV_BY_ZERO, TEST_ISR_START);
+    write(TEST_ISR_START, build_prog().instr(build_instr(CPU_OP_HALT)).bytes);
+    write(TEST_PROG_START,
+          build_prog()
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(1))
+              .instr(build_instr(CPU_OP_DIV_RR)
+                         .reg_code(CPU_CODE_R0)
+                         .reg_code(CPU_CODE_R1))
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R2).imm32(1))
+              .instr(build_instr(CPU_OP_HALT))
+              .bytes);
+    ASSERT_EQ(run_both(100), CPU_STOP_EXCEPTION);
+    EXPECT_EQ(cpus[1]->pc_after_isr, TEST_PROG_START + 6);
+    ASSERT_EQ(run_both(100), CPU_STOP_HALTED);
+    EXPECT_EQ(cpus[1]->gp_regs[2], 0);
+}
+
+TEST_F(CPUBlockTest, TracesEveryInstruction) {
+    write(TEST_PROG_START, build_sum_loop());
+    cpu_trace_t *traces[2];
+    for (size_t idx = 0; idx < 2; idx++) {
+        traces[idx] = cpu_trace_new(64);
+        cpu_set_trace(cpus[idx], traces[idx]);
+    }
+    ASSERT_EQ(run_both(1000), CPU_STOP_HALTED);
+
+    cpu_trace_rec_t recs[2][64];
+    size_t num_recs[2];
+    for (size_t idx = 0; idx < 2; idx++) {
+        num_recs[idx] = cpu_trace_drain(traces[idx], recs[idx], 64, NULL);
+        cpu_trace_free(traces[idx]);
+    }
+    ASSERT_EQ(num_recs[1], num_recs[0]);
+    for (size_t rec = 0; rec < num_recs[0]; rec++) {
+        EXPECT_EQ(recs[1][rec].pc, recs[0][rec].pc) << rec;
+        EXPECT_EQ(recs[1][rec].cycle, recs[0][rec].cycle) << rec;
+        EXPECT_EQ(recs[1][rec].flags, recs[0][rec].flags) << rec;
+    }
+}
+
+TEST_F(CPUBlockTest, FusedCompareAndBranchRunsLikeInterpreter) {
+    const uint8_t compares[] = {CPU_OP_CMP_RR, CPU_OP_TST_RR, CPU_OP_TST_RV};
+    const uint8_t jumps[] = {CPU_OP_JEQR_V8, CPU_OP_JNER_V8, CPU_OP_JGTR_V8,
+                             CPU_OP_JGER_V8, CPU_OP_JLTR_V8, CPU_OP_JLER_V8};
+    const uint32_t vals[] = {0, 1, 5, UINT32_MAX, 0x7FFFFFFF, 0x80000000};
+
+    for (bool fusion : {true, false}) {
+        cpu_set_fusion(cpus[1], fusion);
+        for (uint8_t compare : compares) {
+            for (uint8_t jump : jumps) {
+                for (uint8_t form = 0; form < 3; form++) {
+                    for (uint32_t lhs : vals) {
+                        for (uint32_t rhs : vals) {
+                            SCOPED_TRACE(testing::Message()
+                                         << "opcodes " << +compare << " "
+                                         << +(jump + form) << ", values "
+                                         << lhs << " " << rhs << ", fusion "
+                                         << fusion);
+                            restart(build_compare_and_branch(
+                                compare, jump + form, lhs, rhs));
+                            ASSERT_EQ(run_both(100), CPU_STOP_HALTED);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_F(CPUBlockTest, CountsOpcodePairs) {
+    auto hist = std::make_unique<cpu_pair_hist_t>();
+    cpu_set_pair_hist(cpus[1], hist.get());
+    write(TEST_PROG_START, build_sum_loop());
+    ASSERT_EQ(run_both(1000), CPU_STOP_HALTED);
+
+    EXPECT_EQ(hist->counts[CPU_OP_MOV_VR][CPU_OP_MOV_VR], 1);
+    EXPECT_EQ(hist->counts[CPU_OP_ADD_RR][CPU_OP_SUB_RV], 10);
+    EXPECT_EQ(hist->counts[CPU_OP_SUB_RV][CPU_OP_JNER_V8], 10);
+    EXPECT_EQ(hist->counts[CPU_OP_JNER_V8][CPU_OP_ADD_RR], 0);
+    cpu_set_pair_hist(cpus[1], nullptr);
+}
+
+#define TEST_DEV_ADDR (TEST_MEM_BASE + TEST_MEM_SIZE)
+#define TEST_DEV_SIZE 16
+
+/**
+ * RAM followed by a device whose registers all read @a status, and which
+ * notifies its changes if @a notifies.
+ */
+struct PollMem {
+    mem_if_t mem_if; // must be the first member
+    mem_if_t dev_if;
+    FakeMem backing;
+    uint32_t status = 0;
+    uint32_t num_reads = 0;
+    bool notifies = true;
+
+    PollMem() : backing(TEST_MEM_BASE, TEST_MEM_BASE + TEST_MEM_SIZE) {
+        mem_if = backing.mem_if;
+        mem_if.read_u32 = read_u32;
+        mem_if.get_span = get_span;
+        dev_if = {};
+        dev_if.read_u32 = read_u32;
+    }
+
+    static PollMem *from_ctx(void *ctx) {
+        return reinterpret_cast<PollMem *>(ctx);
+    }
+
+    static vm_err_t read_u32(void *ctx, vm_addr_t addr, uint32_t *out) {
+        PollMem *mem = from_ctx(ctx);
+        if (addr >= TEST_DEV_ADDR && addr < TEST_DEV_ADDR + TEST_DEV_SIZE) {
+            mem->num_reads++;
+            *out = mem->status;
+            return VM_ERR_NONE;
+        }
+        return mem->backing.read(addr, out, 4);
+    }
+    static bool get_span(void *ctx, vm_addr_t addr, mem_span_t *out) {
+        PollMem *mem = from_ctx(ctx);
+        if (addr >= TEST_DEV_ADDR && addr < TEST_DEV_ADDR + TEST_DEV_SIZE) {
+            out->start = TEST_DEV_ADDR;
+            out->end = TEST_DEV_ADDR + TEST_DEV_SIZE;
+            out->mem_if = &mem->dev_if;
+            out->ctx = mem;
+            out->notifies_changes = mem->notifies;
+            return true;
+        }
+        if (addr < mem->backing.base || addr >= mem->backing.end) {
+            return false;
+        }
+        out->ptr = mem->backing.bytes;
+        out->start = mem->backing.base;
+        out->end = mem->backing.end;
+        out->perms = MEM_DIRECT_READ | MEM_DIRECT_WRITE;
+        out->mem_if = &mem->mem_if;
+        out->ctx = mem;
+        return true;
+    }
+};
+
+/// Block engine CPU running a loop that polls a device register.
+class CPUIdleTest : public testing::Test {
+  protected:
+    CPUIdleTest() {
+        cpu = cpu_new(&mem.mem_if);
+        cpu->state = CPU_FETCH_DECODE_OPCODE;
+        cpu->reg_pc = TEST_PROG_START;
+        cpu->reg_sp = TEST_STACK_TOP;
+        cpu_set_engine(cpu, CPU_ENGINE_BLOCKS);
+    }
+
+    ~CPUIdleTest() {
+        cpu_free(cpu);
+    }
+
+    /**
+     * Waits until bit 0 of the device register is set, with @a extra inside
+     * the loop, then halts.
+     */
+    void write_poll_loop(std::vector<uint8_t> extra = {}) {
+        ProgBuilder prog = build_prog().instr(build_instr(CPU_OP_MOV_VR)
+                                                  .reg_code(CPU_CODE_R1)
+                                                  .imm32(TEST_DEV_ADDR));
+        const size_t loop_start = prog.bytes.size();
+        prog.instr(extra)
+            .instr(build_instr(CPU_OP_LDR_RI0)
+                       .reg_code(CPU_CODE_R0)
+                       .reg_code(CPU_CODE_R1))
+            .instr(build_instr(CPU_OP_TST_RV).reg_code(CPU_CODE_R0).imm32(1));
+        const size_t loop_size = prog.bytes.size() - loop_start;
+        prog.instr(build_instr(CPU_OP_JEQR_V8).imm8((uint8_t)-loop_size))
+            .instr(build_instr(CPU_OP_HALT));
+        mem.backing.write(TEST_PROG_START, prog.bytes.data(),
+                          prog.bytes.size());
+    }
+
+    /// Makes the handler of #TEST_IRQ_LINE set r2 to 7 and halt.
+    void write_irq_handler() {
+        const vm_addr_t isr_addr = TEST_ISR_START;
+        mem.backing.write(
+            CPU_IVT_ENTRY_ADDR(CPU_IVT_FIRST_IRQ_ENTRY + TEST_IRQ_LINE),
+            &isr_addr, CPU_IVT_ENTRY_SIZE);
+        const std::vector<uint8_t> isr =
+            build_prog()
+                .instr(
+                    build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R2).imm32(7))
+                .instr(build_instr(CPU_OP_HALT))
+                .bytes;
+        mem.backing.write(TEST_ISR_START, isr.data(), isr.size());
+    }
+
+    PollMem mem;
+    cpu_ctx_t *cpu;
+};
+
+TEST_F(CPUIdleTest, ParksUntilDeviceChange) {
+    write_poll_loop();
+    size_t num_instrs = 0;
+    ASSERT_EQ(cpu_run(cpu, 1000, &num_instrs), CPU_STOP_IDLE);
+    EXPECT_LT(num_instrs, 100);
+
+    // Parked: nothing runs until the device notifies a change.
+    const uint64_t cycles = cpu->cycles;
+    const uint32_t num_reads = mem.num_reads;
+    ASSERT_EQ(cpu_run(cpu, 1000, &num_instrs), CPU_STOP_IDLE);
+    EXPECT_EQ(num_instrs, 0);
+    EXPECT_EQ(cpu->cycles, cycles);
+    EXPECT_EQ(mem.num_reads, num_reads);
+    EXPECT_FALSE(intctl_wait(cpu->intctl, 0));
+
+    mem.status = 1;
+    intctl_notify_dev_change(cpu->intctl);
+    ASSERT_EQ(cpu_run(cpu, 1000, &num_instrs), CPU_STOP_HALTED);
+    EXPECT_EQ(cpu->gp_regs[0], 1);
+}
+
+TEST_F(CPUIdleTest, IRQUnparks) {
+    write_irq_handler();
+    write_poll_loop();
+    ASSERT_EQ(cpu_run(cpu, 1000, NULL), CPU_STOP_IDLE);
+
+    ASSERT_EQ(cpu_raise_irq(cpu, TEST_IRQ_LINE), VM_ERR_NONE);
+    ASSERT_EQ(cpu_run(cpu, 1000, NULL), CPU_STOP_HALTED);
+    EXPECT_EQ(cpu->gp_regs[2], 7);
+}
+
+TEST_F(CPUIdleTest, RunsBudgetWithoutNotifications) {
+    mem.notifies = false;
+    write_poll_loop();
+    size_t num_instrs = 0;
+    ASSERT_EQ(cpu_run(cpu, 1000, &num_instrs), CPU_STOP_BUDGET);
+    EXPECT_EQ(num_instrs, 1000);
+}
+
+TEST_F(CPUIdleTest, RunsBudgetWithCarriedRegister) {
+    // A timeout counter changes the state on every run.
+    write_poll_loop(
+        build_instr(CPU_OP_ADD_RV).reg_code(CPU_CODE_R2).imm32(1).bytes);
+    size_t num_instrs = 0;
+    ASSERT_EQ(cpu_run(cpu, 1000, &num_instrs), CPU_STOP_BUDGET);
+    EXPECT_EQ(num_instrs, 1000);
+}
+
+TEST_F(CPUIdleTest, InterpreterRunsBudget) {
+    cpu_set_engine(cpu, CPU_ENGINE_INTERP);
+    write_poll_loop();
+    ASSERT_EQ(cpu_run_cycles(cpu, 1000, NULL, NULL), CPU_STOP_BUDGET);
+}
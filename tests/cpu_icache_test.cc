@@ -0,0 +1,265 @@
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include <fcvm/memctl.h>
+#include "testcommon/fake_mem.h"
+#include "testcommon/prog_builder.h"
+
+#define TEST_MEM_BASE  CPU_IVT_ADDR
+#define TEST_MEM_SIZE  2048
+#define TEST_STACK_TOP (TEST_MEM_BASE + TEST_MEM_SIZE)
+
+#define TEST_PROG_START (CPU_IVT_ADDR + CPU_IVT_SIZE)
+
+class CPUICacheTest : public testing::Test {
+  protected:
+    CPUICacheTest() {
+        mem = new FakeMem(TEST_MEM_BASE, TEST_MEM_BASE + TEST_MEM_SIZE);
+        cpu = cpu_new(&mem->mem_if);
+        restart();
+    }
+
+    ~CPUICacheTest() {
+        cpu_free(cpu);
+        delete mem;
+    }
+
+    void restart() {
+        cpu->state = CPU_FETCH_DECODE_OPCODE;
+        cpu->reg_pc = TEST_PROG_START;
+        cpu->reg_sp = TEST_STACK_TOP;
+    }
+
+    void write_prog(const std::vector<uint8_t> &prog) {
+        mem->write(TEST_PROG_START, prog.data(), prog.size());
+    }
+
+    /// Sets r0 to @a val and halts.
+    static std::vector<uint8_t> build_set_r0(uint32_t val) {
+        return build_prog()
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(val))
+            .instr(build_instr(CPU_OP_HALT))
+            .bytes;
+    }
+
+    FakeMem *mem;
+    cpu_ctx_t *cpu;
+};
+
+TEST_F(CPUICacheTest, StoreToCodeInvalidatesInstruction) {
+    // The loop overwrites the immediate of its first instruction, and exits
+    // once the new value is seen.
+    constexpr vm_addr_t loop_start = TEST_PROG_START + 3 * 6;
+    write_prog(build_prog()
+                   .instr(build_instr(CPU_OP_MOV_VR)
+                              .reg_code(CPU_CODE_R2)
+                              .imm32(0x22222222))
+                   .instr(build_instr(CPU_OP_MOV_VR)
+                              .reg_code(CPU_CODE_R1)
+                              .imm32(loop_start + 2))
+                   .instr(build_instr(CPU_OP_MOV_VR)
+                              .reg_code(CPU_CODE_R3)
+                              .imm32(0))
+                   // loop:
+                   .instr(build_instr(CPU_OP_MOV_VR)
+                              .reg_code(CPU_CODE_R0)
+                              .imm32(0x11111111))
+                   .instr(build_instr(CPU_OP_CMP_RR)
+                              .reg_code(CPU_CODE_R0)
+                              .reg_code(CPU_CODE_R2))
+                   .instr(build_instr(CPU_OP_JEQR_V8).imm8(7))
+                   .instr(build_instr(CPU_OP_STR_RI0)
+                              .reg_code(CPU_CODE_R1)
+                              .reg_code(CPU_CODE_R2))
+                   .instr(build_instr(CPU_OP_JMPR_V8).imm8((uint8_t)-14))
+                   // done:
+                   .instr(build_instr(CPU_OP_HALT))
+                   .bytes);
+
+    size_t num_instrs = 0;
+    ASSERT_EQ(cpu_run(cpu, 100, &num_instrs), CPU_STOP_HALTED);
+    EXPECT_EQ(cpu->gp_regs[0], 0x22222222);
+    EXPECT_EQ(num_instrs, 3 + 5 + 3 + 1);
+}
+
+TEST_F(CPUICacheTest, HostWriteNeedsFlush) {
+    write_prog(build_set_r0(1));
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    ASSERT_EQ(cpu->gp_regs[0], 1);
+
+    // The host writes are not tracked, so the old instruction is still used.
+    write_prog(build_set_r0(2));
+    restart();
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    EXPECT_EQ(cpu->gp_regs[0], 1);
+
+    cpu_flush_icache(cpu);
+    restart();
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    EXPECT_EQ(cpu->gp_regs[0], 2);
+}
+
+TEST_F(CPUICacheTest, SteppingIsNotCached) {
+    write_prog(build_set_r0(1));
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+
+    write_prog(build_set_r0(2));
+    restart();
+    while (cpu->state != CPU_HALTED) {
+        cpu_step(cpu);
+    }
+    EXPECT_EQ(cpu->gp_regs[0], 2);
+}
+
+TEST_F(CPUICacheTest, RemappingFlushesCache) {
+    constexpr vm_addr_t code_start = 0x1000;
+    constexpr vm_addr_t code_size = 0x100;
+    memctl_ctx_t *memctl = memctl_new();
+    FakeMem code_dev(0, code_size, true);
+    mmio_region_t code_reg = {
+        .start = code_start,
+        .end = code_start + code_size,
+        .ctx = &code_dev.mem_if,
+        .mem_if = code_dev.mem_if,
+        .direct_ptr = code_dev.bytes,
+        .direct_perms = MEM_DIRECT_READ,
+        .notifies_changes = false,
+    };
+    ASSERT_EQ(memctl_map_region(memctl, &code_reg), VM_ERR_NONE);
+
+    cpu_ctx_t *memctl_cpu = cpu_new(&memctl->intf);
+    const auto first = build_set_r0(1);
+    code_dev.write(0, first.data(), first.size());
+    memctl_cpu->state = CPU_FETCH_DECODE_OPCODE;
+    memctl_cpu->reg_pc = code_start;
+    ASSERT_EQ(cpu_run(memctl_cpu, 100, NULL), CPU_STOP_HALTED);
+    ASSERT_EQ(memctl_cpu->gp_regs[0], 1);
+
+    // Mapping another region drops the instructions decoded so far.
+    const auto second = build_set_r0(2);
+    code_dev.write(0, second.data(), second.size());
+    FakeMem other_dev(0, 16, true);
+    mmio_region_t other_reg = code_reg;
+    other_reg.start = code_start + code_size;
+    other_reg.end = code_start + code_size + 16;
+    other_reg.ctx = &other_dev.mem_if;
+    other_reg.mem_if = other_dev.mem_if;
+    other_reg.direct_ptr = other_dev.bytes;
+    ASSERT_EQ(memctl_map_region(memctl, &other_reg), VM_ERR_NONE);
+
+    memctl_cpu->state = CPU_FETCH_DECODE_OPCODE;
+    memctl_cpu->reg_pc = code_start;
+    ASSERT_EQ(cpu_run(memctl_cpu, 100, NULL), CPU_STOP_HALTED);
+    EXPECT_EQ(memctl_cpu->gp_regs[0], 2);
+
+    cpu_free(memctl_cpu);
+    memctl_free(memctl);
+}
+
+/// Forwards the writes reported by the memory controller to the CPU.
+static void note_code_write(void *ctx, vm_addr_t addr, uint32_t size) {
+    cpu_note_code_write((cpu_ctx_t *)ctx, addr, size);
+}
+
+TEST_F(CPUICacheTest, WatchedHostWriteInvalidatesCode) {
+    constexpr vm_addr_t code_start = 0x1000;
+    constexpr vm_addr_t code_size = 0x100;
+    for (cpu_engine_t engine : {CPU_ENGINE_INTERP, CPU_ENGINE_BLOCKS}) {
+        memctl_ctx_t *memctl = memctl_new();
+        FakeMem code_dev(0, code_size, true);
+        mmio_region_t code_reg = {
+            .start = code_start,
+            .end = code_start + code_size,
+            .ctx = &code_dev.mem_if,
+            .mem_if = code_dev.mem_if,
+            .direct_ptr = code_dev.bytes,
+            .direct_perms = MEM_DIRECT_READ | MEM_DIRECT_WRITE,
+            .notifies_changes = false,
+        };
+        ASSERT_EQ(memctl_map_region(memctl, &code_reg), VM_ERR_NONE);
+        cpu_ctx_t *memctl_cpu = cpu_new(&memctl->intf);
+        cpu_set_engine(memctl_cpu, engine);
+        memctl_set_code_watch(memctl, note_code_write, memctl_cpu);
+
+        const auto first = build_set_r0(1);
+        code_dev.write(0, first.data(), first.size());
+        memctl_cpu->state = CPU_FETCH_DECODE_OPCODE;
+        memctl_cpu->reg_pc = code_start;
+        ASSERT_EQ(cpu_run(memctl_cpu, 100, NULL), CPU_STOP_HALTED);
+        ASSERT_EQ(memctl_cpu->gp_regs[0], 1);
+        EXPECT_EQ(cpu_num_code_writes(memctl_cpu), 0u);
+
+        // The immediate of the MOV is rewritten through the controller.
+        ASSERT_EQ(memctl_write_u32(memctl, code_start + 2, 2), VM_ERR_NONE);
+        memctl_cpu->state = CPU_FETCH_DECODE_OPCODE;
+        memctl_cpu->reg_pc = code_start;
+        ASSERT_EQ(cpu_run(memctl_cpu, 100, NULL), CPU_STOP_HALTED);
+        EXPECT_EQ(memctl_cpu->gp_regs[0], 2) << "engine " << engine;
+        EXPECT_EQ(cpu_num_code_writes(memctl_cpu), 1u);
+
+        // So is a host write through the direct pointer.
+        code_dev.bytes[2] = 3;
+        memctl_note_write(memctl, code_start + 2, 1);
+        memctl_cpu->state = CPU_FETCH_DECODE_OPCODE;
+        memctl_cpu->reg_pc = code_start;
+        ASSERT_EQ(cpu_run(memctl_cpu, 100, NULL), CPU_STOP_HALTED);
+        EXPECT_EQ(memctl_cpu->gp_regs[0], 3) << "engine " << engine;
+        EXPECT_EQ(cpu_num_code_writes(memctl_cpu), 2u);
+
+        cpu_free(memctl_cpu);
+        memctl_free(memctl);
+    }
+}
+
+TEST_F(CPUICacheTest, StoreReportedBackIsCountedOnce) {
+    // A store that straddles two RAM regions is passed to the controller,
+    // which reports it to the watch as well.
+    constexpr vm_addr_t code_start = 0x1000;
+    constexpr vm_addr_t store_addr = 0x1FFE;
+    for (cpu_engine_t engine : {CPU_ENGINE_INTERP, CPU_ENGINE_BLOCKS}) {
+        memctl_ctx_t *memctl = memctl_new();
+        const vm_err_t err = memctl_reserve_space(memctl);
+        if (err == VM_ERR_MEM_NO_SPACE) {
+            memctl_free(memctl);
+            GTEST_SKIP() << "not supported";
+        }
+        ASSERT_EQ(err, VM_ERR_NONE);
+        const std::vector<uint8_t> prog =
+            build_prog()
+                .instr(build_instr(CPU_OP_MOV_VR)
+                           .reg_code(CPU_CODE_R1)
+                           .imm32(store_addr))
+                .instr(build_instr(CPU_OP_STR_RI0)
+                           .reg_code(CPU_CODE_R1)
+                           .reg_code(CPU_CODE_R0))
+                .instr(build_instr(CPU_OP_HALT))
+                .bytes;
+        ASSERT_EQ(memctl_map_ram(memctl, code_start, 0x2000,
+                                 MEM_DIRECT_READ | MEM_DIRECT_WRITE,
+                                 prog.data(), prog.size(), nullptr),
+                  VM_ERR_NONE);
+        ASSERT_EQ(memctl_map_ram(memctl, 0x2000, 0x3000,
+                                 MEM_DIRECT_READ | MEM_DIRECT_WRITE, nullptr,
+                                 0, nullptr),
+                  VM_ERR_NONE);
+        cpu_ctx_t *memctl_cpu = cpu_new(&memctl->intf);
+        cpu_set_engine(memctl_cpu, engine);
+        memctl_set_code_watch(memctl, note_code_write, memctl_cpu);
+
+        memctl_cpu->state = CPU_FETCH_DECODE_OPCODE;
+        memctl_cpu->reg_pc = code_start;
+        memctl_cpu->gp_regs[0] = 0x12345678;
+        ASSERT_EQ(cpu_run(memctl_cpu, 100, NULL), CPU_STOP_HALTED);
+        uint32_t stored = 0;
+        ASSERT_EQ(memctl_read_u32(memctl, store_addr, &stored), VM_ERR_NONE);
+        EXPECT_EQ(stored, 0x12345678);
+        EXPECT_EQ(cpu_num_code_writes(memctl_cpu), 1u) << "engine " << engine;
+
+        // Writes of others at the same address are still counted.
+        ASSERT_EQ(memctl_write_u32(memctl, store_addr, 0), VM_ERR_NONE);
+        EXPECT_EQ(cpu_num_code_writes(memctl_cpu), 2u) << "engine " << engine;
+
+        cpu_free(memctl_cpu);
+        memctl_free(memctl);
+    }
+}
@@ -1,3 +1,5 @@
+#include <bit>
+
 #include <absl/strings/str_format.h>
 #include <gtest/gtest.h>
 
@@ -623,6 +625,88 @@ INSTANTIATE_TEST_SUITE_P(
         return v;
     }()));
 
+INSTANTIATE_TEST_SUITE_P(
+    Random_ROL_RR, ALUInstrTest, testing::ValuesIn([&] {
+        std::vector<ALUInstrParam> v;
+        std::mt19937 rng(TEST_RNG_SEED);
+        for (int i = 0; i < TEST_NUM_RANDOM_CASES; i++) {
+            auto param = ALUInstrParam::get_random_param(
+                rng, "ROL_RR", CPU_OP_ROL_RR, ALUInstrParam::ResStoredInDstReg,
+                ALUInstrParam::SrcInReg);
+
+            uint32_t num_bits;
+            if (param.dst_reg_code == *param.src_reg_code) {
+                num_bits = param.dst_val & 31;
+            } else {
+                num_bits = *param.src_val & 31;
+            }
+            param.set_exp_val_flags(std::rotl(param.dst_val, num_bits));
+            // Carry is the last bit rotated.
+            param.exp_flag_carry =
+                num_bits != 0 && (param.exp_res_val & 1) != 0;
+            v.push_back(param);
+        }
+        return v;
+    }()));
+
+INSTANTIATE_TEST_SUITE_P(
+    Random_ROL_RV, ALUInstrTest, testing::ValuesIn([&] {
+        std::vector<ALUInstrParam> v;
+        std::mt19937 rng(TEST_RNG_SEED);
+        for (int i = 0; i < TEST_NUM_RANDOM_CASES; i++) {
+            auto param = ALUInstrParam::get_random_param(
+                rng, "ROL_RV", CPU_OP_ROL_RV, ALUInstrParam::ResStoredInDstReg,
+                ALUInstrParam::SrcInIMM5);
+            const uint32_t num_bits = *param.src_val & 31;
+            param.set_exp_val_flags(std::rotl(param.dst_val, num_bits));
+            param.exp_flag_carry =
+                num_bits != 0 && (param.exp_res_val & 1) != 0;
+            v.push_back(param);
+        }
+        return v;
+    }()));
+
+INSTANTIATE_TEST_SUITE_P(
+    Random_ROR_RR, ALUInstrTest, testing::ValuesIn([&] {
+        std::vector<ALUInstrParam> v;
+        std::mt19937 rng(TEST_RNG_SEED);
+        for (int i = 0; i < TEST_NUM_RANDOM_CASES; i++) {
+            auto param = ALUInstrParam::get_random_param(
+                rng, "ROR_RR", CPU_OP_ROR_RR, ALUInstrParam::ResStoredInDstReg,
+                ALUInstrParam::SrcInReg);
+
+            uint32_t num_bits;
+            if (param.dst_reg_code == *param.src_reg_code) {
+                num_bits = param.dst_val & 31;
+            } else {
+                num_bits = *param.src_val & 31;
+            }
+            param.set_exp_val_flags(std::rotr(param.dst_val, num_bits));
+            // Carry is the last bit rotated.
+            param.exp_flag_carry =
+                num_bits != 0 && (param.exp_res_val & (1U << 31)) != 0;
+            v.push_back(param);
+        }
+        return v;
+    }()));
+
+INSTANTIATE_TEST_SUITE_P(
+    Random_ROR_RV, ALUInstrTest, testing::ValuesIn([&] {
+        std::vector<ALUInstrParam> v;
+        std::mt19937 rng(TEST_RNG_SEED);
+        for (int i = 0; i < TEST_NUM_RANDOM_CASES; i++) {
+            auto param = ALUInstrParam::get_random_param(
+                rng, "ROR_RV", CPU_OP_ROR_RV, ALUInstrParam::ResStoredInDstReg,
+                ALUInstrParam::SrcInIMM5);
+            const uint32_t num_bits = *param.src_val & 31;
+            param.set_exp_val_flags(std::rotr(param.dst_val, num_bits));
+            param.exp_flag_carry =
+                num_bits != 0 && (param.exp_res_val & (1U << 31)) != 0;
+            v.push_back(param);
+        }
+        return v;
+    }()));
+
 INSTANTIATE_TEST_SUITE_P(
     Random_CMP_RR, ALUInstrTest, testing::ValuesIn([&] {
         std::vector<ALUInstrParam> v;
@@ -0,0 +1,25 @@
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu_instr_descs.h>
+#include "cpu/cpu_isa.h"
+
+#define TEST_COUNT_INSTR(op, mnem, layout, cost, mem, handler, jit) +1
+
+/// Number of instructions of the instruction set.
+static constexpr size_t test_num_instrs = 0 CPU_ISA_INSTRS(TEST_COUNT_INSTR);
+
+TEST(CPUInstrDescTest, SizeMatchesOperands) {
+    size_t num_descs = 0;
+    for (size_t opcode = 0; opcode < 256; opcode++) {
+        const cpu_instr_desc_t *desc = cpu_lookup_instr_desc(opcode);
+        if (!desc) { continue; }
+        num_descs++;
+        size_t size = 1;
+        for (size_t opd = 0; opd < desc->num_operands; opd++) {
+            size += desc->operands[opd] == CPU_OPD_IMM32 ? 4 : 1;
+        }
+        EXPECT_EQ(desc->opcode, opcode);
+        EXPECT_EQ(desc->size, size) << desc->mnemonic;
+    }
+    EXPECT_EQ(num_descs, test_num_instrs);
+}
@@ -0,0 +1,411 @@
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include "testcommon/cpu_engine_test.h"
+
+#define TEST_MEM_BASE  CPU_IVT_ADDR
+#define TEST_MEM_SIZE  8192
+#define TEST_STACK_TOP (TEST_MEM_BASE + TEST_MEM_SIZE)
+
+#define TEST_PROG_START (CPU_IVT_ADDR + CPU_IVT_SIZE)
+#define TEST_ISR_START  (TEST_PROG_START + 512)
+#define TEST_DATA_ADDR  (TEST_PROG_START + 4096)
+
+/// Number of runs of a loop, more than needed for its blocks to be compiled.
+#define TEST_NUM_RUNS 24
+
+/// Runs the same program with the interpreter and the JIT engine.
+class CPUJITTest : public CPUEngineTest {
+  protected:
+    CPUJITTest() : CPUEngineTest(CPU_ENGINE_JIT, TEST_MEM_SIZE) {}
+
+    /**
+     * Runs a loop made of @a body and a jump back one iteration at a time,
+     * long enough for the loop to be compiled.
+     */
+    void run_loop(const std::vector<InstrBuilder> &body) {
+        ProgBuilder prog = build_prog();
+        for (const InstrBuilder &instr : body) {
+            prog.instr(instr);
+        }
+        prog.instr(build_instr(CPU_OP_JMPA_V32).imm32(TEST_PROG_START));
+        write(TEST_PROG_START, prog.bytes);
+
+        for (size_t run = 0; run < TEST_NUM_RUNS; run++) {
+            ASSERT_EQ(run_both(body.size() + 1), CPU_STOP_BUDGET)
+                << "run " << run;
+        }
+    }
+};
+
+static const uint32_t test_values[] = {
+    0,          1,          2,          31,         32,
+    33,         0x7F,       0x80,       0xFF,       0x7FFFFFFF,
+    0x80000000, 0x80000001, 0xFFFFFFFE, 0xFFFFFFFF, 0x12345678,
+};
+
+static bool is_div(uint8_t opcode) {
+    return opcode == CPU_OP_DIV_RR || opcode == CPU_OP_DIV_RV ||
+           opcode == CPU_OP_IDIV_RR || opcode == CPU_OP_IDIV_RV;
+}
+
+TEST_F(CPUJITTest, IsSupportedOnThisHost) {
+#if defined(__x86_64__) && defined(__linux__)
+    EXPECT_TRUE(cpu_jit_is_supported());
+#else
+    EXPECT_FALSE(cpu_jit_is_supported());
+#endif
+}
+
+TEST_F(CPUJITTest, ALUMatchesInterpreter) {
+    static const uint8_t rr_opcodes[] = {
+        CPU_OP_ADD_RR, CPU_OP_SUB_RR, CPU_OP_MUL_RR,  CPU_OP_DIV_RR,
+        CPU_OP_AND_RR, CPU_OP_OR_RR,  CPU_OP_XOR_RR,  CPU_OP_SHL_RR,
+        CPU_OP_SHR_RR, CPU_OP_CMP_RR, CPU_OP_TST_RR, CPU_OP_IDIV_RR,
+    };
+    static const uint8_t rv_opcodes[] = {
+        CPU_OP_ADD_RV, CPU_OP_SUB_RV, CPU_OP_MUL_RV, CPU_OP_DIV_RV,
+        CPU_OP_AND_RV, CPU_OP_OR_RV,  CPU_OP_XOR_RV, CPU_OP_TST_RV,
+        CPU_OP_IDIV_RV,
+    };
+
+    for (uint32_t lhs : test_values) {
+        for (uint32_t rhs : test_values) {
+            // Division by zero is tested below, and the interpreter does not
+            // support the overflowing signed division.
+            const bool skip_div =
+                rhs == 0 || (lhs == 0x80000000 && rhs == 0xFFFFFFFF);
+            for (uint8_t opcode : rr_opcodes) {
+                if (skip_div && is_div(opcode)) { continue; }
+                SCOPED_TRACE(testing::Message() << std::hex << "op " << +opcode
+                                                << " " << lhs << " " << rhs);
+                reset();
+                run_loop({
+                    build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R1).imm32(lhs),
+                    build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R2).imm32(rhs),
+                    build_instr(opcode)
+                        .reg_code(CPU_CODE_R1)
+                        .reg_code(CPU_CODE_R2),
+                });
+            }
+            for (uint8_t opcode : rv_opcodes) {
+                if (skip_div && is_div(opcode)) { continue; }
+                SCOPED_TRACE(testing::Message() << std::hex << "op " << +opcode
+                                                << " " << lhs << " " << rhs);
+                reset();
+                run_loop({
+                    build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R1).imm32(lhs),
+                    build_instr(opcode).reg_code(CPU_CODE_R1).imm32(rhs),
+                });
+            }
+        }
+        for (uint8_t num_bits = 0; num_bits < 32; num_bits += 7) {
+            for (uint8_t opcode : {CPU_OP_SHL_RV, CPU_OP_SHR_RV}) {
+                reset();
+                run_loop({
+                    build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R1).imm32(lhs),
+                    build_instr(opcode).reg_code(CPU_CODE_R1).imm5(num_bits),
+                });
+            }
+        }
+        reset();
+        run_loop({
+            build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R1).imm32(lhs),
+            build_instr(CPU_OP_NOT_R).reg_code(CPU_CODE_R1),
+        });
+    }
+}
+
+TEST_F(CPUJITTest, SameRegisterOperands) {
+    run_loop({
+        build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R7).imm32(0x40000001),
+        build_instr(CPU_OP_ADD_RR).reg_code(CPU_CODE_R7).reg_code(CPU_CODE_R7),
+        build_instr(CPU_OP_MUL_RR).reg_code(CPU_CODE_R7).reg_code(CPU_CODE_R7),
+        build_instr(CPU_OP_MOV_RR).reg_code(CPU_CODE_R0).reg_code(CPU_CODE_R7),
+        build_instr(CPU_OP_SHL_RR).reg_code(CPU_CODE_R0).reg_code(CPU_CODE_R0),
+        build_instr(CPU_OP_SUB_RR).reg_code(CPU_CODE_R0).reg_code(CPU_CODE_R0),
+    });
+}
+
+TEST_F(CPUJITTest, StackPointerOperands) {
+    run_loop({
+        build_instr(CPU_OP_MOV_RR).reg_code(CPU_CODE_R0).reg_code(CPU_CODE_SP),
+        build_instr(CPU_OP_SUB_RV).reg_code(CPU_CODE_SP).imm32(8),
+        build_instr(CPU_OP_ADD_RR).reg_code(CPU_CODE_R1).reg_code(CPU_CODE_SP),
+        build_instr(CPU_OP_STR_RI0).reg_code(CPU_CODE_SP).reg_code(CPU_CODE_R1),
+        build_instr(CPU_OP_LDR_RI32)
+            .reg_code(CPU_CODE_R2)
+            .reg_code(CPU_CODE_SP)
+            .imm32(0),
+        build_instr(CPU_OP_MOV_RR).reg_code(CPU_CODE_SP).reg_code(CPU_CODE_R0),
+        build_instr(CPU_OP_XOR_RR).reg_code(CPU_CODE_R3).reg_code(CPU_CODE_SP),
+    });
+}
+
+TEST_F(CPUJITTest, LoadsAndStoresMatchInterpreter) {
+    constexpr uint8_t size_8 = CPU_REG_REF_SIZE_8;
+    run_loop({
+        build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(TEST_DATA_ADDR),
+        build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R1).imm32(4),
+        build_instr(CPU_OP_LDR_RI0).reg_code(CPU_CODE_R2).reg_code(CPU_CODE_R0),
+        build_instr(CPU_OP_ADD_RV).reg_code(CPU_CODE_R2).imm32(0x01010101),
+        build_instr(CPU_OP_STR_RI0).reg_code(CPU_CODE_R0).reg_code(CPU_CODE_R2),
+        build_instr(CPU_OP_STR_RI8)
+            .reg_code(CPU_CODE_R0)
+            .imm8(7)
+            .reg_code(CPU_CODE_R2 | size_8),
+        build_instr(CPU_OP_LDR_RI8)
+            .reg_code(CPU_CODE_R3 | size_8)
+            .reg_code(CPU_CODE_R0)
+            .imm8(1),
+        build_instr(CPU_OP_STR_RIR)
+            .reg_code(CPU_CODE_R0)
+            .reg_code(CPU_CODE_R1)
+            .reg_code(CPU_CODE_R3),
+        build_instr(CPU_OP_LDR_RIR)
+            .reg_code(CPU_CODE_R4)
+            .reg_code(CPU_CODE_R0)
+            .reg_code(CPU_CODE_R1),
+        build_instr(CPU_OP_STR_RI32)
+            .reg_code(CPU_CODE_R0)
+            .imm32((uint32_t)-8)
+            .reg_code(CPU_CODE_R4),
+        build_instr(CPU_OP_LDR_RI32)
+            .reg_code(CPU_CODE_R5)
+            .reg_code(CPU_CODE_R0)
+            .imm32((uint32_t)-6),
+        build_instr(CPU_OP_STR_RV0)
+            .imm32(TEST_DATA_ADDR + 16)
+            .reg_code(CPU_CODE_R5 | size_8),
+        build_instr(CPU_OP_LDR_RV0)
+            .reg_code(CPU_CODE_R6)
+            .imm32(TEST_DATA_ADDR + 15),
+    });
+}
+
+TEST_F(CPUJITTest, OverwrittenFlagsMatchInterpreter) {
+    // Only the flags of the NOT are computed, they are written back at the
+    // end of the block.
+    run_loop({
+        build_instr(CPU_OP_ADD_RV).reg_code(CPU_CODE_R1).imm32(0x40000001),
+        build_instr(CPU_OP_SHL_RR).reg_code(CPU_CODE_R1).reg_code(CPU_CODE_R1),
+        build_instr(CPU_OP_CMP_RR).reg_code(CPU_CODE_R1).reg_code(CPU_CODE_R2),
+        build_instr(CPU_OP_MUL_RV).reg_code(CPU_CODE_R1).imm32(0x10000),
+        build_instr(CPU_OP_NOT_R).reg_code(CPU_CODE_R1),
+    });
+
+    // The flags of the XOR are read by the jump after the store to code
+    // exits.
+    reset();
+    write(TEST_PROG_START,
+          build_prog()
+              .instr(build_instr(CPU_OP_MOV_VR)
+                         .reg_code(CPU_CODE_R0)
+                         .imm32(TEST_PROG_START + 1024))
+              .instr(build_instr(CPU_OP_ADD_RV)
+                         .reg_code(CPU_CODE_R1)
+                         .imm32(0x40000001))
+              .instr(build_instr(CPU_OP_CMP_RR)
+                         .reg_code(CPU_CODE_R1)
+                         .reg_code(CPU_CODE_R2))
+              .instr(build_instr(CPU_OP_XOR_RR)
+                         .reg_code(CPU_CODE_R3)
+                         .reg_code(CPU_CODE_R1))
+              .instr(build_instr(CPU_OP_STR_RI0)
+                         .reg_code(CPU_CODE_R0)
+                         .reg_code(CPU_CODE_R3))
+              .instr(build_instr(CPU_OP_JLTA_V32).imm32(TEST_PROG_START))
+              .instr(build_instr(CPU_OP_ADD_RV)
+                         .reg_code(CPU_CODE_R4)
+                         .imm32(1))
+              .instr(build_instr(CPU_OP_JMPA_V32).imm32(TEST_PROG_START))
+              .bytes);
+    for (size_t run = 0; run < 4 * TEST_NUM_RUNS; run++) {
+        ASSERT_EQ(run_both(8), CPU_STOP_BUDGET) << "run " << run;
+    }
+    EXPECT_NE(cpus[1]->gp_regs[4], 0u);
+}
+
+TEST_F(CPUJITTest, OutOfBoundsStoreFallsBack) {
+    write(CPU_IVT_ENTRY_ADDR(CPU_EXC_BAD_MEM),
+          {(uint8_t)TEST_ISR_START, (uint8_t)(TEST_ISR_START >> 8), 0, 0});
+    write(TEST_ISR_START, build_prog().instr(build_instr(CPU_OP_HALT)).bytes);
+    // Each run stores one byte further, until the word crosses the end of
+    // memory.
+    write(TEST_PROG_START,
+          build_prog()
+              .instr(build_instr(CPU_OP_ADD_RV).reg_code(CPU_CODE_R1).imm32(1))
+              .instr(build_instr(CPU_OP_STR_RI0)
+                         .reg_code(CPU_CODE_R1)
+                         .reg_code(CPU_CODE_R0))
+              .instr(build_instr(CPU_OP_JMPR_V8).imm8((uint8_t)-9))
+              .bytes);
+    for (cpu_ctx_t *cpu : cpus) {
+        cpu->gp_regs[1] = TEST_STACK_TOP - 4 - TEST_NUM_RUNS;
+    }
+
+    for (size_t run = 0; run < TEST_NUM_RUNS; run++) {
+        ASSERT_EQ(run_both(3), CPU_STOP_BUDGET) << run;
+    }
+    ASSERT_EQ(run_both(3), CPU_STOP_EXCEPTION);
+    EXPECT_EQ(cpus[1]->pc_after_isr, TEST_PROG_START + 6);
+    ASSERT_EQ(run_both(100), CPU_STOP_HALTED);
+}
+
+TEST_F(CPUJITTest, StoreToCodeFallsBack) {
+    // The compiled loop patches the immediate of the code it jumps to, on the
+    // same page but on another line. The patched code must always see the
+    // new value.
+    constexpr vm_addr_t loop_start = TEST_PROG_START + 6;
+    constexpr vm_addr_t patched_code = TEST_PROG_START + 256;
+    write(TEST_PROG_START,
+          build_prog()
+              .instr(build_instr(CPU_OP_MOV_VR)
+                         .reg_code(CPU_CODE_R1)
+                         .imm32(patched_code + 2))
+              // loop:
+              .instr(build_instr(CPU_OP_ADD_RV).reg_code(CPU_CODE_R0).imm32(1))
+              .instr(build_instr(CPU_OP_STR_RI0)
+                         .reg_code(CPU_CODE_R1)
+                         .reg_code(CPU_CODE_R0))
+              .instr(build_instr(CPU_OP_JMPA_V32).imm32(patched_code))
+              .bytes);
+    write(patched_code,
+          build_prog()
+              .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R2).imm32(0))
+              .instr(build_instr(CPU_OP_CMP_RR)
+                         .reg_code(CPU_CODE_R2)
+                         .reg_code(CPU_CODE_R4))
+              .instr(build_instr(CPU_OP_JNEA_V32).imm32(loop_start))
+              .instr(build_instr(CPU_OP_HALT))
+              .bytes);
+    for (cpu_ctx_t *cpu : cpus) {
+        cpu->gp_regs[4] = TEST_NUM_RUNS;
+    }
+
+    ASSERT_EQ(run_both(1), CPU_STOP_BUDGET);
+    for (size_t run = 1; run < TEST_NUM_RUNS; run++) {
+        ASSERT_EQ(run_both(6), CPU_STOP_BUDGET) << run;
+        EXPECT_EQ(cpus[1]->gp_regs[2], run);
+    }
+    ASSERT_EQ(run_both(100), CPU_STOP_HALTED);
+    EXPECT_EQ(cpus[1]->gp_regs[2], TEST_NUM_RUNS);
+}
+
+TEST_F(CPUJITTest, DivisionByZeroFallsBack) {
+    write(CPU_IVT_ENTRY_ADDR(CPU_EXC_DIV_BY_ZERO),
+          {(uint8_t)TEST_ISR_START, (uint8_t)(TEST_ISR_START >> 8), 0, 0});
+    write(TEST_ISR_START, build_prog().instr(build_instr(CPU_OP_HALT)).bytes);
+    write(TEST_PROG_START,
+          build_prog()
+              .instr(build_instr(CPU_OP_SUB_RV).reg_code(CPU_CODE_R1).imm32(1))
+              .instr(build_instr(CPU_OP_DIV_RR)
+                         .reg_code(CPU_CODE_R0)
+                         .reg_code(CPU_CODE_R1))
+              .instr(build_instr(CPU_OP_JMPR_V8).imm8((uint8_t)-9))
+              .bytes);
+    for (cpu_ctx_t *cpu : cpus) {
+        cpu->gp_regs[1] = TEST_NUM_RUNS;
+    }
+
+    ASSERT_EQ(run_both(1000), CPU_STOP_EXCEPTION);
+    EXPECT_EQ(cpus[1]->gp_regs[1], 0);
+    EXPECT_EQ(cpus[1]->pc_after_isr, TEST_PROG_START + 6);
+    ASSERT_EQ(run_both(1000), CPU_STOP_HALTED);
+}
+
+TEST_F(CPUJITTest, ConditionalJumpsMatchInterpreter) {
+    static const uint8_t cond_opcodes[] = {
+        CPU_OP_JEQR_V8, CPU_OP_JNER_V8, CPU_OP_JGTR_V8,
+        CPU_OP_JGER_V8, CPU_OP_JLTR_V8, CPU_OP_JLER_V8,
+    };
+    constexpr vm_addr_t jump_at = TEST_PROG_START + 3 * 6 + 3;
+    constexpr vm_addr_t taken = TEST_PROG_START + 64;
+
+    for (uint8_t cond : cond_opcodes) {
+        for (uint8_t form = 0; form < 3; form++) {
+            for (uint32_t rhs : {0u, 5u, 0x80000000u, 0xFFFFFFFFu}) {
+                SCOPED_TRACE(testing::Message() << std::hex << "op "
+                                                << +(cond + form) << " "
+                                                << rhs);
+                reset();
+                InstrBuilder jump = build_instr(cond + form);
+                if (form == 0) {
+                    jump.imm8(taken - jump_at);
+                } else if (form == 1) {
+                    jump.imm32(taken);
+                } else {
+                    jump.reg_code(CPU_CODE_R5);
+                }
+                // r1 walks through every sign and magnitude against rhs.
+                write(TEST_PROG_START,
+                      build_prog()
+                          .instr(build_instr(CPU_OP_MOV_VR)
+                                     .reg_code(CPU_CODE_R5)
+                                     .imm32(taken))
+                          .instr(build_instr(CPU_OP_MOV_VR)
+                                     .reg_code(CPU_CODE_R2)
+                                     .imm32(rhs))
+                          .instr(build_instr(CPU_OP_ADD_RV)
+                                     .reg_code(CPU_CODE_R1)
+                                     .imm32(0x2AAAAAAB))
+                          .instr(build_instr(CPU_OP_CMP_RR)
+                                     .reg_code(CPU_CODE_R1)
+                                     .reg_code(CPU_CODE_R2))
+                          .instr(jump)
+                          .instr(build_instr(CPU_OP_JMPA_V32)
+                                     .imm32(TEST_PROG_START))
+                          .bytes);
+                write(taken, build_prog()
+                                 .instr(build_instr(CPU_OP_ADD_RV)
+                                            .reg_code(CPU_CODE_R3)
+                                            .imm32(1))
+                                 .instr(build_instr(CPU_OP_JMPA_V32)
+                                            .imm32(TEST_PROG_START))
+                                 .bytes);
+                for (size_t run = 0; run < 4 * TEST_NUM_RUNS; run++) {
+                    ASSERT_EQ(run_both(3), CPU_STOP_BUDGET) << run;
+                }
+            }
+        }
+    }
+}
+
+TEST_F(CPUJITTest, TraceDisablesNativeCode) {
+    constexpr size_t max_recs = 128;
+    static_assert(max_recs >= 2 * TEST_NUM_RUNS);
+    cpu_trace_t *traces[2];
+    for (size_t idx = 0; idx < 2; idx++) {
+        traces[idx] = cpu_trace_new(max_recs);
+        cpu_set_trace(cpus[idx], traces[idx]);
+    }
+    run_loop({
+        build_instr(CPU_OP_ADD_RV).reg_code(CPU_CODE_R0).imm32(3),
+    });
+
+    cpu_trace_rec_t recs[2][max_recs];
+    size_t num_recs[2];
+    for (size_t idx = 0; idx < 2; idx++) {
+        num_recs[idx] =
+            cpu_trace_drain(traces[idx], recs[idx], max_recs, NULL);
+        cpu_set_trace(cpus[idx], NULL);
+        cpu_trace_free(traces[idx]);
+    }
+    ASSERT_EQ(num_recs[1], num_recs[0]);
+    EXPECT_EQ(num_recs[1], 2 * TEST_NUM_RUNS);
+}
+
+TEST_F(CPUJITTest, SwitchingEngineKeepsState) {
+    run_loop({
+        build_instr(CPU_OP_ADD_RV).reg_code(CPU_CODE_R0).imm32(3),
+    });
+    cpu_set_engine(cpus[1], CPU_ENGINE_INTERP);
+    for (size_t run = 0; run < TEST_NUM_RUNS; run++) {
+        ASSERT_EQ(run_both(2), CPU_STOP_BUDGET);
+    }
+    cpu_set_engine(cpus[1], CPU_ENGINE_JIT);
+    for (size_t run = 0; run < TEST_NUM_RUNS; run++) {
+        ASSERT_EQ(run_both(2), CPU_STOP_BUDGET);
+    }
+    EXPECT_EQ(cpus[1]->gp_regs[0], 3 * 3 * TEST_NUM_RUNS);
+}
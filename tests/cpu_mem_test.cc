@@ -0,0 +1,413 @@
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include <fcvm/memctl.h>
+#include "testcommon/fake_mem.h"
+#include "testcommon/prog_builder.h"
+
+#define TEST_MEM_BASE  CPU_IVT_ADDR
+#define TEST_MEM_SIZE  2048
+#define TEST_STACK_TOP (TEST_MEM_BASE + TEST_MEM_SIZE)
+
+#define TEST_PROG_START (CPU_IVT_ADDR + CPU_IVT_SIZE)
+#define TEST_DATA_ADDR  (TEST_PROG_START + 512)
+
+/**
+ * A memory interface that forwards to a FakeMem and counts the callback
+ * calls, so that the tests can tell which accesses went around them.
+ */
+struct CountingMem {
+    mem_if_t mem_if; // must be the first member
+    FakeMem *backing;
+    uint8_t direct_perms;
+    size_t num_reads = 0;
+    size_t num_writes = 0;
+
+    CountingMem(FakeMem *abacking, uint8_t adirect_perms)
+        : backing(abacking), direct_perms(adirect_perms) {
+        mem_if.read_u8 = read_u8;
+        mem_if.read_u32 = read_u32;
+        mem_if.write_u8 = write_u8;
+        mem_if.write_u32 = write_u32;
+        mem_if.get_span = get_span;
+    }
+
+    static CountingMem *from_ctx(void *ctx) {
+        return reinterpret_cast<CountingMem *>(ctx);
+    }
+
+    static vm_err_t read_u8(void *ctx, vm_addr_t addr, uint8_t *out) {
+        from_ctx(ctx)->num_reads++;
+        return from_ctx(ctx)->backing->read(addr, out, 1);
+    }
+    static vm_err_t read_u32(void *ctx, vm_addr_t addr, uint32_t *out) {
+        from_ctx(ctx)->num_reads++;
+        return from_ctx(ctx)->backing->read(addr, out, 4);
+    }
+    static vm_err_t write_u8(void *ctx, vm_addr_t addr, uint8_t val) {
+        from_ctx(ctx)->num_writes++;
+        return from_ctx(ctx)->backing->write(addr, &val, 1);
+    }
+    static vm_err_t write_u32(void *ctx, vm_addr_t addr, uint32_t val) {
+        from_ctx(ctx)->num_writes++;
+        return from_ctx(ctx)->backing->write(addr, &val, 4);
+    }
+    static bool get_span(void *ctx, vm_addr_t addr, mem_span_t *out) {
+        CountingMem *mem = from_ctx(ctx);
+        if (addr < mem->backing->base || addr >= mem->backing->end) {
+            return false;
+        }
+        out->ptr = mem->backing->bytes;
+        out->start = mem->backing->base;
+        out->end = mem->backing->end;
+        out->perms = mem->direct_perms;
+        out->mem_if = &mem->mem_if;
+        out->ctx = mem;
+        out->cb_base = 0;
+        out->p_gen = nullptr;
+        return true;
+    }
+};
+
+class CPUMemTest : public testing::Test {
+  protected:
+    CPUMemTest() {
+        fakemem = new FakeMem(TEST_MEM_BASE, TEST_MEM_BASE + TEST_MEM_SIZE);
+    }
+
+    ~CPUMemTest() {
+        delete fakemem;
+    }
+
+    /// Stores and loads bytes and dwords through registers and the stack.
+    void write_mem_prog() {
+        const auto prog =
+            build_prog()
+                .instr(build_instr(CPU_OP_MOV_VR)
+                           .reg_code(CPU_CODE_R1)
+                           .imm32(TEST_DATA_ADDR))
+                .instr(build_instr(CPU_OP_MOV_VR)
+                           .reg_code(CPU_CODE_R0)
+                           .imm32(0xCAFEBABE))
+                .instr(build_instr(CPU_OP_STR_RI0)
+                           .reg_code(CPU_CODE_R1)
+                           .reg_code(CPU_CODE_R0))
+                .instr(build_instr(CPU_OP_STR_RI8)
+                           .reg_code(CPU_CODE_R1)
+                           .imm8(4)
+                           .reg_code(CPU_CODE_R0 | CPU_REG_REF_SIZE_8))
+                .instr(build_instr(CPU_OP_LDR_RI0)
+                           .reg_code(CPU_CODE_R2)
+                           .reg_code(CPU_CODE_R1))
+                .instr(build_instr(CPU_OP_LDR_RV0)
+                           .reg_code(CPU_CODE_R3)
+                           .imm32(TEST_DATA_ADDR + 4))
+                .instr(build_instr(CPU_OP_PUSH_R).reg_code(CPU_CODE_R2))
+                .instr(build_instr(CPU_OP_POP_R).reg_code(CPU_CODE_R4))
+                .instr(build_instr(CPU_OP_HALT))
+                .bytes;
+        fakemem->write(TEST_PROG_START, prog.data(), prog.size());
+    }
+
+    cpu_ctx_t *new_cpu(mem_if_t *mem_if) {
+        cpu_ctx_t *cpu = cpu_new(mem_if);
+        cpu->state = CPU_FETCH_DECODE_OPCODE;
+        cpu->reg_pc = TEST_PROG_START;
+        cpu->reg_sp = TEST_STACK_TOP;
+        return cpu;
+    }
+
+    void expect_mem_prog_done(const cpu_ctx_t *cpu) {
+        EXPECT_EQ(cpu->state, CPU_HALTED);
+        EXPECT_EQ(cpu->gp_regs[2], 0xCAFEBABE);
+        EXPECT_EQ(cpu->gp_regs[3], 0xFFFFFFBE);
+        EXPECT_EQ(cpu->gp_regs[4], 0xCAFEBABE);
+        EXPECT_EQ(cpu->reg_sp, TEST_STACK_TOP);
+    }
+
+    FakeMem *fakemem;
+};
+
+TEST_F(CPUMemTest, UsesCallbacksWithoutGetSpan) {
+    write_mem_prog();
+    CountingMem mem(fakemem, 0);
+    mem.mem_if.get_span = nullptr;
+    cpu_ctx_t *cpu = new_cpu(&mem.mem_if);
+
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    expect_mem_prog_done(cpu);
+    EXPECT_GT(mem.num_reads, 0);
+    EXPECT_EQ(mem.num_writes, 3);
+
+    cpu_free(cpu);
+}
+
+TEST_F(CPUMemTest, DirectAccessSkipsCallbacks) {
+    write_mem_prog();
+    CountingMem mem(fakemem, MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+    cpu_ctx_t *cpu = new_cpu(&mem.mem_if);
+
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    expect_mem_prog_done(cpu);
+    EXPECT_EQ(mem.num_reads, 0);
+    EXPECT_EQ(mem.num_writes, 0);
+
+    cpu_free(cpu);
+}
+
+TEST_F(CPUMemTest, ReadOnlySpanWritesThroughCallbacks) {
+    write_mem_prog();
+    CountingMem mem(fakemem, MEM_DIRECT_READ);
+    cpu_ctx_t *cpu = new_cpu(&mem.mem_if);
+
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    expect_mem_prog_done(cpu);
+    EXPECT_EQ(mem.num_reads, 0);
+    EXPECT_EQ(mem.num_writes, 3);
+
+    cpu_free(cpu);
+}
+
+TEST_F(CPUMemTest, AccessCrossingSpanEndFails) {
+    // Reading a dword at the last byte of memory must fault the same way with
+    // and without the TLB.
+    const auto prog = build_prog()
+                          .instr(build_instr(CPU_OP_LDR_RV0)
+                                     .reg_code(CPU_CODE_R0)
+                                     .imm32(TEST_STACK_TOP - 1))
+                          .bytes;
+    fakemem->write(TEST_PROG_START, prog.data(), prog.size());
+    CountingMem mem(fakemem, MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+    cpu_ctx_t *cpu = new_cpu(&mem.mem_if);
+
+    EXPECT_EQ(cpu_run(cpu, 1, NULL), CPU_STOP_EXCEPTION);
+    EXPECT_EQ(mem.num_reads, 1);
+    EXPECT_EQ(cpu->num_nested_exc, 1);
+
+    cpu_free(cpu);
+}
+
+TEST_F(CPUMemTest, SnapshotDoesNotSaveTLB) {
+    write_mem_prog();
+    CountingMem mem(fakemem, MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+    cpu_ctx_t *cpu = new_cpu(&mem.mem_if);
+    ASSERT_EQ(cpu_run(cpu, 3, NULL), CPU_STOP_BUDGET);
+    ASSERT_NE(cpu->tlb[CPU_TLB_FETCH].span.ptr, nullptr);
+
+    std::vector<uint8_t> buf(cpu_snapshot_size());
+    size_t size = cpu_snapshot(cpu, buf.data(), buf.size());
+    size_t used_size = 0;
+    cpu_ctx_t *rest_cpu =
+        cpu_restore(&mem.mem_if, buf.data(), size, &used_size);
+    for (size_t kind = 0; kind < CPU_TLB_NUM_KINDS; kind++) {
+        EXPECT_EQ(rest_cpu->tlb[kind].span.ptr, nullptr);
+        EXPECT_EQ(rest_cpu->tlb[kind].span.end, 0);
+    }
+
+    ASSERT_EQ(cpu_run(rest_cpu, 100, NULL), CPU_STOP_HALTED);
+    expect_mem_prog_done(rest_cpu);
+
+    cpu_free(rest_cpu);
+    cpu_free(cpu);
+}
+
+TEST_F(CPUMemTest, TLBSurvivesMovingTheContext) {
+    write_mem_prog();
+    CountingMem mem(fakemem, MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+    cpu_ctx_t *cpu = new_cpu(&mem.mem_if);
+    ASSERT_EQ(cpu_run(cpu, 4, NULL), CPU_STOP_BUDGET);
+    ASSERT_NE(cpu->tlb[CPU_TLB_FETCH].span.ptr, nullptr);
+    ASSERT_NE(cpu->tlb[CPU_TLB_STORE].span.ptr, nullptr);
+
+    // Move the context, the copy takes over what it points to.
+    cpu_ctx_t *moved = (cpu_ctx_t *)malloc(sizeof(*moved));
+    ASSERT_NE(moved, nullptr);
+    memcpy(moved, cpu, sizeof(*moved));
+    const uintptr_t old_start = (uintptr_t)cpu;
+    const uintptr_t old_end = old_start + sizeof(*cpu);
+    memset(cpu, 0xA5, sizeof(*cpu));
+    free(cpu);
+
+    for (size_t kind = 0; kind < CPU_TLB_NUM_KINDS; kind++) {
+        const uintptr_t p_gen = (uintptr_t)moved->tlb[kind].span.p_gen;
+        EXPECT_FALSE(p_gen >= old_start && p_gen < old_end) << kind;
+    }
+    const size_t num_reads = mem.num_reads;
+    ASSERT_EQ(cpu_run(moved, 100, NULL), CPU_STOP_HALTED);
+    expect_mem_prog_done(moved);
+    EXPECT_EQ(mem.num_reads, num_reads);
+
+    cpu_free(moved);
+}
+
+TEST_F(CPUMemTest, IVTReadsKeepTheirOwnSpan) {
+    constexpr uint8_t irq_num = 1;
+    constexpr vm_addr_t isr_addr = TEST_PROG_START + 256;
+    const vm_addr_t ivt_entry = isr_addr;
+    fakemem->write(CPU_IVT_ENTRY_ADDR(CPU_IVT_FIRST_IRQ_ENTRY + irq_num),
+                   &ivt_entry, sizeof(ivt_entry));
+    const auto isr = build_instr(CPU_OP_IRET).bytes;
+    fakemem->write(isr_addr, isr.data(), isr.size());
+    const auto prog =
+        build_prog()
+            .instr(build_instr(CPU_OP_INT_V8).imm8(irq_num))
+            .instr(build_instr(CPU_OP_LDR_RV0)
+                       .reg_code(CPU_CODE_R0)
+                       .imm32(TEST_DATA_ADDR))
+            .instr(build_instr(CPU_OP_INT_V8).imm8(irq_num))
+            .instr(build_instr(CPU_OP_HALT))
+            .bytes;
+    fakemem->write(TEST_PROG_START, prog.data(), prog.size());
+
+    CountingMem mem(fakemem, MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+    cpu_ctx_t *cpu = new_cpu(&mem.mem_if);
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    EXPECT_EQ(cpu->num_nested_exc, 0);
+    EXPECT_EQ(mem.num_reads, 0);
+    EXPECT_EQ(cpu->tlb[CPU_TLB_IVT].span.ptr, fakemem->bytes);
+
+    cpu_free(cpu);
+}
+
+TEST_F(CPUMemTest, FlushForgetsSpans) {
+    write_mem_prog();
+    CountingMem mem(fakemem, MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+    cpu_ctx_t *cpu = new_cpu(&mem.mem_if);
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    for (size_t kind = 0; kind < CPU_TLB_NUM_KINDS; kind++) {
+        EXPECT_EQ(cpu->tlb[kind].span.start, TEST_MEM_BASE);
+    }
+
+    cpu_tlb_flush(cpu);
+    for (size_t kind = 0; kind < CPU_TLB_NUM_KINDS; kind++) {
+        EXPECT_EQ(cpu->tlb[kind].span.ptr, nullptr);
+        EXPECT_EQ(cpu->tlb[kind].span.end, 0);
+    }
+
+    cpu_free(cpu);
+}
+
+#define TEST_CODE_START 0x1000
+#define TEST_CODE_SIZE  0x1000
+#define TEST_DATA_START 0x4000
+#define TEST_DATA_SIZE  0x100
+
+/// CPU behind a memory controller, with code and data in different regions.
+class CPUTLBTest : public testing::Test {
+  protected:
+    CPUTLBTest() {
+        memctl = memctl_new();
+
+        // Code is only accessible through the callbacks.
+        code_dev = new FakeMem(0, TEST_CODE_SIZE, true);
+        mmio_region_t code_reg = {
+            .start = TEST_CODE_START,
+            .end = TEST_CODE_START + TEST_CODE_SIZE,
+            .ctx = &code_dev->mem_if,
+            .mem_if = code_dev->mem_if,
+            .direct_ptr = nullptr,
+            .direct_perms = 0,
+            .notifies_changes = false,
+        };
+        EXPECT_EQ(memctl_map_region(memctl, &code_reg), VM_ERR_NONE);
+
+        data_dev = new FakeMem(0, TEST_DATA_SIZE, true);
+        mmio_region_t data_reg = {
+            .start = TEST_DATA_START,
+            .end = TEST_DATA_START + TEST_DATA_SIZE,
+            .ctx = &data_dev->mem_if,
+            .mem_if = data_dev->mem_if,
+            .direct_ptr = data_dev->bytes,
+            .direct_perms = MEM_DIRECT_READ | MEM_DIRECT_WRITE,
+            .notifies_changes = false,
+        };
+        EXPECT_EQ(memctl_map_region(memctl, &data_reg), VM_ERR_NONE);
+
+        const auto prog = build_prog()
+                              .instr(build_instr(CPU_OP_MOV_VR)
+                                         .reg_code(CPU_CODE_R1)
+                                         .imm32(TEST_DATA_START + 8))
+                              .instr(build_instr(CPU_OP_MOV_VR)
+                                         .reg_code(CPU_CODE_R0)
+                                         .imm32(0x12345678))
+                              .instr(build_instr(CPU_OP_STR_RI0)
+                                         .reg_code(CPU_CODE_R1)
+                                         .reg_code(CPU_CODE_R0))
+                              .instr(build_instr(CPU_OP_LDR_RI0)
+                                         .reg_code(CPU_CODE_R2)
+                                         .reg_code(CPU_CODE_R1))
+                              .instr(build_instr(CPU_OP_HALT))
+                              .bytes;
+        code_dev->write(0, prog.data(), prog.size());
+
+        cpu = cpu_new(&memctl->intf);
+        restart();
+    }
+
+    ~CPUTLBTest() {
+        cpu_free(cpu);
+        memctl_free(memctl);
+        delete code_dev;
+        delete data_dev;
+    }
+
+    void restart() {
+        cpu->state = CPU_FETCH_DECODE_OPCODE;
+        cpu->reg_pc = TEST_CODE_START;
+    }
+
+    memctl_ctx_t *memctl;
+    FakeMem *code_dev;
+    FakeMem *data_dev;
+    cpu_ctx_t *cpu;
+};
+
+TEST_F(CPUTLBTest, KeepsSpanPerAccessKind) {
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    EXPECT_EQ(cpu->gp_regs[2], 0x12345678);
+    uint32_t stored = 0;
+    data_dev->read(8, &stored, sizeof(stored));
+    EXPECT_EQ(stored, 0x12345678);
+
+    const mem_span_t &fetch = cpu->tlb[CPU_TLB_FETCH].span;
+    EXPECT_EQ(fetch.start, TEST_CODE_START);
+    EXPECT_EQ(fetch.end, TEST_CODE_START + TEST_CODE_SIZE);
+    EXPECT_EQ(fetch.ptr, nullptr);
+    EXPECT_EQ(fetch.ctx, &code_dev->mem_if);
+    EXPECT_EQ(fetch.cb_base, TEST_CODE_START);
+
+    for (cpu_tlb_kind_t kind : {CPU_TLB_LOAD, CPU_TLB_STORE}) {
+        const mem_span_t &data = cpu->tlb[kind].span;
+        EXPECT_EQ(data.start, TEST_DATA_START);
+        EXPECT_EQ(data.end, TEST_DATA_START + TEST_DATA_SIZE);
+        EXPECT_EQ(data.ptr, data_dev->bytes);
+    }
+}
+
+TEST_F(CPUTLBTest, MappingInvalidatesSpans) {
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    const uint32_t gen = memctl->map_gen;
+    EXPECT_EQ(cpu->tlb[CPU_TLB_FETCH].gen, gen);
+
+    FakeMem other_dev(0, 16, true);
+    mmio_region_t other_reg = {
+        .start = TEST_DATA_START + TEST_DATA_SIZE,
+        .end = TEST_DATA_START + TEST_DATA_SIZE + 16,
+        .ctx = &other_dev.mem_if,
+        .mem_if = other_dev.mem_if,
+        .direct_ptr = nullptr,
+        .direct_perms = 0,
+        .notifies_changes = false,
+    };
+    ASSERT_EQ(memctl_map_region(memctl, &other_reg), VM_ERR_NONE);
+    EXPECT_NE(memctl->map_gen, gen);
+
+    // The stale entries are refilled on the next access.
+    restart();
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    // The program does not take interrupts, so it never reads the IVT.
+    for (cpu_tlb_kind_t kind : {CPU_TLB_FETCH, CPU_TLB_LOAD, CPU_TLB_STORE}) {
+        EXPECT_EQ(cpu->tlb[kind].gen, memctl->map_gen);
+    }
+    EXPECT_EQ(cpu->gp_regs[2], 0x12345678);
+}
@@ -0,0 +1,452 @@
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include "testcommon/fake_mem.h"
+#include "testcommon/prog_builder.h"
+
+#define TEST_MEM_BASE  CPU_IVT_ADDR
+#define TEST_MEM_SIZE  2048
+#define TEST_STACK_TOP (TEST_MEM_BASE + TEST_MEM_SIZE)
+
+#define TEST_PROG_START (CPU_IVT_ADDR + CPU_IVT_SIZE)
+#define TEST_ISR_START  (TEST_PROG_START + 100)
+
+class CPURunTest : public testing::Test {
+  protected:
+    CPURunTest() {
+        mem = new FakeMem(TEST_MEM_BASE, TEST_MEM_BASE + TEST_MEM_SIZE);
+        cpu = cpu_new(&mem->mem_if);
+        cpu->state = CPU_FETCH_DECODE_OPCODE;
+        cpu->reg_pc = TEST_PROG_START;
+        cpu->reg_sp = TEST_STACK_TOP;
+    }
+
+    ~CPURunTest() {
+        cpu_free(cpu);
+        delete mem;
+    }
+
+    void write_prog(vm_addr_t at, const std::vector<uint8_t> &prog) {
+        mem->write(at, prog.data(), prog.size());
+    }
+
+    void write_ivt_entry(uint8_t entry_idx, vm_addr_t isr_addr) {
+        mem->write(CPU_IVT_ENTRY_ADDR(entry_idx), &isr_addr,
+                   CPU_IVT_ENTRY_SIZE);
+    }
+
+    /// An instruction that does nothing (3 bytes).
+    static InstrBuilder build_idle_instr() {
+        return build_instr(CPU_OP_MOV_RR)
+            .reg_code(CPU_CODE_R0)
+            .reg_code(CPU_CODE_R0);
+    }
+
+    /// Sums the numbers from 10 down to 1 into r0, then halts.
+    static std::vector<uint8_t> build_sum_loop() {
+        return build_prog()
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(0))
+            .instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R1).imm32(10))
+            // loop:
+            .instr(build_instr(CPU_OP_ADD_RR)
+                       .reg_code(CPU_CODE_R0)
+                       .reg_code(CPU_CODE_R1))
+            .instr(build_instr(CPU_OP_SUB_RV).reg_code(CPU_CODE_R1).imm32(1))
+            .instr(build_instr(CPU_OP_JNER_V8).imm8((uint8_t)-9))
+            .instr(build_instr(CPU_OP_HALT))
+            .bytes;
+    }
+
+    FakeMem *mem;
+    cpu_ctx_t *cpu;
+};
+
+TEST_F(CPURunTest, StopsWhenBudgetIsExhausted) {
+    write_prog(TEST_PROG_START, build_prog()
+                                    .instr(build_idle_instr())
+                                    .instr(build_idle_instr())
+                                    .instr(build_idle_instr())
+                                    .instr(build_instr(CPU_OP_HALT))
+                                    .bytes);
+
+    size_t num_instrs = 0;
+    cpu_stop_t stop = cpu_run(cpu, 2, &num_instrs);
+    EXPECT_EQ(stop, CPU_STOP_BUDGET);
+    EXPECT_EQ(num_instrs, 2);
+    EXPECT_EQ(cpu->reg_pc, TEST_PROG_START + 2 * 3);
+    EXPECT_EQ(cpu->state, CPU_FETCH_DECODE_OPCODE);
+}
+
+TEST_F(CPURunTest, ZeroBudgetDoesNothing) {
+    write_prog(TEST_PROG_START, build_idle_instr().bytes);
+
+    size_t num_instrs = 1;
+    EXPECT_EQ(cpu_run(cpu, 0, &num_instrs), CPU_STOP_BUDGET);
+    EXPECT_EQ(num_instrs, 0);
+    EXPECT_EQ(cpu->reg_pc, TEST_PROG_START);
+}
+
+TEST_F(CPURunTest, StopsOnHalt) {
+    write_prog(TEST_PROG_START, build_prog()
+                                    .instr(build_idle_instr())
+                                    .instr(build_instr(CPU_OP_HALT))
+                                    .bytes);
+
+    size_t num_instrs = 0;
+    EXPECT_EQ(cpu_run(cpu, 100, &num_instrs), CPU_STOP_HALTED);
+    EXPECT_EQ(num_instrs, 2);
+    EXPECT_EQ(cpu->state, CPU_HALTED);
+
+    // A halted CPU stays halted without doing anything.
+    EXPECT_EQ(cpu_run(cpu, 100, &num_instrs), CPU_STOP_HALTED);
+    EXPECT_EQ(num_instrs, 0);
+}
+
+TEST_F(CPURunTest, NOPOnlyAdvancesPC) {
+    write_prog(TEST_PROG_START, build_prog()
+                                    .instr(build_instr(CPU_OP_NOP))
+                                    .instr(build_instr(CPU_OP_NOP))
+                                    .instr(build_instr(CPU_OP_HALT))
+                                    .bytes);
+    cpu->flags = CPU_FLAG_CARRY;
+
+    size_t num_instrs = 0;
+    EXPECT_EQ(cpu_run(cpu, 2, &num_instrs), CPU_STOP_BUDGET);
+    EXPECT_EQ(num_instrs, 2);
+    EXPECT_EQ(cpu->reg_pc, TEST_PROG_START + 2);
+    EXPECT_EQ(cpu->flags, CPU_FLAG_CARRY);
+    EXPECT_EQ(cpu->cycles, 2 * CPU_CYCLES_BASE);
+}
+
+TEST_F(CPURunTest, HaltedCPUEntersISROnIRQ) {
+    constexpr uint8_t irq_num = 3;
+    const auto instr_halt = build_instr(CPU_OP_HALT).bytes;
+    write_prog(TEST_PROG_START, instr_halt);
+    write_prog(TEST_ISR_START, build_instr(CPU_OP_IRET).bytes);
+    write_ivt_entry(CPU_IVT_FIRST_IRQ_ENTRY + irq_num, TEST_ISR_START);
+
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    ASSERT_EQ(cpu_raise_irq(cpu, irq_num), VM_ERR_NONE);
+
+    // Interrupt entry is not counted, only the IRET instruction is.
+    size_t num_instrs = 0;
+    EXPECT_EQ(cpu_run(cpu, 1, &num_instrs), CPU_STOP_BUDGET);
+    EXPECT_EQ(num_instrs, 1);
+    EXPECT_EQ(cpu->reg_pc, TEST_PROG_START + instr_halt.size());
+    EXPECT_EQ(cpu->reg_sp, TEST_STACK_TOP);
+}
+
+TEST_F(CPURunTest, InterruptEntryFailureMatchesStepping) {
+    constexpr uint8_t irq_num = 3;
+    write_ivt_entry(CPU_IVT_FIRST_IRQ_ENTRY + irq_num, TEST_ISR_START);
+    cpu_ctx_t *step_cpu = cpu_new(&mem->mem_if);
+    for (cpu_ctx_t *any_cpu : {cpu, step_cpu}) {
+        any_cpu->state = CPU_FETCH_DECODE_OPCODE;
+        any_cpu->reg_pc = TEST_PROG_START;
+        // Pushing the return address overflows the stack.
+        any_cpu->reg_sp = 0;
+        ASSERT_EQ(cpu_raise_irq(any_cpu, irq_num), VM_ERR_NONE);
+    }
+
+    // Take the IRQ and read the IVT, then push the PC.
+    cpu_step(step_cpu);
+    cpu_step(step_cpu);
+    EXPECT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_EXCEPTION);
+    EXPECT_EQ(cpu->state, step_cpu->state);
+    EXPECT_EQ(cpu->curr_int_line, step_cpu->curr_int_line);
+    EXPECT_EQ(cpu->curr_isr_addr, step_cpu->curr_isr_addr);
+    EXPECT_EQ(cpu->num_nested_exc, step_cpu->num_nested_exc);
+    EXPECT_EQ(cpu->reg_pc, step_cpu->reg_pc);
+    EXPECT_EQ(cpu->reg_sp, step_cpu->reg_sp);
+    EXPECT_EQ(cpu->cycles, step_cpu->cycles);
+    EXPECT_EQ(cpu->num_nested_exc, 1);
+    cpu_free(step_cpu);
+}
+
+TEST_F(CPURunTest, IRQIsTakenAtInstructionBoundary) {
+    constexpr uint8_t irq_num = 1;
+    const auto instr_int = build_instr(CPU_OP_INT_V8).imm8(irq_num).bytes;
+    write_prog(TEST_PROG_START, build_prog()
+                                    .instr(instr_int)
+                                    .instr(build_instr(CPU_OP_HALT))
+                                    .bytes);
+    write_prog(TEST_ISR_START, build_instr(CPU_OP_HALT).bytes);
+    write_ivt_entry(CPU_IVT_FIRST_IRQ_ENTRY + irq_num, TEST_ISR_START);
+
+    size_t num_instrs = 0;
+    EXPECT_EQ(cpu_run(cpu, 100, &num_instrs), CPU_STOP_HALTED);
+    EXPECT_EQ(num_instrs, 2);
+    EXPECT_EQ(cpu->reg_pc, TEST_ISR_START + 1);
+
+    // The ISR return address is the instruction after INT.
+    uint32_t ret_addr = 0;
+    mem->read(cpu->reg_sp, &ret_addr, sizeof(ret_addr));
+    EXPECT_EQ(ret_addr, TEST_PROG_START + instr_int.size());
+}
+
+TEST_F(CPURunTest, StopsOnException) {
+    constexpr uint8_t bad_opcode = 0x00;
+    write_prog(TEST_PROG_START, build_prog()
+                                    .instr(build_idle_instr())
+                                    .instr(std::vector<uint8_t>{bad_opcode})
+                                    .bytes);
+    write_prog(TEST_ISR_START, build_instr(CPU_OP_HALT).bytes);
+    write_ivt_entry(CPU_EXC_BAD_INSTR, TEST_ISR_START);
+
+    size_t num_instrs = 0;
+    EXPECT_EQ(cpu_run(cpu, 100, &num_instrs), CPU_STOP_EXCEPTION);
+    EXPECT_EQ(num_instrs, 1);
+    EXPECT_EQ(cpu->state, CPU_INT_FETCH_ISR_ADDR);
+    EXPECT_EQ(cpu->curr_int_line, CPU_EXC_BAD_INSTR);
+    EXPECT_EQ(cpu->num_nested_exc, 1);
+
+    // The next run enters the exception handler.
+    EXPECT_EQ(cpu_run(cpu, 100, &num_instrs), CPU_STOP_HALTED);
+    EXPECT_EQ(num_instrs, 1);
+    EXPECT_EQ(cpu->reg_pc, TEST_ISR_START + 1);
+}
+
+TEST_F(CPURunTest, StopsOnTripleFault) {
+    // The stack is too small to push the return address of any exception
+    // handler, so every exception raises another one.
+    constexpr uint8_t bad_opcode = 0x00;
+    write_prog(TEST_PROG_START, std::vector<uint8_t>{bad_opcode});
+    write_ivt_entry(CPU_EXC_BAD_INSTR, TEST_ISR_START);
+    write_ivt_entry(CPU_EXC_STACK_OVERFLOW, TEST_ISR_START);
+    cpu->reg_sp = 0;
+
+    EXPECT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_EXCEPTION);
+    EXPECT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_EXCEPTION);
+    EXPECT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_TRIPLE_FAULT);
+    EXPECT_EQ(cpu->state, CPU_TRIPLE_FAULT);
+}
+
+TEST_F(CPURunTest, FinishesInstructionStartedByStep) {
+    write_prog(TEST_PROG_START, build_prog()
+                                    .instr(build_instr(CPU_OP_MOV_VR)
+                                               .reg_code(CPU_CODE_R2)
+                                               .imm32(0xCAFEBABE))
+                                    .instr(build_instr(CPU_OP_HALT))
+                                    .bytes);
+
+    cpu_step(cpu);
+    ASSERT_EQ(cpu->state, CPU_FETCH_DECODE_OPERANDS);
+
+    size_t num_instrs = 0;
+    EXPECT_EQ(cpu_run(cpu, 1, &num_instrs), CPU_STOP_BUDGET);
+    EXPECT_EQ(num_instrs, 1);
+    EXPECT_EQ(cpu->gp_regs[2], 0xCAFEBABE);
+    EXPECT_EQ(cpu->state, CPU_FETCH_DECODE_OPCODE);
+}
+
+TEST_F(CPURunTest, DecodedInstructionCanBeCopiedToAnotherCPU) {
+    write_prog(TEST_PROG_START, build_prog()
+                                    .instr(build_instr(CPU_OP_ADD_RR)
+                                               .reg_code(CPU_CODE_R2)
+                                               .reg_code(CPU_CODE_SP))
+                                    .bytes);
+    cpu->reg_sp = 5;
+    while (cpu->state != CPU_EXECUTE) {
+        cpu_step(cpu);
+    }
+
+    cpu_ctx_t *other_cpu = cpu_new(&mem->mem_if);
+    other_cpu->state = cpu->state;
+    other_cpu->instr = cpu->instr;
+    other_cpu->reg_pc = cpu->reg_pc;
+    other_cpu->gp_regs[2] = 10;
+    other_cpu->reg_sp = 20;
+    cpu_step(other_cpu);
+    EXPECT_EQ(other_cpu->gp_regs[2], 30);
+    EXPECT_EQ(cpu->gp_regs[2], 0);
+    cpu_free(other_cpu);
+}
+
+TEST_F(CPURunTest, MatchesStepping) {
+    write_prog(TEST_PROG_START, build_sum_loop());
+
+    FakeMem step_mem(TEST_MEM_BASE, TEST_MEM_BASE + TEST_MEM_SIZE);
+    step_mem.write(TEST_MEM_BASE, mem->bytes, TEST_MEM_SIZE);
+    cpu_ctx_t *step_cpu = cpu_new(&step_mem.mem_if);
+    step_cpu->state = cpu->state;
+    step_cpu->reg_pc = cpu->reg_pc;
+    step_cpu->reg_sp = cpu->reg_sp;
+    while (step_cpu->state != CPU_HALTED) {
+        cpu_step(step_cpu);
+        ASSERT_EQ(step_cpu->num_nested_exc, 0);
+    }
+
+    size_t num_instrs = 0;
+    ASSERT_EQ(cpu_run(cpu, 1000, &num_instrs), CPU_STOP_HALTED);
+    EXPECT_EQ(num_instrs, 2 + 3 * 10 + 1);
+    EXPECT_EQ(cpu->gp_regs[0], 55);
+
+    EXPECT_EQ(memcmp(cpu->gp_regs, step_cpu->gp_regs, sizeof(cpu->gp_regs)),
+              0);
+    EXPECT_EQ(cpu->reg_pc, step_cpu->reg_pc);
+    EXPECT_EQ(cpu->reg_sp, step_cpu->reg_sp);
+    EXPECT_EQ(cpu->flags, step_cpu->flags);
+    EXPECT_EQ(cpu->state, step_cpu->state);
+    EXPECT_EQ(cpu->cycles, step_cpu->cycles);
+
+    cpu_free(step_cpu);
+}
+
+/// Snapshots @a cpu from its 32-bit stores, in the middle of cpu_run().
+struct SnapshotOnStoreMem {
+    explicit SnapshotOnStoreMem(FakeMem *amem) : mem(amem) {
+        mem_if.read_u8 = [](void *ctx, vm_addr_t addr, uint8_t *out) {
+            FakeMem *mem = ((SnapshotOnStoreMem *)ctx)->mem;
+            return mem->mem_if.read_u8(&mem->mem_if, addr, out);
+        };
+        mem_if.read_u32 = [](void *ctx, vm_addr_t addr, uint32_t *out) {
+            FakeMem *mem = ((SnapshotOnStoreMem *)ctx)->mem;
+            return mem->mem_if.read_u32(&mem->mem_if, addr, out);
+        };
+        mem_if.write_u8 = [](void *ctx, vm_addr_t addr, uint8_t val) {
+            FakeMem *mem = ((SnapshotOnStoreMem *)ctx)->mem;
+            return mem->mem_if.write_u8(&mem->mem_if, addr, val);
+        };
+        mem_if.write_u32 = [](void *ctx, vm_addr_t addr, uint32_t val) {
+            auto *self = (SnapshotOnStoreMem *)ctx;
+            self->flags_pending = self->cpu->lazy_flags.opcode != 0;
+            self->snapshot.resize(cpu_snapshot_size());
+            self->snapshot.resize(cpu_snapshot(
+                self->cpu, self->snapshot.data(), self->snapshot.size()));
+            return self->mem->mem_if.write_u32(&self->mem->mem_if, addr, val);
+        };
+    }
+
+    mem_if_t mem_if = {}; //!< Must come first, it is the callback context.
+    FakeMem *mem;
+    cpu_ctx_t *cpu = nullptr;
+    bool flags_pending = false;
+    std::vector<uint8_t> snapshot;
+};
+
+TEST_F(CPURunTest, SnapshotSavesPendingFlags) {
+    constexpr vm_addr_t data_addr = TEST_STACK_TOP - 4;
+    write_prog(TEST_PROG_START,
+               build_prog()
+                   .instr(build_instr(CPU_OP_MOV_VR)
+                              .reg_code(CPU_CODE_R0)
+                              .imm32(0xFFFFFFFF))
+                   .instr(build_instr(CPU_OP_ADD_RV)
+                              .reg_code(CPU_CODE_R0)
+                              .imm32(1))
+                   .instr(build_instr(CPU_OP_STR_RV0)
+                              .imm32(data_addr)
+                              .reg_code(CPU_CODE_R0))
+                   .instr(build_instr(CPU_OP_HALT))
+                   .bytes);
+
+    FakeMem step_mem(TEST_MEM_BASE, TEST_MEM_BASE + TEST_MEM_SIZE);
+    step_mem.write(TEST_MEM_BASE, mem->bytes, TEST_MEM_SIZE);
+    cpu_ctx_t *step_cpu = cpu_new(&step_mem.mem_if);
+    step_cpu->state = cpu->state;
+    step_cpu->reg_pc = cpu->reg_pc;
+    step_cpu->reg_sp = cpu->reg_sp;
+    while (step_cpu->state != CPU_HALTED) {
+        cpu_step(step_cpu);
+    }
+    ASSERT_NE(step_cpu->flags, 0);
+
+    // The store snapshots the CPU before the flags of the ADD are computed.
+    SnapshotOnStoreMem snap_mem(mem);
+    cpu_ctx_t *run_cpu = cpu_new(&snap_mem.mem_if);
+    run_cpu->state = cpu->state;
+    run_cpu->reg_pc = cpu->reg_pc;
+    run_cpu->reg_sp = cpu->reg_sp;
+    snap_mem.cpu = run_cpu;
+    ASSERT_EQ(cpu_run(run_cpu, 100, NULL), CPU_STOP_HALTED);
+    ASSERT_TRUE(snap_mem.flags_pending);
+    EXPECT_EQ(run_cpu->flags, step_cpu->flags);
+
+    size_t used_size = 0;
+    cpu_ctx_t *rest_cpu =
+        cpu_restore(&mem->mem_if, snap_mem.snapshot.data(),
+                    snap_mem.snapshot.size(), &used_size);
+    EXPECT_EQ(used_size, snap_mem.snapshot.size());
+    EXPECT_EQ(rest_cpu->flags, step_cpu->flags);
+
+    ASSERT_EQ(cpu_run(rest_cpu, 100, NULL), CPU_STOP_HALTED);
+    EXPECT_EQ(rest_cpu->flags, step_cpu->flags);
+    EXPECT_EQ(rest_cpu->gp_regs[0], step_cpu->gp_regs[0]);
+
+    cpu_free(rest_cpu);
+    cpu_free(run_cpu);
+    cpu_free(step_cpu);
+}
+
+TEST_F(CPURunTest, ChargesCyclesPerInstruction) {
+    write_prog(TEST_PROG_START,
+               build_prog()
+                   .instr(build_idle_instr())
+                   .instr(build_instr(CPU_OP_PUSH_R).reg_code(CPU_CODE_R0))
+                   .instr(build_instr(CPU_OP_POP_R).reg_code(CPU_CODE_R1))
+                   .instr(build_instr(CPU_OP_HALT))
+                   .bytes);
+
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    EXPECT_EQ(cpu->cycles, 4 * CPU_CYCLES_BASE + 2 * CPU_CYCLES_MEM_ACCESS);
+}
+
+TEST_F(CPURunTest, ChargesCyclesForInterruptEntry) {
+    constexpr uint8_t irq_num = 2;
+    write_prog(TEST_PROG_START, build_instr(CPU_OP_HALT).bytes);
+    write_prog(TEST_ISR_START, build_instr(CPU_OP_IRET).bytes);
+    write_ivt_entry(CPU_IVT_FIRST_IRQ_ENTRY + irq_num, TEST_ISR_START);
+
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+    const uint64_t cycles_before_irq = cpu->cycles;
+    ASSERT_EQ(cpu_raise_irq(cpu, irq_num), VM_ERR_NONE);
+
+    ASSERT_EQ(cpu_run(cpu, 1, NULL), CPU_STOP_BUDGET);
+    EXPECT_EQ(cpu->cycles - cycles_before_irq,
+              CPU_CYCLES_INT_ENTRY + CPU_CYCLES_BASE + CPU_CYCLES_MEM_ACCESS);
+}
+
+TEST_F(CPURunTest, RunCyclesStopsWhenBudgetIsSpent) {
+    write_prog(TEST_PROG_START, build_sum_loop());
+
+    uint64_t used_cycles = 0;
+    uint64_t overshoot = 1;
+    EXPECT_EQ(cpu_run_cycles(cpu, 5, &used_cycles, &overshoot),
+              CPU_STOP_BUDGET);
+    EXPECT_EQ(used_cycles, 5);
+    EXPECT_EQ(overshoot, 0);
+    EXPECT_EQ(cpu->cycles, 5);
+
+    // Both MOVs and the first loop iteration have been executed.
+    EXPECT_EQ(cpu->gp_regs[0], 10);
+    EXPECT_EQ(cpu->gp_regs[1], 9);
+}
+
+TEST_F(CPURunTest, RunCyclesReportsOvershoot) {
+    write_prog(TEST_PROG_START,
+               build_prog()
+                   .instr(build_idle_instr())
+                   .instr(build_instr(CPU_OP_PUSH_R).reg_code(CPU_CODE_R0))
+                   .instr(build_instr(CPU_OP_HALT))
+                   .bytes);
+
+    // The PUSH instruction starts within the budget and is not split.
+    uint64_t used_cycles = 0;
+    uint64_t overshoot = 0;
+    EXPECT_EQ(cpu_run_cycles(cpu, 2, &used_cycles, &overshoot),
+              CPU_STOP_BUDGET);
+    EXPECT_EQ(used_cycles, 2 * CPU_CYCLES_BASE + CPU_CYCLES_MEM_ACCESS);
+    EXPECT_EQ(overshoot, used_cycles - 2);
+}
+
+TEST_F(CPURunTest, RunCyclesStopsOnHalt) {
+    write_prog(TEST_PROG_START, build_sum_loop());
+
+    uint64_t used_cycles = 0;
+    uint64_t overshoot = 1;
+    EXPECT_EQ(cpu_run_cycles(cpu, 1000, &used_cycles, &overshoot),
+              CPU_STOP_HALTED);
+    EXPECT_EQ(used_cycles, (2 + 3 * 10 + 1) * CPU_CYCLES_BASE);
+    EXPECT_EQ(overshoot, 0);
+    EXPECT_EQ(cpu->gp_regs[0], 55);
+}
@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include "testcommon/cpu_engine_test.h"
+
+#define TEST_MEM_SIZE 8192
+
+#define TEST_PROG_START (CPU_IVT_ADDR + CPU_IVT_SIZE)
+
+/// Runs the same program with the interpreter and the tiered engine.
+class CPUTierTest : public CPUEngineTest {
+  protected:
+    CPUTierTest() : CPUEngineTest(CPU_ENGINE_TIERED, TEST_MEM_SIZE) {}
+};
+
+TEST_F(CPUTierTest, PromotedCodeRunsLikeInterpreter) {
+    write(TEST_PROG_START, build_sum_prog(200));
+    run_until_halt();
+
+    const cpu_tier_stats_t *stats = &cpus[1]->tier_stats;
+    EXPECT_GT(stats->cold_instrs, 0u);
+    EXPECT_GT(stats->warm_instrs, 0u);
+    EXPECT_GT(stats->num_warmed, 0u);
+    if (cpu_jit_is_supported()) {
+        EXPECT_GT(stats->num_heated, 0u);
+        EXPECT_GT(stats->hot_instrs, 0u);
+    } else {
+        EXPECT_EQ(stats->num_heated, 0u);
+        EXPECT_EQ(stats->hot_instrs, 0u);
+    }
+    EXPECT_EQ(stats->cold_instrs + stats->warm_instrs + stats->hot_instrs,
+              total_instrs);
+}
+
+TEST_F(CPUTierTest, ColdCodeAllocatesNothing) {
+    write(TEST_PROG_START, build_sum_prog(CPU_TIER_DEFAULT_WARM_RUNS - 1));
+    run_until_halt();
+
+    EXPECT_EQ(cpus[1]->blocks, nullptr);
+    EXPECT_EQ(cpus[1]->jit, nullptr);
+    EXPECT_EQ(cpus[1]->tier_stats.cold_instrs, total_instrs);
+    EXPECT_EQ(cpus[1]->tier_stats.num_warmed, 0u);
+}
+
+TEST_F(CPUTierTest, ThresholdsAreTunable) {
+    const cpu_tier_cfg_t cfg = {
+        .warm_runs = 1,
+        .hot_runs = 1,
+        .hot_loop_runs = 1,
+    };
+    cpu_set_tiers(cpus[1], &cfg);
+    write(TEST_PROG_START, build_sum_prog(3));
+    run_until_halt();
+
+    const cpu_tier_stats_t *stats = &cpus[1]->tier_stats;
+    EXPECT_GT(stats->num_warmed, 0u);
+    if (cpu_jit_is_supported()) {
+        EXPECT_GT(stats->num_heated, 0u);
+        EXPECT_GT(stats->hot_instrs, 0u);
+    }
+}
@@ -0,0 +1,206 @@
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include <fcvm/cpu_trace.h>
+#include "testcommon/fake_mem.h"
+#include "testcommon/prog_builder.h"
+
+#define TEST_MEM_BASE  CPU_IVT_ADDR
+#define TEST_MEM_SIZE  2048
+#define TEST_STACK_TOP (TEST_MEM_BASE + TEST_MEM_SIZE)
+
+#define TEST_PROG_START (CPU_IVT_ADDR + CPU_IVT_SIZE)
+
+class CPUTraceTest : public testing::Test {
+  protected:
+    CPUTraceTest() {
+        mem = new FakeMem(TEST_MEM_BASE, TEST_MEM_BASE + TEST_MEM_SIZE);
+        cpu = cpu_new(&mem->mem_if);
+        cpu->state = CPU_FETCH_DECODE_OPCODE;
+        cpu->reg_pc = TEST_PROG_START;
+        cpu->reg_sp = TEST_STACK_TOP;
+    }
+
+    ~CPUTraceTest() {
+        cpu_free(cpu);
+        delete mem;
+    }
+
+    void write_prog(const std::vector<uint8_t> &prog) {
+        mem->write(TEST_PROG_START, prog.data(), prog.size());
+    }
+
+    /// An infinite loop of one MOV and a jump back to it.
+    void write_endless_loop() {
+        write_prog(build_prog()
+                       .instr(build_instr(CPU_OP_MOV_VR)
+                                  .reg_code(CPU_CODE_R0)
+                                  .imm32(0x12345678))
+                       .instr(build_instr(CPU_OP_JMPR_V8).imm8((uint8_t)-6))
+                       .bytes);
+    }
+
+    FakeMem *mem;
+    cpu_ctx_t *cpu;
+};
+
+TEST_F(CPUTraceTest, IsOffByDefault) {
+    EXPECT_EQ(cpu->trace, nullptr);
+}
+
+TEST_F(CPUTraceTest, RecordsExecutedInstructions) {
+    write_prog(build_prog()
+                   .instr(build_instr(CPU_OP_MOV_VR)
+                              .reg_code(CPU_CODE_R1)
+                              .imm32(0xDEADBEEF))
+                   .instr(build_instr(CPU_OP_CMP_RR)
+                              .reg_code(CPU_CODE_R1)
+                              .reg_code(CPU_CODE_R1))
+                   .instr(build_instr(CPU_OP_HALT))
+                   .bytes);
+
+    cpu_trace_t *trace = cpu_trace_new(16);
+    cpu_set_trace(cpu, trace);
+    ASSERT_EQ(cpu_run(cpu, 100, NULL), CPU_STOP_HALTED);
+
+    cpu_trace_rec_t recs[16];
+    size_t num_lost = 1;
+    ASSERT_EQ(cpu_trace_drain(trace, recs, 16, &num_lost), 3);
+    EXPECT_EQ(num_lost, 0);
+
+    EXPECT_EQ(recs[0].pc, TEST_PROG_START);
+    EXPECT_EQ(recs[0].opcode, CPU_OP_MOV_VR);
+    EXPECT_EQ(recs[0].operands[0], CPU_CODE_R1);
+    EXPECT_EQ(recs[0].operands[1], 0xDEADBEEF);
+    EXPECT_EQ(recs[0].operands[2], 0);
+    EXPECT_EQ(recs[0].cycle, 0);
+
+    EXPECT_EQ(recs[1].pc, TEST_PROG_START + 6);
+    EXPECT_EQ(recs[1].opcode, CPU_OP_CMP_RR);
+    EXPECT_EQ(recs[1].cycle, CPU_CYCLES_BASE);
+    EXPECT_EQ(recs[1].flags, 0);
+
+    // Flags are recorded before the instruction is executed.
+    EXPECT_EQ(recs[2].opcode, CPU_OP_HALT);
+    EXPECT_TRUE(recs[2].flags & CPU_FLAG_ZERO);
+    EXPECT_EQ(recs[2].flags, cpu->flags);
+
+    // Everything has been drained.
+    EXPECT_EQ(cpu_trace_drain(trace, recs, 16, NULL), 0);
+
+    cpu_trace_free(trace);
+}
+
+TEST_F(CPUTraceTest, StepAndRunRecordTheSame) {
+    write_endless_loop();
+    cpu_trace_t *trace = cpu_trace_new(8);
+    cpu_set_trace(cpu, trace);
+
+    // MOV and JMPR take 4 and 3 steps respectively.
+    for (int idx = 0; idx < 7; idx++) {
+        cpu_step(cpu);
+    }
+    ASSERT_EQ(cpu_run(cpu, 2, NULL), CPU_STOP_BUDGET);
+
+    cpu_trace_rec_t recs[8];
+    ASSERT_EQ(cpu_trace_drain(trace, recs, 8, NULL), 4);
+    for (size_t idx = 0; idx < 2; idx++) {
+        const cpu_trace_rec_t &stepped = recs[idx];
+        const cpu_trace_rec_t &run = recs[idx + 2];
+        EXPECT_EQ(stepped.pc, run.pc);
+        EXPECT_EQ(stepped.opcode, run.opcode);
+        EXPECT_EQ(stepped.flags, run.flags);
+        for (size_t opd = 0; opd < CPU_MAX_OPERANDS; opd++) {
+            EXPECT_EQ(stepped.operands[opd], run.operands[opd]);
+        }
+    }
+
+    cpu_trace_free(trace);
+}
+
+TEST_F(CPUTraceTest, OverwritesOldestRecords) {
+    write_endless_loop();
+    cpu_trace_t *trace = cpu_trace_new(4);
+    cpu_set_trace(cpu, trace);
+    ASSERT_EQ(cpu_run(cpu, 10, NULL), CPU_STOP_BUDGET);
+
+    cpu_trace_rec_t recs[8];
+    size_t num_lost = 0;
+    ASSERT_EQ(cpu_trace_drain(trace, recs, 8, &num_lost), 4);
+    EXPECT_EQ(num_lost, 6);
+    for (size_t idx = 0; idx < 4; idx++) {
+        EXPECT_EQ(recs[idx].cycle, 6 + idx);
+    }
+
+    cpu_trace_free(trace);
+}
+
+TEST_F(CPUTraceTest, FormatsRecordsAsText) {
+    cpu_trace_rec_t rec = {};
+    rec.pc = 0x00000400;
+    rec.opcode = CPU_OP_STR_RI8;
+    rec.operands[0] = CPU_CODE_R2;
+    rec.operands[1] = 0x7F;
+    rec.operands[2] = CPU_CODE_R3 | CPU_REG_REF_SIZE_8;
+
+    char buf[128];
+    const char expected[] =
+        "00000400 | 24  STR [regref 02, imm8 7F, regref 43]";
+    EXPECT_EQ(cpu_trace_format_rec(&rec, buf, sizeof(buf)),
+              (int)strlen(expected));
+    EXPECT_STREQ(buf, expected);
+
+    rec.opcode = CPU_OP_HALT;
+    cpu_trace_format_rec(&rec, buf, sizeof(buf));
+    EXPECT_STREQ(buf, "00000400 | A1 HALT");
+
+    // The text is truncated like snprintf() does.
+    rec.opcode = CPU_OP_STR_RI8;
+    char small_buf[8];
+    EXPECT_EQ(cpu_trace_format_rec(&rec, small_buf, sizeof(small_buf)),
+              (int)strlen(expected));
+    EXPECT_STREQ(small_buf, "0000040");
+}
+
+TEST_F(CPUTraceTest, DrainsConcurrently) {
+    constexpr size_t num_instrs = 200000;
+    write_endless_loop();
+    cpu_trace_t *trace = cpu_trace_new(64);
+    cpu_set_trace(cpu, trace);
+
+    std::thread producer(
+        [this] { ASSERT_EQ(cpu_run(cpu, num_instrs, NULL), CPU_STOP_BUDGET); });
+
+    // Every record is either read intact or counted as lost.
+    size_t num_read = 0;
+    size_t num_lost_total = 0;
+    uint64_t last_cycle = 0;
+    bool first = true;
+    while (num_read + num_lost_total < num_instrs) {
+        cpu_trace_rec_t recs[16];
+        size_t num_lost = 0;
+        size_t num_recs = cpu_trace_drain(trace, recs, 16, &num_lost);
+        num_lost_total += num_lost;
+        for (size_t idx = 0; idx < num_recs; idx++) {
+            ASSERT_TRUE(first || recs[idx].cycle > last_cycle);
+            if (recs[idx].opcode == CPU_OP_MOV_VR) {
+                ASSERT_EQ(recs[idx].pc, TEST_PROG_START);
+                ASSERT_EQ(recs[idx].operands[1], 0x12345678);
+            } else {
+                ASSERT_EQ(recs[idx].opcode, CPU_OP_JMPR_V8);
+                ASSERT_EQ(recs[idx].pc, TEST_PROG_START + 6);
+            }
+            last_cycle = recs[idx].cycle;
+            first = false;
+        }
+        num_read += num_recs;
+    }
+    producer.join();
+
+    EXPECT_EQ(num_read + num_lost_total, num_instrs);
+    EXPECT_EQ(cpu_trace_drain(trace, nullptr, 0, nullptr), 0);
+
+    cpu_trace_free(trace);
+}
@@ -1,5 +1,9 @@
 #include <gtest/gtest.h>
 
+#include <poll.h>
+#include <thread>
+#include <vector>
+
 #include <fcvm/intctl.h>
 
 #define TEST_INVALID_IRQ (INTCTL_MAX_IRQ_NUM + 1)
@@ -66,7 +70,7 @@ TEST_F(IntCtlTest, LowerNumIsHigherPriority) {
 }
 
 TEST_F(IntCtlTest, SnapshotRestore) {
-    static_assert(SN_INTCTL_CTX_VER == 1);
+    static_assert(SN_INTCTL_CTX_VER == 3);
 
     uint8_t raised_irq = 1;
     vm_err_t err = intctl_raise_irq_line(intctl, raised_irq);
@@ -86,3 +90,79 @@ TEST_F(IntCtlTest, SnapshotRestore) {
 
     delete[] snapshot_buf;
 }
+
+TEST_F(IntCtlTest, WaitReturnsAtOnceWithPendingIRQ) {
+    EXPECT_EQ(intctl_raise_irq_line(intctl, 3), VM_ERR_NONE);
+    EXPECT_EQ(intctl_wait(intctl, -1), true);
+}
+
+TEST_F(IntCtlTest, WaitTimesOutWithoutIRQ) {
+    EXPECT_EQ(intctl_wait(intctl, 0), false);
+    EXPECT_EQ(intctl_wait(intctl, 10), false);
+}
+
+TEST_F(IntCtlTest, WaitFDIsReadableAfterRaise) {
+    struct pollfd pfd = {intctl_wait_fd(intctl), POLLIN, 0};
+    ASSERT_GE(pfd.fd, 0);
+    EXPECT_EQ(poll(&pfd, 1, 0), 0);
+
+    EXPECT_EQ(intctl_raise_irq_line(intctl, 0), VM_ERR_NONE);
+    EXPECT_EQ(poll(&pfd, 1, 0), 1);
+    EXPECT_TRUE(pfd.revents & POLLIN);
+}
+
+TEST_F(IntCtlTest, RestoredWaitFDIsNewAndSignalled) {
+    EXPECT_EQ(intctl_raise_irq_line(intctl, 2), VM_ERR_NONE);
+
+    std::vector<uint8_t> buf(intctl_snapshot_size());
+    const size_t size = intctl_snapshot(intctl, buf.data(), buf.size());
+    size_t rest_size = 0;
+    intctl_ctx_t *rest_intctl = intctl_restore(buf.data(), size, &rest_size);
+
+    struct pollfd pfd = {intctl_wait_fd(rest_intctl), POLLIN, 0};
+    ASSERT_GE(pfd.fd, 0);
+    EXPECT_NE(pfd.fd, intctl_wait_fd(intctl));
+    EXPECT_EQ(poll(&pfd, 1, 0), 1);
+    EXPECT_TRUE(pfd.revents & POLLIN);
+
+    intctl_free(rest_intctl);
+}
+
+TEST_F(IntCtlTest, RaiseFromAnotherThreadWakesWaiter) {
+    std::thread raiser([this] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT_EQ(intctl_raise_irq_line(intctl, 5), VM_ERR_NONE);
+    });
+
+    while (!intctl_wait(intctl, -1)) {
+    }
+    raiser.join();
+
+    uint8_t irq = 0xFF;
+    EXPECT_EQ(intctl_get_pending_irq(intctl, &irq), true);
+    EXPECT_EQ(irq, 5);
+}
+
+TEST_F(IntCtlTest, WakeUnblocksWaiterWithoutIRQ) {
+    std::thread waker([this] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        intctl_wake(intctl);
+    });
+
+    EXPECT_EQ(intctl_wait(intctl, -1), false);
+    waker.join();
+}
+
+TEST_F(IntCtlTest, WakeBeforeWaitIsNotLost) {
+    intctl_wake(intctl);
+    EXPECT_EQ(intctl_wait(intctl, -1), false);
+}
+
+TEST_F(IntCtlTest, DevChangeWakesWaiter) {
+    const uint32_t gen = intctl_dev_change_gen(intctl);
+    intctl_notify_dev_change(intctl);
+    EXPECT_EQ(intctl_dev_change_gen(intctl), gen + 1);
+
+    // No IRQ is pending, but the waiter returns to run the VM again.
+    EXPECT_EQ(intctl_wait(intctl, -1), false);
+}
@@ -31,6 +31,9 @@ class MemCtlTest : public testing::Test {
             .end = TEST_MMIO1_START + TEST_MMIO1_SIZE,
             .ctx = &mmio1_dev->mem_if,
             .mem_if = mmio1_dev->mem_if,
+            .direct_ptr = nullptr,
+            .direct_perms = 0,
+            .notifies_changes = false,
         };
 
         mmio2_dev = new FakeMem(0x0000'0000, TEST_MMIO2_SIZE, true);
@@ -39,6 +42,9 @@ class MemCtlTest : public testing::Test {
             .end = TEST_MMIO2_START + TEST_MMIO2_SIZE,
             .ctx = &mmio2_dev->mem_if,
             .mem_if = mmio2_dev->mem_if,
+            .direct_ptr = nullptr,
+            .direct_perms = 0,
+            .notifies_changes = false,
         };
 
         mmio3_dev = new FakeMem(0x0000'0000, TEST_MMIO1_SIZE, true);
@@ -47,11 +53,16 @@ class MemCtlTest : public testing::Test {
             .end = TEST_MMIO3_START + TEST_MMIO3_SIZE,
             .ctx = &mmio2_dev->mem_if,
             .mem_if = mmio2_dev->mem_if,
+            .direct_ptr = nullptr,
+            .direct_perms = 0,
+            .notifies_changes = false,
         };
         mmio3_reg.mem_if.read_u8 = nullptr;
         mmio3_reg.mem_if.write_u8 = nullptr;
         mmio3_reg.mem_if.read_u32 = nullptr;
         mmio3_reg.mem_if.write_u32 = nullptr;
+        mmio3_reg.mem_if.read_block = nullptr;
+        mmio3_reg.mem_if.write_block = nullptr;
     }
     ~MemCtlTest() {
         memctl_free(memctl);
@@ -226,6 +237,245 @@ TEST_F(MemCtlTest, MapWithOverlapFails5) {
     EXPECT_EQ(err, VM_ERR_MEM_USED);
 }
 
+TEST_F(MemCtlTest, MapWithOverlapFails6) {
+    vm_err_t err;
+    mmio_region_t mmio_reg;
+    memcpy(&mmio_reg, &mmio1_reg, sizeof(mmio_reg));
+
+    //    [R1]
+    // [    R2    ]
+    mmio_reg.start = 0x10'0000;
+    mmio_reg.end = mmio_reg.start + 10;
+    err = memctl_map_region(memctl, &mmio_reg);
+    EXPECT_EQ(err, VM_ERR_NONE);
+    mmio_reg.start -= 0x10'0000;
+    mmio_reg.end += 0x10'0000;
+    err = memctl_map_region(memctl, &mmio_reg);
+    EXPECT_EQ(err, VM_ERR_MEM_USED);
+}
+
+TEST_F(MemCtlTest, FindRegionsSharingPage) {
+    ASSERT_EQ(memctl_map_region(memctl, &mmio1_reg), VM_ERR_NONE);
+    ASSERT_EQ(memctl_map_region(memctl, &mmio2_reg), VM_ERR_NONE);
+
+    mmio_region_t *reg = nullptr;
+    EXPECT_EQ(memctl_find_reg_by_addr(memctl, TEST_MMIO1_START, &reg),
+              VM_ERR_NONE);
+    EXPECT_EQ(reg->start, TEST_MMIO1_START);
+    EXPECT_EQ(memctl_find_reg_by_addr(
+                  memctl, TEST_MMIO1_START + TEST_MMIO1_SIZE - 1, &reg),
+              VM_ERR_NONE);
+    EXPECT_EQ(reg->start, TEST_MMIO1_START);
+
+    // The gap between the regions is not mapped.
+    EXPECT_EQ(memctl_find_reg_by_addr(
+                  memctl, TEST_MMIO1_START + TEST_MMIO1_SIZE, nullptr),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_find_reg_by_addr(memctl, TEST_MMIO2_START - 1, nullptr),
+              VM_ERR_BAD_MEM);
+
+    EXPECT_EQ(memctl_find_reg_by_addr(memctl, TEST_MMIO2_START, &reg),
+              VM_ERR_NONE);
+    EXPECT_EQ(reg->start, TEST_MMIO2_START);
+    EXPECT_EQ(memctl_find_reg_by_addr(
+                  memctl, TEST_MMIO2_START + TEST_MMIO2_SIZE - 1, &reg),
+              VM_ERR_NONE);
+    EXPECT_EQ(reg->start, TEST_MMIO2_START);
+    EXPECT_EQ(memctl_find_reg_by_addr(
+                  memctl, TEST_MMIO2_START + TEST_MMIO2_SIZE, nullptr),
+              VM_ERR_BAD_MEM);
+}
+
+TEST_F(MemCtlTest, FindRegionsSpanningPages) {
+    // Regions that start and end in the middle of pages and cover whole pages
+    // in between, including the last page of the address space.
+    const vm_addr_t starts[] = {0x0000'0800, 0x0000'2801, 0x7FFF'F000,
+                                0xFFFF'E7FF};
+    const vm_addr_t ends[] = {0x0000'2801, 0x0040'1000, 0x8040'0010,
+                              0xFFFF'FFFF};
+    for (size_t idx = 0; idx < std::size(starts); idx++) {
+        mmio_region_t mmio_reg = mmio1_reg;
+        mmio_reg.start = starts[idx];
+        mmio_reg.end = ends[idx];
+        ASSERT_EQ(memctl_map_region(memctl, &mmio_reg), VM_ERR_NONE);
+    }
+
+    for (size_t idx = 0; idx < std::size(starts); idx++) {
+        const vm_addr_t middle = starts[idx] + (ends[idx] - starts[idx]) / 2;
+        const vm_addr_t addrs[] = {starts[idx], starts[idx] + 1, middle,
+                                   ends[idx] - 1};
+        for (vm_addr_t addr : addrs) {
+            mmio_region_t *reg = nullptr;
+            ASSERT_EQ(memctl_find_reg_by_addr(memctl, addr, &reg), VM_ERR_NONE)
+                << "addr " << addr;
+            EXPECT_EQ(reg->start, starts[idx]);
+            EXPECT_EQ(reg->end, ends[idx]);
+        }
+    }
+
+    EXPECT_EQ(memctl_find_reg_by_addr(memctl, 0x0000'07FF, nullptr),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_find_reg_by_addr(memctl, 0x7FFF'EFFF, nullptr),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_find_reg_by_addr(memctl, 0x8040'0010, nullptr),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_find_reg_by_addr(memctl, 0xFFFF'FFFF, nullptr),
+              VM_ERR_BAD_MEM);
+}
+
+TEST_F(MemCtlTest, MapMaxRegions) {
+    // Whole pages with a page between them.
+    constexpr vm_addr_t stride = 2 * MEMCTL_PAGE_SIZE;
+    for (size_t idx = 1; idx <= MEMCTL_MAX_REGIONS; idx++) {
+        mmio_region_t mmio_reg = mmio2_reg;
+        mmio_reg.start = idx * stride;
+        mmio_reg.end = mmio_reg.start + MEMCTL_PAGE_SIZE;
+        ASSERT_EQ(memctl_map_region(memctl, &mmio_reg), VM_ERR_NONE);
+    }
+    EXPECT_EQ(memctl->num_mapped_regions, MEMCTL_MAX_REGIONS);
+
+    mmio_region_t mmio_reg = mmio2_reg;
+    mmio_reg.start = 0;
+    mmio_reg.end = MEMCTL_PAGE_SIZE;
+    EXPECT_EQ(memctl_map_region(memctl, &mmio_reg), VM_ERR_MEM_MAX_REGIONS);
+
+    for (size_t idx = 1; idx <= MEMCTL_MAX_REGIONS; idx++) {
+        mmio_region_t *reg = nullptr;
+        ASSERT_EQ(memctl_find_reg_by_addr(memctl, idx * stride + 500, &reg),
+                  VM_ERR_NONE);
+        EXPECT_EQ(reg->start, idx * stride);
+        EXPECT_EQ(memctl_find_reg_by_addr(
+                      memctl, idx * stride + MEMCTL_PAGE_SIZE, nullptr),
+                  VM_ERR_BAD_MEM);
+    }
+}
+
+TEST_F(MemCtlTest, ManyRegionsRejectOverlaps) {
+    // Small windows with gaps, mapped out of order.
+    constexpr size_t num_regs = 300;
+    for (size_t idx = 0; idx < num_regs; idx++) {
+        mmio_region_t mmio_reg = mmio1_reg;
+        mmio_reg.start = 0x1000'0000 + (idx * 7 % num_regs) * 0x20;
+        mmio_reg.end = mmio_reg.start + 0x10;
+        ASSERT_EQ(memctl_map_region(memctl, &mmio_reg), VM_ERR_NONE);
+    }
+    EXPECT_EQ(memctl->num_mapped_regions, num_regs);
+    for (size_t pos = 1; pos < num_regs; pos++) {
+        EXPECT_LT(memctl->mapped_regions[memctl->sorted_regions[pos - 1]].end,
+                  memctl->mapped_regions[memctl->sorted_regions[pos]].start);
+    }
+
+    const vm_addr_t last = 0x1000'0000 + (num_regs - 1) * 0x20;
+    const vm_addr_t used[][2] = {
+        {0x1000'000F, 0x1000'0010}, // Last byte of the first region.
+        {0x0FFF'FFFF, 0x1000'0001}, // First byte of the first region.
+        {0x1000'0018, 0x1000'0021}, // First byte of the second region.
+        {0x0000'0000, 0xFFFF'FFFF}, // Everything.
+        {last + 0xF, last + 0x100}, // Last byte of the last region.
+    };
+    for (const auto &range : used) {
+        mmio_region_t mmio_reg = mmio1_reg;
+        mmio_reg.start = range[0];
+        mmio_reg.end = range[1];
+        EXPECT_EQ(memctl_map_region(memctl, &mmio_reg), VM_ERR_MEM_USED)
+            << "start " << range[0];
+    }
+
+    // The gaps and both ends are free.
+    const vm_addr_t gaps[][2] = {
+        {0x1000'0010, 0x1000'0020},
+        {0x0FFF'0000, 0x1000'0000},
+        {last + 0x10, last + 0x100},
+    };
+    for (const auto &range : gaps) {
+        mmio_region_t mmio_reg = mmio1_reg;
+        mmio_reg.start = range[0];
+        mmio_reg.end = range[1];
+        EXPECT_EQ(memctl_map_region(memctl, &mmio_reg), VM_ERR_NONE)
+            << "start " << range[0];
+    }
+}
+
+TEST_F(MemCtlTest, UnmapRegion) {
+    constexpr vm_addr_t moved_start = 2 * MEMCTL_PAGE_SIZE;
+    mmio_region_t moved_reg = mmio3_reg;
+    moved_reg.start = moved_start;
+    moved_reg.end = moved_start + TEST_MMIO3_SIZE;
+    ASSERT_EQ(memctl_map_region(memctl, &mmio1_reg), VM_ERR_NONE);
+    ASSERT_EQ(memctl_map_region(memctl, &mmio2_reg), VM_ERR_NONE);
+    ASSERT_EQ(memctl_map_region(memctl, &moved_reg), VM_ERR_NONE);
+    const uint32_t map_gen = memctl->map_gen;
+
+    EXPECT_EQ(memctl_unmap_region(memctl, TEST_MMIO1_START + 1),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_unmap_region(memctl, TEST_MMIO1_START), VM_ERR_NONE);
+    EXPECT_EQ(memctl_unmap_region(memctl, TEST_MMIO1_START), VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl->num_mapped_regions, 2);
+    EXPECT_NE(memctl->map_gen, map_gen);
+
+    // The other regions, one of which has been moved, are still found.
+    uint8_t byte = 0;
+    EXPECT_EQ(memctl_read_u8(memctl, TEST_MMIO1_START, &byte), VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_find_reg_by_addr(memctl, TEST_MMIO1_START, nullptr),
+              VM_ERR_BAD_MEM);
+    mmio_region_t *reg = nullptr;
+    ASSERT_EQ(memctl_find_reg_by_addr(memctl, TEST_MMIO2_START, &reg),
+              VM_ERR_NONE);
+    EXPECT_EQ(reg->start, TEST_MMIO2_START);
+    ASSERT_EQ(memctl_find_reg_by_addr(memctl, moved_start + 1, &reg),
+              VM_ERR_NONE);
+    EXPECT_EQ(reg->start, moved_start);
+    EXPECT_EQ(memctl_write_u8(memctl, TEST_MMIO2_START, 0x5A), VM_ERR_NONE);
+    EXPECT_EQ(mmio2_dev->bytes[0], 0x5A);
+
+    // The space can be mapped again.
+    ASSERT_EQ(memctl_map_region(memctl, &mmio1_reg), VM_ERR_NONE);
+    EXPECT_EQ(memctl_write_u8(memctl, TEST_MMIO1_START, 0xA5), VM_ERR_NONE);
+    EXPECT_EQ(mmio1_dev->bytes[0], 0xA5);
+
+    const vm_addr_t starts[] = {moved_start, TEST_MMIO1_START,
+                                TEST_MMIO2_START};
+    for (vm_addr_t start : starts) {
+        EXPECT_EQ(memctl_unmap_region(memctl, start), VM_ERR_NONE);
+    }
+    EXPECT_EQ(memctl->num_mapped_regions, 0);
+    for (vm_addr_t addr = 0; addr < 3 * MEMCTL_PAGE_SIZE; addr++) {
+        ASSERT_EQ(memctl_find_reg_by_addr(memctl, addr, nullptr),
+                  VM_ERR_BAD_MEM)
+            << "addr " << addr;
+    }
+}
+
+TEST_F(MemCtlTest, UnmapManyRegions) {
+    // Regions sharing pages, unmapped in another order than mapped.
+    constexpr size_t num_regs = 100;
+    for (size_t idx = 0; idx < num_regs; idx++) {
+        mmio_region_t mmio_reg = mmio1_reg;
+        mmio_reg.start = idx * 100;
+        mmio_reg.end = mmio_reg.start + 100;
+        ASSERT_EQ(memctl_map_region(memctl, &mmio_reg), VM_ERR_NONE);
+    }
+    for (size_t idx = 0; idx < num_regs; idx += 3) {
+        ASSERT_EQ(memctl_unmap_region(memctl, idx * 100), VM_ERR_NONE);
+    }
+
+    for (size_t idx = 0; idx < num_regs; idx++) {
+        mmio_region_t *reg = nullptr;
+        const vm_err_t err =
+            memctl_find_reg_by_addr(memctl, idx * 100 + 99, &reg);
+        if (idx % 3 == 0) {
+            EXPECT_EQ(err, VM_ERR_BAD_MEM) << "region " << idx;
+        } else {
+            ASSERT_EQ(err, VM_ERR_NONE) << "region " << idx;
+            EXPECT_EQ(reg->start, idx * 100);
+        }
+    }
+    for (size_t pos = 1; pos < memctl->num_mapped_regions; pos++) {
+        EXPECT_LT(memctl->mapped_regions[memctl->sorted_regions[pos - 1]].start,
+                  memctl->mapped_regions[memctl->sorted_regions[pos]].start);
+    }
+}
+
 TEST_F(MemCtlTest, NoRegionReadU8Fails) {
     uint8_t val = 0x12;
     vm_err_t err = memctl->intf.read_u8(memctl, 0x0000'0000, &val);
@@ -422,10 +672,290 @@ TEST_F(MemCtlTest, Region3CannotReadWriteU32) {
     EXPECT_EQ(err, VM_ERR_MEM_BAD_OP);
 }
 
+TEST_F(MemCtlTest, BlockTransfersSpanRegions) {
+    // Region 1 only has block callbacks, the direct region fills the gap up
+    // to region 2, which only has byte callbacks.
+    mmio1_reg.mem_if.read_u8 = nullptr;
+    mmio1_reg.mem_if.write_u8 = nullptr;
+    mmio2_reg.mem_if.read_block = nullptr;
+    mmio2_reg.mem_if.write_block = nullptr;
+    uint8_t gap[TEST_MMIO_GAP] = {};
+    const mmio_region_t gap_reg = {
+        .start = TEST_MMIO1_START + TEST_MMIO1_SIZE,
+        .end = TEST_MMIO2_START,
+        .ctx = nullptr,
+        .mem_if = {},
+        .direct_ptr = gap,
+        .direct_perms = MEM_DIRECT_READ | MEM_DIRECT_WRITE,
+        .notifies_changes = false,
+    };
+    ASSERT_EQ(memctl_map_region(memctl, &mmio1_reg), VM_ERR_NONE);
+    ASSERT_EQ(memctl_map_region(memctl, &gap_reg), VM_ERR_NONE);
+    ASSERT_EQ(memctl_map_region(memctl, &mmio2_reg), VM_ERR_NONE);
+    EXPECT_EQ(memctl->intf.read_block, memctl_read_block);
+    EXPECT_EQ(memctl->intf.write_block, memctl_write_block);
+
+    constexpr size_t size = TEST_MMIO2_START + TEST_MMIO2_SIZE - 2;
+    uint8_t data[size];
+    for (size_t idx = 0; idx < size; idx++) {
+        data[idx] = idx * 7 + 1;
+    }
+    ASSERT_EQ(memctl_write_block(memctl, 1, data, size), VM_ERR_NONE);
+    EXPECT_EQ(memcmp(&mmio1_dev->bytes[1], data, TEST_MMIO1_SIZE - 1), 0);
+    EXPECT_EQ(memcmp(gap, &data[TEST_MMIO1_SIZE - 1], TEST_MMIO_GAP), 0);
+    EXPECT_EQ(memcmp(mmio2_dev->bytes, &data[TEST_MMIO2_START - 1],
+                     TEST_MMIO2_SIZE - 1),
+              0);
+    EXPECT_EQ(mmio2_dev->bytes[TEST_MMIO2_SIZE - 1], 0xFF);
+
+    uint8_t read[size + 3] = {};
+    ASSERT_EQ(memctl_read_block(memctl, 1, read, size), VM_ERR_NONE);
+    EXPECT_EQ(memcmp(read, data, size), 0);
+    EXPECT_EQ(memctl_read_block(memctl, 1, read, 0), VM_ERR_NONE);
+
+    // Blocks that leave the mapped regions.
+    EXPECT_EQ(memctl_read_block(memctl, 0, read, size + 3), VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_write_block(memctl, TEST_MMIO2_START + 1, data,
+                                 TEST_MMIO2_SIZE),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_read_block(memctl, VM_MAX_ADDR, read, 2), VM_ERR_BAD_MEM);
+}
+
+TEST_F(MemCtlTest, BlockTransfersNeedCallbacks) {
+    ASSERT_EQ(memctl_map_region(memctl, &mmio3_reg), VM_ERR_NONE);
+    uint8_t data[4] = {};
+    EXPECT_EQ(memctl_read_block(memctl, TEST_MMIO3_START, data, sizeof(data)),
+              VM_ERR_MEM_BAD_OP);
+    EXPECT_EQ(memctl_write_block(memctl, TEST_MMIO3_START, data, sizeof(data)),
+              VM_ERR_MEM_BAD_OP);
+}
+
+TEST_F(MemCtlTest, DirectRegionSkipsCallbacks) {
+    // Region 3 has no callbacks, but its memory can be accessed directly.
+    mmio3_reg.direct_ptr = mmio3_dev->bytes;
+    mmio3_reg.direct_perms = MEM_DIRECT_READ | MEM_DIRECT_WRITE;
+    ASSERT_EQ(memctl_map_region(memctl, &mmio3_reg), VM_ERR_NONE);
+
+    EXPECT_EQ(memctl_write_u8(memctl, TEST_MMIO3_START + 1, 0xAE),
+              VM_ERR_NONE);
+    EXPECT_EQ(mmio3_dev->bytes[1], 0xAE);
+    EXPECT_EQ(memctl_write_u32(memctl, TEST_MMIO3_START + 4, 0xDEADBEEF),
+              VM_ERR_NONE);
+
+    uint8_t byte = 0;
+    EXPECT_EQ(memctl_read_u8(memctl, TEST_MMIO3_START + 1, &byte),
+              VM_ERR_NONE);
+    EXPECT_EQ(byte, 0xAE);
+    uint32_t dword = 0;
+    EXPECT_EQ(memctl_read_u32(memctl, TEST_MMIO3_START + 4, &dword),
+              VM_ERR_NONE);
+    EXPECT_EQ(dword, 0xDEADBEEF);
+
+    // A u32 must not cross the region end.
+    EXPECT_EQ(memctl_read_u32(memctl, TEST_MMIO3_START + 5, &dword),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_write_u32(memctl, TEST_MMIO3_START + 5, 0),
+              VM_ERR_BAD_MEM);
+}
+
+TEST_F(MemCtlTest, DirectReadOnlyRegion) {
+    mmio3_reg.direct_ptr = mmio3_dev->bytes;
+    mmio3_reg.direct_perms = MEM_DIRECT_READ;
+    ASSERT_EQ(memctl_map_region(memctl, &mmio3_reg), VM_ERR_NONE);
+    mmio3_dev->bytes[2] = 0x5A;
+
+    uint8_t byte = 0;
+    EXPECT_EQ(memctl_read_u8(memctl, TEST_MMIO3_START + 2, &byte),
+              VM_ERR_NONE);
+    EXPECT_EQ(byte, 0x5A);
+
+    // Writes fall back to the (missing) callbacks.
+    EXPECT_EQ(memctl_write_u8(memctl, TEST_MMIO3_START + 2, 0),
+              VM_ERR_MEM_BAD_OP);
+    EXPECT_EQ(memctl_write_u32(memctl, TEST_MMIO3_START, 0), VM_ERR_MEM_BAD_OP);
+    EXPECT_EQ(mmio3_dev->bytes[2], 0x5A);
+}
+
+TEST_F(MemCtlTest, GetSpan) {
+    mmio3_reg.direct_ptr = mmio3_dev->bytes;
+    mmio3_reg.direct_perms = MEM_DIRECT_READ;
+    ASSERT_EQ(memctl_map_region(memctl, &mmio3_reg), VM_ERR_NONE);
+    ASSERT_EQ(memctl_map_region(memctl, &mmio2_reg), VM_ERR_NONE);
+    EXPECT_EQ(memctl->intf.get_span, memctl_get_span);
+
+    mem_span_t direct = {};
+    ASSERT_TRUE(memctl_get_span(memctl, TEST_MMIO3_START + 3, &direct));
+    EXPECT_EQ(direct.ptr, mmio3_dev->bytes);
+    EXPECT_EQ(direct.start, TEST_MMIO3_START);
+    EXPECT_EQ(direct.end, TEST_MMIO3_START + TEST_MMIO3_SIZE);
+    EXPECT_EQ(direct.perms, MEM_DIRECT_READ);
+    EXPECT_EQ(direct.mem_if, &memctl->mapped_regions[0].mem_if);
+    EXPECT_EQ(direct.cb_base, TEST_MMIO3_START);
+    EXPECT_EQ(direct.p_gen, &memctl->map_gen);
+
+    // Region 2 is mapped without a direct pointer.
+    ASSERT_TRUE(memctl_get_span(memctl, TEST_MMIO2_START, &direct));
+    EXPECT_EQ(direct.ptr, nullptr);
+    EXPECT_EQ(direct.start, TEST_MMIO2_START);
+    EXPECT_EQ(direct.perms, 0);
+
+    EXPECT_FALSE(memctl_get_span(memctl, TEST_MMIO2_START - 1, &direct));
+}
+
+TEST_F(MemCtlTest, MappingChangesGeneration) {
+    const uint32_t gen = memctl->map_gen;
+    ASSERT_EQ(memctl_map_region(memctl, &mmio1_reg), VM_ERR_NONE);
+    EXPECT_NE(memctl->map_gen, gen);
+
+    // A failed mapping leaves the spans valid.
+    const uint32_t mapped_gen = memctl->map_gen;
+    ASSERT_EQ(memctl_map_region(memctl, &mmio1_reg), VM_ERR_MEM_USED);
+    EXPECT_EQ(memctl->map_gen, mapped_gen);
+
+    memctl_flush_spans(memctl);
+    EXPECT_NE(memctl->map_gen, mapped_gen);
+}
+
+/// Records the writes reported by the memory controller.
+static void record_code_write(void *ctx, vm_addr_t addr, uint32_t size) {
+    auto *writes = (std::vector<std::pair<vm_addr_t, uint32_t>> *)ctx;
+    writes->emplace_back(addr, size);
+}
+
+TEST_F(MemCtlTest, WritesToCodePagesAreReported) {
+    mmio3_reg.direct_ptr = mmio3_dev->bytes;
+    mmio3_reg.direct_perms = MEM_DIRECT_READ | MEM_DIRECT_WRITE;
+    ASSERT_EQ(memctl_map_region(memctl, &mmio3_reg), VM_ERR_NONE);
+    std::vector<std::pair<vm_addr_t, uint32_t>> writes;
+    memctl_set_code_watch(memctl, record_code_write, &writes);
+
+    // Nothing has been predecoded yet.
+    ASSERT_EQ(memctl_write_u8(memctl, TEST_MMIO3_START, 1), VM_ERR_NONE);
+    EXPECT_TRUE(writes.empty());
+
+    // Like a CPU predecoding code from the region.
+    mem_span_t span = {};
+    ASSERT_TRUE(memctl_get_span(memctl, TEST_MMIO3_START, &span));
+    ASSERT_NE(span.code_pages, nullptr);
+    mem_page_bitmap_set(span.code_pages,
+                        TEST_MMIO3_START >> MEM_PAGE_BITMAP_PAGE_SHIFT);
+
+    ASSERT_EQ(memctl_write_u8(memctl, TEST_MMIO3_START + 1, 2), VM_ERR_NONE);
+    ASSERT_EQ(memctl_write_u32(memctl, TEST_MMIO3_START + 4, 3), VM_ERR_NONE);
+    const uint8_t block[3] = {4, 5, 6};
+    ASSERT_EQ(memctl_write_block(memctl, TEST_MMIO3_START + 2, block,
+                                 sizeof(block)),
+              VM_ERR_NONE);
+    // Failed writes change nothing.
+    ASSERT_EQ(memctl_write_u32(memctl, TEST_MMIO3_START + 5, 4),
+              VM_ERR_BAD_MEM);
+    // Host writes to another page, then across the code page.
+    memctl_note_write(memctl, TEST_MMIO3_START + MEMCTL_PAGE_SIZE, 16);
+    memctl_note_write(memctl, TEST_MMIO3_START + MEMCTL_PAGE_SIZE - 1, 2);
+    const std::vector<std::pair<vm_addr_t, uint32_t>> expected = {
+        {TEST_MMIO3_START + 1, 1},
+        {TEST_MMIO3_START + 4, 4},
+        {TEST_MMIO3_START + 2, 3},
+        {TEST_MMIO3_START + MEMCTL_PAGE_SIZE - 1, 2},
+    };
+    EXPECT_EQ(writes, expected);
+
+    // The code is dropped when the mapping changes.
+    writes.clear();
+    memctl_flush_spans(memctl);
+    ASSERT_EQ(memctl_write_u8(memctl, TEST_MMIO3_START + 1, 5), VM_ERR_NONE);
+    EXPECT_TRUE(writes.empty());
+}
+
+TEST_F(MemCtlTest, ReservedSpaceRAM) {
+    constexpr vm_addr_t ram_start = 0x10000;
+    constexpr vm_addr_t rom_start = ram_start + 2 * MEMCTL_PAGE_SIZE;
+    constexpr vm_addr_t rom_end = rom_start + MEMCTL_PAGE_SIZE;
+    uint8_t *ram = nullptr;
+    EXPECT_EQ(memctl_map_ram(memctl, ram_start, rom_start,
+                             MEM_DIRECT_READ | MEM_DIRECT_WRITE, nullptr, 0,
+                             &ram),
+              VM_ERR_MEM_NO_SPACE);
+    const vm_err_t err = memctl_reserve_space(memctl);
+    if (err == VM_ERR_MEM_NO_SPACE) { GTEST_SKIP() << "not supported"; }
+    ASSERT_EQ(err, VM_ERR_NONE);
+
+    ASSERT_EQ(memctl_map_ram(memctl, ram_start, rom_start,
+                             MEM_DIRECT_READ | MEM_DIRECT_WRITE, nullptr, 0,
+                             &ram),
+              VM_ERR_NONE);
+    const uint8_t rom_data[] = {0, 0, 0, 0x5A};
+    uint8_t *rom = nullptr;
+    ASSERT_EQ(memctl_map_ram(memctl, rom_start, rom_end, MEM_DIRECT_READ,
+                             rom_data, sizeof(rom_data), &rom),
+              VM_ERR_NONE);
+    EXPECT_EQ(memctl_map_ram(memctl, rom_start - MEMCTL_PAGE_SIZE, rom_end,
+                             MEM_DIRECT_READ, nullptr, 0, nullptr),
+              VM_ERR_MEM_USED);
+    // Callback regions still work next to the RAM.
+    ASSERT_EQ(memctl_map_region(memctl, &mmio2_reg), VM_ERR_NONE);
+    mmio2_dev->bytes[0] = 0x42;
+
+    EXPECT_EQ(memctl_write_u32(memctl, ram_start + 4, 0xDEADBEEF),
+              VM_ERR_NONE);
+    EXPECT_EQ(memcmp(&ram[4], "\xEF\xBE\xAD\xDE", 4), 0);
+    EXPECT_EQ(memctl_write_u8(memctl, ram_start + 9, 0xAE), VM_ERR_NONE);
+    EXPECT_EQ(ram[9], 0xAE);
+    uint32_t dword = 0;
+    EXPECT_EQ(memctl_read_u32(memctl, ram_start + 4, &dword), VM_ERR_NONE);
+    EXPECT_EQ(dword, 0xDEADBEEF);
+    uint8_t byte = 0;
+    EXPECT_EQ(memctl_read_u8(memctl, rom_start + 3, &byte), VM_ERR_NONE);
+    EXPECT_EQ(byte, 0x5A);
+    EXPECT_EQ(rom[3], 0x5A);
+    EXPECT_EQ(memctl_read_u8(memctl, TEST_MMIO2_START, &byte), VM_ERR_NONE);
+    EXPECT_EQ(byte, 0x42);
+
+    // The faulting accesses fail like without the reserved space.
+    EXPECT_EQ(memctl_write_u8(memctl, rom_start, 1), VM_ERR_MEM_BAD_OP);
+    EXPECT_EQ(memctl_write_u32(memctl, rom_start + 8, 1), VM_ERR_MEM_BAD_OP);
+    EXPECT_EQ(rom[0], 0);
+    EXPECT_EQ(memctl_read_u32(memctl, rom_end - 2, &dword), VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_write_u32(memctl, rom_start - 2, 0), VM_ERR_BAD_MEM);
+    EXPECT_EQ(memcmp(&rom[-2], "\0\0\0\0", 4), 0);
+    EXPECT_EQ(memctl_read_u8(memctl, rom_end, &byte), VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_write_u8(memctl, ram_start - 1, 0), VM_ERR_BAD_MEM);
+
+    // Unmapped RAM is gone, and comes back zeroed.
+    EXPECT_EQ(memctl_unmap_region(memctl, ram_start), VM_ERR_NONE);
+    EXPECT_EQ(memctl_read_u32(memctl, ram_start + 4, &dword), VM_ERR_BAD_MEM);
+    EXPECT_EQ(memctl_write_u8(memctl, ram_start + 9, 1), VM_ERR_BAD_MEM);
+    ASSERT_EQ(memctl_map_ram(memctl, ram_start, rom_start,
+                             MEM_DIRECT_READ | MEM_DIRECT_WRITE, nullptr, 0,
+                             &ram),
+              VM_ERR_NONE);
+    EXPECT_EQ(memctl_read_u32(memctl, ram_start + 4, &dword), VM_ERR_NONE);
+    EXPECT_EQ(dword, 0u);
+}
+
+TEST_F(MemCtlTest, ReserveSpaceAfterMapping) {
+    ASSERT_EQ(memctl_map_region(memctl, &mmio2_reg), VM_ERR_NONE);
+    const vm_err_t err = memctl_reserve_space(memctl);
+    if (err == VM_ERR_MEM_NO_SPACE) { GTEST_SKIP() << "not supported"; }
+    ASSERT_EQ(err, VM_ERR_NONE);
+
+    // The region is still accessed through its callbacks.
+    EXPECT_EQ(memctl_write_u32(memctl, TEST_MMIO2_START, 0x12345678),
+              VM_ERR_NONE);
+    uint32_t dword = 0;
+    EXPECT_EQ(memctl_read_u32(memctl, TEST_MMIO2_START, &dword), VM_ERR_NONE);
+    EXPECT_EQ(dword, 0x12345678);
+    EXPECT_EQ(memctl_map_ram(memctl, 0, MEMCTL_PAGE_SIZE, MEM_DIRECT_READ,
+                             nullptr, 0, nullptr),
+              VM_ERR_MEM_USED);
+}
+
 TEST_F(MemCtlTest, SnapshotRestore) {
-    static_assert(SN_MEMCTL_CTX_VER == 1);
+    static_assert(SN_MEMCTL_CTX_VER == 9);
+    ASSERT_EQ(memctl_map_region(memctl, &mmio2_reg), VM_ERR_NONE);
+    ASSERT_EQ(memctl_map_region(memctl, &mmio1_reg), VM_ERR_NONE);
 
-    size_t snapshot_size = memctl_snapshot_size();
+    size_t snapshot_size = memctl_snapshot_size(memctl);
     uint8_t *snapshot_buf = new uint8_t[snapshot_size];
     size_t used_size = memctl_snapshot(memctl, snapshot_buf, snapshot_size);
     EXPECT_EQ(used_size, snapshot_size);
@@ -440,10 +970,11 @@ TEST_F(MemCtlTest, SnapshotRestore) {
     EXPECT_NE(rest_memctl->intf.write_u8, nullptr);
     EXPECT_NE(rest_memctl->intf.write_u32, nullptr);
 
+    ASSERT_EQ(rest_memctl->num_mapped_regions, 2);
     ASSERT_EQ(rest_memctl->num_mapped_regions, memctl->num_mapped_regions);
     for (size_t idx = 0; idx < rest_memctl->num_mapped_regions; idx++) {
-        EXPECT_EQ(rest_memctl->used_regions[idx], memctl->used_regions[idx]);
-
+        EXPECT_EQ(rest_memctl->sorted_regions[idx],
+                  memctl->sorted_regions[idx]);
         EXPECT_EQ(rest_memctl->mapped_regions[idx].start,
                   memctl->mapped_regions[idx].start);
         EXPECT_EQ(rest_memctl->mapped_regions[idx].end,
@@ -454,7 +985,39 @@ TEST_F(MemCtlTest, SnapshotRestore) {
         EXPECT_EQ(rest_memctl->mapped_regions[idx].mem_if.read_u32, nullptr);
         EXPECT_EQ(rest_memctl->mapped_regions[idx].mem_if.write_u8, nullptr);
         EXPECT_EQ(rest_memctl->mapped_regions[idx].mem_if.write_u32, nullptr);
+        EXPECT_EQ(rest_memctl->mapped_regions[idx].mem_if.get_span, nullptr);
+        EXPECT_EQ(rest_memctl->mapped_regions[idx].direct_ptr, nullptr);
+    }
+
+    memctl_free(rest_memctl);
+    delete[] snapshot_buf;
+}
+
+TEST_F(MemCtlTest, RestoreRebuildsPageTable) {
+    ASSERT_EQ(memctl_map_region(memctl, &mmio1_reg), VM_ERR_NONE);
+    ASSERT_EQ(memctl_map_region(memctl, &mmio2_reg), VM_ERR_NONE);
+
+    size_t snapshot_size = memctl_snapshot_size(memctl);
+    uint8_t *snapshot_buf = new uint8_t[snapshot_size];
+    size_t used_size = memctl_snapshot(memctl, snapshot_buf, snapshot_size);
+    size_t rest_size = 0;
+    memctl_ctx_t *rest_memctl =
+        memctl_restore(snapshot_buf, used_size, &rest_size);
+    ASSERT_NE(rest_memctl->page_table, nullptr);
+    EXPECT_NE(rest_memctl->page_table, memctl->page_table);
+
+    for (vm_addr_t addr = 0; addr < 2 * MEMCTL_PAGE_SIZE; addr++) {
+        mmio_region_t *reg = nullptr;
+        mmio_region_t *rest_reg = nullptr;
+        vm_err_t err = memctl_find_reg_by_addr(memctl, addr, &reg);
+        ASSERT_EQ(memctl_find_reg_by_addr(rest_memctl, addr, &rest_reg), err)
+            << "addr " << addr;
+        if (err == VM_ERR_NONE) {
+            EXPECT_EQ(rest_reg - rest_memctl->mapped_regions,
+                      reg - memctl->mapped_regions);
+        }
     }
 
+    memctl_free(rest_memctl);
     delete[] snapshot_buf;
 }
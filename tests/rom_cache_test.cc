@@ -0,0 +1,152 @@
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <ex_common/file_rom.h>
+#include <ex_common/rom_cache.h>
+
+/// Writes ROM files, which the cache shares with every test of the process.
+class ROMCacheTest : public testing::Test {
+  protected:
+    /// Path of a file named @a name in the test temporary directory.
+    static std::string path_of(const std::string &name) {
+        return testing::TempDir() +
+               testing::UnitTest::GetInstance()->current_test_info()->name() +
+               "." + name;
+    }
+
+    /**
+     * Overwrites the file at @a path in place with @a bytes, and moves its
+     * modification time @a mtime_sec seconds after the epoch.
+     */
+    static void write_file(const std::string &path,
+                           const std::vector<uint8_t> &bytes,
+                           time_t mtime_sec = 1000) {
+        std::ofstream(path, std::ios::binary)
+            .write((const char *)bytes.data(), bytes.size());
+        const struct timespec times[2] = {{mtime_sec, 0}, {mtime_sec, 0}};
+        ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+    }
+
+    static std::vector<uint8_t> bytes_of(const rom_image_t *image) {
+        return std::vector<uint8_t>(image->data, image->data + image->size);
+    }
+};
+
+TEST_F(ROMCacheTest, SameFileIsShared) {
+    const std::string path = path_of("rom");
+    const std::vector<uint8_t> contents = {1, 2, 3, 4, 5};
+    write_file(path, contents);
+
+    rom_image_t *first = rom_cache_open(path.c_str());
+    ASSERT_NE(first, nullptr);
+    EXPECT_EQ(bytes_of(first), contents);
+    EXPECT_EQ(first->hash, rom_cache_hash(contents.data(), contents.size()));
+    rom_image_t *second = rom_cache_open(path.c_str());
+    EXPECT_EQ(second, first);
+    EXPECT_EQ(first->num_refs, 2u);
+
+    rom_cache_release(second);
+    rom_cache_release(first);
+}
+
+TEST_F(ROMCacheTest, ModifiedFileIsCopiedAgain) {
+    const std::string path = path_of("rom");
+    const std::vector<uint8_t> old_contents = {1, 2, 3, 4, 5};
+    const std::vector<uint8_t> new_contents = {6, 7, 8, 9, 10};
+    write_file(path, old_contents);
+    rom_image_t *old_image = rom_cache_open(path.c_str());
+    ASSERT_NE(old_image, nullptr);
+
+    // Rebuilt in place: same inode and size, but a new modification time.
+    write_file(path, new_contents, 2000);
+    rom_image_t *new_image = rom_cache_open(path.c_str());
+    ASSERT_NE(new_image, nullptr);
+    EXPECT_NE(new_image, old_image);
+    EXPECT_EQ(bytes_of(new_image), new_contents);
+    // The old image keeps the bytes it was opened with.
+    EXPECT_EQ(bytes_of(old_image), old_contents);
+
+    // Truncated while an image of it is in use.
+    ASSERT_EQ(truncate(path.c_str(), 0), 0);
+    EXPECT_EQ(bytes_of(old_image), old_contents);
+    EXPECT_EQ(rom_cache_open(path.c_str()), nullptr);
+
+    rom_cache_release(new_image);
+    rom_cache_release(old_image);
+}
+
+TEST_F(ROMCacheTest, SameContentsAreShared) {
+    const std::vector<uint8_t> contents = {0xAA, 0xBB, 0xCC};
+    const std::string first_path = path_of("first");
+    const std::string second_path = path_of("second");
+    write_file(first_path, contents);
+    write_file(second_path, contents);
+
+    rom_image_t *first = rom_cache_open(first_path.c_str());
+    ASSERT_NE(first, nullptr);
+    rom_image_t *second = rom_cache_open(second_path.c_str());
+    EXPECT_EQ(second, first);
+    EXPECT_EQ(first->num_refs, 2u);
+
+    rom_cache_release(second);
+    rom_cache_release(first);
+}
+
+TEST_F(ROMCacheTest, LastReleaseDropsImage) {
+    const std::string path = path_of("rom");
+    const std::vector<uint8_t> contents = {0x11, 0x22, 0x33, 0x44};
+    const uint64_t hash = rom_cache_hash(contents.data(), contents.size());
+    write_file(path, contents);
+
+    rom_image_t *image = rom_cache_open(path.c_str());
+    ASSERT_NE(image, nullptr);
+    EXPECT_EQ(rom_cache_find(hash), image);
+    EXPECT_EQ(image->num_refs, 2u);
+
+    rom_cache_release(image);
+    EXPECT_EQ(rom_cache_find(hash), image);
+    rom_cache_release(image);
+    rom_cache_release(image);
+    EXPECT_EQ(rom_cache_find(hash), nullptr);
+}
+
+TEST_F(ROMCacheTest, SnapshotRestoresFromCache) {
+    const std::string path = path_of("rom");
+    const std::vector<uint8_t> contents = {0x12, 0x34, 0x56, 0x78, 0x9A};
+    write_file(path, contents);
+
+    file_rom_ctx_t *rom = file_rom_new(path.c_str());
+    ASSERT_NE(rom, nullptr);
+    std::vector<uint8_t> snapshot(file_rom_snapshot_size(rom));
+    ASSERT_EQ(file_rom_snapshot(rom, snapshot.data(), snapshot.size()),
+              snapshot.size());
+
+    file_rom_ctx_t *restored =
+        file_rom_restore(NULL, snapshot.data(), snapshot.size());
+    ASSERT_NE(restored, nullptr);
+    EXPECT_EQ(restored->image, rom->image);
+    EXPECT_EQ(restored->buf, rom->buf);
+    EXPECT_EQ(restored->size, contents.size());
+    EXPECT_EQ(rom->image->num_refs, 2u);
+
+    // A snapshot of an image with the same hash but another size.
+    std::vector<uint8_t> bad_snapshot = snapshot;
+    const uint64_t bad_size = contents.size() + 1;
+    memcpy(bad_snapshot.data(), &bad_size, sizeof(bad_size));
+    EXPECT_EQ(file_rom_restore(NULL, bad_snapshot.data(), bad_snapshot.size()),
+              nullptr);
+    EXPECT_EQ(rom->image->num_refs, 2u);
+
+    // Once every device is gone, the image is no longer in the cache.
+    file_rom_free(restored);
+    file_rom_free(rom);
+    EXPECT_EQ(file_rom_restore(NULL, snapshot.data(), snapshot.size()),
+              nullptr);
+}
@@ -0,0 +1,213 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <fcvm/busctl.h>
+#include <fcvm/memctl.h>
+#include <fcvm/sparse_ram.h>
+
+#define TEST_RAM_SIZE  0x1000'0000
+#define TEST_RAM_FILL  0xA5
+#define TEST_REG_START 0x2000'0000
+
+class SparseRAMTest : public testing::Test {
+  protected:
+    SparseRAMTest() { ram = sparse_ram_new(TEST_RAM_SIZE, TEST_RAM_FILL); }
+
+    ~SparseRAMTest() { sparse_ram_free(ram); }
+
+    sparse_ram_ctx_t *ram;
+};
+
+TEST_F(SparseRAMTest, UntouchedPagesReadFill) {
+    uint8_t val8 = 0;
+    uint32_t val32 = 0;
+    EXPECT_EQ(sparse_ram_read_u8(ram, 0, &val8), VM_ERR_NONE);
+    EXPECT_EQ(val8, TEST_RAM_FILL);
+    EXPECT_EQ(sparse_ram_read_u32(ram, TEST_RAM_SIZE - 4, &val32),
+              VM_ERR_NONE);
+    EXPECT_EQ(val32, 0xA5A5'A5A5u);
+    EXPECT_EQ(ram->num_pages, 0u);
+}
+
+TEST_F(SparseRAMTest, WritesAllocatePages) {
+    EXPECT_EQ(sparse_ram_write_u8(ram, 0x10, 0x42), VM_ERR_NONE);
+    EXPECT_EQ(ram->num_pages, 1u);
+
+    // Straddles two pages.
+    const vm_addr_t addr = 0x0800'0000 + SPARSE_RAM_PAGE_SIZE - 2;
+    EXPECT_EQ(sparse_ram_write_u32(ram, addr, 0x1122'3344), VM_ERR_NONE);
+    EXPECT_EQ(ram->num_pages, 3u);
+
+    uint8_t val8 = 0;
+    uint32_t val32 = 0;
+    EXPECT_EQ(sparse_ram_read_u8(ram, 0x10, &val8), VM_ERR_NONE);
+    EXPECT_EQ(val8, 0x42);
+    EXPECT_EQ(sparse_ram_read_u8(ram, 0x11, &val8), VM_ERR_NONE);
+    EXPECT_EQ(val8, TEST_RAM_FILL);
+    EXPECT_EQ(sparse_ram_read_u32(ram, addr, &val32), VM_ERR_NONE);
+    EXPECT_EQ(val32, 0x1122'3344u);
+    EXPECT_EQ(sparse_ram_read_u32(ram, addr + 2, &val32), VM_ERR_NONE);
+    EXPECT_EQ(val32, 0xA5A5'1122u);
+}
+
+TEST_F(SparseRAMTest, WritingFillAllocatesNothing) {
+    EXPECT_EQ(sparse_ram_write_u8(ram, 0x10, TEST_RAM_FILL), VM_ERR_NONE);
+    std::vector<uint8_t> block(3 * SPARSE_RAM_PAGE_SIZE, TEST_RAM_FILL);
+    EXPECT_EQ(sparse_ram_write_block(ram, 0x100, block.data(), block.size()),
+              VM_ERR_NONE);
+    EXPECT_EQ(ram->num_pages, 0u);
+
+    // Only the page that gets a different byte is allocated.
+    block[block.size() - 1] = 0;
+    EXPECT_EQ(sparse_ram_write_block(ram, 0x100, block.data(), block.size()),
+              VM_ERR_NONE);
+    EXPECT_EQ(ram->num_pages, 1u);
+}
+
+TEST_F(SparseRAMTest, OutOfBoundsAccessesFail) {
+    uint8_t val8;
+    uint32_t val32;
+    uint8_t block[8] = {};
+    EXPECT_EQ(sparse_ram_read_u8(ram, TEST_RAM_SIZE, &val8), VM_ERR_BAD_MEM);
+    EXPECT_EQ(sparse_ram_read_u32(ram, TEST_RAM_SIZE - 3, &val32),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(sparse_ram_write_u8(ram, TEST_RAM_SIZE, 1), VM_ERR_BAD_MEM);
+    EXPECT_EQ(sparse_ram_write_u32(ram, TEST_RAM_SIZE - 1, 1),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(sparse_ram_read_block(ram, TEST_RAM_SIZE - 4, block, 8),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(sparse_ram_write_block(ram, TEST_RAM_SIZE - 4, block, 8),
+              VM_ERR_BAD_MEM);
+    EXPECT_EQ(ram->num_pages, 0u);
+}
+
+TEST_F(SparseRAMTest, BlockTransfersCrossPages) {
+    std::vector<uint8_t> data(2 * SPARSE_RAM_PAGE_SIZE + 100);
+    for (size_t idx = 0; idx < data.size(); idx++) {
+        data[idx] = static_cast<uint8_t>(idx * 7 + 1);
+    }
+    const vm_addr_t addr = 5 * SPARSE_RAM_PAGE_SIZE - 50;
+    EXPECT_EQ(sparse_ram_write_block(ram, addr, data.data(), data.size()),
+              VM_ERR_NONE);
+    EXPECT_EQ(ram->num_pages, 4u);
+
+    std::vector<uint8_t> read(data.size() + 2);
+    EXPECT_EQ(sparse_ram_read_block(ram, addr - 1, read.data(), read.size()),
+              VM_ERR_NONE);
+    EXPECT_EQ(read.front(), TEST_RAM_FILL);
+    EXPECT_EQ(read.back(), TEST_RAM_FILL);
+    EXPECT_TRUE(std::equal(data.begin(), data.end(), read.begin() + 1));
+}
+
+TEST_F(SparseRAMTest, SpansCoverOnePage) {
+    mem_span_t span;
+    EXPECT_FALSE(sparse_ram_get_span(ram, TEST_RAM_SIZE, &span));
+
+    const vm_addr_t addr = 3 * SPARSE_RAM_PAGE_SIZE + 10;
+    ASSERT_TRUE(sparse_ram_get_span(ram, addr, &span));
+    EXPECT_EQ(span.ptr, nullptr);
+    EXPECT_EQ(span.perms, 0);
+    EXPECT_EQ(span.start, 3 * SPARSE_RAM_PAGE_SIZE);
+    EXPECT_EQ(span.end, 4 * SPARSE_RAM_PAGE_SIZE);
+    EXPECT_EQ(span.mem_if, &ram->desc.mem_if);
+    EXPECT_EQ(span.ctx, ram);
+
+    EXPECT_EQ(sparse_ram_write_u8(ram, addr, 0x42), VM_ERR_NONE);
+    ASSERT_TRUE(sparse_ram_get_span(ram, addr, &span));
+    ASSERT_NE(span.ptr, nullptr);
+    EXPECT_EQ(span.perms, MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+    EXPECT_EQ(span.ptr[addr - span.start], 0x42);
+
+    // Direct writes are seen by the callbacks.
+    span.ptr[0] = 0x24;
+    uint8_t val8 = 0;
+    EXPECT_EQ(sparse_ram_read_u8(ram, span.start, &val8), VM_ERR_NONE);
+    EXPECT_EQ(val8, 0x24);
+}
+
+TEST_F(SparseRAMTest, LastSpanEndsWithDevice) {
+    sparse_ram_ctx_t *small = sparse_ram_new(SPARSE_RAM_PAGE_SIZE + 6, 0);
+    mem_span_t span;
+    ASSERT_TRUE(sparse_ram_get_span(small, SPARSE_RAM_PAGE_SIZE + 5, &span));
+    EXPECT_EQ(span.start, SPARSE_RAM_PAGE_SIZE);
+    EXPECT_EQ(span.end, SPARSE_RAM_PAGE_SIZE + 6);
+    sparse_ram_free(small);
+}
+
+TEST_F(SparseRAMTest, MemCtlUsesDeviceSpans) {
+    memctl_ctx_t *memctl = memctl_new();
+    mmio_region_t reg = {
+        .start = TEST_REG_START,
+        .end = TEST_REG_START + TEST_RAM_SIZE,
+        .ctx = ram,
+        .mem_if = ram->desc.mem_if,
+        .direct_ptr = ram->desc.direct_ptr,
+        .direct_perms = ram->desc.direct_perms,
+        .notifies_changes = false,
+    };
+    ASSERT_EQ(memctl_map_region(memctl, &reg), VM_ERR_NONE);
+
+    const vm_addr_t addr = TEST_REG_START + 2 * SPARSE_RAM_PAGE_SIZE + 8;
+    mem_span_t span;
+    ASSERT_TRUE(memctl_get_span(memctl, addr, &span));
+    EXPECT_EQ(span.ptr, nullptr);
+    EXPECT_EQ(span.perms, 0);
+    EXPECT_EQ(span.start, TEST_REG_START + 2 * SPARSE_RAM_PAGE_SIZE);
+    EXPECT_EQ(span.end, TEST_REG_START + 3 * SPARSE_RAM_PAGE_SIZE);
+    EXPECT_EQ(span.cb_base, TEST_REG_START);
+    EXPECT_EQ(span.ctx, ram);
+
+    // Written through the memory controller, then read directly.
+    EXPECT_EQ(memctl_write_u32(memctl, addr, 0xDEAD'BEEF), VM_ERR_NONE);
+    ASSERT_TRUE(memctl_get_span(memctl, addr, &span));
+    ASSERT_NE(span.ptr, nullptr);
+    EXPECT_EQ(span.perms, MEM_DIRECT_READ | MEM_DIRECT_WRITE);
+    uint32_t val32 = 0;
+    memcpy(&val32, &span.ptr[addr - span.start], 4);
+    EXPECT_EQ(val32, 0xDEAD'BEEFu);
+
+    // Untouched pages still read the fill value through the controller.
+    uint8_t val8 = 0;
+    EXPECT_EQ(memctl_read_u8(memctl, TEST_REG_START, &val8), VM_ERR_NONE);
+    EXPECT_EQ(val8, TEST_RAM_FILL);
+    EXPECT_EQ(ram->num_pages, 1u);
+
+    memctl_free(memctl);
+}
+
+TEST_F(SparseRAMTest, SnapshotOnlyHasTouchedPages) {
+    const size_t empty_size = sparse_ram_snapshot_size(ram);
+    EXPECT_LT(empty_size, 64u);
+
+    EXPECT_EQ(sparse_ram_write_u8(ram, 0x0F00'0000, 1), VM_ERR_NONE);
+    EXPECT_EQ(sparse_ram_write_u8(ram, 0x10, 2), VM_ERR_NONE);
+    EXPECT_EQ(sparse_ram_snapshot_size(ram),
+              empty_size + 2 * (sizeof(uint32_t) + SPARSE_RAM_PAGE_SIZE));
+
+    std::vector<uint8_t> buf(sparse_ram_snapshot_size(ram));
+    EXPECT_EQ(sparse_ram_snapshot(ram, buf.data(), buf.size()), buf.size());
+
+    busctl_dev_ctx_t busdev = {};
+    size_t used_size = 0;
+    sparse_ram_ctx_t *restored =
+        sparse_ram_restore(&busdev, buf.data(), buf.size(), &used_size);
+    EXPECT_EQ(used_size, buf.size());
+    EXPECT_EQ(restored->size, ram->size);
+    EXPECT_EQ(restored->fill, ram->fill);
+    EXPECT_EQ(restored->num_pages, 2u);
+    EXPECT_EQ(busdev.mmio.ctx, restored);
+    EXPECT_EQ(busdev.snapshot_ctx, restored);
+    EXPECT_EQ(busdev.mmio.mem_if.get_span, sparse_ram_get_span);
+
+    uint8_t val8 = 0;
+    EXPECT_EQ(sparse_ram_read_u8(restored, 0x0F00'0000, &val8), VM_ERR_NONE);
+    EXPECT_EQ(val8, 1);
+    EXPECT_EQ(sparse_ram_read_u8(restored, 0x10, &val8), VM_ERR_NONE);
+    EXPECT_EQ(val8, 2);
+    EXPECT_EQ(sparse_ram_read_u8(restored, 0x11, &val8), VM_ERR_NONE);
+    EXPECT_EQ(val8, TEST_RAM_FILL);
+    sparse_ram_free(restored);
+}
@@ -0,0 +1,164 @@
+#include <string.h>
+
+#include "testcommon/cpu_engine_test.h"
+
+CPUEngineTest::CPUEngineTest(cpu_engine_t aengine, vm_addr_t amem_size)
+    : engine(aengine), mem_size(amem_size) {
+    for (size_t idx = 0; idx < 2; idx++) {
+        mems[idx] = new FakeMem(CPU_IVT_ADDR, CPU_IVT_ADDR + mem_size);
+    }
+    create(nullptr);
+}
+
+CPUEngineTest::~CPUEngineTest() {
+    destroy();
+}
+
+void CPUEngineTest::reset() {
+    destroy();
+    for (size_t idx = 0; idx < 2; idx++) {
+        mems[idx] = new FakeMem(CPU_IVT_ADDR, CPU_IVT_ADDR + mem_size);
+    }
+    create(nullptr);
+}
+
+void CPUEngineTest::use_mem_ifs(mem_if_t *const mem_ifs[2]) {
+    for (cpu_ctx_t *cpu : cpus) {
+        cpu_free(cpu);
+    }
+    create(mem_ifs);
+}
+
+void CPUEngineTest::write(vm_addr_t at, const std::vector<uint8_t> &bytes) {
+    for (FakeMem *mem : mems) {
+        mem->write(at, bytes.data(), bytes.size());
+    }
+}
+
+void CPUEngineTest::write_ivt_entry(uint8_t entry_idx, vm_addr_t isr_addr) {
+    for (FakeMem *mem : mems) {
+        mem->write(CPU_IVT_ENTRY_ADDR(entry_idx), &isr_addr,
+                   CPU_IVT_ENTRY_SIZE);
+    }
+}
+
+cpu_stop_t CPUEngineTest::run_both(size_t max_instrs) {
+    size_t num_instrs[2];
+    cpu_stop_t stops[2];
+    for (size_t idx = 0; idx < 2; idx++) {
+        stops[idx] = cpu_run(cpus[idx], max_instrs, &num_instrs[idx]);
+    }
+    EXPECT_EQ(stops[1], stops[0]);
+    EXPECT_EQ(num_instrs[1], num_instrs[0]);
+    total_instrs += num_instrs[0];
+    expect_same_state();
+    return stops[0];
+}
+
+cpu_stop_t CPUEngineTest::run_both_cycles(uint64_t budget) {
+    uint64_t used_cycles[2];
+    cpu_stop_t stops[2];
+    for (size_t idx = 0; idx < 2; idx++) {
+        stops[idx] = cpu_run_cycles(cpus[idx], budget, &used_cycles[idx], NULL);
+    }
+    EXPECT_EQ(stops[1], stops[0]);
+    EXPECT_EQ(used_cycles[1], used_cycles[0]);
+    expect_same_state();
+    return stops[0];
+}
+
+void CPUEngineTest::run_until_halt() {
+    for (size_t run = 0; run < 10000; run++) {
+        const cpu_stop_t stop = run_both(7);
+        if (stop == CPU_STOP_HALTED) { return; }
+        ASSERT_EQ(stop, CPU_STOP_BUDGET) << "run " << run;
+    }
+    FAIL() << "not halted";
+}
+
+void CPUEngineTest::expect_same_state() {
+    const cpu_ctx_t *interp = cpus[0];
+    const cpu_ctx_t *other = cpus[1];
+    EXPECT_EQ(other->state, interp->state);
+    for (size_t reg = 0; reg < CPU_NUM_GP_REGS; reg++) {
+        EXPECT_EQ(other->gp_regs[reg], interp->gp_regs[reg]) << "r" << reg;
+    }
+    EXPECT_EQ(other->reg_pc, interp->reg_pc);
+    EXPECT_EQ(other->reg_sp, interp->reg_sp);
+    EXPECT_EQ(other->flags, interp->flags);
+    EXPECT_EQ(other->cycles, interp->cycles);
+    EXPECT_EQ(other->num_nested_exc, interp->num_nested_exc);
+    EXPECT_EQ(other->pc_after_isr, interp->pc_after_isr);
+    EXPECT_EQ(other->instr.start_addr, interp->instr.start_addr);
+    EXPECT_EQ(memcmp(mems[1]->bytes, mems[0]->bytes, mem_size), 0);
+}
+
+std::vector<uint8_t> CPUEngineTest::build_sum_prog(uint32_t num_runs) {
+    constexpr vm_addr_t prog_start = CPU_IVT_ADDR + CPU_IVT_SIZE;
+    constexpr vm_addr_t func_start = prog_start + 512;
+    constexpr vm_addr_t data_addr = prog_start + 4096;
+    constexpr uint8_t size_8 = CPU_REG_REF_SIZE_8;
+    ProgBuilder prog = build_prog();
+    prog.instr(build_instr(CPU_OP_MOV_VR).reg_code(CPU_CODE_R0).imm32(0))
+        .instr(build_instr(CPU_OP_MOV_VR)
+                   .reg_code(CPU_CODE_R1)
+                   .imm32(data_addr))
+        .instr(build_instr(CPU_OP_MOV_VR)
+                   .reg_code(CPU_CODE_R2)
+                   .imm32(num_runs - 1));
+    // loop:
+    const vm_addr_t loop = prog_start + prog.bytes.size();
+    prog.instr(build_instr(CPU_OP_STR_RIR)
+                   .reg_code(CPU_CODE_R1)
+                   .reg_code(CPU_CODE_R2)
+                   .reg_code(CPU_CODE_R2))
+        .instr(build_instr(CPU_OP_LDR_RIR)
+                   .reg_code(CPU_CODE_R3)
+                   .reg_code(CPU_CODE_R1)
+                   .reg_code(CPU_CODE_R2))
+        .instr(build_instr(CPU_OP_ADD_RR)
+                   .reg_code(CPU_CODE_R0)
+                   .reg_code(CPU_CODE_R3))
+        .instr(build_instr(CPU_OP_STR_RI8)
+                   .reg_code(CPU_CODE_R1)
+                   .imm8((uint8_t)-1)
+                   .reg_code(CPU_CODE_R0 | size_8))
+        .instr(build_instr(CPU_OP_CALLA_V32).imm32(func_start))
+        .instr(build_instr(CPU_OP_SUB_RV).reg_code(CPU_CODE_R2).imm32(1))
+        .instr(build_instr(CPU_OP_JGEA_V32).imm32(loop))
+        .instr(build_instr(CPU_OP_TST_RR)
+                   .reg_code(CPU_CODE_R0)
+                   .reg_code(CPU_CODE_R0))
+        .instr(build_instr(CPU_OP_JEQA_V32).imm32(loop))
+        .instr(build_instr(CPU_OP_HALT));
+    prog.bytes.resize(func_start - prog_start);
+
+    // Scrambles r5 and r6, with a division.
+    prog.instr(build_instr(CPU_OP_MOV_RR)
+                   .reg_code(CPU_CODE_R5)
+                   .reg_code(CPU_CODE_R0))
+        .instr(build_instr(CPU_OP_ROL_RV).reg_code(CPU_CODE_R5).imm5(7))
+        .instr(build_instr(CPU_OP_XOR_RR)
+                   .reg_code(CPU_CODE_R6)
+                   .reg_code(CPU_CODE_R5))
+        .instr(build_instr(CPU_OP_IDIV_RV).reg_code(CPU_CODE_R6).imm32(3))
+        .instr(build_instr(CPU_OP_RET));
+    return prog.bytes;
+}
+
+void CPUEngineTest::create(mem_if_t *const mem_ifs[2]) {
+    for (size_t idx = 0; idx < 2; idx++) {
+        cpus[idx] = cpu_new(mem_ifs ? mem_ifs[idx] : &mems[idx]->mem_if);
+        cpus[idx]->state = CPU_FETCH_DECODE_OPCODE;
+        cpus[idx]->reg_pc = CPU_IVT_ADDR + CPU_IVT_SIZE;
+        cpus[idx]->reg_sp = CPU_IVT_ADDR + mem_size;
+    }
+    cpu_set_engine(cpus[1], engine);
+}
+
+void CPUEngineTest::destroy() {
+    for (size_t idx = 0; idx < 2; idx++) {
+        cpu_free(cpus[idx]);
+        delete mems[idx];
+    }
+}
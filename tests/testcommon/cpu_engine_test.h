@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <fcvm/cpu.h>
+#include "testcommon/fake_mem.h"
+#include "testcommon/prog_builder.h"
+
+/**
+ * Runs the same program on two CPUs, the first one with the interpreter and
+ * the second one with another engine, and checks that they agree on
+ * everything. Each CPU has its own memory from #CPU_IVT_ADDR, and starts at
+ * the end of the IVT with the stack at the end of the memory.
+ */
+class CPUEngineTest : public testing::Test {
+  protected:
+    CPUEngineTest(cpu_engine_t aengine, vm_addr_t amem_size);
+    ~CPUEngineTest();
+
+    /// Starts over with new CPUs and memory.
+    void reset();
+
+    /**
+     * Replaces the CPUs with new ones on @a mem_ifs, which must forward to
+     * #mems (the interpreter CPU first).
+     */
+    void use_mem_ifs(mem_if_t *const mem_ifs[2]);
+
+    void write(vm_addr_t at, const std::vector<uint8_t> &bytes);
+    void write_ivt_entry(uint8_t entry_idx, vm_addr_t isr_addr);
+
+    /// Runs both CPUs with the same instruction budget and compares them.
+    cpu_stop_t run_both(size_t max_instrs);
+    /// Runs both CPUs with the same cycle budget and compares them.
+    cpu_stop_t run_both_cycles(uint64_t budget);
+    /// Runs both CPUs a few instructions at a time until they halt.
+    void run_until_halt();
+
+    void expect_same_state();
+
+    /**
+     * Straight-line setup run once, then a loop of @a num_runs iterations
+     * summing a table with loads, stores, a call and conditional jumps. The
+     * function is 512 bytes and the table 4096 bytes past the start.
+     */
+    static std::vector<uint8_t> build_sum_prog(uint32_t num_runs);
+
+    cpu_engine_t engine;
+    vm_addr_t mem_size;
+    FakeMem *mems[2];
+    /// Interpreter CPU, then the CPU with @a engine.
+    cpu_ctx_t *cpus[2];
+    /// Instructions run by each CPU so far.
+    uint64_t total_instrs = 0;
+
+  private:
+    void create(mem_if_t *const mem_ifs[2]);
+    void destroy();
+};
@@ -22,6 +22,9 @@ FakeMem::FakeMem(vm_addr_t abase, vm_addr_t aend, bool fail_on_wrong_access) {
     mem_if.read_u32 = read_u32;
     mem_if.write_u8 = write_u8;
     mem_if.write_u32 = write_u32;
+    mem_if.get_span = get_span;
+    mem_if.read_block = read_block;
+    mem_if.write_block = write_block;
     this->fail_on_wrong_access = fail_on_wrong_access;
 
     _mmio_ctx_to_this[&mem_if] = this;
@@ -37,8 +40,11 @@ dev_desc_t FakeMem::dev_desc() const {
         .dev_class = dev_class,
         .region_size = end - base,
         .mem_if = mem_if,
+        .direct_ptr = bytes,
+        .direct_perms = MEM_DIRECT_READ | MEM_DIRECT_WRITE,
         .f_snapshot_size = snapshot_size_cb,
         .f_snapshot = snapshot_cb,
+        .f_set_notify = nullptr,
     };
 }
 
@@ -120,6 +126,7 @@ size_t FakeMem::restore(FakeMem **out_fakemem,
     if (busdev_ctx) {
         busdev_ctx->mmio.ctx = &fake_mem->mem_if;
         busdev_ctx->mmio.mem_if = fake_mem->mem_if;
+        busdev_ctx->mmio.direct_ptr = fake_mem->bytes;
         busdev_ctx->snapshot_ctx = fake_mem;
         busdev_ctx->f_snapshot_size = snapshot_size_cb;
         busdev_ctx->f_snapshot = snapshot_cb;
@@ -153,6 +160,32 @@ vm_err_t FakeMem::write_u32(void *ctx, vm_addr_t addr, uint32_t val) {
     return obj->write(addr, &val, 4);
 }
 
+vm_err_t FakeMem::read_block(void *ctx, vm_addr_t addr, void *out,
+                             size_t size) {
+    FakeMem *obj = find_obj_by_mmio_ctx(ctx);
+    return obj->read(addr, out, size);
+}
+
+vm_err_t FakeMem::write_block(void *ctx, vm_addr_t addr, const void *data,
+                              size_t size) {
+    FakeMem *obj = find_obj_by_mmio_ctx(ctx);
+    return obj->write(addr, data, size);
+}
+
+bool FakeMem::get_span(void *ctx, vm_addr_t addr, mem_span_t *out) {
+    FakeMem *obj = find_obj_by_mmio_ctx(ctx);
+    if (addr < obj->base || addr >= obj->end) { return false; }
+    out->ptr = obj->bytes;
+    out->start = obj->base;
+    out->end = obj->end;
+    out->perms = MEM_DIRECT_READ | MEM_DIRECT_WRITE;
+    out->mem_if = &obj->mem_if;
+    out->ctx = &obj->mem_if;
+    out->cb_base = 0;
+    out->p_gen = nullptr;
+    return true;
+}
+
 void FakeMem::read_impl(vm_addr_t addr, void *out_buf, size_t num_bytes,
                         vm_err_t *out_err) {
     if (base <= addr && (addr + num_bytes) <= end) {
@@ -38,6 +38,11 @@ class FakeMem {
     static vm_err_t read_u32(void *ctx, vm_addr_t addr, uint32_t *out);
     static vm_err_t write_u8(void *ctx, vm_addr_t addr, uint8_t val);
     static vm_err_t write_u32(void *ctx, vm_addr_t addr, uint32_t val);
+    static bool get_span(void *ctx, vm_addr_t addr, mem_span_t *out);
+    static vm_err_t read_block(void *ctx, vm_addr_t addr, void *out,
+                               size_t size);
+    static vm_err_t write_block(void *ctx, vm_addr_t addr, const void *data,
+                                size_t size);
 
     void read_impl(vm_addr_t addr, void *out_buf, size_t num_bytes,
                    vm_err_t *out_err);
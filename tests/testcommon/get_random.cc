@@ -47,12 +47,11 @@ uint32_t *get_reg_ptr(cpu_ctx_t *cpu, uint8_t reg_code) {
     const uint8_t reg_ref_byte = CPU_REG_REF_SIZE_32 | reg_code;
 
     cpu_reg_ref_t decoded_ref;
-    cpu_decode_reg(cpu, reg_ref_byte, &decoded_ref);
-    if (!decoded_ref.p_reg) {
+    if (cpu_decode_reg(reg_ref_byte, &decoded_ref) != VM_ERR_NONE) {
         fprintf(stderr, "failed to decode register code 0x%02X\n", reg_code);
         abort();
     }
-    return decoded_ref.p_reg;
+    return cpu_reg_ptr(cpu, decoded_ref);
 }
 
 uint8_t get_random_reg_code(std::mt19937 &rng, bool unique_regs,
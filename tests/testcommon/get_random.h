@@ -27,23 +27,21 @@ struct RegRef {
     uint32_t *get_ptr_u32(cpu_ctx_t *cpu) const {
         uint8_t encoded_ref = encode();
         cpu_reg_ref_t decoded_ref;
-        cpu_decode_reg(cpu, encoded_ref, &decoded_ref);
-        if (!decoded_ref.p_reg) {
+        if (cpu_decode_reg(encoded_ref, &decoded_ref) != VM_ERR_NONE) {
             fprintf(stderr, "failed to decode register code 0x%02X\n", code);
             abort();
         }
-        return decoded_ref.p_reg;
+        return cpu_reg_ptr(cpu, decoded_ref);
     }
 
     uint8_t *get_ptr_u8(cpu_ctx_t *cpu) const {
         uint8_t encoded_ref = encode();
         cpu_reg_ref_t decoded_ref;
-        cpu_decode_reg(cpu, encoded_ref, &decoded_ref);
-        if (!decoded_ref.p_reg) {
+        if (cpu_decode_reg(encoded_ref, &decoded_ref) != VM_ERR_NONE) {
             fprintf(stderr, "failed to decode register code 0x%02X\n", code);
             abort();
         }
-        return decoded_ref.p_reg_u8;
+        return cpu_reg_ptr_u8(cpu, decoded_ref);
     }
 };
 
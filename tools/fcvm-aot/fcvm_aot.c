@@ -0,0 +1,727 @@
+/**
+ * @file fcvm_aot.c
+ * Ahead-of-time translator of ROM images, see @ref fcvm/cpu_aot.h.
+ *
+ * Usage: `fcvm-aot ROM --output FILE.c [--base ADDR] [--entry ADDR]...`
+ *
+ * The ROM is assumed to be mapped at `--base` (0 by default). The code is found
+ * by following the control flow from the IVT entries that point into the ROM
+ * and from the `--entry` addresses. It is split into blocks exactly like
+ * #CPU_ENGINE_BLOCKS does, and each block is translated to a C function that
+ * runs the longest prefix of it made of moves, ALU instructions, loads, stores
+ * and jumps whose condition is set by an earlier instruction of the block. The
+ * other instructions are left to the interpreter.
+ *
+ * The output is compiled into a shared object with the public headers of the
+ * library in the include path.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcvm/cpu.h>
+#include <fcvm/cpu_aot.h>
+
+/// Maximum number of `--entry` options.
+#define AOT_MAX_ENTRIES 64
+
+/// ROM image being translated.
+typedef struct {
+    const char *path;
+    vm_addr_t base; //!< Guest address of the first byte.
+    uint8_t *bytes;
+    size_t size;
+} aot_rom_t;
+
+/// Decoded block, split like the blocks of the block engine.
+typedef struct {
+    vm_addr_t start_pc;
+    vm_addr_t end_pc;
+    size_t num_ops;
+    cpu_instr_t ops[CPU_AOT_BLOCK_MAX_OPS];
+} aot_block_t;
+
+/// What the flags set by the last ALU instruction tell the jumps.
+typedef enum {
+    /// Unknown, the jumps are left to the interpreter.
+    AOT_FLAGS_UNKNOWN,
+    /// The flags order the operands as signed values (subtractions).
+    AOT_FLAGS_ORDER,
+    /// The flags order the result and zero (no overflow, exact zero flag).
+    AOT_FLAGS_SIGN,
+} aot_flags_t;
+
+static bool prv_aot_read_rom(aot_rom_t *rom);
+static bool prv_aot_decode(const aot_rom_t *rom, vm_addr_t pc,
+                           cpu_instr_t *out_instr);
+static bool prv_aot_build_block(const aot_rom_t *rom, vm_addr_t start_pc,
+                                aot_block_t *out_block);
+static size_t prv_aot_successors(const aot_block_t *block,
+                                 vm_addr_t out_pcs[2]);
+static size_t prv_aot_num_translated(const aot_block_t *block);
+static aot_flags_t prv_aot_flags_of(uint8_t opcode);
+static int prv_aot_cmp_blocks(const void *v_lhs, const void *v_rhs);
+static void prv_aot_emit_block(FILE *out, const aot_rom_t *rom,
+                               const aot_block_t *block);
+static void prv_aot_emit_alu(FILE *out, const cpu_instr_t *instr, size_t idx);
+static void prv_aot_emit_mem(FILE *out, const cpu_instr_t *instr, size_t idx);
+static void prv_aot_emit_jump(FILE *out, const aot_block_t *block, size_t idx);
+static void prv_aot_usage(const char *prog);
+
+/// Checks if @a pc is in the ROM.
+static inline bool prv_aot_in_rom(const aot_rom_t *rom, vm_addr_t pc) {
+    return (pc - rom->base) < rom->size;
+}
+
+/// Opcode of the flow instructions without the operand type bits.
+#define PRV_AOT_FLOW_OP(opcode) ((opcode) & ~3)
+
+/// Checks if @a opcode is a conditional jump.
+static inline bool prv_aot_is_cond_jump(uint8_t opcode) {
+    return (opcode & CPU_OP_KIND_MASK) == CPU_OP_KIND_FLOW &&
+           PRV_AOT_FLOW_OP(opcode) != CPU_OP_JMPR_V8 &&
+           PRV_AOT_FLOW_OP(opcode) != PRV_AOT_FLOW_OP(CPU_OP_RET);
+}
+
+int main(int argc, char **argv) {
+    aot_rom_t rom = {.base = 0};
+    const char *out_path = NULL;
+    vm_addr_t entries[AOT_MAX_ENTRIES];
+    size_t num_entries = 0;
+
+    static const struct option long_opts[] = {
+        {"output", required_argument, NULL, 'o'},
+        {"base", required_argument, NULL, 'b'},
+        {"entry", required_argument, NULL, 'e'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:b:e:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'b':
+            rom.base = (vm_addr_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            if (num_entries == AOT_MAX_ENTRIES) {
+                fprintf(stderr, "fcvm-aot: too many entries\n");
+                return 1;
+            }
+            entries[num_entries++] = (vm_addr_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            prv_aot_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc || !out_path) {
+        prv_aot_usage(argv[0]);
+        return 1;
+    }
+    rom.path = argv[optind];
+    if (!prv_aot_read_rom(&rom)) { return 1; }
+
+    // Follow the control flow from the entry points, with a stack of the
+    // block addresses left to visit. Each address is pushed at most once.
+    bool *seen = calloc(rom.size, sizeof(*seen));
+    vm_addr_t *todo = malloc(rom.size * sizeof(*todo));
+    size_t num_todo = 0;
+    size_t max_blocks = 64;
+    aot_block_t *blocks = malloc(max_blocks * sizeof(*blocks));
+    if (!seen || !todo || !blocks) {
+        fprintf(stderr, "fcvm-aot: out of memory\n");
+        return 1;
+    }
+#define PRV_AOT_VISIT(pc)                                                      \
+    do {                                                                       \
+        const vm_addr_t visit_pc = (pc);                                       \
+        if (prv_aot_in_rom(&rom, visit_pc) && !seen[visit_pc - rom.base]) {    \
+            seen[visit_pc - rom.base] = true;                                  \
+            todo[num_todo++] = visit_pc;                                       \
+        }                                                                      \
+    } while (0)
+
+    for (size_t idx = 0; idx < num_entries; idx++) {
+        PRV_AOT_VISIT(entries[idx]);
+    }
+    for (size_t entry = 0; entry < CPU_IVT_NUM_ENTRIES; entry++) {
+        const vm_addr_t entry_addr = CPU_IVT_ENTRY_ADDR(entry);
+        if (!prv_aot_in_rom(&rom, entry_addr) ||
+            !prv_aot_in_rom(&rom, entry_addr + CPU_IVT_ENTRY_SIZE - 1)) {
+            continue;
+        }
+        vm_addr_t isr_addr;
+        memcpy(&isr_addr, &rom.bytes[entry_addr - rom.base],
+               CPU_IVT_ENTRY_SIZE);
+        // Unused entries point into the IVT itself.
+        if (isr_addr - CPU_IVT_ADDR >= CPU_IVT_SIZE) {
+            PRV_AOT_VISIT(isr_addr);
+        }
+    }
+
+    size_t num_blocks = 0;
+    while (num_todo > 0) {
+        if (num_blocks == max_blocks) {
+            max_blocks *= 2;
+            blocks = realloc(blocks, max_blocks * sizeof(*blocks));
+            if (!blocks) {
+                fprintf(stderr, "fcvm-aot: out of memory\n");
+                return 1;
+            }
+        }
+        aot_block_t *block = &blocks[num_blocks];
+        if (!prv_aot_build_block(&rom, todo[--num_todo], block)) { continue; }
+
+        vm_addr_t next_pcs[2];
+        const size_t num_next = prv_aot_successors(block, next_pcs);
+        for (size_t idx = 0; idx < num_next; idx++) {
+            PRV_AOT_VISIT(next_pcs[idx]);
+        }
+        // Blocks that start with an instruction left to the interpreter are
+        // not worth a call.
+        if (prv_aot_num_translated(block) > 0) { num_blocks++; }
+    }
+#undef PRV_AOT_VISIT
+    qsort(blocks, num_blocks, sizeof(*blocks), prv_aot_cmp_blocks);
+
+    FILE *out = fopen(out_path, "w");
+    if (!out) {
+        perror("fcvm-aot: fopen");
+        return 1;
+    }
+    fprintf(out, "// Generated by fcvm-aot from %s, do not edit.\n\n",
+            rom.path);
+    fprintf(out, "#include <fcvm/cpu_aot.h>\n");
+    for (size_t idx = 0; idx < num_blocks; idx++) {
+        prv_aot_emit_block(out, &rom, &blocks[idx]);
+    }
+
+    fprintf(out, "\nstatic const cpu_aot_block_t prv_aot_blocks[] = {\n");
+    for (size_t idx = 0; idx < num_blocks; idx++) {
+        const vm_addr_t pc = blocks[idx].start_pc;
+        fprintf(out,
+                "    {0x%08XU, %zuU, %uU, prv_aot_code_%08X, "
+                "prv_aot_block_%08X},\n",
+                pc, blocks[idx].num_ops, blocks[idx].end_pc - pc, pc, pc);
+    }
+    // An empty initializer list is not valid C before C23.
+    if (num_blocks == 0) { fprintf(out, "    {0},\n"); }
+    fprintf(out, "};\n\n");
+
+    fprintf(out,
+            "__attribute__((visibility(\"default\")))\n"
+            "const cpu_aot_module_t %s = {\n"
+            "    .abi_ver = %uU,\n"
+            "    .ctx_ver = %uU,\n"
+            "    .code_page_shift = %uU,\n"
+            "    .rom_hash = 0x%016llXULL,\n"
+            "    .rom_size = %zuU,\n"
+            "    .num_blocks = %zuU,\n"
+            "    .blocks = prv_aot_blocks,\n"
+            "};\n",
+            CPU_AOT_MODULE_SYM, CPU_AOT_ABI_VER, SN_CPU_CTX_VER,
+            MEM_PAGE_BITMAP_PAGE_SHIFT,
+            (unsigned long long)cpu_aot_hash(rom.bytes, rom.size), rom.size,
+            num_blocks);
+
+    if (fclose(out) != 0) {
+        perror("fcvm-aot: fclose");
+        return 1;
+    }
+    fprintf(stderr, "fcvm-aot: translated %zu blocks of %s\n", num_blocks,
+            rom.path);
+    free(blocks);
+    free(todo);
+    free(seen);
+    free(rom.bytes);
+    return 0;
+}
+
+static void prv_aot_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s ROM --output FILE.c [--base ADDR] [--entry ADDR]...\n",
+            prog);
+}
+
+/// Reads the whole file at @a rom->path into @a rom->bytes.
+static bool prv_aot_read_rom(aot_rom_t *rom) {
+    FILE *file = fopen(rom->path, "rb");
+    if (!file) {
+        perror("fcvm-aot: fopen");
+        return false;
+    }
+    size_t capacity = 4096;
+    rom->bytes = malloc(capacity);
+    rom->size = 0;
+    size_t num_read;
+    while (rom->bytes &&
+           (num_read = fread(&rom->bytes[rom->size], 1, capacity - rom->size,
+                             file)) > 0) {
+        rom->size += num_read;
+        if (rom->size == capacity) {
+            capacity *= 2;
+            rom->bytes = realloc(rom->bytes, capacity);
+        }
+    }
+    const bool ok = rom->bytes && !ferror(file) && rom->size > 0;
+    fclose(file);
+    if (!ok) { fprintf(stderr, "fcvm-aot: cannot read %s\n", rom->path); }
+    return ok;
+}
+
+/**
+ * Decodes the instruction at @a pc like the CPU does.
+ * @returns `false` if it is not a valid instruction, is not entirely in the ROM
+ * or crosses an instruction cache line.
+ */
+static bool prv_aot_decode(const aot_rom_t *rom, vm_addr_t pc,
+                           cpu_instr_t *out_instr) {
+    if (!prv_aot_in_rom(rom, pc)) { return false; }
+    const uint8_t *bytes = &rom->bytes[pc - rom->base];
+    const cpu_instr_desc_t *desc = cpu_lookup_instr_desc(bytes[0]);
+    if (!desc || rom->size - (pc - rom->base) < desc->size ||
+        (pc >> CPU_AOT_LINE_SHIFT) !=
+            ((pc + desc->size - 1) >> CPU_AOT_LINE_SHIFT)) {
+        return false;
+    }
+
+    memset(out_instr, 0, sizeof(*out_instr));
+    out_instr->start_addr = pc;
+    out_instr->opcode = bytes[0];
+    out_instr->desc = desc;
+    size_t pos = 1;
+    for (size_t idx = 0; idx < desc->num_operands; idx++) {
+        cpu_opd_val_t *opd = &out_instr->operands[idx];
+        switch (desc->operands[idx]) {
+        case CPU_OPD_REG:
+            if (cpu_decode_reg(bytes[pos], &opd->reg_ref) != VM_ERR_NONE) {
+                return false;
+            }
+            pos += 1;
+            break;
+        case CPU_OPD_IMM5:
+            if ((bytes[pos] & ~31) != 0) { return false; }
+            opd->imm5 = bytes[pos];
+            pos += 1;
+            break;
+        case CPU_OPD_IMM8:
+            opd->u8 = bytes[pos];
+            pos += 1;
+            break;
+        case CPU_OPD_IMM32:
+            memcpy(&opd->u32, &bytes[pos], 4);
+            pos += 4;
+            break;
+        }
+    }
+    out_instr->next_operand = desc->num_operands;
+    return true;
+}
+
+/**
+ * Decodes the block starting at @a start_pc, with the limits of the block
+ * engine (see #prv_cpu_build_block()).
+ * @returns `false` if its first instruction cannot be decoded.
+ */
+static bool prv_aot_build_block(const aot_rom_t *rom, vm_addr_t start_pc,
+                                aot_block_t *out_block) {
+    out_block->start_pc = start_pc;
+    out_block->num_ops = 0;
+    vm_addr_t pc = start_pc;
+    while (out_block->num_ops < CPU_AOT_BLOCK_MAX_OPS) {
+        if ((pc >> CPU_AOT_LINE_SHIFT) !=
+            (start_pc >> CPU_AOT_LINE_SHIFT)) {
+            break;
+        }
+        cpu_instr_t *instr = &out_block->ops[out_block->num_ops];
+        if (!prv_aot_decode(rom, pc, instr)) { break; }
+        out_block->num_ops++;
+        pc += instr->desc->size;
+
+        const uint8_t opcode = instr->opcode;
+        if ((opcode & CPU_OP_KIND_MASK) == CPU_OP_KIND_FLOW ||
+            opcode == CPU_OP_HALT || opcode == CPU_OP_INT_V8 ||
+            opcode == CPU_OP_IRET) {
+            break;
+        }
+    }
+    out_block->end_pc = pc;
+    return out_block->num_ops > 0;
+}
+
+/**
+ * Finds the addresses that can run after @a block, except those only known at
+ * run time.
+ * @returns Number of addresses written to @a out_pcs.
+ */
+static size_t prv_aot_successors(const aot_block_t *block,
+                                 vm_addr_t out_pcs[2]) {
+    const cpu_instr_t *last = &block->ops[block->num_ops - 1];
+    const uint8_t opcode = last->opcode;
+    size_t num_pcs = 0;
+    if ((opcode & CPU_OP_KIND_MASK) != CPU_OP_KIND_FLOW) {
+        // Execution resumes after HALT and INT once the IRQ has been handled.
+        if (opcode != CPU_OP_IRET) { out_pcs[num_pcs++] = block->end_pc; }
+        return num_pcs;
+    }
+    if (opcode == CPU_OP_RET) { return 0; }
+
+    switch (opcode & 3) {
+    case 0:
+        out_pcs[num_pcs++] = last->start_addr + (int8_t)last->operands[0].u8;
+        break;
+    case 1:
+        out_pcs[num_pcs++] = last->operands[0].u32;
+        break;
+    default:
+        break;
+    }
+    // Conditional jumps and calls also continue after the instruction.
+    if (PRV_AOT_FLOW_OP(opcode) != CPU_OP_JMPR_V8) {
+        out_pcs[num_pcs++] = block->end_pc;
+    }
+    return num_pcs;
+}
+
+/// Kind of the flags set by the ALU instruction @a opcode.
+static aot_flags_t prv_aot_flags_of(uint8_t opcode) {
+    switch (opcode) {
+    case CPU_OP_SUB_RR:
+    case CPU_OP_SUB_RV:
+    case CPU_OP_CMP_RR:
+        return AOT_FLAGS_ORDER;
+    case CPU_OP_ADD_RR:
+    case CPU_OP_ADD_RV:
+    case CPU_OP_MUL_RR:
+    case CPU_OP_MUL_RV:
+        // The zero flag is set from the wide result.
+        return AOT_FLAGS_UNKNOWN;
+    default:
+        return AOT_FLAGS_SIGN;
+    }
+}
+
+/// Number of instructions at the start of @a block that are translated.
+static size_t prv_aot_num_translated(const aot_block_t *block) {
+    aot_flags_t flags = AOT_FLAGS_UNKNOWN;
+    for (size_t idx = 0; idx < block->num_ops; idx++) {
+        const uint8_t opcode = block->ops[idx].opcode;
+        switch (opcode & CPU_OP_KIND_MASK) {
+        case CPU_OP_KIND_DATA:
+            break;
+        case CPU_OP_KIND_ALU:
+            flags = prv_aot_flags_of(opcode);
+            break;
+        case CPU_OP_KIND_FLOW:
+            // Calls and returns use the stack.
+            if (PRV_AOT_FLOW_OP(opcode) == PRV_AOT_FLOW_OP(CPU_OP_RET)) {
+                return idx;
+            }
+            if (prv_aot_is_cond_jump(opcode) && flags == AOT_FLAGS_UNKNOWN) {
+                return idx;
+            }
+            break;
+        default:
+            if (opcode != CPU_OP_NOP) { return idx; }
+            break;
+        }
+    }
+    return block->num_ops;
+}
+
+static int prv_aot_cmp_blocks(const void *v_lhs, const void *v_rhs) {
+    const aot_block_t *lhs = v_lhs;
+    const aot_block_t *rhs = v_rhs;
+    return (lhs->start_pc > rhs->start_pc) - (lhs->start_pc < rhs->start_pc);
+}
+
+/// Emits the code bytes and the function of @a block.
+static void prv_aot_emit_block(FILE *out, const aot_rom_t *rom,
+                               const aot_block_t *block) {
+    const vm_addr_t start_pc = block->start_pc;
+    fprintf(out, "\nstatic const uint8_t prv_aot_code_%08X[] = {", start_pc);
+    for (vm_addr_t pc = start_pc; pc < block->end_pc; pc++) {
+        fprintf(out, "%s0x%02X", pc == start_pc ? "" : ", ",
+                rom->bytes[pc - rom->base]);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out,
+            "static uint32_t prv_aot_block_%08X(\n"
+            "    cpu_ctx_t *cpu, const mem_page_bitmap_t *code_pages) {\n"
+            "    uint32_t lhs = 0;\n"
+            "    uint32_t rhs = 0;\n"
+            "    (void)code_pages;\n"
+            "    (void)lhs;\n"
+            "    (void)rhs;\n",
+            start_pc);
+    const size_t num_translated = prv_aot_num_translated(block);
+    for (size_t idx = 0; idx < num_translated; idx++) {
+        const cpu_instr_t *instr = &block->ops[idx];
+        fprintf(out, "    // 0x%08X: %s\n", instr->start_addr,
+                instr->desc->mnemonic);
+        switch (instr->opcode & CPU_OP_KIND_MASK) {
+        case CPU_OP_KIND_DATA:
+            prv_aot_emit_mem(out, instr, idx);
+            break;
+        case CPU_OP_KIND_ALU:
+            prv_aot_emit_alu(out, instr, idx);
+            break;
+        case CPU_OP_KIND_FLOW:
+            prv_aot_emit_jump(out, block, idx);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Jumps have returned already.
+    const cpu_instr_t *last = &block->ops[num_translated - 1];
+    if ((last->opcode & CPU_OP_KIND_MASK) != CPU_OP_KIND_FLOW) {
+        if (num_translated == block->num_ops) {
+            fprintf(out, "    cpu->reg_pc = 0x%08XU;\n", block->end_pc);
+        }
+        fprintf(out, "    return %zuU;\n", num_translated);
+    }
+    fprintf(out, "}\n");
+}
+
+/// Value of the register of operand @a idx of @a instr.
+#define PRV_AOT_REG(instr, idx)                                                \
+    "CPU_AOT_REG(cpu, %u)", (unsigned)(instr)->operands[idx].reg_ref.ctx_offset
+
+/// Emits a move, a load or a store, which exits if it is not direct.
+static void prv_aot_emit_mem(FILE *out, const cpu_instr_t *instr, size_t idx) {
+    const cpu_opd_val_t *opds = instr->operands;
+    const uint8_t opcode = instr->opcode;
+    if (opcode == CPU_OP_MOV_VR) {
+        fprintf(out, "    CPU_AOT_REG(cpu, %u) = 0x%08XU;\n",
+                opds[0].reg_ref.ctx_offset, opds[1].u32);
+        return;
+    }
+    if (opcode == CPU_OP_MOV_RR) {
+        fprintf(out, "    CPU_AOT_REG(cpu, %u) = CPU_AOT_REG(cpu, %u);\n",
+                opds[0].reg_ref.ctx_offset, opds[1].reg_ref.ctx_offset);
+        return;
+    }
+
+    // Same addresses as the handlers, the stores have the address first.
+    const bool is_store = opcode <= CPU_OP_STR_RIR;
+    const size_t base_opd = is_store ? 0 : 1;
+    const cpu_reg_ref_t reg =
+        is_store ? opds[instr->desc->num_operands - 1].reg_ref
+                 : opds[0].reg_ref;
+    fprintf(out, "    {\n        const vm_addr_t addr = ");
+    switch (opcode) {
+    case CPU_OP_STR_RV0:
+        fprintf(out, "0x%08XU", opds[0].u32);
+        break;
+    case CPU_OP_LDR_RV0:
+        fprintf(out, "0x%08XU", opds[1].u32);
+        break;
+    case CPU_OP_STR_RI0:
+    case CPU_OP_LDR_RI0:
+        fprintf(out, PRV_AOT_REG(instr, base_opd));
+        break;
+    case CPU_OP_STR_RI8:
+    case CPU_OP_LDR_RI8:
+        fprintf(out, PRV_AOT_REG(instr, base_opd));
+        fprintf(out, " + 0x%08XU",
+                (uint32_t)(int32_t)(int8_t)opds[base_opd + 1].u8);
+        break;
+    case CPU_OP_STR_RI32:
+    case CPU_OP_LDR_RI32:
+        fprintf(out, PRV_AOT_REG(instr, base_opd));
+        fprintf(out, " + 0x%08XU", opds[base_opd + 1].u32);
+        break;
+    default: // CPU_OP_STR_RIR, CPU_OP_LDR_RIR
+        fprintf(out, PRV_AOT_REG(instr, base_opd));
+        fprintf(out, " + ");
+        fprintf(out, PRV_AOT_REG(instr, base_opd + 1));
+        break;
+    }
+    fprintf(out, ";\n");
+
+    const bool is_u8 = reg.access_size == CPU_REG_SIZE_8;
+    const unsigned size = is_u8 ? 1 : 4;
+    if (is_store) {
+        fprintf(out,
+                "        uint8_t *ptr = cpu_aot_store_ptr(cpu, code_pages, "
+                "addr, %u);\n",
+                size);
+    } else {
+        fprintf(out,
+                "        uint8_t *ptr = cpu_aot_direct_ptr(cpu, CPU_TLB_LOAD, "
+                "addr, %u);\n",
+                size);
+    }
+    fprintf(out, "        if (!ptr) { return %zuU; }\n", idx);
+    if (is_u8) {
+        fprintf(out,
+                is_store ? "        *ptr = CPU_AOT_REG_U8(cpu, %u);\n"
+                         : "        CPU_AOT_REG_U8(cpu, %u) = *ptr;\n",
+                reg.ctx_offset);
+    } else {
+        fprintf(out,
+                is_store ? "        memcpy(ptr, &CPU_AOT_REG(cpu, %u), 4);\n"
+                         : "        memcpy(&CPU_AOT_REG(cpu, %u), ptr, 4);\n",
+                reg.ctx_offset);
+    }
+    fprintf(out, "    }\n");
+}
+
+/// Emits an ALU instruction, which records its flags like the handlers.
+static void prv_aot_emit_alu(FILE *out, const cpu_instr_t *instr, size_t idx) {
+    const cpu_opd_val_t *opds = instr->operands;
+    const uint8_t opcode = instr->opcode;
+    fprintf(out, "    {\n        const uint32_t dst = ");
+    fprintf(out, PRV_AOT_REG(instr, 0));
+    fprintf(out, ";\n        const uint32_t src = ");
+    if (opcode == CPU_OP_NOT_R) {
+        fprintf(out, "0U");
+    } else if (instr->desc->operands[1] == CPU_OPD_REG) {
+        fprintf(out, PRV_AOT_REG(instr, 1));
+    } else if (instr->desc->operands[1] == CPU_OPD_IMM5) {
+        fprintf(out, "%uU", opds[1].imm5);
+    } else {
+        fprintf(out, "0x%08XU", opds[1].u32);
+    }
+    fprintf(out, ";\n");
+
+    const char *expr;
+    bool store = true;
+    switch (opcode) {
+    case CPU_OP_ADD_RR:
+    case CPU_OP_ADD_RV:
+        expr = "dst + src";
+        break;
+    case CPU_OP_SUB_RR:
+    case CPU_OP_SUB_RV:
+        expr = "dst - src";
+        break;
+    case CPU_OP_MUL_RR:
+    case CPU_OP_MUL_RV:
+        expr = "dst * src";
+        break;
+    case CPU_OP_DIV_RR:
+    case CPU_OP_DIV_RV:
+        fprintf(out, "        if (src == 0) { return %zuU; }\n", idx);
+        expr = "dst / src";
+        break;
+    case CPU_OP_IDIV_RR:
+    case CPU_OP_IDIV_RV:
+        // INT32_MIN / -1 is left to the interpreter, it overflows in C.
+        fprintf(out,
+                "        if (src == 0 || src == 0xFFFFFFFFU) {\n"
+                "            return %zuU;\n"
+                "        }\n",
+                idx);
+        expr = "(uint32_t)((int32_t)dst / (int32_t)src)";
+        break;
+    case CPU_OP_AND_RR:
+    case CPU_OP_AND_RV:
+        expr = "dst & src";
+        break;
+    case CPU_OP_OR_RR:
+    case CPU_OP_OR_RV:
+        expr = "dst | src";
+        break;
+    case CPU_OP_XOR_RR:
+    case CPU_OP_XOR_RV:
+        expr = "dst ^ src";
+        break;
+    case CPU_OP_NOT_R:
+        expr = "~dst";
+        break;
+    case CPU_OP_SHL_RR:
+    case CPU_OP_SHL_RV:
+        expr = "dst << (src & 31)";
+        break;
+    case CPU_OP_SHR_RR:
+    case CPU_OP_SHR_RV:
+        expr = "dst >> (src & 31)";
+        break;
+    case CPU_OP_ROL_RR:
+    case CPU_OP_ROL_RV:
+        expr = "(dst << (src & 31)) | (dst >> ((32 - (src & 31)) & 31))";
+        break;
+    case CPU_OP_ROR_RR:
+    case CPU_OP_ROR_RV:
+        expr = "(dst >> (src & 31)) | (dst << ((32 - (src & 31)) & 31))";
+        break;
+    case CPU_OP_CMP_RR:
+        expr = "dst - src";
+        store = false;
+        break;
+    default: // CPU_OP_TST_RR, CPU_OP_TST_RV
+        expr = "dst & src";
+        store = false;
+        break;
+    }
+    fprintf(out, "        const uint32_t res = %s;\n", expr);
+    if (store) {
+        fprintf(out, "        CPU_AOT_REG(cpu, %u) = res;\n",
+                opds[0].reg_ref.ctx_offset);
+    }
+    fprintf(out,
+            "        cpu->lazy_flags = (cpu_lazy_flags_t){\n"
+            "            .opcode = 0x%02X, .op1 = dst, .op2 = src, "
+            ".res = res};\n",
+            opcode);
+    switch (prv_aot_flags_of(opcode)) {
+    case AOT_FLAGS_ORDER:
+        fprintf(out, "        lhs = dst;\n        rhs = src;\n");
+        break;
+    case AOT_FLAGS_SIGN:
+        fprintf(out, "        lhs = res;\n        rhs = 0;\n");
+        break;
+    default:
+        break;
+    }
+    fprintf(out, "    }\n");
+}
+
+/**
+ * Emits the jump ending @a block. A condition compares the values @a lhs and
+ * @a rhs ordered by the last ALU instruction like its flags do.
+ */
+static void prv_aot_emit_jump(FILE *out, const aot_block_t *block, size_t idx) {
+    const cpu_instr_t *instr = &block->ops[idx];
+    const uint8_t opcode = instr->opcode;
+    fprintf(out, "    {\n        const vm_addr_t target = ");
+    switch (opcode & 3) {
+    case 0:
+        fprintf(out, "0x%08XU",
+                instr->start_addr + (int8_t)instr->operands[0].u8);
+        break;
+    case 1:
+        fprintf(out, "0x%08XU", instr->operands[0].u32);
+        break;
+    default:
+        fprintf(out, PRV_AOT_REG(instr, 0));
+        break;
+    }
+    fprintf(out, ";\n");
+
+    static const char *const conds[] = {
+        [(CPU_OP_JEQR_V8 - CPU_OP_JMPR_V8) / 4] = "==",
+        [(CPU_OP_JNER_V8 - CPU_OP_JMPR_V8) / 4] = "!=",
+        [(CPU_OP_JGTR_V8 - CPU_OP_JMPR_V8) / 4] = ">",
+        [(CPU_OP_JGER_V8 - CPU_OP_JMPR_V8) / 4] = ">=",
+        [(CPU_OP_JLTR_V8 - CPU_OP_JMPR_V8) / 4] = "<",
+        [(CPU_OP_JLER_V8 - CPU_OP_JMPR_V8) / 4] = "<=",
+    };
+    if (prv_aot_is_cond_jump(opcode)) {
+        fprintf(out,
+                "        cpu->reg_pc = (int32_t)lhs %s (int32_t)rhs ? target "
+                ": 0x%08XU;\n",
+                conds[(opcode - CPU_OP_JMPR_V8) / 4], block->end_pc);
+    } else {
+        fprintf(out, "        cpu->reg_pc = target;\n");
+    }
+    fprintf(out, "        return %zuU;\n    }\n", idx + 1);
+}